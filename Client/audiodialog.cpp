@@ -49,6 +49,23 @@ AudioDialog::~AudioDialog()
     }
 }
 
+void AudioDialog::setStreamSocket(QTcpSocket *socket)
+{
+    streamSocket = socket;
+    if (streamSocket && streamSocket->state() == QAbstractSocket::ConnectedState)
+    {
+        attachStreamSocket();
+    }
+}
+
+// Bind the stream connection to our chat session so the server delivers
+// incoming audio here instead of on the chat socket
+void AudioDialog::attachStreamSocket()
+{
+    sendStreamPacket(MSG_STREAM_ATTACH, QString(), QByteArray());
+    logAudio("[STREAM] Attaching stream connection as " + username);
+}
+
 void AudioDialog::setupUI()
 {
     QVBoxLayout *mainLayout = new QVBoxLayout(this);
@@ -311,6 +328,13 @@ void AudioDialog::onStreamReadyRead()
 
         streamSocket->read((char *)&header, sizeof(PacketHeader));
 
+        // Server heartbeat on an idle stream connection
+        if (header.msgType == MSG_PING)
+        {
+            sendStreamPacket(MSG_PONG, QString(), QByteArray());
+            continue;
+        }
+
         if (header.payloadLength > 0)
         {
             QByteArray payload = streamSocket->read(header.payloadLength);
@@ -340,6 +364,17 @@ void AudioDialog::onStreamReadyRead()
                     logAudio("[AUDIO] Playing frame (" + QString::number(payload.size()) + " bytes)");
                 }
             }
+            else if (header.msgType == MSG_REDIRECT)
+            {
+                // Cluster: the topic's stream sessions live on another broker node
+                logAudio("[STREAM] Topic " + QString::fromUtf8(header.topic) + " is served by " +
+                         QString::fromUtf8(payload) + ", reconnect there to stream");
+                if (isStreaming)
+                {
+                    stopAudioCapture();
+                }
+                lblStatus->setText("Status: Redirected to " + QString::fromUtf8(payload));
+            }
         }
     }
 }
@@ -348,6 +383,7 @@ void AudioDialog::onStreamConnected()
 {
     logAudio("[STREAM] Connected to streaming server");
     lblStatus->setText("Status: Stream Connected");
+    attachStreamSocket();
 }
 
 void AudioDialog::onStreamDisconnected()
@@ -23,7 +23,7 @@ public:
     AudioDialog(QTcpSocket *chatSocket, const QString &username, QWidget *parent = nullptr);
     ~AudioDialog();
 
-    void setStreamSocket(QTcpSocket *socket) { streamSocket = socket; }
+    void setStreamSocket(QTcpSocket *socket);
     void setCurrentTopic(const QString &topic) { currentTopic = topic; }
 
 private slots:
@@ -67,6 +67,7 @@ private:
     void setupUI();
     void sendStreamPacket(MessageType type, const QString &topic,
                           const QByteArray &payload, uint8_t flags = 0);
+    void attachStreamSocket();
     void logAudio(const QString &msg);
     void startAudioCapture();
     void stopAudioCapture();
@@ -1,6 +1,15 @@
 // clientCLI.cpp - Pub/Sub CLI Client
-// Communicates with server using protocol.h
-// Commands: /login <user>, /subscribe <topic>, /publish <topic> <msg>, /logout, /quit
+// Communicates with server using protocol.h (compact v2 headers unless run with "v1",
+// CRC32C payload checksums unless run with "nocrc", compression unless "nocompress";
+// "tls" or "tls=<ca.pem>" connects with TLS in a -DUSE_TLS build; a dropped connection
+// is re-established and the session resumed with its token, see FLAG_RESUME)
+// Usage: clientCLI [host] [port] [v1] [nocrc] [nocompress] [tls[=ca.pem]]
+// Commands: /login <user>, /subscribe <topic>, /publish <topic> <msg>,
+//           /filter <topic> <expression> (server-side filter, e.g. price > 10 && region == eu),
+//           /join <topic> <group>, /leave <topic> <group> (consumer groups),
+//           /who [topic|-] [after], /watch [topic], /unwatch [topic] (presence, "-"/none = online users),
+//           /dm <user> <msg> (direct message, kept for the user while logged out),
+//           /batch <topic>:<msg>;<topic>:<msg>..., /logout, /quit
 
 #include <iostream>
 #include <thread>
@@ -10,7 +19,17 @@
 #include <cstring>
 #include <atomic>
 #include <sstream>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <map>
 #include "../protocol.h"
+#include "../protocol_v2.h"
+#include "../crc32c.h"
+#include "../compression.h"
+#include "../tls_session.h"
+#include "publishwindow.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -34,35 +53,76 @@ typedef int socket_t;
 std::atomic<bool> running(true);
 std::atomic<int> nextMessageId(1);
 
+// Protocol v2 (see protocol_v2.h) - requested at login unless started with "v1"
+bool requestV2 = true;
+std::atomic<int> sendVersion(PROTOCOL_VERSION_1); // Header encoding for outgoing packets
+CompactEncoder v2Encoder;                         // Guarded by sendMutex
+std::mutex sendMutex;                             // Input thread sends, receiver answers MSG_PING
+
+// Payload checksums (FLAG_CHECKSUM) - requested at login unless started with "nocrc"
+bool requestChecksum = true;
+std::atomic<bool> checksumActive(false);
+
+// Payload compression (compression.h) - offered at login unless started with "nocompress"
+bool requestCompression = true;
+std::atomic<uint8_t> sharedCodecs(0); // Codecs the server granted in the login ACK
+std::mutex dictionaryMutex;
+std::map<uint32_t, DictionaryRef> dictionariesById;     // From MSG_DICTIONARY
+std::map<std::string, DictionaryRef> dictionaryByTopic; // Used to compress publishes
+
+// TLS (tls_session.h) - set after the handshake when started with "tls"
+TlsSessionRef tlsSession;
+
+// Server connection - replaced (under sendMutex) when a dropped session is resumed
+std::string serverHost = "127.0.0.1";
+int serverPort = DEFAULT_PORT;
+bool useTls = false;
+std::string tlsCaFile;
+std::atomic<socket_t> serverSocket(INVALID_SOCKET);
+
+// Session resumption (FLAG_RESUME) - token from the login ACK, 0 when not logged in
+#define RESUME_RETRY_MS 1000 // Between reconnection attempts
+#define RESUME_ATTEMPTS 30   // Then give up (the server keeps a session about this long)
+std::atomic<uint64_t> resumeToken(0);
+std::string sessionUser; // Guarded by loginMutex
+
+// Login handshake - the input thread waits for the reply, which decides the wire format
+std::mutex loginMutex;
+std::condition_variable loginCv;
+bool loginPending = false;
+uint32_t loginMessageId = 0;
+
+// Publish flow control - input thread waits, receiver thread opens the window
+PublishWindow publishWindow;
+std::mutex publishWindowMutex;
+std::condition_variable publishWindowCv;
+
+// Publishes awaiting their ACK, sent again with the same messageId after a resume
+// (FLAG_DEDUP: the server delivers a retry of a delivered publish only once)
+struct UnackedPublish
+{
+    MessageType type;
+    std::string topic;
+    std::string payload; // As sent (compressed)
+    uint8_t flags;
+};
+std::map<uint32_t, UnackedPublish> unackedPublishes; // Guarded by publishWindowMutex
+
 // Thread-safe logging
 void logMessage(const std::string &msg)
 {
     std::cout << msg << std::endl;
 }
 
-// Receive all bytes reliably
-bool recvAll(socket_t sock, char *buffer, int total)
-{
-    if (total <= 0 || !buffer)
-        return false;
-
-    int recvd = 0;
-    while (recvd < total)
-    {
-        int n = recv(sock, buffer + recvd, total - recvd, 0);
-        if (n <= 0)
-            return false;
-        recvd += n;
-    }
-    return true;
-}
-
 // Send all bytes reliably
 bool sendAll(socket_t sock, const char *data, int total)
 {
     if (total <= 0 || !data)
         return false;
 
+    if (tlsSession && !tlsSession->kernelSend())
+        return tlsSession->sendAll(data, total);
+
     int sent = 0;
     while (sent < total)
     {
@@ -74,20 +134,218 @@ bool sendAll(socket_t sock, const char *data, int total)
     return true;
 }
 
+// Buffered receive side - the v2 header has no fixed size
+class RecvBuffer
+{
+private:
+    socket_t sock;
+    std::vector<char> data;
+    size_t start = 0;
+    size_t end = 0;
+
+    bool fill()
+    {
+        if (start > 0)
+        {
+            std::memmove(data.data(), data.data() + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        if (end == data.size())
+            return false;
+
+        int n = (tlsSession && !tlsSession->kernelRecv())
+                    ? tlsSession->receive(data.data() + end, data.size() - end)
+                    : recv(sock, data.data() + end, data.size() - end, 0);
+        if (n <= 0)
+            return false;
+        end += n;
+        return true;
+    }
+
+public:
+    explicit RecvBuffer(socket_t s) : sock(s), data(4 * MAX_BUFFER_SIZE) {}
+
+    bool read(char *dest, size_t total)
+    {
+        while (end - start < total)
+        {
+            if (total > data.size() || !fill())
+                return false;
+        }
+        std::memcpy(dest, data.data() + start, total);
+        start += total;
+        return true;
+    }
+
+    bool readHeader(int version, CompactDecoder &decoder, PacketHeader &header)
+    {
+        if (version < PROTOCOL_VERSION_2)
+            return read((char *)&header, sizeof(PacketHeader));
+
+        while (true)
+        {
+            int consumed = decoder.decodeHeader(data.data() + start, end - start, header);
+            if (consumed > 0)
+            {
+                start += consumed;
+                return true;
+            }
+            if (consumed < 0 || !fill())
+                return false;
+        }
+    }
+};
+
+bool writePacket(socket_t sock, PacketHeader &header, const std::string &payload);
+bool sendLogin(const std::string &username, uint64_t token);
+bool sendPacket(socket_t sock, MessageType type, const std::string &sender, const std::string &topic,
+                const std::string &payload, uint8_t flags = 0, uint32_t messageId = 0);
+
+// After a resume: publishes the old connection never got an ACK for go out again
+void resendUnacked(socket_t sock, const std::string &username)
+{
+    std::map<uint32_t, UnackedPublish> pending;
+    {
+        std::lock_guard<std::mutex> lock(publishWindowMutex);
+        pending = unackedPublishes;
+        for (auto const &pair : pending)
+        {
+            publishWindow.onPublishSent(pair.first);
+        }
+    }
+    for (auto const &pair : pending)
+    {
+        const UnackedPublish &publish = pair.second;
+        sendPacket(sock, publish.type, username, publish.topic, publish.payload, publish.flags, pair.first);
+    }
+    if (!pending.empty())
+        logMessage("\n[INFO] " + std::to_string(pending.size()) + " unacknowledged publishes sent again");
+}
+
+// Connect (and TLS handshake) to the server; INVALID_SOCKET on failure
+socket_t connectToServer(TlsSessionRef &tls)
+{
+    socket_t sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET)
+    {
+        logMessage("socket() failed");
+        return INVALID_SOCKET;
+    }
+
+    struct sockaddr_in srv;
+    std::memset(&srv, 0, sizeof(srv));
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons(serverPort);
+
+    if (inet_pton(AF_INET, serverHost.c_str(), &srv.sin_addr) <= 0)
+    {
+        logMessage("Invalid address: " + serverHost);
+        CLOSE_SOCKET(sock);
+        return INVALID_SOCKET;
+    }
+
+    if (connect(sock, (struct sockaddr *)&srv, sizeof(srv)) == SOCKET_ERROR)
+    {
+        logMessage("connect() failed");
+        CLOSE_SOCKET(sock);
+        return INVALID_SOCKET;
+    }
+
+    if (useTls)
+    {
+#ifdef USE_TLS
+        static SSL_CTX *tlsContext = createClientTlsContext(tlsCaFile);
+        tls = tlsContext ? TlsSession::connect(tlsContext, sock, serverHost) : TlsSessionRef();
+        if (!tls)
+        {
+            logMessage("TLS handshake failed (certificate not trusted?)");
+            CLOSE_SOCKET(sock);
+            return INVALID_SOCKET;
+        }
+        logMessage(std::string("TLS established (") + tls->describe() + ")");
+#else
+        (void)tls;
+        logMessage("TLS requires a build with -DUSE_TLS");
+        CLOSE_SOCKET(sock);
+        return INVALID_SOCKET;
+#endif
+    }
+    return sock;
+}
+
+// The connection dropped with a resumable session: connect again and present the
+// token. The server kept the subscriptions and queued what was published meanwhile.
+// Returns the new socket (the old one is closed), or INVALID_SOCKET
+socket_t resumeSession()
+{
+    for (int attempt = 0; attempt < RESUME_ATTEMPTS && running && resumeToken; attempt++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(RESUME_RETRY_MS));
+        TlsSessionRef tls;
+        socket_t sock = connectToServer(tls);
+        if (sock == INVALID_SOCKET)
+            continue;
+
+        // A fresh connection starts in v1 without checksums until the login ACK
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            CLOSE_SOCKET(serverSocket.exchange(sock));
+            tlsSession = tls;
+            v2Encoder = CompactEncoder();
+            sendVersion = PROTOCOL_VERSION_1;
+            checksumActive = false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(publishWindowMutex);
+            publishWindow.reset(); // Unacknowledged publishes went down with the connection
+        }
+        publishWindowCv.notify_all();
+
+        std::string username;
+        {
+            std::lock_guard<std::mutex> lock(loginMutex);
+            username = sessionUser;
+        }
+        if (sendLogin(username, resumeToken))
+            return sock;
+    }
+    return INVALID_SOCKET;
+}
+
 // Receiver thread - continuously receive and display messages
 void receiverThread(socket_t sock)
 {
     char headerBuffer[sizeof(PacketHeader)];
+    RecvBuffer reader(sock);
+    CompactDecoder decoder;
+    int recvVersion = PROTOCOL_VERSION_1;
+    bool resuming = false; // Our login carries the token of the dropped session
+    bool resumed = false;  // Its ACK came back with the same token
 
     while (running)
     {
         // Receive packet header
-        if (!recvAll(sock, headerBuffer, sizeof(PacketHeader)))
+        if (!reader.readHeader(recvVersion, decoder, *(PacketHeader *)headerBuffer))
         {
             if (running)
             {
                 logMessage("\n[RECV] Connection closed or error");
             }
+            if (running && resumeToken)
+            {
+                logMessage("[INFO] Reconnecting to resume the session...");
+                sock = resumeSession();
+                if (sock != INVALID_SOCKET)
+                {
+                    reader = RecvBuffer(sock);
+                    decoder = CompactDecoder();
+                    recvVersion = PROTOCOL_VERSION_1;
+                    resuming = true;
+                    continue;
+                }
+                logMessage("[INFO] Could not reconnect");
+            }
             running = false;
             break;
         }
@@ -114,7 +372,7 @@ void receiverThread(socket_t sock)
             }
 
             std::vector<char> buf(header->payloadLength + 1);
-            if (!recvAll(sock, buf.data(), header->payloadLength))
+            if (!reader.read(buf.data(), header->payloadLength))
             {
                 if (running)
                 {
@@ -125,17 +383,143 @@ void receiverThread(socket_t sock)
             }
             buf[header->payloadLength] = '\0';
             payload = std::string(buf.data(), header->payloadLength);
+
+            if (checksumActive && crc32c(buf.data(), header->payloadLength) != header->checksum)
+            {
+                logMessage("\n[RECV] Checksum mismatch, message " + std::to_string(header->messageId) + " dropped");
+                continue;
+            }
+        }
+
+        // Compressed publish: restore the original payload
+        if ((header->flags & FLAG_COMPRESSED) &&
+            (header->msgType == MSG_PUBLISH_TEXT || header->msgType == MSG_PUBLISH_FILE))
+        {
+            CompressionEnvelope envelope;
+            DictionaryRef dictionary;
+            std::vector<char> plain;
+            bool ok = parseEnvelope(payload.data(), payload.size(), envelope);
+            if (ok && envelope.dictionaryId != 0)
+            {
+                std::lock_guard<std::mutex> lock(dictionaryMutex);
+                auto it = dictionariesById.find(envelope.dictionaryId);
+                if (it != dictionariesById.end())
+                    dictionary = it->second;
+            }
+            if (!ok || !decompressPayload(envelope, dictionary.get(), plain))
+            {
+                logMessage("\n[RECV] Cannot decompress message " + std::to_string(header->messageId));
+                continue;
+            }
+            payload.assign(plain.data(), plain.size());
+            header->payloadLength = plain.size();
+        }
+
+        // Reply to our login: an ACK with version 2 switches both directions after it
+        if (header->msgType == MSG_ACK || header->msgType == MSG_ERROR)
+        {
+            std::lock_guard<std::mutex> lock(loginMutex);
+            if (loginPending && header->messageId == loginMessageId)
+            {
+                if (header->msgType == MSG_ACK && header->version >= PROTOCOL_VERSION_2)
+                {
+                    recvVersion = PROTOCOL_VERSION_2;
+                    sendVersion = PROTOCOL_VERSION_2;
+                    logMessage("\n[INFO] Using compact protocol v2");
+                }
+                if (header->msgType == MSG_ACK && (header->flags & FLAG_CHECKSUM))
+                {
+                    checksumActive = true;
+                    logMessage("\n[INFO] Payload checksums enabled");
+                }
+                if (header->msgType == MSG_ACK && (header->flags & FLAG_COMPRESSED) && !payload.empty())
+                {
+                    sharedCodecs = (uint8_t)payload[0] & localCodecMask();
+                    if (sharedCodecs)
+                        logMessage("\n[INFO] Payload compression enabled");
+                }
+                if (header->msgType == MSG_ACK && (header->flags & FLAG_RESUME) && payload.size() >= sizeof(uint64_t))
+                {
+                    uint64_t token;
+                    std::memcpy(&token, payload.data() + payload.size() - sizeof(uint64_t), sizeof(token));
+                    if (resuming)
+                        logMessage(token == resumeToken ? "\n[INFO] Session resumed"
+                                                        : "\n[INFO] Session expired - logged in again, subscribe again");
+                    resumed = resuming && token == resumeToken;
+                    resumeToken = token;
+                }
+                if (resuming && !resumed)
+                {
+                    std::lock_guard<std::mutex> windowLock(publishWindowMutex);
+                    unackedPublishes.clear(); // A new session would deliver them twice
+                }
+                resuming = false;
+                loginPending = false;
+                loginCv.notify_all();
+            }
+        }
+        if (resumed)
+        {
+            resumed = false;
+            std::string username;
+            {
+                std::lock_guard<std::mutex> lock(loginMutex);
+                username = sessionUser;
+            }
+            resendUnacked(sock, username);
+        }
+
+        // Heartbeat from the server: answer quietly
+        if (header->msgType == MSG_PING)
+        {
+            PacketHeader pong;
+            std::memset(&pong, 0, sizeof(pong));
+            pong.msgType = MSG_PONG;
+            pong.messageId = header->messageId;
+            writePacket(sock, pong, "");
+            continue;
+        }
+
+        // Consumer group delivery: shown below, then acknowledged so the server
+        // stops counting it against this member
+        if ((header->flags & FLAG_GROUP) &&
+            (header->msgType == MSG_PUBLISH_TEXT || header->msgType == MSG_PUBLISH_FILE))
+        {
+            PacketHeader ack;
+            std::memset(&ack, 0, sizeof(ack));
+            ack.msgType = MSG_ACK;
+            ack.flags = FLAG_GROUP;
+            ack.messageId = header->messageId;
+            std::memcpy(ack.topic, header->topic, MAX_TOPIC_LEN); // Fields of the same size
+            ack.topic[MAX_TOPIC_LEN - 1] = '\0';
+            writePacket(sock, ack, "");
         }
 
         // Handle different message types
         if (header->msgType == MSG_ACK)
         {
+            {
+                std::lock_guard<std::mutex> lock(publishWindowMutex);
+                publishWindow.onAck(*header, payload.data(), payload.size());
+                unackedPublishes.erase(header->messageId);
+            }
+            publishWindowCv.notify_all();
             logMessage("\n[ACK] Message " + std::to_string(header->messageId) + " acknowledged");
         }
         else if (header->msgType == MSG_ERROR)
         {
+            {
+                std::lock_guard<std::mutex> lock(publishWindowMutex);
+                publishWindow.onError(*header);
+                unackedPublishes.erase(header->messageId);
+            }
+            publishWindowCv.notify_all();
             logMessage("\n[ERROR] " + payload);
         }
+        else if (header->msgType == MSG_PUBLISH_TEXT && (header->flags & FLAG_DIRECT))
+        {
+            logMessage("\n[DM] " + std::string(header->sender) + ": " + payload);
+        }
         else if (header->msgType == MSG_PUBLISH_TEXT)
         {
             logMessage("\n[" + std::string(header->topic) + "] " +
@@ -146,6 +530,42 @@ void receiverThread(socket_t sock)
             logMessage("\n[FILE] " + std::string(header->sender) +
                        " sent file (" + std::to_string(header->payloadLength) + " bytes)");
         }
+        else if (header->msgType == MSG_REDIRECT)
+        {
+            logMessage("\n[INFO] Topic " + std::string(header->topic) + " is served by " + payload +
+                       " - connect there to stream on it");
+        }
+        else if (header->msgType == MSG_QUERY_RESULT && payload.size() > sizeof(uint32_t))
+        {
+            uint32_t total;
+            std::memcpy(&total, payload.data(), sizeof(total));
+            bool more = payload[sizeof(uint32_t)] != 0;
+            std::string names = payload.substr(sizeof(uint32_t) + 1);
+            std::string scope = header->topic[0] ? std::string(header->topic) : std::string("online");
+            std::replace(names.begin(), names.end(), '\n', ' ');
+            logMessage("\n[WHO] " + scope + " (" + std::to_string(total) + "): " + names +
+                       (more ? " ... /who " + (header->topic[0] ? scope : std::string("-")) + " " +
+                                   names.substr(names.rfind(' ') + 1)
+                             : std::string()));
+        }
+        else if (header->msgType == MSG_PRESENCE && !payload.empty())
+        {
+            std::string scope = header->topic[0] ? "topic " + std::string(header->topic) : std::string("online");
+            logMessage("\n[PRESENCE] " + std::string(header->sender) +
+                       (payload[0] == PRESENCE_JOINED ? " joined " : " left ") + scope);
+        }
+        else if (header->msgType == MSG_DICTIONARY)
+        {
+            auto dictionary = std::make_shared<CompressionDictionary>();
+            if (parseDictionaryPayload(payload.data(), payload.size(), header->topic, *dictionary))
+            {
+                std::lock_guard<std::mutex> lock(dictionaryMutex);
+                dictionariesById[dictionary->id] = dictionary;
+                dictionaryByTopic[dictionary->topic] = dictionary;
+            }
+            logMessage("\n[INFO] Compression dictionary for topic " + std::string(header->topic) +
+                       " (" + std::to_string(payload.size()) + " bytes)");
+        }
         else if (header->msgType == MSG_STREAM_FRAME)
         {
             logMessage("\n[AUDIO] Received frame (" + std::to_string(header->payloadLength) + " bytes)");
@@ -161,21 +581,70 @@ void receiverThread(socket_t sock)
     }
 }
 
-// Send packet to server
+// Send packet to server (messageId 0: the next one)
 bool sendPacket(socket_t sock, MessageType type, const std::string &sender,
-                const std::string &topic, const std::string &payload)
+                const std::string &topic, const std::string &payload, uint8_t flags, uint32_t messageId)
 {
     PacketHeader header;
     std::memset(&header, 0, sizeof(header));
 
     header.msgType = type;
     header.payloadLength = payload.length();
-    header.messageId = nextMessageId++;
+    header.messageId = messageId ? messageId : nextMessageId++;
     header.timestamp = 0;
+    header.flags = flags;
     std::strncpy(header.sender, sender.c_str(), MAX_USERNAME_LEN - 1);
     std::strncpy(header.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
 
-    if (!sendAll(sock, (char *)&header, sizeof(PacketHeader)))
+    if (type == MSG_LOGIN && requestV2)
+    {
+        header.version = PROTOCOL_VERSION_2;
+    }
+    if (type == MSG_LOGIN && requestChecksum)
+    {
+        header.flags |= FLAG_CHECKSUM;
+    }
+    return writePacket(sock, header, payload);
+}
+
+// Log in with a resumable session; token 0 asks for a new one
+bool sendLogin(const std::string &username, uint64_t token)
+{
+    uint32_t messageId = nextMessageId++;
+    {
+        std::lock_guard<std::mutex> lock(loginMutex);
+        loginPending = true;
+        loginMessageId = messageId;
+        sessionUser = username;
+    }
+
+    // Offer the codecs this build decodes; the token ends the payload
+    bool offerCodecs = requestCompression && localCodecMask() != 0;
+    std::string payload = offerCodecs ? std::string(1, (char)localCodecMask()) : std::string();
+    payload.append((const char *)&token, sizeof(token));
+    return sendPacket(serverSocket, MSG_LOGIN, username, "", payload,
+                      FLAG_RESUME | FLAG_DEDUP | (offerCodecs ? FLAG_COMPRESSED : 0), messageId);
+}
+
+// Encode and write one packet (checksum and header format as negotiated)
+bool writePacket(socket_t sock, PacketHeader &header, const std::string &payload)
+{
+    std::lock_guard<std::mutex> lock(sendMutex);
+    if (sock != serverSocket)
+        return false; // Replaced by a reconnection meanwhile
+    if (checksumActive && !payload.empty())
+    {
+        header.checksum = crc32c(payload.data(), payload.length());
+    }
+
+    if (sendVersion >= PROTOCOL_VERSION_2)
+    {
+        std::vector<char> encoded;
+        v2Encoder.encodeHeader(header, encoded);
+        if (!sendAll(sock, encoded.data(), encoded.size()))
+            return false;
+    }
+    else if (!sendAll(sock, (char *)&header, sizeof(PacketHeader)))
         return false;
 
     if (payload.length() > 0)
@@ -187,6 +656,80 @@ bool sendPacket(socket_t sock, MessageType type, const std::string &sender,
     return true;
 }
 
+// Compress a publish when it pays off: with the topic's dictionary, or when large
+void compressForTopic(const std::string &topic, std::string &payload, uint8_t &flags)
+{
+    uint8_t codec = preferredCodec(sharedCodecs);
+    if (codec == CODEC_NONE || payload.size() > MAX_BUFFER_SIZE)
+        return;
+
+    DictionaryRef dictionary;
+    {
+        std::lock_guard<std::mutex> lock(dictionaryMutex);
+        auto it = dictionaryByTopic.find(topic);
+        if (it != dictionaryByTopic.end() && it->second->codec == codec)
+            dictionary = it->second;
+    }
+    if (!dictionary && payload.size() < COMPRESSION_MIN_PLAIN)
+        return;
+
+    std::vector<char> compressed;
+    if (compressPayload(codec, payload.data(), payload.size(), dictionary.get(), compressed))
+    {
+        payload.assign(compressed.data(), compressed.size());
+        flags |= FLAG_COMPRESSED;
+    }
+}
+
+// Send a publish once the server's flow-control window has room
+// flags: FLAG_DIRECT for a direct message (topic is then the recipient)
+bool sendPublishPacket(socket_t sock, MessageType type, const std::string &sender,
+                       const std::string &topic, const std::string &payload, uint8_t flags = 0)
+{
+    std::string wirePayload = payload;
+    if (type == MSG_PUBLISH_TEXT)
+    {
+        compressForTopic(topic, wirePayload, flags);
+    }
+
+    std::unique_lock<std::mutex> lock(publishWindowMutex);
+    while (running && !publishWindow.canPublish())
+    {
+        publishWindowCv.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    if (!running)
+        return false;
+
+    // Registered before sending, so the ACK can never race ahead of it
+    uint32_t messageId = nextMessageId++;
+    publishWindow.onPublishSent(messageId);
+    unackedPublishes[messageId] = UnackedPublish{type, topic, wirePayload, flags};
+    lock.unlock();
+    return sendPacket(sock, type, sender, topic, wirePayload, flags, messageId);
+}
+
+// Encode (topic, message) records as a MSG_PUBLISH_BATCH payload
+std::string encodeBatch(const std::vector<std::pair<std::string, std::string>> &records)
+{
+    std::string payload;
+    for (auto const &record : records)
+    {
+        uint32_t length = record.second.length();
+        payload.push_back((char)record.first.length());
+        payload.append(record.first);
+        payload.append((const char *)&length, sizeof(length));
+        payload.append(record.second);
+    }
+    return payload;
+}
+
+// MSG_QUERY payload: uint16_t limit | cursor (names after it)
+std::string encodeQuery(uint16_t limit, const std::string &cursor)
+{
+    std::string payload((const char *)&limit, sizeof(limit));
+    return payload + cursor;
+}
+
 int main(int argc, char **argv)
 {
 #ifdef _WIN32
@@ -198,45 +741,38 @@ int main(int argc, char **argv)
     }
 #endif
 
-    std::string host = "127.0.0.1";
-    int port = DEFAULT_PORT;
-
     if (argc >= 2)
-        host = argv[1];
+        serverHost = argv[1];
     if (argc >= 3)
-        port = std::atoi(argv[2]);
-
-    // Create socket
-    socket_t sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sock == INVALID_SOCKET)
-    {
-        logMessage("socket() failed");
-        return 1;
-    }
-
-    // Connect to server
-    struct sockaddr_in srv;
-    std::memset(&srv, 0, sizeof(srv));
-    srv.sin_family = AF_INET;
-    srv.sin_port = htons(port);
-
-    if (inet_pton(AF_INET, host.c_str(), &srv.sin_addr) <= 0)
+        serverPort = std::atoi(argv[2]);
+    for (int i = 3; i < argc; i++)
     {
-        logMessage("Invalid address: " + host);
-        CLOSE_SOCKET(sock);
-        return 1;
+        if (std::string(argv[i]) == "v1")
+            requestV2 = false;
+        else if (std::string(argv[i]) == "nocrc")
+            requestChecksum = false;
+        else if (std::string(argv[i]) == "nocompress")
+            requestCompression = false;
+        else if (std::string(argv[i]).rfind("tls", 0) == 0)
+        {
+            useTls = true;
+            if (std::string(argv[i]).rfind("tls=", 0) == 0)
+                tlsCaFile = std::string(argv[i]).substr(4);
+        }
     }
 
-    if (connect(sock, (struct sockaddr *)&srv, sizeof(srv)) == SOCKET_ERROR)
-    {
-        logMessage("connect() failed");
-        CLOSE_SOCKET(sock);
+    TlsSessionRef tls;
+    socket_t sock = connectToServer(tls);
+    if (sock == INVALID_SOCKET)
         return 1;
-    }
+    serverSocket = sock;
+    tlsSession = tls;
+    logMessage("Connected to " + serverHost + ":" + std::to_string(serverPort));
 
-    logMessage("Connected to " + host + ":" + std::to_string(port));
     logMessage("Commands: /login <user>, /subscribe <topic>, /unsubscribe <topic>,");
-    logMessage("          /publish <topic> <msg>, /logout, /quit");
+    logMessage("          /filter <topic> <expression>, /join <topic> <group>, /leave <topic> <group>,");
+    logMessage("          /who [topic|-] [after], /watch [topic], /unwatch [topic], /dm <user> <msg>,");
+    logMessage("          /publish <topic> <msg>, /batch <topic>:<msg>;..., /logout, /quit");
 
     // Start receiver thread
     std::thread recvT(receiverThread, sock);
@@ -268,9 +804,15 @@ int main(int argc, char **argv)
             }
             else
             {
-                if (sendPacket(sock, MSG_LOGIN, username, "", ""))
+                if (sendLogin(username, 0))
                 {
                     logMessage("[SENT] LOGIN as " + username);
+
+                    // Nothing else may be sent until the reply fixes the wire format
+                    std::unique_lock<std::mutex> lock(loginMutex);
+                    loginCv.wait_for(lock, std::chrono::milliseconds(SOCKET_TIMEOUT_MS),
+                                     []
+                                     { return !loginPending || !running; });
                 }
                 else
                 {
@@ -287,7 +829,7 @@ int main(int argc, char **argv)
                 logMessage("Usage: /subscribe <topic> (max " +
                            std::to_string(MAX_TOPIC_LEN - 1) + " chars)");
             }
-            else if (sendPacket(sock, MSG_SUBSCRIBE, username, topic, ""))
+            else if (sendPacket(serverSocket, MSG_SUBSCRIBE, username, topic, ""))
             {
                 logMessage("[SENT] SUBSCRIBE to " + topic);
             }
@@ -305,7 +847,7 @@ int main(int argc, char **argv)
                 logMessage("Usage: /unsubscribe <topic> (max " +
                            std::to_string(MAX_TOPIC_LEN - 1) + " chars)");
             }
-            else if (sendPacket(sock, MSG_UNSUBSCRIBE, username, topic, ""))
+            else if (sendPacket(serverSocket, MSG_UNSUBSCRIBE, username, topic, ""))
             {
                 logMessage("[SENT] UNSUBSCRIBE from " + topic);
             }
@@ -315,6 +857,105 @@ int main(int argc, char **argv)
                 break;
             }
         }
+        else if (line.rfind("/filter ", 0) == 0)
+        {
+            std::string rest = line.substr(8);
+            size_t spacePos = rest.find(' ');
+            std::string topic = rest.substr(0, spacePos);
+            std::string expression = spacePos == std::string::npos ? "" : rest.substr(spacePos + 1);
+            if (topic.empty() || topic.length() >= MAX_TOPIC_LEN || expression.empty())
+            {
+                logMessage("Usage: /filter <topic> <expression>");
+            }
+            else if (sendPacket(serverSocket, MSG_SUBSCRIBE, username, topic, expression, FLAG_FILTER))
+            {
+                logMessage("[SENT] SUBSCRIBE to " + topic + " where " + expression);
+            }
+            else
+            {
+                logMessage("Failed to send subscribe packet");
+                break;
+            }
+        }
+        else if (line.rfind("/join ", 0) == 0 || line.rfind("/leave ", 0) == 0)
+        {
+            bool join = line.rfind("/join ", 0) == 0;
+            std::stringstream args(line.substr(join ? 6 : 7));
+            std::string topic, group;
+            args >> topic >> group;
+            if (topic.empty() || topic.length() >= MAX_TOPIC_LEN || group.empty() ||
+                group.length() >= MAX_GROUP_NAME_LEN)
+            {
+                logMessage(std::string("Usage: ") + (join ? "/join" : "/leave") + " <topic> <group> (max " +
+                           std::to_string(MAX_TOPIC_LEN - 1) + " chars each)");
+            }
+            else if (sendPacket(serverSocket, join ? MSG_SUBSCRIBE : MSG_UNSUBSCRIBE, username, topic, group))
+            {
+                logMessage(std::string("[SENT] ") + (join ? "JOIN group " : "LEAVE group ") + group + " on " + topic);
+            }
+            else
+            {
+                logMessage("Failed to send group request");
+                break;
+            }
+        }
+        else if (line.rfind("/dm ", 0) == 0)
+        {
+            std::string rest = line.substr(4);
+            size_t spacePos = rest.find(' ');
+            std::string recipient = rest.substr(0, spacePos);
+            std::string msg = spacePos == std::string::npos ? "" : rest.substr(spacePos + 1);
+            if (recipient.empty() || recipient.length() >= MAX_USERNAME_LEN || msg.empty())
+            {
+                logMessage("Usage: /dm <user> <message>");
+            }
+            else if (sendPublishPacket(serverSocket, MSG_PUBLISH_TEXT, username, recipient, msg, FLAG_DIRECT))
+            {
+                logMessage("[SENT] Direct message to " + recipient);
+            }
+            else
+            {
+                logMessage("Failed to send message");
+                break;
+            }
+        }
+        else if (line == "/who" || line.rfind("/who ", 0) == 0)
+        {
+            std::stringstream args(line.substr(4));
+            std::string topic, after;
+            args >> topic >> after;
+            if (topic == "-")
+                topic.clear();
+            if (topic.length() >= MAX_TOPIC_LEN || after.length() >= MAX_USERNAME_LEN)
+            {
+                logMessage("Usage: /who [topic|-] [after]");
+            }
+            else if (!sendPacket(serverSocket, MSG_QUERY, username, topic, encodeQuery(QUERY_MAX_PAGE, after)))
+            {
+                logMessage("Failed to send query");
+                break;
+            }
+        }
+        else if (line == "/watch" || line.rfind("/watch ", 0) == 0 || line == "/unwatch" ||
+                 line.rfind("/unwatch ", 0) == 0)
+        {
+            bool watch = line.rfind("/watch", 0) == 0;
+            std::string topic = line.length() > (watch ? 7u : 9u) ? line.substr(watch ? 7 : 9) : "";
+            if (topic.length() >= MAX_TOPIC_LEN)
+            {
+                logMessage("Usage: /watch [topic], /unwatch [topic]");
+            }
+            else if (sendPacket(serverSocket, MSG_QUERY, username, topic, encodeQuery(0, ""), watch ? FLAG_WATCH : 0))
+            {
+                logMessage(std::string("[SENT] ") + (watch ? "WATCH " : "UNWATCH ") +
+                           (topic.empty() ? std::string("online users") : topic));
+            }
+            else
+            {
+                logMessage("Failed to send query");
+                break;
+            }
+        }
         else if (line.rfind("/publish ", 0) == 0)
         {
             std::string rest = line.substr(9);
@@ -336,7 +977,7 @@ int main(int argc, char **argv)
                 {
                     logMessage("Message cannot be empty");
                 }
-                else if (sendPacket(sock, MSG_PUBLISH_TEXT, username, topic, msg))
+                else if (sendPublishPacket(serverSocket, MSG_PUBLISH_TEXT, username, topic, msg))
                 {
                     logMessage("[SENT] Message to " + topic);
                 }
@@ -347,9 +988,47 @@ int main(int argc, char **argv)
                 }
             }
         }
+        else if (line.rfind("/batch ", 0) == 0)
+        {
+            std::vector<std::pair<std::string, std::string>> records;
+            std::stringstream entries(line.substr(7));
+            std::string entry;
+            bool valid = true;
+
+            while (std::getline(entries, entry, ';'))
+            {
+                size_t colonPos = entry.find(':');
+                if (colonPos == std::string::npos || colonPos == 0 || colonPos >= MAX_TOPIC_LEN)
+                {
+                    valid = false;
+                    break;
+                }
+                records.push_back({entry.substr(0, colonPos), entry.substr(colonPos + 1)});
+            }
+
+            std::string payload = encodeBatch(records);
+            if (!valid || records.empty())
+            {
+                logMessage("Usage: /batch <topic>:<msg>;<topic>:<msg>...");
+            }
+            else if (payload.length() > MAX_BATCH_SIZE)
+            {
+                logMessage("Batch too large (max " + std::to_string(MAX_BATCH_SIZE) + " bytes)");
+            }
+            else if (sendPublishPacket(serverSocket, MSG_PUBLISH_BATCH, username, "", payload))
+            {
+                logMessage("[SENT] Batch of " + std::to_string(records.size()) + " messages");
+            }
+            else
+            {
+                logMessage("Failed to send batch");
+                break;
+            }
+        }
         else if (line.rfind("/logout", 0) == 0)
         {
-            if (sendPacket(sock, MSG_LOGOUT, username, "", ""))
+            resumeToken = 0; // Ended on purpose: nothing to resume
+            if (sendPacket(serverSocket, MSG_LOGOUT, username, "", ""))
             {
                 logMessage("[SENT] LOGOUT");
             }
@@ -366,7 +1045,7 @@ int main(int argc, char **argv)
         }
         else
         {
-            logMessage("Unknown command. Use /login, /subscribe, /publish, /logout, /quit");
+            logMessage("Unknown command. Use /login, /subscribe, /filter, /join, /who, /watch, /dm, /publish, /batch, /logout, /quit");
         }
 
         std::cout << "> ";
@@ -375,7 +1054,10 @@ int main(int argc, char **argv)
 
     // Cleanup
     running = false;
-    CLOSE_SOCKET(sock);
+    {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        CLOSE_SOCKET(serverSocket.exchange(INVALID_SOCKET));
+    }
 
     if (recvT.joinable())
     {
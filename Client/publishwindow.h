@@ -0,0 +1,57 @@
+#ifndef PUBLISHWINDOW_H
+#define PUBLISHWINDOW_H
+
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include "../protocol.h"
+
+// Client side of publish flow control
+// Tracks unacknowledged publishes against the window the server advertises
+// in publish ACKs (FLAG_CREDIT). Not thread-safe: callers serialize access.
+class PublishWindow
+{
+private:
+    uint32_t window;             // Max unacknowledged publishes
+    std::set<uint32_t> inFlight; // messageIds of publishes awaiting ACK/ERROR
+
+public:
+    PublishWindow() : window(PUBLISH_WINDOW_INITIAL) {}
+
+    bool canPublish() const
+    {
+        return inFlight.size() < window;
+    }
+
+    void onPublishSent(uint32_t messageId)
+    {
+        inFlight.insert(messageId);
+    }
+
+    // Feed every ACK; adopts the advertised window if present
+    void onAck(const PacketHeader &header, const char *payload, uint32_t payloadLen)
+    {
+        inFlight.erase(header.messageId);
+
+        if ((header.flags & FLAG_CREDIT) && payload && payloadLen >= sizeof(uint32_t))
+        {
+            uint32_t grant;
+            std::memcpy(&grant, payload, sizeof(grant));
+            window = grant > 0 ? grant : 1;
+        }
+    }
+
+    // A rejected publish no longer occupies the window
+    void onError(const PacketHeader &header)
+    {
+        inFlight.erase(header.messageId);
+    }
+
+    void reset()
+    {
+        window = PUBLISH_WINDOW_INITIAL;
+        inFlight.clear();
+    }
+};
+
+#endif // PUBLISHWINDOW_H
@@ -0,0 +1,74 @@
+// CRC32C throughput benchmark
+// Build: g++ -O2 -std=c++17 bench_crc32c.cpp -o bench_crc32c
+// Prints GB/s of the dispatched implementation (SSE4.2 when available), the
+// portable slicing-by-8 path and memcpy, for a chat message, a relay chunk
+// (MAX_BUFFER_SIZE) and a large file buffer.
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include "../crc32c.h"
+#include "../protocol.h"
+
+typedef uint32_t (*Crc32cFunction)(const void *, size_t, uint32_t);
+
+static double measure(Crc32cFunction fn, const std::vector<uint8_t> &buffer, size_t size, uint32_t &sink)
+{
+    const size_t totalBytes = (size_t)2 << 30; // 2 GB per measurement
+    size_t rounds = totalBytes / size;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; i++)
+    {
+        sink ^= fn(buffer.data(), size, sink);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return (double)(rounds * size) / seconds / 1e9;
+}
+
+static double measureMemcpy(const std::vector<uint8_t> &buffer, size_t size, std::vector<uint8_t> &target)
+{
+    const size_t totalBytes = (size_t)2 << 30;
+    size_t rounds = totalBytes / size;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; i++)
+    {
+        std::memcpy(target.data(), buffer.data(), size);
+        target[i % size] ^= 1; // Keep the copy observable
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return (double)(rounds * size) / seconds / 1e9;
+}
+
+int main()
+{
+    const size_t sizes[] = {64, MAX_BUFFER_SIZE, 1024 * 1024};
+    std::vector<uint8_t> buffer(1024 * 1024);
+    std::vector<uint8_t> target(buffer.size());
+    for (size_t i = 0; i < buffer.size(); i++)
+    {
+        buffer[i] = (uint8_t)(i * 2654435761u >> 24);
+    }
+
+    // Known answer check before timing anything
+    if (crc32c("123456789", 9) != 0xE3069283 || crc32cPortable("123456789", 9) != 0xE3069283)
+    {
+        std::printf("CRC32C self-test FAILED\n");
+        return 1;
+    }
+
+    std::printf("CRC32C implementation: %s\n", crc32c_detail::useHardware() ? "SSE4.2 + PCLMUL" : "slicing-by-8");
+    std::printf("%10s %14s %14s %14s\n", "size", "crc32c GB/s", "portable GB/s", "memcpy GB/s");
+
+    uint32_t sink = 0;
+    for (size_t size : sizes)
+    {
+        double fast = measure(crc32c, buffer, size, sink);
+        double portable = measure(crc32cPortable, buffer, size, sink);
+        double copy = measureMemcpy(buffer, size, target);
+        std::printf("%10zu %14.2f %14.2f %14.2f\n", size, fast, portable, copy);
+    }
+    std::printf("(sink %08x %02x)\n", sink, target[0]);
+    return 0;
+}
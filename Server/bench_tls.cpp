@@ -0,0 +1,177 @@
+// Loopback throughput: plaintext vs user-space TLS vs kTLS
+// Build: g++ -O2 -std=c++17 -DUSE_TLS bench_tls.cpp -o bench_tls -lssl -lcrypto -lpthread
+// Usage: bench_tls [megabytes]   (Linux; kTLS needs the "tls" kernel module)
+// A sender pushes MAX_BUFFER_SIZE chunks the way EgressQueue does (send() when the
+// kernel encrypts, SSL_write otherwise) and the receiver drains them; a throwaway
+// self-signed P-256 certificate is generated for the run.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include "../protocol.h"
+#include "../tls_session.h"
+
+enum Mode
+{
+    MODE_PLAIN,
+    MODE_USERSPACE_TLS,
+    MODE_KTLS
+};
+
+static const char *CERT_FILE = "/tmp/bench_tls_cert.pem";
+static const char *KEY_FILE = "/tmp/bench_tls_key.pem";
+
+static bool writeSelfSignedCertificate()
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    if (!key || !cert)
+        return false;
+
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"bench", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_sign(cert, key, EVP_sha256());
+
+    FILE *certOut = std::fopen(CERT_FILE, "w");
+    FILE *keyOut = std::fopen(KEY_FILE, "w");
+    bool ok = certOut && keyOut && PEM_write_X509(certOut, cert) &&
+              PEM_write_PrivateKey(keyOut, key, nullptr, nullptr, 0, nullptr, nullptr);
+    if (certOut)
+        std::fclose(certOut);
+    if (keyOut)
+        std::fclose(keyOut);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+static bool connectedPair(int &serverSide, int &clientSide)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, (sockaddr *)&addr, &addrLen) != 0)
+        return false;
+
+    clientSide = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(clientSide, (sockaddr *)&addr, sizeof(addr)) != 0)
+        return false;
+    serverSide = accept(listener, nullptr, nullptr);
+    close(listener);
+    return serverSide >= 0;
+}
+
+// Returns MB/s, or a negative value if the mode is unavailable
+static double run(Mode mode, size_t totalBytes, std::string &description)
+{
+    int serverSide, clientSide;
+    if (!connectedPair(serverSide, clientSide))
+        return -1;
+
+    TlsSessionRef serverTls, clientTls;
+    if (mode != MODE_PLAIN)
+    {
+        bool ktls = mode == MODE_KTLS;
+        SSL_CTX *serverCtx = createServerTlsContext(CERT_FILE, KEY_FILE, ktls);
+        SSL_CTX *clientCtx = createClientTlsContext(CERT_FILE, ktls);
+        if (!serverCtx || !clientCtx)
+            return -1;
+        SSL_CTX_set_verify(clientCtx, SSL_VERIFY_NONE, nullptr); // Throwaway certificate
+
+        std::thread handshake([&]
+                              { serverTls = TlsSession::accept(serverCtx, serverSide); });
+        clientTls = TlsSession::connect(clientCtx, clientSide, "");
+        handshake.join();
+        SSL_CTX_free(serverCtx);
+        SSL_CTX_free(clientCtx);
+        if (!serverTls || !clientTls)
+            return -1;
+
+        description = serverTls->describe();
+        if (mode == MODE_KTLS && !serverTls->kernelSend())
+        {
+            close(serverSide);
+            close(clientSide);
+            return -1; // Kernel did not take the keys
+        }
+    }
+    else
+    {
+        description = "plaintext";
+    }
+
+    std::vector<char> chunk(MAX_BUFFER_SIZE, 'x');
+    std::thread sender([&]
+                       {
+        for (size_t sent = 0; sent < totalBytes; sent += chunk.size())
+        {
+            bool ok;
+            if (serverTls && !serverTls->kernelSend())
+                ok = serverTls->sendAll(chunk.data(), chunk.size());
+            else
+                ok = send(serverSide, chunk.data(), chunk.size(), 0) == (ssize_t)chunk.size();
+            if (!ok)
+                break;
+        } });
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<char> buffer(64 * 1024);
+    size_t received = 0;
+    while (received < totalBytes)
+    {
+        int n = (clientTls && !clientTls->kernelRecv()) ? clientTls->receive(buffer.data(), buffer.size())
+                                                        : (int)recv(clientSide, buffer.data(), buffer.size(), 0);
+        if (n <= 0)
+            break;
+        received += n;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    sender.join();
+    close(serverSide);
+    close(clientSide);
+    return received < totalBytes ? -1 : (double)received / seconds / (1024 * 1024);
+}
+
+int main(int argc, char **argv)
+{
+    size_t megabytes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1024;
+    if (!writeSelfSignedCertificate())
+    {
+        std::printf("Failed to create a test certificate\n");
+        return 1;
+    }
+
+    const Mode modes[] = {MODE_PLAIN, MODE_USERSPACE_TLS, MODE_KTLS};
+    const char *names[] = {"plaintext", "user-space TLS", "kTLS"};
+    std::printf("%zu MB over loopback in %d-byte sends\n", megabytes, MAX_BUFFER_SIZE);
+    for (int i = 0; i < 3; i++)
+    {
+        std::string description;
+        double rate = run(modes[i], megabytes * 1024 * 1024, description);
+        if (rate < 0)
+            std::printf("%-16s unavailable (%s)\n", names[i],
+                        description.empty() ? "setup failed" : description.c_str());
+        else
+            std::printf("%-16s %10.1f MB/s  [%s]\n", names[i], rate, description.c_str());
+    }
+
+    unlink(CERT_FILE);
+    unlink(KEY_FILE);
+    return 0;
+}
@@ -9,7 +9,16 @@
 #include <memory>
 #include <cstring>
 #include <algorithm> // For std::find()
+#include <functional>
+#include <tuple>
 #include "../protocol.h"
+#include "../compression.h"
+#include "egress.h"
+#include "consumer_group.h"
+#include "topic_filter.h"
+#include "last_value.h"
+#include "presence.h"
+#include "direct_message.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -19,46 +28,115 @@
 #define CLOSE_SOCKET(s) close(s)
 #endif
 
-struct StreamSession
-{
-    uint32_t sessionId;
-    std::string topic;
-    std::string publisher;
-    bool active;
-};
-
 // Struct to hold client information
 struct ClientInfo
 {
     int clientId;                           // Unique client identifier
     SOCKET socket;                          // Client socket
+    std::shared_ptr<EgressQueue> egress;    // Outbound scheduler for the chat socket, atomic access (swapped while parked)
+    std::shared_ptr<EgressQueue> streamEgress; // Attached stream-port connection (media only), atomic access
     char username[MAX_USERNAME_LEN];        // Client's username
     std::set<std::string> subscribedTopics; // Topics this client subscribed to
     bool isConnected;                       // Connection status
+    uint8_t codecs;                         // Compression codecs it decodes (CODEC_BIT mask)
+    std::set<uint32_t> dictionaries;        // Dictionaries already sent to it
+    std::mutex dictionaryMutex;             // Protects dictionaries
+    GroupInbox groupInbox;                  // Consumer-group deliveries awaiting its ACK
 
-    ClientInfo() : clientId(-1), socket(INVALID_SOCKET), isConnected(false)
+    ClientInfo() : clientId(-1), socket(INVALID_SOCKET), isConnected(false), codecs(0)
     {
         std::memset(username, 0, MAX_USERNAME_LEN);
     }
 };
 
+// Listener set resolved once per stream session (publisher excluded)
+typedef std::vector<std::shared_ptr<ClientInfo>> StreamListenerList;
+
+// Identifies a stream session: session ids are chosen by publishers, so they are
+// only unique per publishing connection (or, relayed by another node, per sender)
+struct StreamSessionKey
+{
+    int node;              // Cluster node that relayed the stream, -1: published here
+    int connection;        // Publishing connection here, -1 for a relayed stream
+    std::string publisher; // Relayed streams: the sender (unique cluster-wide), else empty
+    uint32_t sessionId;    // Chosen by the publisher (messageId of its stream packets)
+
+    bool operator<(const StreamSessionKey &other) const
+    {
+        return std::tie(node, connection, publisher, sessionId) <
+               std::tie(other.node, other.connection, other.publisher, other.sessionId);
+    }
+};
+
+struct StreamSession
+{
+    StreamSessionKey sessionId;
+    std::string topic;
+    std::string publisher;
+    bool active;
+    std::shared_ptr<const StreamListenerList> listeners; // nullptr = needs re-resolve
+    uint64_t generation;                                 // Bumped on every invalidation
+};
+
+// Subscribers of a topic sharing one filter expression (see topic_filter.h)
+struct FilteredSubscribers
+{
+    TopicFilterRef filter;
+    std::vector<int> subscribers; // Client ids
+};
+
+// Interned topic - lives as long as the broker, so aliases can point at it directly
+struct Topic
+{
+    std::string name;
+    std::vector<int> subscribers;               // Client ids, guarded by topicsMutex
+    std::vector<std::string> dictionarySamples; // Small payloads for the dictionary, guarded by topicsMutex
+    DictionaryRef dictionary;                   // Compression dictionary once built, guarded by topicsMutex
+    std::map<std::string, ConsumerGroup> groups; // Group name -> members, guarded by topicsMutex
+    std::map<std::string, FilteredSubscribers> filters; // Canonical filter -> its subscribers, guarded by topicsMutex
+    std::shared_ptr<LastValueCache> lastValues;  // Set when interned for a last-value topic, then constant
+    MemberIndex members;                         // Plain and filtered subscribers by name, guarded by topicsMutex
+    std::vector<std::shared_ptr<ClientInfo>> watchers; // Sent MSG_PRESENCE on member changes, guarded by topicsMutex
+};
+typedef std::shared_ptr<Topic> TopicRef;
+
+// One (topic, payload) record of a MSG_PUBLISH_BATCH; payload points into the batch buffer
+struct BatchRecord
+{
+    std::string topic;
+    const char *payload;
+    uint32_t payloadLength;
+};
+
 // Message Broker - manages all clients and pub/sub logic
 class MessageBroker
 {
 private:
     std::map<int, std::shared_ptr<ClientInfo>> clients;       // client_id -> ClientInfo
-    std::map<std::string, std::vector<int>> topicSubscribers; // topic -> list of client_ids
+    std::map<std::string, TopicRef> topicSubscribers;         // topic -> interned Topic (subscriber ids)
     std::mutex clientsMutex;                                  // Protect clients map
     std::mutex topicsMutex;                                   // Protect topics map
     int nextClientId;                                         // Auto-increment client ID
-    std::map<uint32_t, StreamSession> streamSessions;
+    std::map<StreamSessionKey, StreamSession> streamSessions;
     std::mutex streamMutex;
+    std::map<uint32_t, DictionaryRef> dictionaries; // id -> dictionary, guarded by topicsMutex
+    uint32_t nextDictionaryId;
+    bool dictionariesFrozen; // Handed to a successor process: build no more, guarded by topicsMutex
+    std::function<void(const std::string &, bool)> interestListener; // See setInterestListener
+    std::function<bool(const std::string &)> topicOwnership;        // See setTopicOwnership
+    std::vector<std::string> lastValuePrefixes; // Topics starting with one are last-value topics, set before serving
+    MemberIndex onlineUsers;                    // Registered clients by name, guarded by clientsMutex
+    std::vector<std::shared_ptr<ClientInfo>> presenceWatchers; // Watching onlineUsers, guarded by clientsMutex
+    std::map<std::string, std::vector<std::shared_ptr<ClientInfo>>> pendingWatchers; // Watching topics not interned yet, guarded by topicsMutex
+    OfflineInbox offlineInbox;                  // Direct messages for users not logged in
 
 public:
-    MessageBroker() : nextClientId(0) {}
+    MessageBroker() : nextClientId(0), nextDictionaryId(1), dictionariesFrozen(false) {}
 
     // Register a new client
-    int registerClient(SOCKET clientSocket, const char *username)
+    // codecs: compression codecs negotiated at login (CODEC_BIT mask)
+    int registerClient(SOCKET clientSocket, const char *username, const std::shared_ptr<EgressQueue> &egress,
+                       uint8_t codecs = 0)
     {
         std::lock_guard<std::mutex> lock(clientsMutex);
 
@@ -66,10 +144,14 @@ public:
         auto clientInfo = std::make_shared<ClientInfo>();
         clientInfo->clientId = clientId;
         clientInfo->socket = clientSocket;
+        clientInfo->egress = egress;
         clientInfo->isConnected = true;
+        clientInfo->codecs = codecs;
         std::strncpy(clientInfo->username, username, MAX_USERNAME_LEN - 1);
 
         clients[clientId] = clientInfo;
+        onlineUsers.add(clientId, clientInfo->username);
+        notifyWatchers(presenceWatchers, std::string(), clientInfo->username, true);
         std::cout << "[BROKER] Client registered: ID=" << clientId
                   << ", Username=" << username << std::endl;
         return clientId;
@@ -78,76 +160,157 @@ public:
     // Unregister and disconnect a client
     void unregisterClient(int clientId)
     {
-        std::lock_guard<std::mutex> lock(clientsMutex);
-
-        if (clients.count(clientId))
+        std::shared_ptr<ClientInfo> client;
         {
-            auto client = clients[clientId];
+            std::lock_guard<std::mutex> lock(clientsMutex);
+
+            if (!clients.count(clientId))
+                return;
+            client = clients[clientId];
             client->isConnected = false;
 
-            // Close socket
-            if (client->socket != INVALID_SOCKET)
-            {
-                CLOSE_SOCKET(client->socket);
-            }
+            // Sockets and their egress queues are owned and closed by the connection handlers
+            std::atomic_store(&client->streamEgress, std::shared_ptr<EgressQueue>());
 
             clients.erase(clientId);
+            onlineUsers.remove(clientId);
+            removeWatcher(presenceWatchers, clientId);
+            notifyWatchers(presenceWatchers, std::string(), client->username, false);
             std::cout << "[BROKER] Client unregistered: ID=" << clientId << std::endl;
 
-            // Remove from all topic subscriptions
+            // Remove from all topic subscriptions and consumer groups
             unsubscribeClientFromAllTopics(clientId);
         }
+
+        // Its unacknowledged group deliveries go to the members that remain
+        redeliverToGroups(client->groupInbox.take());
     }
 
     // Subscribe a client to a topic
     void subscribeToTopic(int clientId, const char *topic)
     {
-        std::lock_guard<std::mutex> lock(topicsMutex);
-
         std::string topicStr(topic);
+        auto client = getClient(clientId);
 
-        // Add client to topic's subscriber list (avoid duplicates)
-        auto &subscribers = topicSubscribers[topicStr];
-        if (std::find(subscribers.begin(), subscribers.end(), clientId) == subscribers.end())
         {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+
+            // Add client to topic's subscriber list (avoid duplicates)
+            TopicRef ref = internTopicLocked(topicStr);
+            auto &subscribers = ref->subscribers;
+            if (std::find(subscribers.begin(), subscribers.end(), clientId) != subscribers.end())
+            {
+                return;
+            }
+            bool wasInterested = hasLocalInterest(*ref);
+            removeFilteredLocked(*ref, clientId); // Now wants everything
             subscribers.push_back(clientId);
+            if (client)
+                addMemberLocked(*ref, clientId, client->username);
             std::cout << "[BROKER] Client " << clientId << " subscribed to topic: " << topic << std::endl;
+            if (!wasInterested && interestListener)
+                interestListener(topicStr, true);
+        }
+
+        invalidateStreamSessions(topicStr);
+    }
+
+    // Subscribe a client to the messages of a topic that match a filter, replacing its
+    // plain or filtered subscription there. Clients using the same expression share
+    // one compiled filter (see topic_filter.h)
+    void subscribeWithFilter(int clientId, const char *topic, const TopicFilterRef &filter)
+    {
+        std::string topicStr(topic);
+        auto client = getClient(clientId);
+
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+
+            TopicRef ref = internTopicLocked(topicStr);
+            bool wasInterested = hasLocalInterest(*ref);
+            auto &subscribers = ref->subscribers;
+            auto it = std::find(subscribers.begin(), subscribers.end(), clientId);
+            if (it != subscribers.end())
+                subscribers.erase(it);
+            removeFilteredLocked(*ref, clientId);
+
+            FilteredSubscribers &shared = ref->filters[filter->canonical()];
+            if (!shared.filter)
+                shared.filter = filter;
+            shared.subscribers.push_back(clientId);
+            if (client)
+                addMemberLocked(*ref, clientId, client->username);
+            std::cout << "[BROKER] Client " << clientId << " subscribed to topic: " << topic << " where "
+                      << filter->canonical() << " (" << shared.subscribers.size() << " sharing it)" << std::endl;
+            if (!wasInterested && interestListener)
+                interestListener(topicStr, true);
         }
+
+        invalidateStreamSessions(topicStr); // Filtered subscribers do not receive streams
     }
 
     // Unsubscribe a client from a topic
     void unsubscribeFromTopic(int clientId, const char *topic)
     {
-        std::lock_guard<std::mutex> lock(topicsMutex);
-
         std::string topicStr(topic);
 
-        if (topicSubscribers.count(topicStr))
         {
-            auto &subscribers = topicSubscribers[topicStr];
+            std::lock_guard<std::mutex> lock(topicsMutex);
+
+            if (!topicSubscribers.count(topicStr))
+            {
+                return;
+            }
+
+            Topic &entry = *topicSubscribers[topicStr];
+            auto &subscribers = entry.subscribers;
             auto it = std::find(subscribers.begin(), subscribers.end(), clientId);
             if (it != subscribers.end())
             {
                 subscribers.erase(it);
-                std::cout << "[BROKER] Client " << clientId << " unsubscribed from topic: " << topic << std::endl;
             }
+            else if (!removeFilteredLocked(entry, clientId))
+            {
+                return;
+            }
+            removeMemberLocked(entry, clientId);
+            std::cout << "[BROKER] Client " << clientId << " unsubscribed from topic: " << topic << std::endl;
+            if (!hasLocalInterest(entry) && interestListener)
+                interestListener(topicStr, false);
         }
+
+        invalidateStreamSessions(topicStr);
     }
 
     // Unsubscribe a client from all topics
     void unsubscribeClientFromAllTopics(int clientId)
     {
-        std::lock_guard<std::mutex> lock(topicsMutex);
-
-        for (auto &pair : topicSubscribers)
         {
-            auto &subscribers = pair.second;
-            auto it = std::find(subscribers.begin(), subscribers.end(), clientId);
-            if (it != subscribers.end())
+            std::lock_guard<std::mutex> lock(topicsMutex);
+
+            for (auto &pair : topicSubscribers)
             {
-                subscribers.erase(it);
+                Topic &entry = *pair.second;
+                bool wasInterested = hasLocalInterest(entry);
+                auto it = std::find(entry.subscribers.begin(), entry.subscribers.end(), clientId);
+                if (it != entry.subscribers.end())
+                    entry.subscribers.erase(it);
+                removeFilteredLocked(entry, clientId);
+                removeGroupMemberLocked(entry, clientId);
+                removeWatcher(entry.watchers, clientId);
+                removeMemberLocked(entry, clientId);
+                if (wasInterested && !hasLocalInterest(entry) && interestListener)
+                    interestListener(pair.first, false);
+            }
+            for (auto it = pendingWatchers.begin(); it != pendingWatchers.end();)
+            {
+                removeWatcher(it->second, clientId);
+                it = it->second.empty() ? pendingWatchers.erase(it) : std::next(it);
             }
         }
+
+        // The client may have been a listener of any session
+        invalidateStreamSessions(std::string());
     }
 
     // Publish a message to all subscribers of a topic
@@ -170,58 +333,410 @@ public:
             return 0;
         }
 
-        std::vector<int> subscriberIds;
+        TopicRef ref;
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+            auto it = topicSubscribers.find(topic);
+            if (it != topicSubscribers.end())
+                ref = it->second;
+            else if (isLastValueTopic(topic) && ownsTopicLocked(topic))
+                ref = internTopicLocked(topic); // Cached for whoever subscribes later
+            else
+                return 0; // Never subscribed
+        }
+        return publishToTopic(ref, header, payload, payloadLen);
+    }
+
+    // Publish through an interned Topic (e.g. resolved from a connection's alias):
+    // no topic-name lookup at all
+    int publishToTopic(const TopicRef &topic, const PacketHeader &header, const char *payload, int payloadLen)
+    {
+        if (!topic || payloadLen < 0 || payloadLen > MAX_MESSAGE_SIZE)
+        {
+            std::cerr << "[BROKER] Invalid publish parameters" << std::endl;
+            return 0;
+        }
+
+        // Payload is copied once and shared by every subscriber's egress queue
+        SharedPayload sharedPayload;
+        if (payloadLen > 0 && payload)
+        {
+            sharedPayload = std::make_shared<const std::vector<char>>(payload, payload + payloadLen);
+        }
 
-        // Get list of subscribers (under lock)
+        // Cached before the subscribers are read (see LastValueCache::sendTo)
+        std::string conflationKey;
+        if (topic->lastValues)
+            conflationKey = cacheLastValue(*topic, header, sharedPayload);
+
+        std::vector<int> subscriberIds;
+        std::vector<FilteredSubscribers> filtered;
+        DictionaryRef dictionary;
+        bool grouped;
         {
             std::lock_guard<std::mutex> lock(topicsMutex);
-            if (topicSubscribers.count(topic))
+            subscriberIds = topic->subscribers;
+            for (auto const &pair : topic->filters)
             {
-                subscriberIds = topicSubscribers[topic];
+                filtered.push_back(pair.second);
             }
+            grouped = !topic->groups.empty();
+            if (header.flags & FLAG_COMPRESSED)
+            {
+                CompressionEnvelope envelope;
+                if (parseEnvelope(payload, payloadLen, envelope) && envelope.dictionaryId != 0 &&
+                    dictionaries.count(envelope.dictionaryId))
+                {
+                    dictionary = dictionaries[envelope.dictionaryId];
+                }
+            }
+        }
+
+        if (!(header.flags & FLAG_COMPRESSED))
+        {
+            sampleForDictionary(topic, payload, payloadLen);
+        }
+        if (!filtered.empty())
+        {
+            matchFilters(topic->name, filtered, header, payload, payloadLen, dictionary, subscriberIds);
+        }
+
+        int sentCount = deliverToClients(topic->name.c_str(), lookupClients(subscriberIds), header, sharedPayload,
+                                         dictionary, conflationKey.empty() ? nullptr : &conflationKey);
+        if (grouped)
+            sentCount += deliverToGroups(topic, header, sharedPayload, dictionary);
+        return sentCount;
+    }
+
+    // Check a FLAG_COMPRESSED publish before relaying it: the codec must be one the
+    // broker can decode for legacy subscribers, the dictionary one it issued for this topic
+    bool validateCompressed(const char *topic, const char *payload, int payloadLen)
+    {
+        CompressionEnvelope envelope;
+        if (!parseEnvelope(payload, payloadLen, envelope) || !(localCodecMask() & CODEC_BIT(envelope.codec)))
+            return false;
+        if (envelope.dictionaryId == 0)
+            return true;
+
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        auto it = dictionaries.find(envelope.dictionaryId);
+        return it != dictionaries.end() && it->second->codec == envelope.codec &&
+               std::strncmp(it->second->topic.c_str(), topic, MAX_TOPIC_LEN) == 0;
+    }
+
+    // Give a publisher the topic's dictionary (once) so its next publishes can use it
+    void offerDictionary(int clientId, const char *topic)
+    {
+        std::shared_ptr<ClientInfo> client;
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex);
+            auto it = clients.find(clientId);
+            if (it == clients.end() || it->second->codecs == 0)
+                return;
+            client = it->second;
+        }
+
+        DictionaryRef dictionary;
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+            auto it = topicSubscribers.find(topic);
+            if (it == topicSubscribers.end() || !it->second->dictionary)
+                return;
+            dictionary = it->second->dictionary;
+        }
+        ensureDictionary(*client, dictionary);
+    }
+
+private:
+    // ===== OPTIMIZATION: Per-topic compression dictionary =====
+    // Purpose: Small chat/telemetry messages barely compress on their own. The first
+    // DICTIONARY_SAMPLE_COUNT small publishes of a topic become its dictionary, which
+    // publishers and subscribers that negotiated compression receive once.
+    void sampleForDictionary(const TopicRef &topic, const char *payload, int payloadLen)
+    {
+        uint8_t codec = preferredCodec(localCodecMask());
+        if (codec == CODEC_NONE || payloadLen <= 0 || payloadLen > DICTIONARY_MAX_SAMPLE)
+            return;
+
+        std::vector<std::string> samples;
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+            if (topic->dictionary || topic->dictionarySamples.size() >= DICTIONARY_SAMPLE_COUNT ||
+                dictionariesFrozen)
+                return; // Built, or being built by another publisher
+            topic->dictionarySamples.emplace_back(payload, payloadLen);
+            if (topic->dictionarySamples.size() < DICTIONARY_SAMPLE_COUNT)
+                return;
+            samples = topic->dictionarySamples;
+        }
+
+        // Build outside the lock (zstd training is not free)
+        auto dictionary = std::make_shared<CompressionDictionary>();
+        dictionary->codec = codec;
+        dictionary->topic = topic->name;
+        dictionary->bytes = buildDictionary(codec, samples);
+
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        topic->dictionarySamples.clear();
+        topic->dictionarySamples.shrink_to_fit();
+        if (dictionary->bytes.empty() || dictionariesFrozen)
+            return;
+        dictionary->id = nextDictionaryId++;
+        topic->dictionary = dictionary;
+        dictionaries[dictionary->id] = dictionary;
+        std::cout << "[BROKER] Built " << dictionary->bytes.size() << "-byte dictionary "
+                  << dictionary->id << " for topic: " << topic->name << std::endl;
+    }
+
+    // Queue MSG_DICTIONARY ahead of the first packet that needs it (CONTROL class)
+    void ensureDictionary(ClientInfo &client, const DictionaryRef &dictionary)
+    {
+        if (!(client.codecs & CODEC_BIT(dictionary->codec)))
+            return;
+        {
+            std::lock_guard<std::mutex> lock(client.dictionaryMutex);
+            if (!client.dictionaries.insert(dictionary->id).second)
+                return;
         }
 
+        std::vector<char> payload = encodeDictionaryPayload(*dictionary);
+        PacketHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.msgType = MSG_DICTIONARY;
+        header.payloadLength = payload.size();
+        std::strcpy(header.sender, "SERVER");
+        std::strncpy(header.topic, dictionary->topic.c_str(), MAX_TOPIC_LEN - 1);
+        std::atomic_load(&client.egress)->enqueue(header, payload.data(), (int)payload.size());
+    }
+
+    // Queue one packet to every target, sharing a single payload copy
+    // ===== OPTIMIZATION: Compressed fan-out =====
+    // Purpose: Compressed payloads go out untouched to subscribers that decode the
+    // codec; legacy subscribers share one decompressed copy made on first need.
+    int deliverToClients(const char *topic, const std::vector<std::shared_ptr<ClientInfo>> &targets,
+                         const PacketHeader &header, const SharedPayload &sharedPayload,
+                         const DictionaryRef &dictionary = DictionaryRef(), const std::string *conflationKey = nullptr)
+    {
         int sentCount = 0;
+        const char *payload = sharedPayload ? sharedPayload->data() : nullptr;
+        int payloadLen = sharedPayload ? (int)sharedPayload->size() : 0;
 
-        // Send to each subscriber (without holding lock during socket operations)
-        for (int clientId : subscriberIds)
+        bool compressed = (header.flags & FLAG_COMPRESSED) != 0;
+        CompressionEnvelope envelope;
+        if (compressed && !parseEnvelope(payload, payloadLen, envelope))
+            return 0;
+
+        PacketHeader plainHeader;
+        SharedPayload plainPayload;
+        bool plainFailed = false;
+
+        // Queue for each subscriber (without holding lock during socket operations)
+        for (const auto &client : targets)
+        {
+            bool queued;
+            if (!compressed || (client->codecs & CODEC_BIT(envelope.codec)))
+            {
+                if (compressed && dictionary)
+                    ensureDictionary(*client, dictionary);
+                queued = enqueueTo(*client, header, sharedPayload, conflationKey);
+            }
+            else
+            {
+                if (!plainPayload && !plainFailed)
+                {
+                    std::vector<char> plain;
+                    plainFailed = !decompressPayload(envelope, dictionary.get(), plain);
+                    if (!plainFailed)
+                    {
+                        plainPayload = std::make_shared<const std::vector<char>>(std::move(plain));
+                        plainHeader = header;
+                        plainHeader.flags &= ~FLAG_COMPRESSED;
+                        plainHeader.payloadLength = plainPayload->size();
+                        plainHeader.checksum = 0; // Recomputed by checksum-enabled egress
+                    }
+                }
+                queued = plainPayload && enqueueTo(*client, plainHeader, plainPayload, conflationKey);
+            }
+
+            if (queued)
+            {
+                sentCount++;
+                std::cout << "[BROKER] Message published to client " << client->clientId
+                          << " on topic: " << topic << std::endl;
+            }
+        }
+
+        return sentCount;
+    }
+
+    bool enqueueTo(ClientInfo &client, const PacketHeader &header, const SharedPayload &payload,
+                   const std::string *conflationKey)
+    {
+        auto egress = std::atomic_load(&client.egress);
+        return conflationKey ? egress->enqueueConflated(header, payload, *conflationKey)
+                             : egress->enqueue(header, payload);
+    }
+
+    // Record a publish on a last-value topic; returns its conflation key. The cache
+    // holds it plain, so a snapshot never needs a dictionary the subscriber lacks
+    std::string cacheLastValue(Topic &topic, const PacketHeader &header, const SharedPayload &payload)
+    {
+        PacketHeader plainHeader = header;
+        SharedPayload plainPayload = payload;
+        if (!inflateForStorage(plainHeader, plainPayload))
+            return std::string();
+        return LastValueCache::conflationKey(topic.name, topic.lastValues->update(plainHeader, plainPayload));
+    }
+
+    // A publish kept for later delivery is stored plain: whoever receives it may not
+    // decode the codec or hold the dictionary. False if it cannot be decompressed
+    bool inflateForStorage(PacketHeader &header, SharedPayload &payload)
+    {
+        if (!(header.flags & FLAG_COMPRESSED))
+            return true;
+        CompressionEnvelope envelope;
+        DictionaryRef dictionary;
+        if (!payload || !parseEnvelope(payload->data(), (int)payload->size(), envelope))
+            return false;
+        if (envelope.dictionaryId != 0)
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+            auto it = dictionaries.find(envelope.dictionaryId);
+            if (it != dictionaries.end())
+                dictionary = it->second;
+        }
+        std::vector<char> plain;
+        if (!decompressPayload(envelope, dictionary.get(), plain))
+            return false;
+        payload = std::make_shared<const std::vector<char>>(std::move(plain));
+        header.flags &= ~FLAG_COMPRESSED;
+        header.payloadLength = payload->size();
+        header.checksum = 0; // Recomputed by checksum-enabled egress
+        return true;
+    }
+
+    // Connected client logged in under username, via the index (caller holds clientsMutex)
+    std::shared_ptr<ClientInfo> findOnlineLocked(const char *username)
+    {
+        auto it = clients.find(onlineUsers.find(username));
+        if (it == clients.end() || !it->second->isConnected)
+            return nullptr;
+        return it->second;
+    }
+
+public:
+    // ===== OPTIMIZATION: Batched publish =====
+    // Purpose: High-rate producers pack many small records into one MSG_PUBLISH_BATCH.
+    // Records are grouped per topic so each topic's subscribers are resolved once per
+    // batch; subscribers still receive ordinary MSG_PUBLISH_TEXT packets, in publish
+    // order within each topic.
+    // Returns total number of deliveries
+    int publishBatch(const PacketHeader &batchHeader, const std::vector<BatchRecord> &records)
+    {
+        std::map<std::string, std::vector<size_t>> recordsByTopic;
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            recordsByTopic[records[i].topic].push_back(i);
+        }
+
+        int deliveries = 0;
+        for (auto const &group : recordsByTopic)
         {
-            std::shared_ptr<ClientInfo> client;
+            TopicRef topic;
+            std::vector<int> subscriberIds;
+            std::vector<std::pair<TopicFilterRef, std::vector<int>>> filterIds;
+            bool grouped;
+            {
+                std::lock_guard<std::mutex> lock(topicsMutex);
+                auto it = topicSubscribers.find(group.first);
+                if (it != topicSubscribers.end())
+                    topic = it->second;
+                else if (isLastValueTopic(group.first) && ownsTopicLocked(group.first))
+                    topic = internTopicLocked(group.first);
+                else
+                    continue; // Never subscribed
+            }
+
+            PacketHeader header = batchHeader;
+            header.msgType = MSG_PUBLISH_TEXT;
+            header.checksum = 0; // Covered the whole batch - egress recomputes per record
+            header.flags &= ~FLAG_COMPRESSED; // Records are always plain
+            std::memset(header.topic, 0, MAX_TOPIC_LEN);
+            std::strncpy(header.topic, group.first.c_str(), MAX_TOPIC_LEN - 1);
 
+            // Cached before the subscribers are read, as in publishToTopic
+            std::vector<SharedPayload> payloads;
+            std::vector<std::string> conflationKeys;
+            for (size_t index : group.second)
             {
-                std::lock_guard<std::mutex> lock(clientsMutex);
-                if (clients.count(clientId))
+                const BatchRecord &record = records[index];
+                SharedPayload sharedPayload;
+                if (record.payloadLength > 0)
                 {
-                    client = clients[clientId];
+                    sharedPayload = std::make_shared<const std::vector<char>>(record.payload, record.payload + record.payloadLength);
                 }
+                payloads.push_back(sharedPayload);
+                if (topic->lastValues)
+                {
+                    header.payloadLength = record.payloadLength;
+                    conflationKeys.push_back(cacheLastValue(*topic, header, sharedPayload));
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(topicsMutex);
+                subscriberIds = topic->subscribers;
+                for (auto const &pair : topic->filters)
+                {
+                    filterIds.emplace_back(pair.second.filter, pair.second.subscribers);
+                }
+                grouped = !topic->groups.empty();
+            }
+            std::vector<std::shared_ptr<ClientInfo>> targets = lookupClients(subscriberIds);
+            if (targets.empty() && filterIds.empty() && !grouped)
+                continue;
+
+            // Filtered subscribers are resolved once per topic, the filters run per record
+            std::vector<std::pair<TopicFilterRef, std::vector<std::shared_ptr<ClientInfo>>>> filterTargets;
+            for (auto const &entry : filterIds)
+            {
+                filterTargets.emplace_back(entry.first, lookupClients(entry.second));
             }
 
-            if (client && client->isConnected && client->socket != INVALID_SOCKET)
+            for (size_t i = 0; i < group.second.size(); i++)
             {
-                // Send header
-                if (send(client->socket, (const char *)&header, sizeof(PacketHeader), 0) != SOCKET_ERROR)
+                const BatchRecord &record = records[group.second[i]];
+                header.payloadLength = record.payloadLength;
+                const SharedPayload &sharedPayload = payloads[i];
+                const std::string *conflationKey = topic->lastValues && !conflationKeys[i].empty() ? &conflationKeys[i] : nullptr;
+
+                for (const auto &client : targets)
                 {
-                    // Send payload if exists
-                    if (payloadLen > 0 && payload)
+                    if (enqueueTo(*client, header, sharedPayload, conflationKey))
+                        deliveries++;
+                }
+                if (!filterTargets.empty())
+                {
+                    FilterMessage message(header.sender, header.topic, record.payload, record.payloadLength);
+                    for (auto const &entry : filterTargets)
                     {
-                        if (send(client->socket, payload, payloadLen, 0) != SOCKET_ERROR)
+                        if (!entry.first->matches(message))
+                            continue;
+                        for (const auto &client : entry.second)
                         {
-                            sentCount++;
-                            std::cout << "[BROKER] Message published to client " << clientId
-                                      << " on topic: " << topic << std::endl;
+                            if (enqueueTo(*client, header, sharedPayload, conflationKey))
+                                deliveries++;
                         }
                     }
-                    else
-                    {
-                        sentCount++;
-                        std::cout << "[BROKER] Message published to client " << clientId
-                                  << " on topic: " << topic << std::endl;
-                    }
                 }
+                if (grouped)
+                    deliveries += deliverToGroups(topic, header, sharedPayload, DictionaryRef());
             }
         }
 
-        return sentCount;
+        std::cout << "[BROKER] Batch of " << records.size() << " records on " << recordsByTopic.size()
+                  << " topics, " << deliveries << " deliveries" << std::endl;
+        return deliveries;
     }
 
     // Get client info by ID
@@ -246,97 +761,1127 @@ public:
     std::vector<int> getTopicSubscribers(const char *topic)
     {
         std::lock_guard<std::mutex> lock(topicsMutex);
-        if (topicSubscribers.count(topic))
+        auto it = topicSubscribers.find(topic);
+        if (it != topicSubscribers.end())
         {
-            return topicSubscribers[topic];
+            return it->second->subscribers;
         }
         return std::vector<int>();
     }
 
-    // Check if username is already taken by an online client
-    // Returns true if username exists and client is connected
-    bool isUsernameTaken(const char *username)
+    // Get (creating if needed) the interned Topic for a name
+    TopicRef internTopic(const char *topic)
     {
-        std::lock_guard<std::mutex> lock(clientsMutex);
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        return internTopicLocked(topic);
+    }
 
-        // Iterate through all connected clients
-        for (auto const &pair : clients)
+    // The interned Topic for a name, nullptr if there is none
+    TopicRef findTopic(const std::string &topic)
+    {
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        auto it = topicSubscribers.find(topic);
+        return it == topicSubscribers.end() ? nullptr : it->second;
+    }
+
+    // ----- Last-value topics (see last_value.h) -----
+
+    // Topics starting with prefix keep their newest value per key. Startup only
+    void addLastValuePrefix(const std::string &prefix)
+    {
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        lastValuePrefixes.push_back(prefix);
+    }
+
+    bool isLastValueTopic(const std::string &topic) const
+    {
+        for (auto const &prefix : lastValuePrefixes)
         {
-            auto const &client = pair.second;
-            // Check if client is connected AND username matches (case-sensitive)
-            if (client && client->isConnected && std::strcmp(client->username, username) == 0)
-            {
+            if (topic.compare(0, prefix.size(), prefix) == 0)
                 return true;
-            }
         }
         return false;
     }
 
-    void registerStreamSession(uint32_t sessionId,
-                               const char *publisher,
-                               const char *topic)
+    // Queue a last-value topic's cached values to a client that just subscribed (its
+    // filter applies). Returns the number queued; 0 for other topics
+    size_t sendLastValues(int clientId, const char *topic)
     {
-        std::lock_guard<std::mutex> lock(streamMutex);
-        streamSessions[sessionId] = {
-            sessionId,
-            topic,
-            publisher,
-            true};
+        TopicRef ref;
+        TopicFilterRef filter;
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+            auto it = topicSubscribers.find(topic);
+            if (it == topicSubscribers.end() || !it->second->lastValues)
+                return 0;
+            ref = it->second;
+            subscriptionLocked(*ref, clientId, filter);
+        }
+        auto client = getClient(clientId);
+        if (!client)
+            return 0;
+        size_t sent = ref->lastValues->sendTo(*std::atomic_load(&client->egress), ref->name, filter);
+        std::cout << "[BROKER] Sent " << sent << " last values of topic " << topic << " to client " << clientId
+                  << std::endl;
+        return sent;
     }
 
-    void unregisterStreamSession(uint32_t sessionId)
+    // Cluster: position of the newest update cached here for topic (0 if none), sent
+    // with a snapshot request so mergeLastValue can tell later updates apart
+    uint64_t lastValueStamp(const char *topic)
     {
-        std::lock_guard<std::mutex> lock(streamMutex);
-        streamSessions.erase(sessionId);
+        TopicRef ref = findTopic(topic);
+        return ref && ref->lastValues ? ref->lastValues->stamp() : 0;
     }
 
-    bool hasStreamSession(uint32_t sessionId)
+    // Cluster: f(header, payload) for every value cached here for topic
+    template <typename F>
+    void forEachLastValue(const std::string &topic, F f)
     {
-        std::lock_guard<std::mutex> lock(streamMutex);
-        return streamSessions.count(sessionId) > 0;
+        TopicRef ref = findTopic(topic);
+        if (ref && ref->lastValues)
+            ref->lastValues->forEach(f);
     }
 
-    void relayStreamFrame(const char *topic,
-                          const char *sender,
-                          const PacketHeader &header,
-                          const char *payload,
-                          int payloadLen)
+    // Cluster: last-value topics with values cached here
+    std::vector<std::string> lastValueTopics()
     {
-        std::vector<int> subscribers;
-
+        std::vector<std::string> names;
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        for (auto const &pair : topicSubscribers)
         {
-            std::lock_guard<std::mutex> lock(topicsMutex);
-            if (topicSubscribers.count(topic))
-                subscribers = topicSubscribers[topic];
+            if (pair.second->lastValues)
+                names.push_back(pair.first);
         }
+        return names;
+    }
 
-        for (int clientId : subscribers)
+    // Cluster: a value from the topic owner's snapshot for a client subscribed here
+    // since stamp since (see LastValueCache::merge), or handed over by a former owner
+    // (clientId -1). False if not taken
+    bool mergeLastValue(int clientId, const PacketHeader &header, const char *payload, uint32_t length, uint64_t since)
+    {
+        std::string name(header.topic);
+        TopicRef ref;
+        TopicFilterRef filter;
         {
-            std::shared_ptr<ClientInfo> client;
+            std::lock_guard<std::mutex> lock(topicsMutex);
+            if (clientId < 0)
+            {
+                if (!isLastValueTopic(name))
+                    return false;
+                ref = internTopicLocked(name);
+            }
+            else
             {
-                std::lock_guard<std::mutex> lock(clientsMutex);
-                if (clients.count(clientId))
-                    client = clients[clientId];
+                auto it = topicSubscribers.find(name);
+                if (it == topicSubscribers.end() || !it->second->lastValues ||
+                    !subscriptionLocked(*it->second, clientId, filter))
+                    return false; // Unsubscribed meanwhile
+                ref = it->second;
             }
+        }
+        std::shared_ptr<EgressQueue> egress;
+        if (clientId >= 0)
+        {
+            auto client = getClient(clientId);
+            if (!client)
+                return false;
+            egress = std::atomic_load(&client->egress);
+        }
+        SharedPayload shared;
+        if (length > 0)
+            shared = std::make_shared<const std::vector<char>>(payload, payload + length);
+        return ref->lastValues->merge(header, shared, since, egress.get(), name, filter);
+    }
 
-            if (!client || !client->isConnected)
-                continue;
+    // ----- Presence and membership queries (see presence.h) -----
 
-            // Không gửi lại cho chính sender
-            if (std::strcmp(client->username, sender) == 0)
-                continue;
+    // A page of a scope's names (empty scope: users logged in here, else the topic's
+    // subscribers) after cursor, and its size. watch starts or stops the client's
+    // MSG_PRESENCE deltas for the scope in the same step, so none is missed between them
+    std::vector<std::string> queryMembers(int clientId, const std::string &scope, const std::string &cursor,
+                                          size_t limit, bool watch, uint32_t &total, bool &more)
+    {
+        if (scope.empty())
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex);
+            auto it = clients.find(clientId);
+            if (it != clients.end())
+                setWatcher(presenceWatchers, it->second, watch);
+            total = (uint32_t)onlineUsers.size();
+            return onlineUsers.page(cursor, limit, more);
+        }
 
-            send(client->socket,
-                 (const char *)&header,
-                 sizeof(PacketHeader),
-                 0);
+        auto client = getClient(clientId);
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        auto it = topicSubscribers.find(scope);
+        if (it == topicSubscribers.end())
+        {
+            // Nobody subscribed yet: the watch waits outside the topic map (moved in by
+            // internTopicLocked), so watches alone cannot grow it and die with the client
+            if (client)
+            {
+                auto &watchers = pendingWatchers[scope];
+                setWatcher(watchers, client, watch);
+                if (watchers.empty())
+                    pendingWatchers.erase(scope);
+            }
+            total = 0;
+            more = false;
+            return std::vector<std::string>();
+        }
+        if (client)
+            setWatcher(it->second->watchers, client, watch);
+        total = (uint32_t)it->second->members.size();
+        return it->second->members.page(cursor, limit, more);
+    }
 
-            if (payloadLen > 0)
+    // Scopes a client watches (empty string: online users)
+    std::vector<std::string> watchesOf(int clientId)
+    {
+        std::vector<std::string> scopes;
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex);
+            if (findWatcher(presenceWatchers, clientId) != presenceWatchers.end())
+                scopes.push_back(std::string());
+        }
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        for (auto const &pair : topicSubscribers)
+        {
+            if (findWatcher(pair.second->watchers, clientId) != pair.second->watchers.end())
+                scopes.push_back(pair.first);
+        }
+        for (auto &pair : pendingWatchers)
+        {
+            if (findWatcher(pair.second, clientId) != pair.second.end())
+                scopes.push_back(pair.first);
+        }
+        return scopes;
+    }
+
+    // ----- Direct messages (see direct_message.h) -----
+
+    // Deliver a FLAG_DIRECT publish to the user named in header.topic if logged in here.
+    // Returns 1 if it was queued to the recipient, 0 if the recipient is not here
+    int publishDirect(const PacketHeader &header, const char *payload, int payloadLen)
+    {
+        std::shared_ptr<ClientInfo> recipient;
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex);
+            recipient = findOnlineLocked(header.topic);
+        }
+        if (!recipient)
+            return 0;
+
+        SharedPayload sharedPayload;
+        if (payloadLen > 0 && payload)
+        {
+            sharedPayload = std::make_shared<const std::vector<char>>(payload, payload + payloadLen);
+        }
+        DictionaryRef dictionary;
+        CompressionEnvelope envelope;
+        if ((header.flags & FLAG_COMPRESSED) && parseEnvelope(payload, payloadLen, envelope) &&
+            envelope.dictionaryId != 0)
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+            auto it = dictionaries.find(envelope.dictionaryId);
+            if (it != dictionaries.end())
+                dictionary = it->second;
+        }
+        return deliverToClients(header.topic, {recipient}, header, sharedPayload, dictionary);
+    }
+
+    // Keep a direct message for a recipient logged in nowhere. False if its inbox is full.
+    // A login racing with this one finds it at the next login instead
+    bool storeDirect(const PacketHeader &header, const char *payload, int payloadLen)
+    {
+        PacketHeader plainHeader = header;
+        SharedPayload plainPayload;
+        if (payloadLen > 0 && payload)
+        {
+            plainPayload = std::make_shared<const std::vector<char>>(payload, payload + payloadLen);
+        }
+        if (!inflateForStorage(plainHeader, plainPayload))
+            return false;
+        return offlineInbox.store(header.topic, plainHeader, plainPayload);
+    }
+
+    // Queue the direct messages that waited for a client's user. Call after its login
+    // ACK. Returns the number queued
+    size_t deliverOffline(int clientId)
+    {
+        auto client = getClient(clientId);
+        if (!client)
+            return 0;
+        std::vector<OfflineMessage> messages = offlineInbox.take(client->username);
+        auto egress = std::atomic_load(&client->egress);
+        size_t sent = 0;
+        for (auto const &message : messages)
+        {
+            if (egress->enqueue(message.header, message.payload))
+                sent++;
+        }
+        if (!messages.empty())
+            std::cout << "[BROKER] Delivered " << sent << " offline messages to client " << clientId << std::endl;
+        return sent;
+    }
+
+    // ----- Cluster (see cluster.h) -----
+
+    // listener(topic, interested) runs, under the topics lock and so in order, whenever
+    // a topic gains its first local subscriber or loses its last one (group members count)
+    void setInterestListener(const std::function<void(const std::string &, bool)> &listener)
+    {
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        interestListener = listener;
+    }
+
+    // owns(topic): whether this node is the topic's owner, which alone keeps last values
+    // of topics without local subscribers. Runs under the topics lock
+    void setTopicOwnership(const std::function<bool(const std::string &)> &owns)
+    {
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        topicOwnership = owns;
+    }
+
+    // f(topic) for every topic with local subscribers, under the same lock, so no
+    // interest change can slip in between the snapshot and the listener
+    template <typename F>
+    void forEachInterestedTopic(F f)
+    {
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        for (auto const &pair : topicSubscribers)
+        {
+            if (hasLocalInterest(*pair.second))
+                f(pair.first);
+        }
+    }
+
+    // Usernames of the clients logged in here
+    std::vector<std::string> localUsernames()
+    {
+        std::vector<std::string> names;
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        for (auto const &pair : clients)
+        {
+            if (pair.second->isConnected)
+                names.push_back(pair.second->username);
+        }
+        return names;
+    }
+
+    // Dictionary ids are per node: a payload compressed with one of ours is
+    // decompressed (into storage) before it leaves for another node. Payloads
+    // compressed without a dictionary travel as they are. False if it cannot be decoded.
+    bool withoutDictionary(PacketHeader &header, const char *&payload, uint32_t &length, std::vector<char> &storage)
+    {
+        if (!(header.flags & FLAG_COMPRESSED))
+            return true;
+        CompressionEnvelope envelope;
+        if (!parseEnvelope(payload, length, envelope))
+            return false;
+        if (envelope.dictionaryId == 0)
+            return true;
+
+        DictionaryRef dictionary;
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+            auto it = dictionaries.find(envelope.dictionaryId);
+            if (it == dictionaries.end())
+                return false;
+            dictionary = it->second;
+        }
+        if (!decompressPayload(envelope, dictionary.get(), storage))
+            return false;
+        header.flags &= ~FLAG_COMPRESSED;
+        header.checksum = 0; // Recomputed by checksum-enabled egress
+        header.payloadLength = storage.size();
+        payload = storage.data();
+        length = storage.size();
+        return true;
+    }
+
+    // ----- Replication (see replication.h) -----
+
+    // Username -> topics (personal topic included) of every client logged in here
+    std::map<std::string, std::vector<std::string>> sessionSubscriptions()
+    {
+        std::map<int, std::string> usernames;
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex);
+            for (auto const &pair : clients)
+            {
+                if (pair.second->isConnected)
+                    usernames[pair.first] = pair.second->username;
+            }
+        }
+
+        std::map<std::string, std::vector<std::string>> sessions;
+        for (auto const &pair : usernames)
+        {
+            sessions[pair.second]; // Logged in without subscriptions still counts
+        }
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        for (auto const &pair : topicSubscribers)
+        {
+            for (int clientId : pair.second->subscribers)
+            {
+                auto it = usernames.find(clientId);
+                if (it != usernames.end())
+                    sessions[it->second].push_back(pair.first);
+            }
+        }
+        return sessions;
+    }
+
+    // ----- Session resumption (see session_resume.h) -----
+
+    // Deliver a client's packets to another queue: a parked session's buffer, or the
+    // connection that resumed it. A new queue starts without the client's dictionaries
+    void swapEgress(int clientId, const std::shared_ptr<EgressQueue> &egress)
+    {
+        auto client = getClient(clientId);
+        if (!client)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(client->dictionaryMutex);
+            client->dictionaries.clear();
+        }
+        std::atomic_store(&client->egress, egress);
+    }
+
+    // ----- Consumer groups (see consumer_group.h) -----
+
+    // Join a topic's group. A client is in at most one group per topic: its previous
+    // one is left, and what it held unacknowledged there goes to the rest of that group.
+    // False if it already is a member
+    bool joinGroup(int clientId, const char *topic, const std::string &group)
+    {
+        std::string topicStr(topic);
+        std::string previous;
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+
+            TopicRef ref = internTopicLocked(topicStr);
+            auto found = ref->groups.find(group);
+            if (found != ref->groups.end() &&
+                std::find(found->second.members.begin(), found->second.members.end(), clientId) !=
+                    found->second.members.end())
+            {
+                return false;
+            }
+            bool wasInterested = hasLocalInterest(*ref);
+            previous = removeGroupMemberLocked(*ref, clientId);
+            ref->groups[group].members.push_back(clientId);
+            std::cout << "[BROKER] Client " << clientId << " joined group " << group << " on topic: " << topic
+                      << std::endl;
+            if (!wasInterested && interestListener)
+                interestListener(topicStr, true);
+        }
+
+        auto client = getClient(clientId);
+        if (client && !previous.empty())
+            redeliverToGroups(client->groupInbox.take(topicStr, previous));
+        return true;
+    }
+
+    // Leave a topic's group: its unacknowledged deliveries go to the remaining members.
+    // False if it was not a member
+    bool leaveGroup(int clientId, const char *topic, const std::string &group)
+    {
+        std::string topicStr(topic);
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+
+            auto it = topicSubscribers.find(topicStr);
+            if (it == topicSubscribers.end())
+                return false;
+            Topic &entry = *it->second;
+            auto found = entry.groups.find(group);
+            if (found == entry.groups.end())
+                return false;
+            auto &members = found->second.members;
+            auto member = std::find(members.begin(), members.end(), clientId);
+            if (member == members.end())
+                return false;
+            members.erase(member);
+            if (members.empty())
+                entry.groups.erase(found);
+            std::cout << "[BROKER] Client " << clientId << " left group " << group << " on topic: " << topic
+                      << std::endl;
+            if (!hasLocalInterest(entry) && interestListener)
+                interestListener(topicStr, false);
+        }
+
+        auto client = getClient(clientId);
+        if (client)
+            redeliverToGroups(client->groupInbox.take(topicStr, group));
+        return true;
+    }
+
+    // A member has processed a delivery. False if the id is unknown (acknowledged before)
+    bool ackGroupDelivery(int clientId, uint32_t deliveryId)
+    {
+        auto client = getClient(clientId);
+        return client && client->groupInbox.ack(deliveryId);
+    }
+
+    // ----- Hot restart (see hot_restart.h) -----
+
+    // (topic, group) of every consumer group a client is a member of
+    std::vector<std::pair<std::string, std::string>> groupsOf(int clientId)
+    {
+        std::vector<std::pair<std::string, std::string>> groups;
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        for (auto const &pair : topicSubscribers)
+        {
+            for (auto const &group : pair.second->groups)
+            {
+                auto const &members = group.second.members;
+                if (std::find(members.begin(), members.end(), clientId) != members.end())
+                    groups.emplace_back(pair.first, group.first);
+            }
+        }
+        return groups;
+    }
+
+    // (topic, expression) of every filtered subscription of a client
+    std::vector<std::pair<std::string, std::string>> filtersOf(int clientId)
+    {
+        std::vector<std::pair<std::string, std::string>> filters;
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        for (auto const &pair : topicSubscribers)
+        {
+            for (auto const &filter : pair.second->filters)
+            {
+                auto const &subscribers = filter.second.subscribers;
+                if (std::find(subscribers.begin(), subscribers.end(), clientId) != subscribers.end())
+                    filters.emplace_back(pair.first, filter.first);
+            }
+        }
+        return filters;
+    }
+
+    // The client moves to the successor with everything it was sent: its group
+    // deliveries are not handed to other members when it unregisters here
+    void forgetGroupDeliveries(int clientId)
+    {
+        auto client = getClient(clientId);
+        if (client)
+            client->groupInbox.take();
+    }
+
+    // Topics a client is subscribed to (its personal topic included)
+    std::vector<std::string> subscriptionsOf(int clientId)
+    {
+        std::vector<std::string> topics;
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        for (auto const &pair : topicSubscribers)
+        {
+            auto const &subscribers = pair.second->subscribers;
+            if (std::find(subscribers.begin(), subscribers.end(), clientId) != subscribers.end())
+                topics.push_back(pair.first);
+        }
+        return topics;
+    }
+
+    // Dictionaries a client already holds, so the successor does not resend them
+    std::vector<uint32_t> dictionariesSentTo(int clientId)
+    {
+        auto client = getClient(clientId);
+        if (!client)
+            return std::vector<uint32_t>();
+        std::lock_guard<std::mutex> lock(client->dictionaryMutex);
+        return std::vector<uint32_t>(client->dictionaries.begin(), client->dictionaries.end());
+    }
+
+    void restoreDictionariesSent(int clientId, const std::vector<uint32_t> &ids)
+    {
+        auto client = getClient(clientId);
+        if (!client)
+            return;
+        std::lock_guard<std::mutex> lock(client->dictionaryMutex);
+        client->dictionaries.insert(ids.begin(), ids.end());
+    }
+
+    // Stop building dictionaries and write the ones built so far; ids stay valid in
+    // the successor, which keeps numbering after them
+    template <typename Writer>
+    void saveDictionaries(Writer &out)
+    {
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        dictionariesFrozen = true;
+        out.u32(nextDictionaryId);
+        out.u32((uint32_t)dictionaries.size());
+        for (auto const &pair : dictionaries)
+        {
+            out.u32(pair.second->id);
+            out.u8(pair.second->codec);
+            out.str(pair.second->topic);
+            out.str(std::string(pair.second->bytes.begin(), pair.second->bytes.end()));
+        }
+    }
+
+    template <typename Reader>
+    bool loadDictionaries(Reader &in)
+    {
+        uint32_t next, count;
+        if (!in.u32(next) || !in.u32(count))
+            return false;
+        std::lock_guard<std::mutex> lock(topicsMutex);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            auto dictionary = std::make_shared<CompressionDictionary>();
+            std::string bytes;
+            if (!in.u32(dictionary->id) || !in.u8(dictionary->codec) || !in.str(dictionary->topic) || !in.str(bytes))
+                return false;
+            dictionary->bytes.assign(bytes.begin(), bytes.end());
+            TopicRef topic = internTopicLocked(dictionary->topic);
+            topic->dictionary = dictionary;
+            topic->dictionarySamples.clear();
+            dictionaries[dictionary->id] = dictionary;
+        }
+        if (next > nextDictionaryId)
+            nextDictionaryId = next;
+        return true;
+    }
+
+    template <typename Writer>
+    void saveOfflineMessages(Writer &out)
+    {
+        offlineInbox.saveState(out);
+    }
+
+    template <typename Reader>
+    bool loadOfflineMessages(Reader &in)
+    {
+        return offlineInbox.loadState(in);
+    }
+
+    // Last values travel with the dictionaries, a successor serves the same snapshots
+    template <typename Writer>
+    void saveLastValues(Writer &out)
+    {
+        std::vector<TopicRef> cached;
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+            for (auto const &pair : topicSubscribers)
+            {
+                if (pair.second->lastValues)
+                    cached.push_back(pair.second);
+            }
+        }
+        out.u32((uint32_t)cached.size());
+        for (auto const &topic : cached)
+        {
+            out.str(topic->name);
+            topic->lastValues->saveState(out);
+        }
+    }
+
+    template <typename Reader>
+    bool loadLastValues(Reader &in)
+    {
+        uint32_t count;
+        if (!in.u32(count))
+            return true; // From a predecessor without last-value topics
+        for (uint32_t i = 0; i < count; i++)
+        {
+            std::string name;
+            if (!in.str(name))
+                return false;
+            LastValueCache discarded; // No longer a last-value topic here: read past it
+            LastValueCache &cache = isLastValueTopic(name) ? *internTopic(name.c_str())->lastValues : discarded;
+            if (!cache.loadState(in))
+                return false;
+        }
+        return true;
+    }
+
+    // Check if username is already taken by an online client
+    // Returns true if username exists and client is connected
+    bool isUsernameTaken(const char *username)
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        return findOnlineLocked(username) != nullptr;
+    }
+
+    // Bind a stream-port connection to a logged-in user's chat session
+    // Returns the chat client id, or -1 if the user is not online
+    int attachStreamSocket(const char *username, const std::shared_ptr<EgressQueue> &streamEgress)
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+
+        auto client = findOnlineLocked(username);
+        if (!client)
+            return -1;
+        std::atomic_store(&client->streamEgress, streamEgress);
+        std::cout << "[BROKER] Stream socket attached to client " << client->clientId
+                  << " (" << username << ")" << std::endl;
+        return client->clientId;
+    }
+
+    // Unbind a stream connection, unless the client has already attached a newer one
+    void detachStreamSocket(int clientId, const std::shared_ptr<EgressQueue> &streamEgress)
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+
+        if (clients.count(clientId))
+        {
+            auto client = clients[clientId];
+            if (std::atomic_load(&client->streamEgress) == streamEgress)
+            {
+                std::atomic_store(&client->streamEgress, std::shared_ptr<EgressQueue>());
+            }
+        }
+    }
+
+    // ===== OPTIMIZATION: Per-session stream relay =====
+    // Purpose: Audio frames arrive ~50/s per stream; resolving topic -> ids -> ClientInfo
+    // for every frame costs two mutex acquisitions per subscriber. The listener set is
+    // resolved once on MSG_STREAM_START and cached on the session; subscribe/unsubscribe
+    // invalidate it so the next frame re-resolves lazily.
+    // Lock order: streamMutex is never held while taking topicsMutex/clientsMutex.
+
+    // Register a stream session and resolve its listener set
+    // Returns number of listeners
+    int registerStreamSession(const StreamSessionKey &sessionId,
+                              const char *publisher,
+                              const char *topic)
+    {
+        uint64_t generation;
+        {
+            std::lock_guard<std::mutex> lock(streamMutex);
+            StreamSession &session = streamSessions[sessionId];
+            generation = session.generation + 1;
+            session = {
+                sessionId,
+                topic,
+                publisher,
+                true,
+                nullptr,
+                generation};
+        }
+
+        auto listeners = resolveStreamListeners(topic, publisher);
+        storeStreamListeners(sessionId, generation, listeners);
+        return listeners->size();
+    }
+
+    void unregisterStreamSession(const StreamSessionKey &sessionId)
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        streamSessions.erase(sessionId);
+    }
+
+    bool hasStreamSession(const StreamSessionKey &sessionId)
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        return streamSessions.count(sessionId) > 0;
+    }
+
+    // Relay a stream packet to the cached listeners of a session
+    // Returns number of listeners reached, or -1 if the session is unknown (a packet
+    // whose sender or topic is not the session's is dropped: 0)
+    int relayStreamFrame(const StreamSessionKey &sessionId,
+                         const PacketHeader &header,
+                         const char *payload,
+                         int payloadLen)
+    {
+        std::shared_ptr<const StreamListenerList> listeners;
+        std::string topic;
+        std::string publisher;
+        uint64_t generation = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(streamMutex);
+            auto it = streamSessions.find(sessionId);
+            if (it == streamSessions.end())
+                return -1;
+            if (it->second.topic != std::string_view(header.topic, strnlen(header.topic, MAX_TOPIC_LEN)) ||
+                it->second.publisher != std::string_view(header.sender, strnlen(header.sender, MAX_USERNAME_LEN)))
+                return 0;
+
+            listeners = it->second.listeners;
+            if (!listeners)
+            {
+                topic = it->second.topic;
+                publisher = it->second.publisher;
+                generation = it->second.generation;
+            }
+        }
+
+        // Cache was invalidated by a membership change - re-resolve outside streamMutex
+        if (!listeners)
+        {
+            listeners = resolveStreamListeners(topic.c_str(), publisher.c_str());
+            storeStreamListeners(sessionId, generation, listeners);
+        }
+
+        SharedPayload sharedPayload;
+        if (payloadLen > 0 && payload)
+        {
+            sharedPayload = std::make_shared<const std::vector<char>>(payload, payload + payloadLen);
+        }
+
+        int sentCount = 0;
+        for (const auto &client : *listeners)
+        {
+            if (!client->isConnected)
+                continue;
+
+            // Media goes over the listener's stream connection so it never queues behind chat
+            // traffic; clients that never attached one still get it on the chat socket
+            std::shared_ptr<EgressQueue> target = std::atomic_load(&client->streamEgress);
+            if (!target)
+                target = std::atomic_load(&client->egress);
+            if (!target)
+                continue;
+
+            if (target->enqueue(header, sharedPayload))
+                sentCount++;
+        }
+        return sentCount;
+    }
+
+private:
+    // Members of one group, starting at its cursor
+    struct GroupRoute
+    {
+        std::string group;
+        std::vector<int> members;
+    };
+
+    // A topic concerns this node (cluster interest) while it has subscribers or group members
+    static bool hasLocalInterest(const Topic &topic)
+    {
+        return !topic.subscribers.empty() || !topic.filters.empty() || !topic.groups.empty();
+    }
+
+    // Remove a client's filtered subscription to a topic (topicsMutex held); a filter
+    // nobody uses any more is dropped. False if it had none
+    bool removeFilteredLocked(Topic &topic, int clientId)
+    {
+        for (auto it = topic.filters.begin(); it != topic.filters.end(); ++it)
+        {
+            auto &subscribers = it->second.subscribers;
+            auto member = std::find(subscribers.begin(), subscribers.end(), clientId);
+            if (member == subscribers.end())
+                continue;
+            subscribers.erase(member);
+            if (subscribers.empty())
+                topic.filters.erase(it);
+            return true;
+        }
+        return false;
+    }
+
+    // Add the subscribers of every filter the message matches to ids. A compressed
+    // payload is inflated once, and only if some filter looks at the payload
+    void matchFilters(const std::string &topic, const std::vector<FilteredSubscribers> &filtered,
+                      const PacketHeader &header, const char *payload, int payloadLen,
+                      const DictionaryRef &dictionary, std::vector<int> &ids)
+    {
+        std::vector<char> plain;
+        if (header.flags & FLAG_COMPRESSED)
+        {
+            bool needed = false;
+            for (auto const &entry : filtered)
+            {
+                needed = needed || entry.filter->needsPayload();
+            }
+            CompressionEnvelope envelope;
+            if (needed && parseEnvelope(payload, payloadLen, envelope))
+                decompressPayload(envelope, dictionary.get(), plain);
+            payload = plain.data();
+            payloadLen = (int)plain.size();
+        }
+
+        FilterMessage message(header.sender, topic.c_str(), payload, payloadLen);
+        for (auto const &entry : filtered)
+        {
+            if (entry.filter->matches(message))
+                ids.insert(ids.end(), entry.subscribers.begin(), entry.subscribers.end());
+        }
+    }
+
+    // Remove a client from its group on a topic (topicsMutex held). Returns the group's
+    // name, empty if it was in none
+    std::string removeGroupMemberLocked(Topic &topic, int clientId)
+    {
+        for (auto it = topic.groups.begin(); it != topic.groups.end(); ++it)
+        {
+            auto &members = it->second.members;
+            auto member = std::find(members.begin(), members.end(), clientId);
+            if (member == members.end())
+                continue;
+            members.erase(member);
+            std::string name = it->first;
+            if (members.empty())
+                topic.groups.erase(it);
+            return name;
+        }
+        return std::string();
+    }
+
+    // Route the next message of a group (topicsMutex held): the cursor moves on, so
+    // equally loaded members take turns
+    void routeGroupLocked(const std::string &name, ConsumerGroup &group, std::vector<GroupRoute> &routes)
+    {
+        GroupRoute route;
+        route.group = name;
+        size_t count = group.members.size();
+        size_t start = group.cursor++ % count;
+        route.members.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            route.members.push_back(group.members[(start + i) % count]);
+        }
+        routes.push_back(std::move(route));
+    }
+
+    // One member of each of the topic's groups gets the message. Returns deliveries made
+    int deliverToGroups(const TopicRef &topic, const PacketHeader &header, const SharedPayload &payload,
+                        const DictionaryRef &dictionary)
+    {
+        std::vector<GroupRoute> routes;
+        {
+            std::lock_guard<std::mutex> lock(topicsMutex);
+            for (auto &pair : topic->groups)
+            {
+                routeGroupLocked(pair.first, pair.second, routes);
+            }
+        }
+
+        int sentCount = 0;
+        for (auto const &route : routes)
+        {
+            if (deliverToGroupMember(topic->name, route, header, payload, dictionary))
+                sentCount++;
+        }
+        return sentCount;
+    }
+
+    // Queue a message to the route's least loaded member, tracked until it is acknowledged
+    bool deliverToGroupMember(const std::string &topic, const GroupRoute &route, const PacketHeader &header,
+                              const SharedPayload &payload, const DictionaryRef &dictionary)
+    {
+        std::shared_ptr<ClientInfo> chosen;
+        uint32_t least = GROUP_MAX_UNACKED;
+        for (auto const &member : lookupClients(route.members))
+        {
+            uint32_t outstanding = member->groupInbox.outstanding();
+            if (outstanding < least)
+            {
+                least = outstanding;
+                chosen = member;
+            }
+        }
+        if (!chosen)
+        {
+            std::cerr << "[BROKER] No member of group " << route.group << " on topic " << topic
+                      << " can take a message, dropped" << std::endl;
+            return false;
+        }
+
+        // Tracked even if the queue refuses it: that connection is ending, and its
+        // deliveries move on when it unregisters
+        PacketHeader groupHeader = header;
+        groupHeader.flags |= FLAG_GROUP;
+        groupHeader.messageId = chosen->groupInbox.track({topic, route.group, header, payload, dictionary});
+        return deliverToClients(topic.c_str(), {chosen}, groupHeader, payload, dictionary) > 0;
+    }
+
+    // Hand deliveries a member gave up (left, or its session ended) to the rest of their group
+    void redeliverToGroups(const std::vector<GroupDelivery> &deliveries)
+    {
+        for (auto const &delivery : deliveries)
+        {
+            std::vector<GroupRoute> routes;
+            {
+                std::lock_guard<std::mutex> lock(topicsMutex);
+                auto it = topicSubscribers.find(delivery.topic);
+                if (it != topicSubscribers.end())
+                {
+                    auto group = it->second->groups.find(delivery.group);
+                    if (group != it->second->groups.end())
+                        routeGroupLocked(group->first, group->second, routes);
+                }
+            }
+            if (routes.empty())
+            {
+                std::cerr << "[BROKER] Group " << delivery.group << " on topic " << delivery.topic
+                          << " has no members left, message dropped" << std::endl;
+                continue;
+            }
+            deliverToGroupMember(delivery.topic, routes.front(), delivery.header, delivery.payload,
+                                 delivery.dictionary);
+        }
+        if (!deliveries.empty())
+            std::cout << "[BROKER] " << deliveries.size() << " unacknowledged group deliveries handed on" << std::endl;
+    }
+
+    TopicRef internTopicLocked(const std::string &topic)
+    {
+        TopicRef &ref = topicSubscribers[topic];
+        if (!ref)
+        {
+            ref = std::make_shared<Topic>();
+            ref->name = topic;
+            if (isLastValueTopic(topic))
+                ref->lastValues = std::make_shared<LastValueCache>();
+            auto pending = pendingWatchers.find(topic);
+            if (pending != pendingWatchers.end())
+            {
+                ref->watchers = std::move(pending->second);
+                pendingWatchers.erase(pending);
+            }
+        }
+        return ref;
+    }
+
+    static std::vector<std::shared_ptr<ClientInfo>>::iterator findWatcher(
+        std::vector<std::shared_ptr<ClientInfo>> &watchers, int clientId)
+    {
+        return std::find_if(watchers.begin(), watchers.end(),
+                            [clientId](const std::shared_ptr<ClientInfo> &watcher)
+                            { return watcher->clientId == clientId; });
+    }
+
+    static void setWatcher(std::vector<std::shared_ptr<ClientInfo>> &watchers,
+                           const std::shared_ptr<ClientInfo> &client, bool watch)
+    {
+        auto it = findWatcher(watchers, client->clientId);
+        if (watch && it == watchers.end())
+            watchers.push_back(client);
+        else if (!watch && it != watchers.end())
+            watchers.erase(it);
+    }
+
+    static void removeWatcher(std::vector<std::shared_ptr<ClientInfo>> &watchers, int clientId)
+    {
+        auto it = findWatcher(watchers, clientId);
+        if (it != watchers.end())
+            watchers.erase(it);
+    }
+
+    // Queue a MSG_PRESENCE delta to a scope's watchers. Runs under the lock guarding the
+    // scope, so watchers see a scope's deltas in the order the changes happened
+    static void notifyWatchers(const std::vector<std::shared_ptr<ClientInfo>> &watchers, const std::string &scope,
+                               const std::string &username, bool joined)
+    {
+        if (watchers.empty())
+            return;
+        PacketHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.msgType = MSG_PRESENCE;
+        header.payloadLength = 1;
+        std::strncpy(header.sender, username.c_str(), MAX_USERNAME_LEN - 1);
+        std::strncpy(header.topic, scope.c_str(), MAX_TOPIC_LEN - 1);
+        auto payload = std::make_shared<const std::vector<char>>(1, joined ? PRESENCE_JOINED : PRESENCE_LEFT);
+        for (auto const &watcher : watchers)
+        {
+            std::atomic_load(&watcher->egress)->enqueue(header, payload);
+        }
+    }
+
+    void addMemberLocked(Topic &topic, int clientId, const std::string &username)
+    {
+        if (topic.members.add(clientId, username))
+            notifyWatchers(topic.watchers, topic.name, username, true);
+    }
+
+    void removeMemberLocked(Topic &topic, int clientId)
+    {
+        std::string username = topic.members.remove(clientId);
+        if (!username.empty())
+            notifyWatchers(topic.watchers, topic.name, username, false);
+    }
+
+    // The topic's last values are cached here: no cluster, or this node owns it
+    bool ownsTopicLocked(const std::string &topic) const
+    {
+        return !topicOwnership || topicOwnership(topic);
+    }
+
+    // Whether client is subscribed to topic (plainly or through filter)
+    static bool subscriptionLocked(const Topic &topic, int clientId, TopicFilterRef &filter)
+    {
+        for (auto const &pair : topic.filters)
+        {
+            auto const &subscribers = pair.second.subscribers;
+            if (std::find(subscribers.begin(), subscribers.end(), clientId) != subscribers.end())
+            {
+                filter = pair.second.filter;
+                return true;
+            }
+        }
+        return std::find(topic.subscribers.begin(), topic.subscribers.end(), clientId) != topic.subscribers.end();
+    }
+
+    std::vector<std::shared_ptr<ClientInfo>> lookupClients(const std::vector<int> &subscriberIds)
+    {
+        std::vector<std::shared_ptr<ClientInfo>> targets;
+        targets.reserve(subscriberIds.size());
+
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        for (int clientId : subscriberIds)
+        {
+            auto it = clients.find(clientId);
+            if (it != clients.end() && it->second->isConnected && std::atomic_load(&it->second->egress))
+            {
+                targets.push_back(it->second);
+            }
+        }
+        return targets;
+    }
+
+    // Snapshot connected subscribers of a topic, skipping the publisher itself
+    std::shared_ptr<const StreamListenerList> resolveStreamListeners(const char *topic, const char *publisher)
+    {
+        std::vector<int> subscriberIds = getTopicSubscribers(topic);
+        auto listeners = std::make_shared<StreamListenerList>();
+
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        for (int clientId : subscriberIds)
+        {
+            auto it = clients.find(clientId);
+            if (it == clients.end() || !it->second->isConnected)
+                continue;
+
+            // Không gửi lại cho chính sender
+            if (std::strcmp(it->second->username, publisher) == 0)
+                continue;
+
+            listeners->push_back(it->second);
+        }
+        return listeners;
+    }
+
+    // Cache a resolved listener set unless membership changed while resolving
+    void storeStreamListeners(const StreamSessionKey &sessionId, uint64_t generation,
+                              const std::shared_ptr<const StreamListenerList> &listeners)
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        auto it = streamSessions.find(sessionId);
+        if (it != streamSessions.end() && it->second.generation == generation)
+        {
+            it->second.listeners = listeners;
+        }
+    }
+
+    // Drop cached listener sets for sessions on a topic (empty topic = all sessions)
+    void invalidateStreamSessions(const std::string &topic)
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        for (auto &pair : streamSessions)
+        {
+            StreamSession &session = pair.second;
+            if (topic.empty() || session.topic == topic)
             {
-                send(client->socket,
-                     payload,
-                     payloadLen,
-                     0);
+                session.listeners.reset();
+                session.generation++;
             }
         }
     }
@@ -0,0 +1,768 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include "../protocol.h"
+#include "broker.h"
+#include "egress.h"
+#include "session_io.h"
+#include "socket_reader.h"
+#include "timer_wheel.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+
+// ===== OPTIMIZATION: Broker cluster =====
+// Purpose: One process was the ceiling for connections and fan-out. Broker nodes
+// (--node <id> <cluster-port>, --peer <id> <host>:<port> for every other node)
+// now share the load:
+// - Each pair of nodes keeps one TCP link (the lower id dials) carrying v1-framed
+//   CLUSTER_* packets (egress.h), on a port clients never see
+// - A node advertises the topics it has local subscribers for (CLUSTER_INTEREST,
+//   on the first subscriber / after the last one, and in full when a link comes up)
+// - A publish is delivered locally and forwarded once to each node interested in
+//   the topic, which fans it out to its own subscribers - one copy per node,
+//   not per remote subscriber
+// - Usernames are owned by nodes (the topic ring below): a login asks the owner to
+//   claim the name, so it is unique cluster-wide. An owner that does not answer
+//   refuses the login rather than risk a duplicate; when nodes come and go, names
+//   move to their new owners and every node re-asserts its logged-in users there
+// Stream-port attachments stay local to a node.
+
+// ===== OPTIMIZATION: Consistent-hash topic partitioning =====
+// Purpose: Per-topic state (stream sessions) should be spread over the nodes, not
+// duplicated on every node a publisher happens to connect to:
+// - Every node places PARTITION_VNODES points per live node (itself and the peers
+//   whose link is up) on a hash ring; a topic belongs to the first point after its
+//   hash. All nodes with the same view agree on the owner without asking
+// - A node joining or leaving moves only the topics on its own arcs (~1/N of them)
+// - MSG_STREAM_START on a node that does not own the topic is answered with
+//   MSG_REDIRECT ("host:port" of the owner's chat port); a session whose topic moves
+//   away mid-stream is redirected at its next frame
+// - The owner relays the stream to its local listeners and forwards it once to each
+//   node with subscribers for the topic, like any publish
+// - Last-value topics (last_value.h) are cached by their owner: their publishes are
+//   also forwarded to it, a subscribe elsewhere fetches the snapshot from it
+//   (CLUSTER_SNAPSHOT, answered by CLUSTER_LAST_VALUE; both queued behind the
+//   publishes on the link, so a snapshot never overtakes one), and a node handing
+//   topics to a node that joins sends it their values
+
+enum ClaimResult
+{
+    CLAIM_GRANTED = 0,
+    CLAIM_TAKEN = 1,
+    CLAIM_UNAVAILABLE = 2 // Owner node unreachable or too slow
+};
+
+#define CLUSTER_CLAIM_TIMEOUT_MS 2000 // Login refused if the owner node has not answered by then
+#define CLUSTER_RECONNECT_MS 1000     // Between attempts to dial a peer / bind the cluster port
+
+#define PARTITION_VNODES 64 // Ring points per node: more = more even spread, bigger ring
+
+#define CLAIM_SYNC 0x01 // Re-assert a name already logged in (link came back), no reply unless it conflicts
+#define LAST_VALUE_HANDOFF 0x01 // CLUSTER_LAST_VALUE from a former owner: fills missing keys, no subscriber
+
+class ClusterNode
+{
+public:
+    // Delivers a publish forwarded by another node to local subscribers
+    typedef std::function<void(int node, const PacketHeader &, const char *, uint32_t)> DeliverFn;
+    // A node's link went down: drop what it was relaying here
+    typedef std::function<void(int node)> NodeDownFn;
+
+private:
+    struct Peer
+    {
+        std::string host;
+        int port;
+        int chatPort;                        // Where its clients connect (from CLUSTER_HELLO)
+        SOCKET sock;                         // Link socket while up
+        std::shared_ptr<EgressQueue> egress; // Link queue while up
+    };
+
+    // A claim sent to the owner node, failed by the wheel if no reply comes in time
+    struct PendingClaim : WheelTimer
+    {
+        ClusterNode &node;
+        int owner;
+        std::string username;
+        AsyncResultRef result;
+
+        PendingClaim(ClusterNode &n, int o, const std::string &name)
+            : node(n), owner(o), username(name), result(std::make_shared<AsyncResult>()) {}
+
+        unsigned expired(int64_t) override
+        {
+            // A grant that arrives later must not leave the name claimed
+            if (result->complete(CLAIM_UNAVAILABLE))
+                node.sendToNode(owner, CLUSTER_RELEASE, username, "", 0, 0);
+            return 0;
+        }
+    };
+    typedef std::shared_ptr<PendingClaim> PendingClaimRef;
+
+    MessageBroker &broker;
+    TimerWheel &wheel;
+    DeliverFn deliver;
+    NodeDownFn nodeDown;
+    int selfId;
+    int clusterPort;
+    int chatPort;
+    std::map<int, Peer> peers;                        // Node id -> peer, guarded by clusterMutex
+    std::map<std::string, std::set<int>> remoteInterest; // Topic -> nodes with subscribers, guarded by clusterMutex
+    std::map<std::string, int> claims;                // Names this node owns -> node holding them, guarded by clusterMutex
+    std::map<uint32_t, PendingClaimRef> pendingClaims; // Request id -> claim, guarded by clusterMutex
+    std::vector<std::pair<uint64_t, int>> ring;       // Sorted (point, node) of live nodes, guarded by clusterMutex
+    uint32_t nextRequestId;
+    std::mutex clusterMutex; // Never held while calling into the broker or the wheel
+
+    static uint64_t mix(uint64_t x)
+    {
+        x += 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    static uint64_t hashName(const std::string &name)
+    {
+        uint64_t hash = 1469598103934665603ull; // FNV-1a
+        for (unsigned char c : name)
+        {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Ring of the nodes currently reachable (this one always)
+    void rebuildRingLocked()
+    {
+        ring.clear();
+        auto place = [this](int node)
+        {
+            for (uint64_t point = 0; point < PARTITION_VNODES; point++)
+            {
+                ring.emplace_back(mix(((uint64_t)node << 32) | point), node);
+            }
+        };
+        place(selfId);
+        for (auto const &pair : peers)
+        {
+            if (pair.second.egress)
+                place(pair.first);
+        }
+        std::sort(ring.begin(), ring.end());
+    }
+
+    int topicOwnerLocked(const std::string &topic) const
+    {
+        if (ring.empty())
+            return selfId;
+        auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(mix(hashName(topic)), INT32_MIN));
+        return it == ring.end() ? ring.front().second : it->second;
+    }
+
+    static PacketHeader clusterHeader(uint32_t type, const std::string &sender, const std::string &topic,
+                                      uint32_t messageId, uint8_t flags)
+    {
+        PacketHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.msgType = type;
+        header.messageId = messageId;
+        header.flags = flags;
+        std::strncpy(header.sender, sender.c_str(), MAX_USERNAME_LEN - 1);
+        std::strncpy(header.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+        return header;
+    }
+
+    // Payload of CLUSTER_PUBLISH / CLUSTER_LAST_VALUE: the packet's v1 header, then its payload
+    static SharedPayload nestPacket(const PacketHeader &inner, const char *payload, uint32_t length)
+    {
+        auto shared = std::make_shared<std::vector<char>>(sizeof(PacketHeader) + length);
+        std::memcpy(shared->data(), &inner, sizeof(PacketHeader));
+        if (length > 0)
+            std::memcpy(shared->data() + sizeof(PacketHeader), payload, length);
+        return shared;
+    }
+
+    // Split a nested payload; false if malformed
+    static bool unnestPacket(const PacketHeader &header, const char *payload, PacketHeader &inner)
+    {
+        if (header.payloadLength < sizeof(PacketHeader))
+            return false;
+        std::memcpy(&inner, payload, sizeof(PacketHeader));
+        if (inner.payloadLength != header.payloadLength - sizeof(PacketHeader))
+            return false;
+        inner.sender[MAX_USERNAME_LEN - 1] = '\0';
+        inner.topic[MAX_TOPIC_LEN - 1] = '\0';
+        return true;
+    }
+
+    std::shared_ptr<EgressQueue> linkTo(int node)
+    {
+        std::lock_guard<std::mutex> lock(clusterMutex);
+        auto it = peers.find(node);
+        return it == peers.end() ? nullptr : it->second.egress;
+    }
+
+    // Queue topic's cached last values to node as CLUSTER_LAST_VALUE, echoing request's fields
+    void sendLastValues(const std::shared_ptr<EgressQueue> &egress, const std::string &topic, const PacketHeader &request)
+    {
+        broker.forEachLastValue(topic, [&](const PacketHeader &inner, const SharedPayload &payload)
+                                {
+            uint32_t length = payload ? (uint32_t)payload->size() : 0;
+            PacketHeader outer = request;
+            outer.msgType = CLUSTER_LAST_VALUE;
+            outer.payloadLength = sizeof(PacketHeader) + length;
+            egress->enqueue(outer, nestPacket(inner, payload ? payload->data() : nullptr, length)); });
+    }
+
+    // False if the node's link is down (or its queue refused the packet)
+    bool sendToNode(int node, uint32_t type, const std::string &sender, const std::string &topic,
+                    uint32_t messageId, uint8_t flags)
+    {
+        std::shared_ptr<EgressQueue> egress = linkTo(node);
+        return egress && egress->enqueue(clusterHeader(type, sender, topic, messageId, flags), SharedPayload());
+    }
+
+    // Owner side of a claim; node: the node the login happened on
+    ClaimResult claimLocally(const std::string &username, int node, bool sync)
+    {
+        std::lock_guard<std::mutex> lock(clusterMutex);
+        auto it = claims.find(username);
+        if (it == claims.end())
+        {
+            claims[username] = node;
+            return CLAIM_GRANTED;
+        }
+        return (sync && it->second == node) ? CLAIM_GRANTED : CLAIM_TAKEN;
+    }
+
+    void finishClaim(uint32_t requestId, int result)
+    {
+        PendingClaimRef claim;
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            auto it = pendingClaims.find(requestId);
+            if (it == pendingClaims.end())
+                return;
+            claim = it->second;
+            pendingClaims.erase(it);
+        }
+        wheel.cancel(claim.get());
+        if (!claim->result->complete(result) && result == CLAIM_GRANTED)
+            sendToNode(claim->owner, CLUSTER_RELEASE, claim->username, "", 0, 0);
+    }
+
+    void linkUp(int node, SOCKET sock, const std::shared_ptr<EgressQueue> &egress, int peerChatPort)
+    {
+        SOCKET replaced = INVALID_SOCKET;
+        size_t liveNodes;
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            Peer &peer = peers[node];
+            if (peer.egress)
+                replaced = peer.sock;
+            peer.sock = sock;
+            peer.egress = egress;
+            peer.chatPort = peerChatPort;
+            rebuildRingLocked();
+            liveNodes = ring.size() / PARTITION_VNODES;
+        }
+        if (replaced != INVALID_SOCKET)
+            shutdown(replaced, SHUT_RDWR); // Its reader ends and finds the link replaced
+        std::cout << "[CLUSTER] Link to node " << node << " up, " << liveNodes << " nodes share the topics" << std::endl;
+
+        // Interest in full; later changes follow through the broker's listener
+        broker.forEachInterestedTopic([&](const std::string &topic)
+                                      { egress->enqueue(clusterHeader(CLUSTER_INTEREST, "", topic, 0, 1), SharedPayload()); });
+        resyncClaims();
+
+        // Last-value topics now on the new node's arcs: it starts with the values kept here
+        std::vector<std::string> handedOver = broker.lastValueTopics();
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            handedOver.erase(std::remove_if(handedOver.begin(), handedOver.end(), [&](const std::string &topic)
+                                            { return topicOwnerLocked(topic) != node; }),
+                             handedOver.end());
+        }
+        for (auto const &topic : handedOver)
+        {
+            sendLastValues(egress, topic, clusterHeader(CLUSTER_LAST_VALUE, "", topic, 0, LAST_VALUE_HANDOFF));
+        }
+    }
+
+    // The ring changed: claims go to the names' (possibly new) owners again.
+    // An owner forgets the names it gave up; their holders re-assert them at the new owner.
+    void resyncClaims()
+    {
+        std::vector<std::string> names = broker.localUsernames();
+        std::vector<std::pair<int, std::string>> remote;
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            for (auto it = claims.begin(); it != claims.end();)
+            {
+                if (topicOwnerLocked(it->first) != selfId)
+                    it = claims.erase(it);
+                else
+                    ++it;
+            }
+            for (auto const &name : names)
+            {
+                int owner = topicOwnerLocked(name);
+                if (owner != selfId)
+                    remote.emplace_back(owner, name);
+                else if (!claims.emplace(name, selfId).second && claims[name] != selfId)
+                    std::cout << "[CLUSTER] Username " << name << " is logged in on two nodes" << std::endl;
+            }
+        }
+        for (auto const &claim : remote)
+        {
+            sendToNode(claim.first, CLUSTER_CLAIM, claim.second, "", 0, CLAIM_SYNC);
+        }
+    }
+
+    void linkDown(int node, const std::shared_ptr<EgressQueue> &egress)
+    {
+        std::vector<PendingClaimRef> failed;
+        size_t liveNodes;
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            Peer &peer = peers[node];
+            if (peer.egress != egress)
+                return; // Replaced by a newer link
+            peer.egress.reset();
+            peer.sock = INVALID_SOCKET;
+            rebuildRingLocked(); // Its topics move to the next points on the ring
+            liveNodes = ring.size() / PARTITION_VNODES;
+
+            for (auto &pair : remoteInterest)
+            {
+                pair.second.erase(node);
+            }
+            for (auto it = claims.begin(); it != claims.end();)
+            {
+                if (it->second == node)
+                    it = claims.erase(it);
+                else
+                    ++it;
+            }
+            for (auto it = pendingClaims.begin(); it != pendingClaims.end();)
+            {
+                if (it->second->owner == node)
+                {
+                    failed.push_back(it->second);
+                    it = pendingClaims.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+        for (auto const &claim : failed)
+        {
+            wheel.cancel(claim.get());
+            claim->result->complete(CLAIM_UNAVAILABLE);
+        }
+        resyncClaims();
+        if (nodeDown)
+            nodeDown(node);
+        std::cout << "[CLUSTER] Link to node " << node << " down, " << liveNodes << " nodes share the topics" << std::endl;
+    }
+
+    void handle(int node, PacketHeader &header, const char *payload)
+    {
+        header.sender[MAX_USERNAME_LEN - 1] = '\0';
+        header.topic[MAX_TOPIC_LEN - 1] = '\0';
+        switch (header.msgType)
+        {
+        case CLUSTER_INTEREST:
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            if (header.flags & 1)
+                remoteInterest[header.topic].insert(node);
+            else
+                remoteInterest[header.topic].erase(node);
+            break;
+        }
+
+        case CLUSTER_PUBLISH:
+        {
+            PacketHeader inner;
+            if (unnestPacket(header, payload, inner))
+                deliver(node, inner, payload + sizeof(PacketHeader), inner.payloadLength);
+            break;
+        }
+
+        case CLUSTER_SNAPSHOT:
+        {
+            std::shared_ptr<EgressQueue> egress = linkTo(node);
+            if (egress)
+                sendLastValues(egress, header.topic, header);
+            break;
+        }
+
+        case CLUSTER_LAST_VALUE:
+        {
+            PacketHeader inner;
+            if (unnestPacket(header, payload, inner) && std::strcmp(inner.topic, header.topic) == 0)
+                broker.mergeLastValue((header.flags & LAST_VALUE_HANDOFF) ? -1 : (int)header.messageId, inner,
+                                      payload + sizeof(PacketHeader), inner.payloadLength, header.timestamp);
+            break;
+        }
+
+        case CLUSTER_CLAIM:
+        {
+            bool sync = (header.flags & CLAIM_SYNC) != 0;
+            ClaimResult result = claimLocally(header.sender, node, sync);
+            if (sync && result != CLAIM_GRANTED)
+                std::cout << "[CLUSTER] Username " << header.sender << " is logged in on two nodes" << std::endl;
+            if (!sync)
+                sendToNode(node, CLUSTER_CLAIM_RESULT, "", "", header.messageId, (uint8_t)result);
+            break;
+        }
+
+        case CLUSTER_CLAIM_RESULT:
+            finishClaim(header.messageId, header.flags);
+            break;
+
+        case CLUSTER_RELEASE:
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            auto it = claims.find(header.sender);
+            if (it != claims.end() && it->second == node)
+                claims.erase(it);
+            break;
+        }
+        }
+    }
+
+    // One link: HELLO both ways (the dialing node first), then packets until the socket fails
+    // node: the peer dialed, or -1 for an accepted connection
+    void serveLink(SOCKET sock, int node)
+    {
+        int flag = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag, sizeof(flag));
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (const char *)&flag, sizeof(flag));
+
+        SocketReader reader(sock);
+        CompactDecoder decoder; // Links stay on v1 headers
+        PacketHeader header;
+        PacketHeader hello = clusterHeader(CLUSTER_HELLO, std::to_string(selfId), "", chatPort, 0);
+        bool dialed = node >= 0;
+        if (dialed && send(sock, (const char *)&hello, sizeof(hello), 0) != (int)sizeof(hello))
+        {
+            CLOSE_SOCKET(sock);
+            return;
+        }
+        bool greeted = reader.readHeader(PROTOCOL_VERSION_1, decoder, header) && header.msgType == CLUSTER_HELLO;
+        header.sender[MAX_USERNAME_LEN - 1] = '\0';
+        int greeter = greeted ? std::atoi(header.sender) : -1;
+        // Only lower ids dial; peer ids are fixed after start
+        bool valid = dialed ? greeter == node : (greeter >= 0 && greeter < selfId && peers.count(greeter));
+        if (!valid || (!dialed && send(sock, (const char *)&hello, sizeof(hello), 0) != (int)sizeof(hello)))
+        {
+            CLOSE_SOCKET(sock);
+            return;
+        }
+        node = greeter;
+
+        auto egress = std::make_shared<EgressQueue>(sock);
+        linkUp(node, sock, egress, (int)header.messageId);
+
+        std::vector<char> payload;
+        while (reader.readHeader(PROTOCOL_VERSION_1, decoder, header))
+        {
+            if (header.payloadLength > sizeof(PacketHeader) + MAX_MESSAGE_SIZE)
+                break;
+            payload.resize(header.payloadLength);
+            if (header.payloadLength > 0 && !reader.readExact(payload.data(), header.payloadLength))
+                break;
+            handle(node, header, payload.data());
+        }
+
+        linkDown(node, egress);
+        egress->close();
+        CLOSE_SOCKET(sock);
+    }
+
+    void acceptLoop()
+    {
+        SOCKET listener = INVALID_SOCKET;
+        while (listener == INVALID_SOCKET)
+        {
+            listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            int opt = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons(clusterPort);
+            if (bind(listener, (sockaddr *)&address, sizeof(address)) == SOCKET_ERROR ||
+                listen(listener, SOMAXCONN) == SOCKET_ERROR)
+            {
+                // Still held by a process this one takes over from (hot restart)
+                CLOSE_SOCKET(listener);
+                listener = INVALID_SOCKET;
+                std::this_thread::sleep_for(std::chrono::milliseconds(CLUSTER_RECONNECT_MS));
+            }
+        }
+        std::cout << "[CLUSTER] Node " << selfId << " listening for peers on port " << clusterPort << std::endl;
+
+        while (true)
+        {
+            SOCKET sock = accept(listener, nullptr, nullptr);
+            if (sock == INVALID_SOCKET)
+                continue;
+            std::thread(&ClusterNode::serveLink, this, sock, -1).detach();
+        }
+    }
+
+    void dialLoop(int node, std::string host, int port)
+    {
+        while (true)
+        {
+            addrinfo hints{};
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo *result = nullptr;
+            if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) == 0 && result)
+            {
+                SOCKET sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+                if (sock != INVALID_SOCKET && connect(sock, result->ai_addr, (int)result->ai_addrlen) == 0)
+                    serveLink(sock, node); // Returns once the link fails
+                else if (sock != INVALID_SOCKET)
+                    CLOSE_SOCKET(sock);
+                freeaddrinfo(result);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(CLUSTER_RECONNECT_MS));
+        }
+    }
+
+public:
+    ClusterNode(MessageBroker &owner, TimerWheel &timers)
+        : broker(owner), wheel(timers), selfId(-1), clusterPort(0), chatPort(0), nextRequestId(1)
+    {
+    }
+
+    ClusterNode(const ClusterNode &) = delete;
+    ClusterNode &operator=(const ClusterNode &) = delete;
+
+    bool configureSelf(int id, int port)
+    {
+        if (id < 0 || port <= 0 || port > 65535)
+            return false;
+        selfId = id;
+        clusterPort = port;
+        return true;
+    }
+
+    // spec: "<host>:<port>" of the peer's cluster port
+    bool addPeer(int id, const std::string &spec)
+    {
+        size_t colon = spec.rfind(':');
+        if (id < 0 || colon == std::string::npos || colon == 0)
+            return false;
+        int port = std::atoi(spec.c_str() + colon + 1);
+        if (port <= 0 || port > 65535 || peers.count(id))
+            return false;
+        peers[id] = Peer{spec.substr(0, colon), port, 0, INVALID_SOCKET, nullptr};
+        return true;
+    }
+
+    bool enabled() const
+    {
+        return selfId >= 0;
+    }
+
+    // Start linking up with the peers (after configuration, before clients connect)
+    // clientPort: this node's chat port, where other nodes redirect clients to
+    bool start(int clientPort, const DeliverFn &deliverFn, const NodeDownFn &nodeDownFn)
+    {
+        if (!enabled() || peers.count(selfId))
+            return false;
+        chatPort = clientPort;
+        deliver = deliverFn;
+        nodeDown = nodeDownFn;
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            rebuildRingLocked();
+        }
+        broker.setInterestListener([this](const std::string &topic, bool interested)
+                                   {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            for (auto &pair : peers)
+            {
+                if (pair.second.egress)
+                    pair.second.egress->enqueue(clusterHeader(CLUSTER_INTEREST, "", topic, 0, interested ? 1 : 0),
+                                                SharedPayload());
+            } });
+        broker.setTopicOwnership([this](const std::string &topic)
+                                 { return topicOwner(topic) == selfId; });
+
+        std::thread(&ClusterNode::acceptLoop, this).detach();
+        for (auto const &pair : peers)
+        {
+            if (pair.first > selfId)
+                std::thread(&ClusterNode::dialLoop, this, pair.first, pair.second.host, pair.second.port).detach();
+        }
+        return true;
+    }
+
+    // Node whose ring arc holds topic (this one if no peer is reachable). Usernames
+    // are placed on the same ring: a name's owner decides whether it is free.
+    int topicOwner(const std::string &topic)
+    {
+        std::lock_guard<std::mutex> lock(clusterMutex);
+        return topicOwnerLocked(topic);
+    }
+
+    // True if another node owns topic; address: "<host>:<chat port>" to redirect to
+    bool redirectFor(const char *topic, std::string &address)
+    {
+        if (!enabled())
+            return false;
+        std::lock_guard<std::mutex> lock(clusterMutex);
+        int owner = topicOwnerLocked(topic);
+        if (owner == selfId)
+            return false;
+        const Peer &peer = peers[owner];
+        address = peer.host + ":" + std::to_string(peer.chatPort);
+        return true;
+    }
+
+    // Claim a username for a login here; completes with a ClaimResult
+    AsyncResultRef claimUsername(const std::string &username)
+    {
+        int owner = topicOwner(username);
+        if (owner == selfId)
+        {
+            auto result = std::make_shared<AsyncResult>();
+            result->complete(claimLocally(username, selfId, false));
+            return result;
+        }
+
+        // Armed before it is visible to a reply, so a reply always finds it armed
+        auto claim = std::make_shared<PendingClaim>(*this, owner, username);
+        wheel.schedule(claim.get(), CLUSTER_CLAIM_TIMEOUT_MS);
+        std::shared_ptr<EgressQueue> egress;
+        uint32_t requestId;
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            egress = peers[owner].egress;
+            requestId = nextRequestId++;
+            if (egress)
+                pendingClaims[requestId] = claim;
+        }
+        if (!egress)
+        {
+            wheel.cancel(claim.get());
+            claim->result->complete(CLAIM_UNAVAILABLE);
+            return claim->result;
+        }
+        egress->enqueue(clusterHeader(CLUSTER_CLAIM, username, "", requestId, 0), SharedPayload());
+        return claim->result;
+    }
+
+    // A client here subscribed to a last-value topic another node owns: ask the owner
+    // for the snapshot, merged into this node's values as it arrives. False if this
+    // node owns the topic (or the owner is unreachable): the local values are the snapshot
+    bool requestLastValues(int clientId, const char *topic)
+    {
+        if (!enabled() || !broker.isLastValueTopic(topic))
+            return false;
+        int owner = topicOwner(topic);
+        if (owner == selfId)
+            return false;
+        PacketHeader request = clusterHeader(CLUSTER_SNAPSHOT, "", topic, (uint32_t)clientId, 0);
+        request.timestamp = broker.lastValueStamp(topic);
+        std::shared_ptr<EgressQueue> egress = linkTo(owner);
+        return egress && egress->enqueue(request, SharedPayload());
+    }
+
+    // The login that claimed username has ended
+    void releaseUsername(const std::string &username)
+    {
+        int owner = topicOwner(username);
+        if (owner != selfId)
+        {
+            sendToNode(owner, CLUSTER_RELEASE, username, "", 0, 0);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(clusterMutex);
+        auto it = claims.find(username);
+        if (it != claims.end() && it->second == selfId)
+            claims.erase(it);
+    }
+
+    // Forward a publish (already delivered here) once to every node with
+    // subscribers for one of topics. Returns the number of nodes.
+    int forward(const PacketHeader &header, const char *payload, uint32_t length,
+                const std::vector<std::string> &topics)
+    {
+        if (!enabled())
+            return 0;
+        std::vector<std::shared_ptr<EgressQueue>> targets;
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            std::set<int> nodes;
+            for (auto const &topic : topics)
+            {
+                auto it = remoteInterest.find(topic);
+                if (it != remoteInterest.end())
+                    nodes.insert(it->second.begin(), it->second.end());
+                if (broker.isLastValueTopic(topic)) // Prefixes are fixed before serving, no lock taken
+                    nodes.insert(topicOwnerLocked(topic));
+            }
+            nodes.erase(selfId);
+            for (int node : nodes)
+            {
+                auto peer = peers.find(node);
+                if (peer != peers.end() && peer->second.egress)
+                    targets.push_back(peer->second.egress);
+            }
+        }
+        if (targets.empty())
+            return 0;
+
+        PacketHeader inner = header;
+        std::vector<char> plain;
+        if (!broker.withoutDictionary(inner, payload, length, plain))
+            return 0;
+        inner.payloadLength = length;
+
+        // One copy shared by every link's queue
+        SharedPayload shared = nestPacket(inner, payload, length);
+        PacketHeader outer = clusterHeader(CLUSTER_PUBLISH, "", "", 0, 0);
+        outer.payloadLength = shared->size();
+
+        int forwarded = 0;
+        for (auto const &egress : targets)
+        {
+            if (egress->enqueue(outer, shared))
+                forwarded++;
+        }
+        return forwarded;
+    }
+};
+
+#endif // CLUSTER_H
@@ -0,0 +1,108 @@
+#ifndef CONSUMER_GROUP_H
+#define CONSUMER_GROUP_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../protocol.h"
+#include "../compression.h"
+#include "egress.h"
+
+// ===== OPTIMIZATION: Consumer groups =====
+// Purpose: Every subscriber of a topic receives every message, so a pool of workers
+// could only split the work by topic. A MSG_SUBSCRIBE carrying a group name joins the
+// topic's group instead, and each message goes to one member of each group:
+// - The member with the fewest unacknowledged deliveries, scanning from a cursor that
+//   rotates per message so equally loaded members take turns
+// - The delivery carries FLAG_GROUP and a per-member delivery id in messageId, which
+//   the member returns in a MSG_ACK (FLAG_GROUP) once it has processed the message
+// - Deliveries not acknowledged when a member leaves the group or its session ends go
+//   to the remaining members; a member at GROUP_MAX_UNACKED is skipped
+// Groups are per node: in a cluster each node picks one member among its own clients.
+
+#define GROUP_MAX_UNACKED 1024 // Deliveries a member may hold unacknowledged before it is skipped
+
+// Members of one group on one topic, guarded by the broker's topicsMutex
+struct ConsumerGroup
+{
+    std::vector<int> members; // Client ids
+    size_t cursor;            // Where the next pick starts scanning
+
+    ConsumerGroup() : cursor(0) {}
+};
+
+// A message handed to a group member and not acknowledged yet
+struct GroupDelivery
+{
+    std::string topic;
+    std::string group;
+    PacketHeader header; // As published (messageId and FLAG_GROUP are per delivery)
+    SharedPayload payload;
+    DictionaryRef dictionary;
+};
+
+// A member's unacknowledged deliveries (one per client, across its groups)
+class GroupInbox
+{
+private:
+    std::mutex inboxMutex;
+    std::map<uint32_t, GroupDelivery> unacked; // delivery id -> message, guarded by inboxMutex
+    uint32_t nextId;                           // Guarded by inboxMutex, never 0
+    std::atomic<uint32_t> count;               // unacked.size(), read without the lock when picking
+
+public:
+    GroupInbox() : nextId(1), count(0) {}
+
+    uint32_t outstanding() const
+    {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    // Remember a delivery until acknowledged; returns its id
+    uint32_t track(GroupDelivery delivery)
+    {
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        uint32_t id = nextId++;
+        if (nextId == 0)
+            nextId = 1;
+        unacked[id] = std::move(delivery);
+        count.store((uint32_t)unacked.size(), std::memory_order_relaxed);
+        return id;
+    }
+
+    // False if the id is unknown (acknowledged before, or never delivered here)
+    bool ack(uint32_t id)
+    {
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        if (!unacked.erase(id))
+            return false;
+        count.store((uint32_t)unacked.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    // Take back the deliveries of one group (empty group: of every group), in delivery order
+    std::vector<GroupDelivery> take(const std::string &topic = std::string(), const std::string &group = std::string())
+    {
+        std::vector<GroupDelivery> taken;
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        for (auto it = unacked.begin(); it != unacked.end();)
+        {
+            if (group.empty() || (it->second.topic == topic && it->second.group == group))
+            {
+                taken.push_back(std::move(it->second));
+                it = unacked.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        count.store((uint32_t)unacked.size(), std::memory_order_relaxed);
+        return taken;
+    }
+};
+
+#endif // CONSUMER_GROUP_H
@@ -0,0 +1,127 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <cstdint>
+#include <cstring>
+
+// ===== OPTIMIZATION: Duplicate publish suppression =====
+// Purpose: A publisher that retries after a lost ACK (typically after resuming its
+// session) used to deliver the message twice. A login with FLAG_DEDUP promises
+// increasing messageIds on publishes; the session then remembers which ids it has
+// delivered and acknowledges a retry without delivering it again.
+// - Sliding window over the newest DEDUP_WINDOW_BITS ids: one bit per id in a
+//   fixed 128-byte ring, so a session's cost does not grow with its rate
+// - Ids older than the window are treated as retries: a publisher keeps at most
+//   PUBLISH_WINDOW_MAX publishes in flight, far fewer than the window
+// - Ids compare in serial-number order, so the 32-bit counter may wrap
+
+#define DEDUP_WINDOW_BITS 1024 // Ids remembered per session (multiple of 64)
+
+class DuplicateWindow
+{
+private:
+    static const int WORDS = DEDUP_WINDOW_BITS / 64;
+
+    uint32_t newest; // Highest id recorded
+    bool empty;      // Nothing recorded yet
+    uint64_t bits[WORDS]; // Bit (id % DEDUP_WINDOW_BITS) set: id recorded
+
+    bool test(uint32_t id) const
+    {
+        uint32_t bit = id % DEDUP_WINDOW_BITS;
+        return (bits[bit / 64] >> (bit % 64)) & 1;
+    }
+
+    void set(uint32_t id)
+    {
+        uint32_t bit = id % DEDUP_WINDOW_BITS;
+        bits[bit / 64] |= 1ull << (bit % 64);
+    }
+
+    void clear(uint32_t id)
+    {
+        uint32_t bit = id % DEDUP_WINDOW_BITS;
+        bits[bit / 64] &= ~(1ull << (bit % 64));
+    }
+
+public:
+    DuplicateWindow()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        newest = 0;
+        empty = true;
+        std::memset(bits, 0, sizeof(bits));
+    }
+
+    // Record a publish id. Returns false if it was recorded before (or is too old
+    // to tell), i.e. the publish is a retry and must not be delivered again
+    bool record(uint32_t id)
+    {
+        int32_t ahead = (int32_t)(id - newest);
+        if (empty || ahead >= DEDUP_WINDOW_BITS)
+        {
+            std::memset(bits, 0, sizeof(bits));
+        }
+        else if (ahead > 0)
+        {
+            // Slots of the ids skipped over now stand for newer ids
+            for (uint32_t skipped = newest + 1; skipped != id; skipped++)
+            {
+                clear(skipped);
+            }
+        }
+        else
+        {
+            if (-ahead >= DEDUP_WINDOW_BITS || test(id))
+                return false;
+            set(id);
+            return true;
+        }
+        newest = id;
+        empty = false;
+        set(id);
+        return true;
+    }
+
+    // Undo record() for a publish that was refused after all, so its retry is
+    // accepted rather than acknowledged as a duplicate
+    void forget(uint32_t id)
+    {
+        int32_t behind = (int32_t)(newest - id);
+        if (!empty && behind >= 0 && behind < DEDUP_WINDOW_BITS)
+            clear(id);
+    }
+
+    // Hot restart: carried with the session like its other state
+    template <typename Writer>
+    void saveState(Writer &out) const
+    {
+        out.u8(empty);
+        out.u32(newest);
+        for (uint64_t word : bits)
+        {
+            out.u64(word);
+        }
+    }
+
+    template <typename Reader>
+    bool loadState(Reader &in)
+    {
+        uint8_t wasEmpty;
+        if (!in.u8(wasEmpty) || !in.u32(newest))
+            return false;
+        empty = wasEmpty != 0;
+        for (uint64_t &word : bits)
+        {
+            if (!in.u64(word))
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif // DEDUP_H
@@ -0,0 +1,126 @@
+#ifndef DIRECT_MESSAGE_H
+#define DIRECT_MESSAGE_H
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../protocol.h"
+#include "egress.h"
+
+// ===== OPTIMIZATION: Direct messages =====
+// Purpose: Every user is subscribed to its personal topic (its username) at login, so
+// a 1:1 message took the generic path: topic map lookup, subscriber vector copy,
+// per-subscriber client lookup, filter/group/last-value checks. A publish with
+// FLAG_DIRECT names the recipient in topic and:
+// - Resolves through the broker's username index (presence.h) to the recipient's
+//   session under one lock and is queued there - the topic map is not involved
+// - Waits in the recipient's offline inbox when it is not logged in (on this node or,
+//   in a cluster, any other), and goes out right after its next login ACK here
+// Other subscribers of a personal topic do not see direct messages; plain publishes
+// to it reach them as before.
+
+#define OFFLINE_MAX_MESSAGES 256                // Per recipient; a direct message beyond it is refused
+#define OFFLINE_MAX_BYTES (16 * 1024 * 1024)    // Payload bytes held for all recipients together
+
+// A direct message waiting for its recipient, plain (a compressed one is stored inflated)
+struct OfflineMessage
+{
+    PacketHeader header;
+    SharedPayload payload;
+};
+
+class OfflineInbox
+{
+private:
+    std::map<std::string, std::deque<OfflineMessage>> inboxes; // Recipient -> messages, guarded by inboxMutex
+    size_t storedBytes;                                        // Guarded by inboxMutex
+    std::mutex inboxMutex;
+
+public:
+    OfflineInbox() : storedBytes(0) {}
+
+    // False if the recipient's inbox, or the space for all of them, is full
+    bool store(const std::string &recipient, const PacketHeader &header, const SharedPayload &payload)
+    {
+        size_t size = payload ? payload->size() : 0;
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        std::deque<OfflineMessage> &inbox = inboxes[recipient];
+        if (inbox.size() >= OFFLINE_MAX_MESSAGES || storedBytes + size > OFFLINE_MAX_BYTES)
+        {
+            if (inbox.empty())
+                inboxes.erase(recipient);
+            return false;
+        }
+        inbox.push_back(OfflineMessage{header, payload});
+        storedBytes += size;
+        return true;
+    }
+
+    // Everything waiting for recipient, oldest first; the inbox is emptied
+    std::vector<OfflineMessage> take(const std::string &recipient)
+    {
+        std::vector<OfflineMessage> messages;
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        auto it = inboxes.find(recipient);
+        if (it == inboxes.end())
+            return messages;
+        for (auto &message : it->second)
+        {
+            storedBytes -= message.payload ? message.payload->size() : 0;
+            messages.push_back(std::move(message));
+        }
+        inboxes.erase(it);
+        return messages;
+    }
+
+    // Hot restart: the successor holds the same messages
+    template <typename Writer>
+    void saveState(Writer &out)
+    {
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        out.u32((uint32_t)inboxes.size());
+        for (auto const &pair : inboxes)
+        {
+            out.str(pair.first);
+            out.u32((uint32_t)pair.second.size());
+            for (auto const &message : pair.second)
+            {
+                out.str((const char *)&message.header, sizeof(PacketHeader));
+                out.str(message.payload ? std::string(message.payload->begin(), message.payload->end())
+                                        : std::string());
+            }
+        }
+    }
+
+    template <typename Reader>
+    bool loadState(Reader &in)
+    {
+        uint32_t recipients;
+        if (!in.u32(recipients))
+            return true; // From a predecessor without direct messages
+        for (uint32_t i = 0; i < recipients; i++)
+        {
+            std::string recipient;
+            uint32_t count;
+            if (!in.str(recipient) || !in.u32(count))
+                return false;
+            for (uint32_t j = 0; j < count; j++)
+            {
+                std::string header, payload;
+                if (!in.str(header) || !in.str(payload) || header.size() != sizeof(PacketHeader))
+                    return false;
+                OfflineMessage message;
+                std::memcpy(&message.header, header.data(), sizeof(PacketHeader));
+                if (!payload.empty())
+                    message.payload = std::make_shared<const std::vector<char>>(payload.begin(), payload.end());
+                store(recipient, message.header, message.payload);
+            }
+        }
+        return true;
+    }
+};
+
+#endif // DIRECT_MESSAGE_H
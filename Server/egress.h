@@ -0,0 +1,704 @@
+#ifndef EGRESS_H
+#define EGRESS_H
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <cstring>
+#include "../protocol.h"
+#include "../protocol_v2.h"
+#include "../crc32c.h"
+#include "../tls_session.h"
+#include "timer_wheel.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+// Packet types on the cluster links (never sent to clients, see cluster.h)
+enum ClusterMessageType
+{
+    CLUSTER_HELLO = 100,        // sender: node id; messageId: the node's client (chat) port. Sent both ways
+    CLUSTER_INTEREST = 101,     // topic; flags: 1 = has local subscribers, 0 = none left
+    CLUSTER_PUBLISH = 102,      // payload: the publish's PacketHeader (v1) + its payload
+    CLUSTER_CLAIM = 103,        // sender: username; messageId: request id; flags: CLAIM_SYNC
+    CLUSTER_CLAIM_RESULT = 104, // messageId: request id; flags: ClaimResult
+    CLUSTER_RELEASE = 105,      // sender: username
+    CLUSTER_SNAPSHOT = 106,     // topic; messageId: client id; timestamp: requester's cache stamp. To the owner
+    CLUSTER_LAST_VALUE = 107    // A CLUSTER_SNAPSHOT's fields echoed, payload as CLUSTER_PUBLISH; flags: LAST_VALUE_HANDOFF
+};
+
+// Traffic classes for outbound packets, highest priority first
+enum EgressClass
+{
+    EGRESS_CONTROL = 0, // ACK/ERROR and session management - strict priority
+    EGRESS_TEXT,        // Chat/text publishes
+    EGRESS_STREAM,      // Audio stream packets
+    EGRESS_FILE,        // File relay
+    EGRESS_CLASS_COUNT
+};
+
+// Map a MessageType to its egress class
+inline EgressClass egressClassFor(uint32_t msgType)
+{
+    switch (msgType)
+    {
+    case MSG_ACK:
+    case MSG_ERROR:
+    case MSG_LOGIN:
+    case MSG_LOGOUT:
+    case MSG_SUBSCRIBE:
+    case MSG_UNSUBSCRIBE:
+    case MSG_STREAM_READY:
+    case MSG_STREAM_ATTACH:
+    case MSG_DICTIONARY: // Must overtake the queued publishes that reference it
+    case MSG_PING:
+    case MSG_PONG:
+    case MSG_REDIRECT:
+    // Cluster membership, interest and username ownership: a dropped one would leave
+    // the nodes' views out of sync until the link resets
+    case CLUSTER_HELLO:
+    case CLUSTER_INTEREST:
+    case CLUSTER_CLAIM:
+    case CLUSTER_CLAIM_RESULT:
+    case CLUSTER_RELEASE:
+        return EGRESS_CONTROL;
+
+    case MSG_STREAM_START:
+    case MSG_STREAM_FRAME:
+    case MSG_STREAM_STOP:
+        return EGRESS_STREAM;
+
+    case MSG_PUBLISH_FILE:
+    case MSG_FILE_DATA:
+        return EGRESS_FILE;
+
+    default:
+        return EGRESS_TEXT;
+    }
+}
+
+// ===== OPTIMIZATION: Aggregate egress occupancy =====
+// Purpose: Bytes waiting in every connection's queue, summed. Drives the publish
+// credits granted to publishers and parks readers when the server is overloaded,
+// so memory stays bounded instead of growing with the slowest subscriber.
+class EgressAccounting
+{
+private:
+    size_t queuedBytes;
+    std::mutex accountingMutex;
+    std::condition_variable belowCv;
+    std::multimap<size_t, std::function<void()>> belowWakes; // parkBelow callers by limit
+
+    EgressAccounting() : queuedBytes(0) {}
+
+public:
+    static EgressAccounting &instance()
+    {
+        static EgressAccounting accounting;
+        return accounting;
+    }
+
+    void add(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(accountingMutex);
+        queuedBytes += bytes;
+    }
+
+    void release(size_t bytes)
+    {
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lock(accountingMutex);
+            queuedBytes -= bytes;
+            // Every parked limit now above the total
+            auto first = belowWakes.upper_bound(queuedBytes);
+            for (auto it = first; it != belowWakes.end(); ++it)
+                ready.push_back(std::move(it->second));
+            belowWakes.erase(first, belowWakes.end());
+        }
+        belowCv.notify_all();
+        for (auto &wake : ready)
+            wake();
+    }
+
+    size_t queued()
+    {
+        std::lock_guard<std::mutex> lock(accountingMutex);
+        return queuedBytes;
+    }
+
+    // Block until aggregate occupancy drops below limit
+    void waitBelow(size_t limit)
+    {
+        std::unique_lock<std::mutex> lock(accountingMutex);
+        belowCv.wait(lock, [&]
+                     { return queuedBytes < limit; });
+    }
+
+    // waitBelow without blocking: false if occupancy is already below limit,
+    // otherwise wake runs once, on the releasing thread, when it drops below
+    bool parkBelow(size_t limit, std::function<void()> wake)
+    {
+        std::lock_guard<std::mutex> lock(accountingMutex);
+        if (queuedBytes < limit)
+            return false;
+        belowWakes.emplace(limit, std::move(wake));
+        return true;
+    }
+};
+
+// Payload bytes shared by every subscriber of one publish
+typedef std::shared_ptr<const std::vector<char>> SharedPayload;
+
+struct EgressPacket
+{
+    PacketHeader header;
+    SharedPayload payload;
+    uint8_t wireVersion; // Header encoding, fixed when the packet is queued
+    bool withChecksum;   // Connection verifies PacketHeader::checksum
+    const std::string *conflationKey = nullptr; // Its key in the queue's conflation index while queued
+
+    // Bytes on the wire with a v1 header (upper bound for v2)
+    size_t wireSize() const
+    {
+        return sizeof(PacketHeader) + (payload ? payload->size() : 0);
+    }
+};
+
+class EgressQueue;
+
+// Writes queued packets for the queue instead of its own writer thread (io_uring
+// backend): called once when a queue gains work, the driver then drains it with
+// EgressQueue::takeBatch() until that returns false
+class EgressDriver
+{
+public:
+    virtual ~EgressDriver() {}
+    virtual void requestWrite(const std::shared_ptr<EgressQueue> &queue) = 0;
+};
+
+// ===== OPTIMIZATION: Per-connection egress scheduler =====
+// Purpose: Packets to one client used to be written in arrival order by whichever
+// thread produced them, so a file relay could sit in front of an ACK or audio frame.
+// Each connection now owns a queue per traffic class and a writer thread:
+// - CONTROL is served with strict priority
+// - TEXT/STREAM/FILE share the link by deficit round robin with a quantum of one
+//   full packet, so a large file adds at most one chunk of delay to audio and chat
+class EgressQueue : public std::enable_shared_from_this<EgressQueue>
+{
+private:
+    SOCKET sock;
+    TlsSessionRef tls; // Set when records are encrypted in user space
+    std::deque<EgressPacket> queues[EGRESS_CLASS_COUNT];
+    std::unordered_map<std::string, EgressPacket *> conflatable; // Key -> its packet still queued (see enqueueConflated)
+    size_t deficit[EGRESS_CLASS_COUNT];
+    int drrCurrent;       // DRR class being served
+    bool quantumGranted;  // Quantum already added for drrCurrent this round
+    size_t queuedBytes;   // Bytes waiting in all classes
+    size_t droppedPackets; // Packets refused because the queue was full
+    size_t conflatedPackets; // Packets replaced by a newer one with the same key before being written
+    uint8_t wireVersion;  // Encoding for newly queued packets (see protocol_v2.h)
+    bool checksumEnabled; // Negotiated FLAG_CHECKSUM
+    CompactEncoder encoder; // v2 interning state - writer thread (or driver) only
+    bool closing;         // No more packets accepted, writer drains and exits
+    bool failed;          // Socket write failed - drop everything
+    EgressDriver *driver; // Set when a backend writes for us (no writer thread)
+    bool writeScheduled;  // Driver was asked to write and has not drained us yet
+    bool writing;         // Writer thread is sending a dequeued packet
+    std::atomic<int64_t> lastProgress; // steadyMillis() of the last write, or of gaining work
+    std::mutex queueMutex;
+    std::condition_variable queueCv;
+    std::thread writer;
+
+    // One DRR quantum = the largest packet a client can publish
+    static const size_t DRR_QUANTUM = sizeof(PacketHeader) + MAX_BUFFER_SIZE;
+
+    // Unsent bytes the kernel may hold per socket; anything beyond waits here where
+    // it can still be reordered (a deep kernel buffer would undo the scheduling)
+    static const int KERNEL_UNSENT_LIMIT = 4 * DRR_QUANTUM;
+
+    // Per-connection backlog cap: a stalled subscriber loses its oldest audio
+    // frames first, then new packets are refused, instead of growing without bound
+    static const size_t MAX_QUEUED_BYTES = 4 * 1024 * 1024;
+
+    bool sendAll(const char *data, size_t total)
+    {
+        if (tls)
+            return tls->sendAll(data, total);
+
+        size_t sent = 0;
+        while (sent < total)
+        {
+            int n = send(sock, data + sent, (int)(total - sent), 0);
+            if (n <= 0)
+                return false;
+            sent += n;
+            lastProgress.store(steadyMillis(), std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    void advanceDrr()
+    {
+        drrCurrent = drrCurrent + 1 < EGRESS_CLASS_COUNT ? drrCurrent + 1 : EGRESS_TEXT;
+        quantumGranted = false;
+    }
+
+    // A packet leaves its deque: it can no longer be replaced (caller holds queueMutex)
+    void forgetConflation(EgressPacket &packet)
+    {
+        if (!packet.conflationKey)
+            return;
+        conflatable.erase(*packet.conflationKey);
+        packet.conflationKey = nullptr;
+    }
+
+    // Pick the next packet to write (caller holds queueMutex)
+    bool popNext(EgressPacket &out)
+    {
+        if (!queues[EGRESS_CONTROL].empty())
+        {
+            out = std::move(queues[EGRESS_CONTROL].front());
+            queues[EGRESS_CONTROL].pop_front();
+            forgetConflation(out);
+            return true;
+        }
+
+        bool anyPending = false;
+        for (int c = EGRESS_TEXT; c < EGRESS_CLASS_COUNT; c++)
+        {
+            anyPending = anyPending || !queues[c].empty();
+        }
+        if (!anyPending)
+            return false;
+
+        while (true)
+        {
+            std::deque<EgressPacket> &q = queues[drrCurrent];
+            if (q.empty())
+            {
+                deficit[drrCurrent] = 0;
+                advanceDrr();
+                continue;
+            }
+
+            if (!quantumGranted)
+            {
+                deficit[drrCurrent] += DRR_QUANTUM;
+                quantumGranted = true;
+            }
+
+            size_t size = q.front().wireSize();
+            if (size > deficit[drrCurrent])
+            {
+                advanceDrr();
+                continue;
+            }
+
+            deficit[drrCurrent] -= size;
+            out = std::move(q.front());
+            q.pop_front();
+            forgetConflation(out);
+            if (q.empty())
+            {
+                deficit[drrCurrent] = 0;
+                advanceDrr();
+            }
+            return true;
+        }
+    }
+
+    // Final header bytes of a dequeued packet, in wire order (writer or driver only)
+    void prepareHeader(EgressPacket &packet, std::vector<char> &encodedHeader)
+    {
+        // Relayed payloads keep the checksum verified on receipt (end to end);
+        // packets built by the server carry 0 and are checksummed here
+        if (!packet.withChecksum)
+        {
+            packet.header.checksum = 0;
+        }
+        else if (packet.header.checksum == 0 && packet.payload && !packet.payload->empty())
+        {
+            packet.header.checksum = crc32c(packet.payload->data(), packet.payload->size());
+        }
+
+        encodedHeader.clear();
+        if (packet.wireVersion >= PROTOCOL_VERSION_2)
+        {
+            encoder.encodeHeader(packet.header, encodedHeader);
+        }
+        else
+        {
+            const char *raw = (const char *)&packet.header;
+            encodedHeader.insert(encodedHeader.end(), raw, raw + sizeof(PacketHeader));
+        }
+    }
+
+    // Socket write failed: drop the backlog and refuse new packets
+    void discardAll()
+    {
+        size_t discarded;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            failed = true;
+            writeScheduled = false;
+            for (auto &q : queues)
+            {
+                q.clear();
+            }
+            conflatable.clear();
+            discarded = queuedBytes;
+            queuedBytes = 0;
+        }
+        queueCv.notify_all();
+        EgressAccounting::instance().release(discarded);
+    }
+
+    void writerLoop()
+    {
+        std::vector<char> encodedHeader;
+        encodedHeader.reserve(V2_MAX_HEADER_SIZE);
+
+        while (true)
+        {
+            EgressPacket packet;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                writing = false;
+                queueCv.wait(lock, [this]
+                             { return queuedBytes > 0 || closing; });
+                if (!popNext(packet))
+                    return; // closing and fully drained
+                queuedBytes -= packet.wireSize();
+                writing = true;
+            }
+            EgressAccounting::instance().release(packet.wireSize());
+
+            prepareHeader(packet, encodedHeader);
+            bool ok = sendAll(encodedHeader.data(), encodedHeader.size());
+            if (ok && packet.payload && !packet.payload->empty())
+            {
+                ok = sendAll(packet.payload->data(), packet.payload->size());
+            }
+
+            if (!ok)
+            {
+                discardAll();
+                return;
+            }
+            if (tls)
+                recordProgress(); // SSL_write reports whole records only
+        }
+    }
+
+public:
+    // session: the connection's TLS session, if any (kTLS send needs no help)
+    // writeDriver: backend that writes for this queue; ignored when TLS records are
+    // encrypted in user space (those go through SSL_write on the writer thread)
+    explicit EgressQueue(SOCKET s, const TlsSessionRef &session = TlsSessionRef(), EgressDriver *writeDriver = nullptr)
+        : sock(s), tls(session && !session->kernelSend() ? session : TlsSessionRef()), drrCurrent(EGRESS_TEXT), quantumGranted(false), queuedBytes(0),
+          droppedPackets(0), conflatedPackets(0), wireVersion(PROTOCOL_VERSION_1), checksumEnabled(false), closing(false), failed(false),
+          writeScheduled(false), writing(false), lastProgress(steadyMillis())
+    {
+        driver = tls ? nullptr : writeDriver;
+        std::memset(deficit, 0, sizeof(deficit));
+#ifdef TCP_NOTSENT_LOWAT
+        int lowat = KERNEL_UNSENT_LIMIT;
+        setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char *)&lowat, sizeof(lowat));
+#endif
+        if (!driver)
+            writer = std::thread(&EgressQueue::writerLoop, this);
+    }
+
+    ~EgressQueue()
+    {
+        close();
+    }
+
+    EgressQueue(const EgressQueue &) = delete;
+    EgressQueue &operator=(const EgressQueue &) = delete;
+
+    // Queue a packet for this connection
+    // Returns false if the connection is closing, its socket failed or its backlog is full
+    bool enqueue(const PacketHeader &header, const SharedPayload &payload)
+    {
+        return push(header, payload, nullptr);
+    }
+
+    // ===== OPTIMIZATION: Conflation =====
+    // Purpose: On a last-value topic only the newest value per key matters. When a
+    // subscriber is behind, a packet whose key still has an unwritten packet queued
+    // replaces that one in place instead of queueing behind it, so a slow subscriber's
+    // backlog is bounded by the number of keys and it catches up with current values.
+    // Keys are opaque here (the broker prefixes them with the topic)
+    bool enqueueConflated(const PacketHeader &header, const SharedPayload &payload, const std::string &key)
+    {
+        return push(header, payload, &key);
+    }
+
+private:
+    bool push(const PacketHeader &header, const SharedPayload &payload, const std::string *conflationKey)
+    {
+        EgressPacket packet;
+        packet.header = header;
+        packet.payload = payload;
+        packet.wireVersion = PROTOCOL_VERSION_1;
+        packet.withChecksum = false;
+
+        EgressClass cls = egressClassFor(header.msgType);
+        size_t size = packet.wireSize();
+        size_t evicted = 0;
+        bool schedule = false;
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (closing || failed)
+                return false;
+            packet.wireVersion = wireVersion;
+            packet.withChecksum = checksumEnabled;
+
+            if (conflationKey)
+            {
+                auto queued = conflatable.find(*conflationKey);
+                if (queued != conflatable.end())
+                {
+                    // Superseded before it was written: the new value takes its place
+                    EgressPacket &stale = *queued->second;
+                    size_t staleSize = stale.wireSize();
+                    stale.header = packet.header;
+                    stale.payload = packet.payload;
+                    stale.wireVersion = packet.wireVersion;
+                    stale.withChecksum = packet.withChecksum;
+                    conflatedPackets++;
+                    queuedBytes = queuedBytes - staleSize + size;
+                    if (size > staleSize)
+                        EgressAccounting::instance().add(size - staleSize);
+                    else if (size < staleSize)
+                        EgressAccounting::instance().release(staleSize - size);
+                    return true; // Already scheduled for writing
+                }
+            }
+
+            // Stale audio is worthless - make room by dropping the oldest frames
+            std::deque<EgressPacket> &streamQueue = queues[EGRESS_STREAM];
+            while (cls == EGRESS_STREAM && queuedBytes + size > MAX_QUEUED_BYTES && !streamQueue.empty())
+            {
+                evicted += streamQueue.front().wireSize();
+                queuedBytes -= streamQueue.front().wireSize();
+                forgetConflation(streamQueue.front());
+                streamQueue.pop_front();
+                droppedPackets++;
+            }
+
+            // Control packets are tiny and must never be lost
+            if (cls != EGRESS_CONTROL && queuedBytes + size > MAX_QUEUED_BYTES)
+            {
+                droppedPackets++;
+                size = 0;
+            }
+            else
+            {
+                // A stall is measured from when an idle queue gains work
+                if (queuedBytes == 0 && !writing && !writeScheduled)
+                    lastProgress.store(steadyMillis(), std::memory_order_relaxed);
+
+                // Accounted before the writer can see (and release) the packet
+                EgressAccounting::instance().add(size);
+                queuedBytes += size;
+                queues[cls].push_back(std::move(packet));
+                if (conflationKey)
+                {
+                    // Deque elements stay put while others are pushed and popped at the ends
+                    auto entry = conflatable.emplace(*conflationKey, &queues[cls].back());
+                    queues[cls].back().conflationKey = &entry.first->first;
+                }
+                schedule = driver && !writeScheduled;
+                writeScheduled = writeScheduled || schedule;
+            }
+        }
+
+        if (evicted > 0)
+            EgressAccounting::instance().release(evicted);
+        if (size == 0)
+            return false;
+
+        if (schedule)
+            driver->requestWrite(shared_from_this());
+        else
+            queueCv.notify_one();
+        return true;
+    }
+
+public:
+    // Convenience overload for packets built by the caller (copies the payload)
+    bool enqueue(const PacketHeader &header, const char *payload, int payloadLen)
+    {
+        SharedPayload shared;
+        if (payload && payloadLen > 0)
+        {
+            shared = std::make_shared<const std::vector<char>>(payload, payload + payloadLen);
+        }
+        return enqueue(header, shared);
+    }
+
+    // Switch the header encoding for packets queued from now on
+    // (the negotiating ACK must already be queued so it still goes out as v1)
+    void setWireVersion(uint8_t version)
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        wireVersion = version;
+    }
+
+    // Checksum packets queued from now on (after the negotiating ACK)
+    void setChecksum(bool enabled)
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        checksumEnabled = enabled;
+    }
+
+    // v2 interning state of the outbound direction (hot restart: after a drain)
+    template <typename Writer>
+    void saveEncoder(Writer &out)
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        encoder.saveState(out);
+    }
+
+    template <typename Reader>
+    bool loadEncoder(Reader &in)
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        return encoder.loadState(in);
+    }
+
+    // Driver side: dequeue the next packets in scheduling order, headers encoded
+    // Stops at maxPackets or about KERNEL_UNSENT_LIMIT bytes so a batch in flight
+    // bounds the delay of a later control packet like the kernel limit does.
+    // Returns false (and forgets the write request) once the queue is empty.
+    bool takeBatch(std::vector<EgressPacket> &packets, std::vector<std::vector<char>> &headers, size_t maxPackets)
+    {
+        packets.clear();
+        size_t taken = 0;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            while (packets.size() < maxPackets && taken < (size_t)KERNEL_UNSENT_LIMIT && !failed)
+            {
+                EgressPacket packet;
+                if (!popNext(packet))
+                    break;
+                taken += packet.wireSize();
+                queuedBytes -= packet.wireSize();
+                packets.push_back(std::move(packet));
+            }
+            if (packets.empty())
+                writeScheduled = false;
+        }
+        if (packets.empty())
+        {
+            queueCv.notify_all(); // close() waits for the driver to let go
+            return false;
+        }
+        EgressAccounting::instance().release(taken);
+
+        if (headers.size() < packets.size())
+            headers.resize(packets.size());
+        for (size_t i = 0; i < packets.size(); i++)
+        {
+            prepareHeader(packets[i], headers[i]);
+        }
+        return true;
+    }
+
+    // Driver side: the socket refused a write
+    void writeFailed()
+    {
+        discardAll();
+    }
+
+    SOCKET socket() const
+    {
+        return sock;
+    }
+
+    // Bytes reached the socket (driver side; the writer thread records its own)
+    void recordProgress()
+    {
+        lastProgress.store(steadyMillis(), std::memory_order_relaxed);
+    }
+
+    // How long the queue has had bytes to write without any going out, 0 when idle
+    int64_t stalledFor(int64_t now)
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        bool busy = queuedBytes > 0 || writing || writeScheduled;
+        if (!busy || failed)
+            return 0;
+        int64_t since = lastProgress.load(std::memory_order_relaxed);
+        return now > since ? now - since : 0;
+    }
+
+    // Stop accepting packets; with a driver, returns true if nothing is left for it
+    // to write (a coroutine handler then closes without waiting, see session_io.h)
+    bool beginClose()
+    {
+        bool drained;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            closing = true;
+            drained = failed || !writeScheduled;
+        }
+        queueCv.notify_one();
+        return drained;
+    }
+
+    // Stop accepting packets, let the writer flush what is queued, and join it
+    // (with a driver: wait until it has written everything or the socket failed)
+    void close()
+    {
+        beginClose();
+        if (driver)
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueCv.wait(lock, [this]
+                         { return failed || !writeScheduled; });
+            return;
+        }
+        if (writer.joinable() && writer.get_id() != std::this_thread::get_id())
+        {
+            writer.join();
+        }
+    }
+
+    size_t pendingBytes()
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        return queuedBytes;
+    }
+
+    size_t dropped()
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        return droppedPackets;
+    }
+
+    size_t conflated()
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        return conflatedPackets;
+    }
+};
+
+#endif // EGRESS_H
@@ -0,0 +1,655 @@
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "session_io.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// ===== OPTIMIZATION: Hot restart with socket handoff =====
+// Purpose: Deploying a new build meant killing the server: every client dropped
+// and reconnected at once, re-running MSG_LOGIN and all its subscriptions.
+// The running server listens on a Unix control socket (--control <path>); a new
+// process started with --takeover <path> connects to it and, over SCM_RIGHTS:
+// - receives both listening sockets and starts accepting on them right away
+//   (connections the old process still accepts are forwarded to it)
+// - receives the broker's compression dictionaries, then every chat session that
+//   runs on the ring thread (--io uring, no TLS): socket, login, subscriptions,
+//   negotiated v2/checksum/codecs, v2 interning tables and unparsed bytes. The old
+//   handler stops at a packet boundary and flushes its queue first, so the client
+//   sees no gap in the byte stream
+// Sessions that cannot move (threaded handlers, TLS, stream port) are closed
+// gracefully and reconnect to the new process; SIGTERM closes all of them that way.
+
+// Serialized state: little-endian integers, length-prefixed strings
+class StateWriter
+{
+private:
+    std::string out;
+
+public:
+    void u8(uint8_t value)
+    {
+        out.push_back((char)value);
+    }
+
+    void u32(uint32_t value)
+    {
+        for (int shift = 0; shift < 32; shift += 8)
+            out.push_back((char)((value >> shift) & 0xFF));
+    }
+
+    void u64(uint64_t value)
+    {
+        u32((uint32_t)value);
+        u32((uint32_t)(value >> 32));
+    }
+
+    void str(const std::string &value)
+    {
+        u32((uint32_t)value.size());
+        out += value;
+    }
+
+    void str(const char *data, size_t length)
+    {
+        u32((uint32_t)length);
+        out.append(data, length);
+    }
+
+    const std::string &data() const
+    {
+        return out;
+    }
+
+    // Hand the bytes written so far over and start empty
+    std::string take()
+    {
+        std::string taken;
+        taken.swap(out);
+        return taken;
+    }
+
+    size_t size() const
+    {
+        return out.size();
+    }
+};
+
+class StateReader
+{
+private:
+    const std::string &in;
+    size_t pos;
+
+public:
+    explicit StateReader(const std::string &data) : in(data), pos(0) {}
+
+    bool u8(uint8_t &value)
+    {
+        if (pos + 1 > in.size())
+            return false;
+        value = (uint8_t)in[pos++];
+        return true;
+    }
+
+    bool u32(uint32_t &value)
+    {
+        if (pos + 4 > in.size())
+            return false;
+        value = 0;
+        for (int shift = 0; shift < 32; shift += 8)
+            value |= (uint32_t)(uint8_t)in[pos++] << shift;
+        return true;
+    }
+
+    bool u64(uint64_t &value)
+    {
+        uint32_t low, high;
+        if (!u32(low) || !u32(high))
+            return false;
+        value = ((uint64_t)high << 32) | low;
+        return true;
+    }
+
+    bool str(std::string &value)
+    {
+        uint32_t length;
+        if (!u32(length) || length > in.size() - pos)
+            return false;
+        value.assign(in, pos, length);
+        pos += length;
+        return true;
+    }
+};
+
+// Everything a chat session needs to continue in another process
+struct SessionSnapshot
+{
+    bool loggedIn;
+    std::string username;
+    uint8_t wireVersion;
+    bool checksumEnabled;
+    uint8_t codecs;
+    std::vector<std::string> topics;    // Subscriptions, the personal topic included
+    std::vector<uint32_t> dictionaries; // Dictionary ids the client already holds
+    std::string decoderState;           // CompactDecoder::saveState (client -> server)
+    std::string encoderState;           // CompactEncoder::saveState (server -> client)
+    std::string pendingBytes;           // Received but not parsed yet
+    uint64_t resumeToken;               // Resumable session (session_resume.h), else 0
+    std::string publishIds;             // DuplicateWindow::saveState with FLAG_DEDUP (dedup.h), else empty
+    std::vector<std::pair<std::string, std::string>> groups; // Consumer groups joined, (topic, group)
+    std::vector<std::pair<std::string, std::string>> filters; // Filtered subscriptions, (topic, expression)
+    std::vector<std::string> watches;   // Scopes watched with FLAG_WATCH (presence.h), "" = online users
+
+    SessionSnapshot() : loggedIn(false), wireVersion(PROTOCOL_VERSION_1), checksumEnabled(false), codecs(0),
+                        resumeToken(0) {}
+
+    std::string encode() const
+    {
+        StateWriter out;
+        out.u8(loggedIn);
+        out.str(username);
+        out.u8(wireVersion);
+        out.u8(checksumEnabled);
+        out.u8(codecs);
+        out.u32((uint32_t)topics.size());
+        for (auto const &topic : topics)
+        {
+            out.str(topic);
+        }
+        out.u32((uint32_t)dictionaries.size());
+        for (uint32_t id : dictionaries)
+        {
+            out.u32(id);
+        }
+        out.str(decoderState);
+        out.str(encoderState);
+        out.str(pendingBytes);
+        out.u64(resumeToken);
+        out.str(publishIds);
+        out.u32((uint32_t)groups.size());
+        for (auto const &group : groups)
+        {
+            out.str(group.first);
+            out.str(group.second);
+        }
+        out.u32((uint32_t)filters.size());
+        for (auto const &filter : filters)
+        {
+            out.str(filter.first);
+            out.str(filter.second);
+        }
+        out.u32((uint32_t)watches.size());
+        for (auto const &scope : watches)
+        {
+            out.str(scope);
+        }
+        return out.data();
+    }
+
+    bool decode(const std::string &data)
+    {
+        StateReader in(data);
+        uint8_t login, checksum;
+        uint32_t count;
+        if (!in.u8(login) || !in.str(username) || !in.u8(wireVersion) || !in.u8(checksum) || !in.u8(codecs))
+            return false;
+        loggedIn = login != 0;
+        checksumEnabled = checksum != 0;
+        if (!in.u32(count))
+            return false;
+        topics.resize(count < 65536 ? count : 0);
+        for (auto &topic : topics)
+        {
+            if (!in.str(topic))
+                return false;
+        }
+        if (!in.u32(count))
+            return false;
+        dictionaries.resize(count < 65536 ? count : 0);
+        for (auto &id : dictionaries)
+        {
+            if (!in.u32(id))
+                return false;
+        }
+        if (!in.str(decoderState) || !in.str(encoderState) || !in.str(pendingBytes))
+            return false;
+        if (!in.u64(resumeToken))
+            resumeToken = 0; // From a predecessor without resumable sessions
+        if (!in.str(publishIds))
+            publishIds.clear(); // ... or without duplicate suppression
+        if (in.u32(count))
+        {
+            groups.resize(count < 65536 ? count : 0);
+            for (auto &group : groups)
+            {
+                if (!in.str(group.first) || !in.str(group.second))
+                    return false;
+            }
+        }
+        else
+        {
+            groups.clear(); // ... or without consumer groups
+        }
+        if (in.u32(count))
+        {
+            filters.resize(count < 65536 ? count : 0);
+            for (auto &filter : filters)
+            {
+                if (!in.str(filter.first) || !in.str(filter.second))
+                    return false;
+            }
+        }
+        else
+        {
+            filters.clear(); // ... or without subscription filters
+        }
+        if (in.u32(count))
+        {
+            watches.resize(count < 65536 ? count : 0);
+            for (auto &scope : watches)
+            {
+                if (!in.str(scope))
+                    return false;
+            }
+        }
+        else
+        {
+            watches.clear(); // ... or without presence queries
+        }
+
+        // The v2 tables must load before the session is resumed with them
+        CompactDecoder decoder;
+        CompactEncoder encoder;
+        StateReader decoderIn(decoderState), encoderIn(encoderState);
+        return decoder.loadState(decoderIn) && encoder.loadState(encoderIn);
+    }
+};
+
+// ----- Sessions of this process -----
+
+// A live connection, so a restart can hand it over or close it
+struct LiveSession
+{
+    SOCKET sock;
+    SessionIo *io; // Set when the session can be handed over (coroutine on the ring thread)
+};
+
+class SessionRegistry
+{
+private:
+    std::set<LiveSession *> sessions;
+    size_t transferable; // Sessions with io set
+    std::mutex registryMutex;
+    std::condition_variable registryCv;
+
+public:
+    SessionRegistry() : transferable(0) {}
+
+    void add(LiveSession *session)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        sessions.insert(session);
+        if (session->io)
+            transferable++;
+    }
+
+    void remove(LiveSession *session)
+    {
+        {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            if (sessions.erase(session) && session->io)
+                transferable--;
+        }
+        registryCv.notify_all();
+    }
+
+    // f runs with the registry locked: it must not add or remove sessions
+    template <typename F>
+    void forEach(F f)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (LiveSession *session : sessions)
+        {
+            f(*session);
+        }
+    }
+
+    // Wait until no session (transferableOnly: no transferable one) is left
+    // Returns false on timeout
+    bool waitUntilGone(bool transferableOnly, unsigned milliseconds)
+    {
+        std::unique_lock<std::mutex> lock(registryMutex);
+        return registryCv.wait_for(lock, std::chrono::milliseconds(milliseconds), [&]
+                                   { return transferableOnly ? transferable == 0 : sessions.empty(); });
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        return sessions.size();
+    }
+};
+
+// Registration held for a connection handler's lifetime
+class RegisteredSession
+{
+private:
+    SessionRegistry &registry;
+    LiveSession session;
+
+public:
+    RegisteredSession(SessionRegistry &owner, SOCKET sock, SessionIo *io) : registry(owner), session{sock, io}
+    {
+        registry.add(&session);
+    }
+
+    ~RegisteredSession()
+    {
+        registry.remove(&session);
+    }
+
+    RegisteredSession(const RegisteredSession &) = delete;
+    RegisteredSession &operator=(const RegisteredSession &) = delete;
+};
+
+// ----- Control channel -----
+
+// Messages from the old process to its successor (kind byte, uint32 length, body)
+enum HandoffKind
+{
+    HANDOFF_LISTENERS = 'L',    // fds: chat and stream listening sockets
+    HANDOFF_BROKER_STATE = 'B', // MessageBroker::saveDictionaries
+    HANDOFF_SESSION = 'S',      // fd: chat connection, body: SessionSnapshot
+    HANDOFF_CONNECTION = 'C'    // fd: connection accepted after the handoff, body: "chat" or "stream"
+};
+
+struct HandoffMessage
+{
+    uint8_t kind;
+    std::string body;
+    std::vector<int> fds;
+};
+
+#ifndef _WIN32
+
+class HotRestart
+{
+private:
+    static const int MAX_FDS = 2;
+    static const uint32_t MAX_MESSAGE = 64 * 1024 * 1024;
+
+    int controlListener; // --control: where a successor connects
+    int channel;         // Connection to the successor (or, on the new side, to the old process)
+    std::mutex channelMutex;
+    std::atomic<bool> handingOff;
+
+    static bool sendFully(int fd, const char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    static bool receiveFully(int fd, char *dest, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t n = recv(fd, dest, length, 0);
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                return false;
+            }
+            dest += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    // One message; the fds ride on its first byte
+    bool sendMessage(uint8_t kind, const std::string &body, const int *fds, int fdCount)
+    {
+        char head[5];
+        uint32_t length = (uint32_t)body.size();
+        head[0] = (char)kind;
+        std::memcpy(head + 1, &length, sizeof(length));
+
+        iovec iov;
+        iov.iov_base = head;
+        iov.iov_len = sizeof(head);
+        msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+        if (fdCount > 0)
+        {
+            message.msg_control = control;
+            message.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+            std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+        }
+
+        std::lock_guard<std::mutex> lock(channelMutex);
+        if (channel < 0)
+            return false;
+        ssize_t sent;
+        do
+        {
+            sent = sendmsg(channel, &message, MSG_NOSIGNAL);
+        } while (sent < 0 && errno == EINTR);
+        if (sent <= 0)
+            return false;
+        return sendFully(channel, head + sent, sizeof(head) - sent) && sendFully(channel, body.data(), body.size());
+    }
+
+public:
+    HotRestart() : controlListener(-1), channel(-1), handingOff(false) {}
+
+    static bool supported() { return true; }
+
+    // Old side: accept a successor on path (a stale socket file is replaced)
+    bool listen(const std::string &path)
+    {
+        sockaddr_un address;
+        if (path.size() >= sizeof(address.sun_path))
+            return false;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        std::strcpy(address.sun_path, path.c_str());
+
+        controlListener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (controlListener < 0)
+            return false;
+        unlink(path.c_str());
+        if (bind(controlListener, (sockaddr *)&address, sizeof(address)) < 0 || ::listen(controlListener, 1) < 0)
+        {
+            close(controlListener);
+            controlListener = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // Readable when a successor connects, -1 without --control
+    int controlFd() const
+    {
+        return controlListener;
+    }
+
+    // Old side: take the successor's connection and give it the listening sockets.
+    // From here on accepted connections go to the successor (forwardConnection).
+    bool startHandoff(SOCKET chatListener, SOCKET streamListener)
+    {
+        int successor = accept(controlListener, nullptr, nullptr);
+        if (successor < 0)
+            return false;
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            channel = successor;
+        }
+        int listeners[2] = {chatListener, streamListener};
+        if (!sendMessage(HANDOFF_LISTENERS, std::string(), listeners, 2))
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            close(channel);
+            channel = -1;
+            return false;
+        }
+        handingOff.store(true);
+        return true;
+    }
+
+    bool isHandingOff() const
+    {
+        return handingOff.load();
+    }
+
+    bool sendBrokerState(const std::string &state)
+    {
+        return sendMessage(HANDOFF_BROKER_STATE, state, nullptr, 0);
+    }
+
+    // The caller closes its own descriptor afterwards
+    bool sendSession(SOCKET sock, const SessionSnapshot &snapshot)
+    {
+        int fd = sock;
+        return sendMessage(HANDOFF_SESSION, snapshot.encode(), &fd, 1);
+    }
+
+    bool forwardConnection(SOCKET sock, bool stream)
+    {
+        int fd = sock;
+        return sendMessage(HANDOFF_CONNECTION, stream ? "stream" : "chat", &fd, 1);
+    }
+
+    // New side: connect to the running server and receive its listening sockets
+    bool takeOver(const std::string &path, SOCKET &chatListener, SOCKET &streamListener)
+    {
+        sockaddr_un address;
+        if (path.size() >= sizeof(address.sun_path))
+            return false;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        std::strcpy(address.sun_path, path.c_str());
+
+        channel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (channel < 0 || connect(channel, (sockaddr *)&address, sizeof(address)) < 0)
+            return false;
+
+        HandoffMessage message;
+        if (!receive(message) || message.kind != HANDOFF_LISTENERS || message.fds.size() != 2)
+            return false;
+        chatListener = message.fds[0];
+        streamListener = message.fds[1];
+        return true;
+    }
+
+    // New side: next message from the old process; false once it has exited
+    bool receive(HandoffMessage &message)
+    {
+        char head[5];
+        iovec iov;
+        iov.iov_base = head;
+        iov.iov_len = sizeof(head);
+        msghdr header;
+        std::memset(&header, 0, sizeof(header));
+        header.msg_iov = &iov;
+        header.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+
+        ssize_t n;
+        do
+        {
+            n = recvmsg(channel, &header, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return false;
+
+        message.fds.clear();
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < count; i++)
+            {
+                int fd;
+                std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                message.fds.push_back(fd);
+            }
+        }
+
+        uint32_t length;
+        if (!receiveFully(channel, head + n, sizeof(head) - n))
+            return false;
+        std::memcpy(&length, head + 1, sizeof(length));
+        if (length > MAX_MESSAGE)
+            return false;
+        message.kind = (uint8_t)head[0];
+        message.body.resize(length);
+        return receiveFully(channel, &message.body[0], length);
+    }
+
+    void closeChannel()
+    {
+        std::lock_guard<std::mutex> lock(channelMutex);
+        if (channel >= 0)
+            close(channel);
+        channel = -1;
+    }
+};
+
+#else
+
+// Windows has no SCM_RIGHTS: --control / --takeover are refused at startup
+class HotRestart
+{
+public:
+    static bool supported() { return false; }
+    bool listen(const std::string &) { return false; }
+    int controlFd() const { return -1; }
+    bool startHandoff(SOCKET, SOCKET) { return false; }
+    bool isHandingOff() const { return false; }
+    bool sendBrokerState(const std::string &) { return false; }
+    bool sendSession(SOCKET, const SessionSnapshot &) { return false; }
+    bool forwardConnection(SOCKET, bool) { return false; }
+    bool takeOver(const std::string &, SOCKET &, SOCKET &) { return false; }
+    bool receive(HandoffMessage &) { return false; }
+    void closeChannel() {}
+};
+
+#endif // _WIN32
+
+#endif // HOT_RESTART_H
@@ -0,0 +1,184 @@
+#ifndef LAST_VALUE_H
+#define LAST_VALUE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../protocol.h"
+#include "egress.h"
+#include "topic_filter.h"
+
+// ===== OPTIMIZATION: Last-value topics =====
+// Purpose: Subscribers of status topics (presence, sensor readings) only care about
+// the latest value per key, yet received every intermediate publish, and a new
+// subscriber saw nothing until the next one. Topics matching a --last-value prefix:
+// - Keep the newest publish per key; a subscriber gets them all right after its
+//   subscribe ACK, before any later update
+// - Deliver through EgressQueue::enqueueConflated: a subscriber that is behind gets
+//   the newest value in place of the one still queued, so its backlog is bounded by
+//   the number of keys instead of growing with the publish rate
+// The key is the payload's "key" attribute (key=value syntax, see topic_filter.h),
+// else the sender: presence keys by user, a gateway publishing for many sensors
+// names each one.
+// In a cluster a node only sees the publishes forwarded to it, so the topic's ring
+// owner (cluster.h) keeps the cache: every last-value publish is forwarded to it,
+// other nodes cache only topics with local subscribers (for conflation and to order
+// snapshots against live updates) and fetch a new subscriber's snapshot from the owner.
+
+#define LAST_VALUE_MAX_KEYS 65536 // Keys cached per topic; publishes for further keys are delivered, not cached
+#define LAST_VALUE_KEY_ATTRIBUTE "key"
+
+// Newest publish of one key, plain (a compressed publish is cached inflated)
+struct LastValue
+{
+    PacketHeader header;
+    SharedPayload payload;
+    uint64_t stamp; // Update that stored it; 0 if merged from the owner's snapshot, not delivered here
+};
+
+class LastValueCache
+{
+private:
+    std::map<std::string, LastValue> values; // Key -> newest publish, guarded by cacheMutex
+    uint64_t updates;                        // Publishes recorded so far, guarded by cacheMutex
+    std::mutex cacheMutex;
+
+    static bool passes(const TopicFilterRef &filter, const std::string &topic, const LastValue &value)
+    {
+        if (!filter)
+            return true;
+        FilterMessage message(value.header.sender, topic.c_str(), value.payload ? value.payload->data() : nullptr,
+                              value.payload ? value.payload->size() : 0);
+        return filter->matches(message);
+    }
+
+public:
+    LastValueCache() : updates(0) {}
+
+    static std::string keyOf(const PacketHeader &header, const SharedPayload &payload)
+    {
+        FilterMessage message(header.sender, header.topic, payload ? payload->data() : nullptr,
+                              payload ? payload->size() : 0);
+        std::string_view key;
+        if (message.attribute(LAST_VALUE_KEY_ATTRIBUTE, key) && !key.empty())
+            return std::string(key);
+        return std::string(message.sender);
+    }
+
+    // Conflation key of a topic's key: distinct across topics sharing a queue
+    static std::string conflationKey(const std::string &topic, const std::string &key)
+    {
+        return topic + '\n' + key;
+    }
+
+    // Record a publish as its key's newest value. Returns the key
+    std::string update(const PacketHeader &header, const SharedPayload &payload)
+    {
+        std::string key = keyOf(header, payload);
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto it = values.find(key);
+        if (it != values.end())
+            it->second = LastValue{header, payload, ++updates};
+        else if (values.size() < LAST_VALUE_MAX_KEYS)
+            values.emplace(key, LastValue{header, payload, ++updates});
+        return key;
+    }
+
+    // Position of the newest update, for merge()
+    uint64_t stamp()
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        return updates;
+    }
+
+    // Take a value from the owner's snapshot unless this cache recorded its key since
+    // the snapshot was requested (stamp since); that update already reached the
+    // subscribers here and is newer. egress: the subscriber that requested it (queued
+    // if filter passes), nullptr for values handed over by a former owner, which only
+    // fill keys missing here. False if the value was not taken
+    bool merge(const PacketHeader &header, const SharedPayload &payload, uint64_t since, EgressQueue *egress,
+               const std::string &topic, const TopicFilterRef &filter)
+    {
+        std::string key = keyOf(header, payload);
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto it = values.find(key);
+        if (it != values.end() && (!egress || it->second.stamp > since))
+            return false;
+        if (it == values.end() && values.size() >= LAST_VALUE_MAX_KEYS)
+            return false;
+        LastValue &value = values[key];
+        value = LastValue{header, payload, 0};
+        if (egress && passes(filter, topic, value))
+            egress->enqueueConflated(value.header, value.payload, conflationKey(topic, key));
+        return true;
+    }
+
+    // f(header, payload) for every cached value, locked like sendTo
+    template <typename F>
+    void forEach(F f)
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        for (auto const &pair : values)
+        {
+            f(pair.second.header, pair.second.payload);
+        }
+    }
+
+    // Queue every cached value (matching filter, when given) to a new subscriber.
+    // Held locked throughout, so an update racing with the subscribe is either in
+    // this snapshot or delivered after it - never an older value after a newer one
+    size_t sendTo(EgressQueue &egress, const std::string &topic, const TopicFilterRef &filter)
+    {
+        size_t sent = 0;
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        for (auto const &pair : values)
+        {
+            const LastValue &value = pair.second;
+            if (!passes(filter, topic, value))
+                continue;
+            if (egress.enqueueConflated(value.header, value.payload, conflationKey(topic, pair.first)))
+                sent++;
+        }
+        return sent;
+    }
+
+    // Hot restart: the successor starts with the same values
+    template <typename Writer>
+    void saveState(Writer &out)
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        out.u32((uint32_t)values.size());
+        for (auto const &pair : values)
+        {
+            out.str(pair.first);
+            out.str((const char *)&pair.second.header, sizeof(PacketHeader));
+            out.str(pair.second.payload ? std::string(pair.second.payload->begin(), pair.second.payload->end())
+                                        : std::string());
+        }
+    }
+
+    template <typename Reader>
+    bool loadState(Reader &in)
+    {
+        uint32_t count;
+        if (!in.u32(count))
+            return false;
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            std::string key, header, payload;
+            if (!in.str(key) || !in.str(header) || !in.str(payload) || header.size() != sizeof(PacketHeader))
+                return false;
+            LastValue value{};
+            std::memcpy(&value.header, header.data(), sizeof(PacketHeader));
+            if (!payload.empty())
+                value.payload = std::make_shared<const std::vector<char>>(payload.begin(), payload.end());
+            if (values.size() < LAST_VALUE_MAX_KEYS)
+                values[key] = value;
+        }
+        return true;
+    }
+};
+
+#endif // LAST_VALUE_H
@@ -0,0 +1,102 @@
+#ifndef LIVENESS_H
+#define LIVENESS_H
+
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include "../protocol.h"
+#include "egress.h"
+#include "timer_wheel.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#define SHUT_RDWR SD_BOTH
+#else
+#include <sys/socket.h>
+#endif
+
+// ===== OPTIMIZATION: Dead-peer eviction =====
+// Purpose: A peer that vanished without a FIN kept its handler, socket and
+// subscriptions forever, and every publish to its topics still queued for it.
+// Each connection now has one wheel timer (timer_wheel.h) checking:
+// - Idle: no packet for HEARTBEAT_INTERVAL_MS -> MSG_PING; none for IDLE_TIMEOUT_MS -> evict
+// - Write stall: queued bytes with no progress for SOCKET_TIMEOUT_MS -> evict
+// Eviction shuts the socket down; the handler's pending read then fails and its
+// usual cleanup unregisters the client and frees its subscriptions.
+class ConnectionLiveness : public WheelTimer
+{
+private:
+    SOCKET sock;
+    std::shared_ptr<EgressQueue> egress;
+    std::atomic<int64_t> lastReceive; // steadyMillis() of the last packet from the peer
+    int64_t lastPing;                 // When the last MSG_PING went out (wheel thread only)
+    std::atomic<const char *> evictReason;
+
+    unsigned evict(const char *reason)
+    {
+        evictReason.store(reason);
+        shutdown(sock, SHUT_RDWR);
+        return 0;
+    }
+
+    void sendPing()
+    {
+        PacketHeader ping;
+        std::memset(&ping, 0, sizeof(ping));
+        ping.msgType = MSG_PING;
+        std::strcpy(ping.sender, "SERVER");
+        egress->enqueue(ping, SharedPayload());
+    }
+
+public:
+    ConnectionLiveness(SOCKET s, const std::shared_ptr<EgressQueue> &queue)
+        : sock(s), egress(queue), lastReceive(steadyMillis()), lastPing(0), evictReason(nullptr)
+    {
+    }
+
+    // A packet arrived from the peer (one relaxed store per packet)
+    void touch()
+    {
+        lastReceive.store(steadyMillis(), std::memory_order_relaxed);
+    }
+
+    // Why the connection was evicted, or null
+    const char *evicted() const
+    {
+        return evictReason.load();
+    }
+
+    unsigned expired(int64_t now) override
+    {
+        int64_t stalled = egress->stalledFor(now);
+        if (stalled >= SOCKET_TIMEOUT_MS)
+            return evict("write stall");
+
+        int64_t received = lastReceive.load(std::memory_order_relaxed);
+        int64_t idle = now - received;
+        if (idle >= IDLE_TIMEOUT_MS)
+            return evict("idle timeout");
+
+        int64_t next;
+        if (idle < HEARTBEAT_INTERVAL_MS)
+        {
+            next = HEARTBEAT_INTERVAL_MS - idle;
+        }
+        else
+        {
+            // One ping per silence: the peer answered the previous one if it spoke since
+            if (lastPing <= received)
+            {
+                sendPing();
+                lastPing = now;
+            }
+            next = IDLE_TIMEOUT_MS - idle;
+        }
+
+        // A queue can start stalling at any time: look again within the stall timeout
+        int64_t stallCheck = SOCKET_TIMEOUT_MS - stalled;
+        return (unsigned)(next < stallCheck ? next : stallCheck);
+    }
+};
+
+#endif // LIVENESS_H
@@ -0,0 +1,112 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "../protocol.h"
+
+// ===== OPTIMIZATION: Presence and membership index =====
+// Purpose: Listing who is online or who subscribes to a topic meant walking every
+// client (or copying a topic's subscriber vector and resolving each id), and a
+// client could only learn about changes by asking again. MSG_QUERY is answered
+// from sorted username indexes kept up to date on login/logout and
+// subscribe/unsubscribe:
+// - Keyset pagination: a page starts after a cursor (the last name of the previous
+//   page), O(log N + page) however large the scope, and stays consistent while
+//   members come and go between pages
+// - FLAG_WATCH keeps the querying client watching the scope: each later join/leave
+//   is pushed as a MSG_PRESENCE delta instead of the client polling full lists
+// Scopes: the empty topic is the users logged in here, any other topic its plain and
+// filtered subscribers (consumer group members are workers, not listed). Per node.
+
+// Usernames in one scope, sorted for paging
+class MemberIndex
+{
+private:
+    std::map<std::string, int> byName; // username -> client id
+    std::map<int, std::string> byId;   // client id -> username, for removal by id
+
+public:
+    // False if the client is already listed
+    bool add(int clientId, const std::string &username)
+    {
+        if (!byId.emplace(clientId, username).second)
+            return false;
+        byName[username] = clientId;
+        return true;
+    }
+
+    // The name the client was listed under, empty if it was not
+    std::string remove(int clientId)
+    {
+        auto it = byId.find(clientId);
+        if (it == byId.end())
+            return std::string();
+        std::string username = it->second;
+        byId.erase(it);
+        auto named = byName.find(username);
+        if (named != byName.end() && named->second == clientId)
+            byName.erase(named);
+        return username;
+    }
+
+    bool contains(int clientId) const
+    {
+        return byId.count(clientId) > 0;
+    }
+
+    // Client id listed under a name, -1 if none
+    int find(const std::string &username) const
+    {
+        auto it = byName.find(username);
+        return it == byName.end() ? -1 : it->second;
+    }
+
+    size_t size() const
+    {
+        return byName.size();
+    }
+
+    // Up to limit names after cursor (empty: from the first); more is set if names remain
+    std::vector<std::string> page(const std::string &cursor, size_t limit, bool &more) const
+    {
+        std::vector<std::string> names;
+        auto it = cursor.empty() ? byName.begin() : byName.upper_bound(cursor);
+        for (; it != byName.end() && names.size() < limit; ++it)
+        {
+            names.push_back(it->first);
+        }
+        more = it != byName.end();
+        return names;
+    }
+};
+
+// Split a MSG_QUERY payload (see protocol.h). False if malformed
+inline bool parseQuery(const char *payload, uint32_t length, uint16_t &limit, std::string &cursor)
+{
+    if (length < sizeof(uint16_t) || length - sizeof(uint16_t) >= MAX_USERNAME_LEN)
+        return false;
+    std::memcpy(&limit, payload, sizeof(uint16_t));
+    cursor.assign(payload + sizeof(uint16_t), length - sizeof(uint16_t));
+    return true;
+}
+
+// Build a MSG_QUERY_RESULT payload (see protocol.h)
+inline std::vector<char> encodeQueryResult(uint32_t total, bool more, const std::vector<std::string> &names)
+{
+    std::vector<char> payload(sizeof(uint32_t) + 1);
+    std::memcpy(payload.data(), &total, sizeof(uint32_t));
+    payload[sizeof(uint32_t)] = more ? 1 : 0;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        if (i > 0)
+            payload.push_back('\n');
+        payload.insert(payload.end(), names[i].begin(), names[i].end());
+    }
+    return payload;
+}
+
+#endif // PRESENCE_H
@@ -0,0 +1,352 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include "../protocol.h"
+#include "timer_wheel.h"
+
+// ===== OPTIMIZATION: Rate limiting and admission control =====
+// Purpose: One client flooding MSG_PUBLISH_TEXT used to fill every subscriber's
+// queue on the topic and stretch the tail latency of everyone sharing it, and
+// accept() admitted connections without bound.
+// - Token buckets per connection and per user (chat and stream connections of a
+//   user share one set), for messages/s and bytes/s, configured per message type
+// - Over the limit a request is refused with MSG_ERROR (stream frames are dropped)
+// - A global connection cap rejects new connections with MSG_ERROR "Server full"
+// - Throttled packets and rejected connections are counted per message type
+
+static const int RATE_LIMIT_TYPES = 32; // Indexed by MessageType
+
+struct RateLimitConfig
+{
+    double messagesPerSecond; // 0 = unlimited
+    double bytesPerSecond;    // 0 = unlimited
+};
+
+// Token bucket holding up to one second of the configured rate
+class TokenBucket
+{
+private:
+    double tokens;
+    int64_t lastRefill;
+
+public:
+    TokenBucket() : tokens(-1), lastRefill(0) {}
+
+    bool take(double rate, double amount, int64_t now)
+    {
+        if (rate <= 0)
+            return true;
+        if (tokens < 0) // First use starts full
+        {
+            tokens = rate;
+            lastRefill = now;
+        }
+        tokens += rate * (double)(now - lastRefill) / 1000.0;
+        if (tokens > rate)
+            tokens = rate;
+        lastRefill = now;
+        if (tokens < amount)
+            return false;
+        tokens -= amount;
+        return true;
+    }
+
+    // Return tokens taken for a packet a later bucket refused
+    void refund(double amount)
+    {
+        tokens += amount;
+    }
+};
+
+// Message and byte buckets for every message type
+struct RateBuckets
+{
+    TokenBucket messages[RATE_LIMIT_TYPES];
+    TokenBucket bytes[RATE_LIMIT_TYPES];
+
+    bool take(const RateLimitConfig &config, uint32_t type, uint32_t length, int64_t now)
+    {
+        if (!messages[type].take(config.messagesPerSecond, 1, now))
+            return false;
+        if (!bytes[type].take(config.bytesPerSecond, length, now))
+        {
+            if (config.messagesPerSecond > 0)
+                messages[type].refund(1);
+            return false;
+        }
+        return true;
+    }
+
+    // Undo a successful take() (the user's buckets refused the packet)
+    void refund(const RateLimitConfig &config, uint32_t type, uint32_t length)
+    {
+        if (config.messagesPerSecond > 0)
+            messages[type].refund(1);
+        if (config.bytesPerSecond > 0)
+            bytes[type].refund(length);
+    }
+};
+
+// Buckets shared by all connections of one user
+struct UserRateBuckets
+{
+    RateBuckets buckets;
+    std::mutex bucketMutex;
+};
+typedef std::shared_ptr<UserRateBuckets> UserRateBucketsRef;
+
+class RateLimiter
+{
+private:
+    RateLimitConfig connectionLimits[RATE_LIMIT_TYPES];
+    RateLimitConfig userLimits[RATE_LIMIT_TYPES];
+    std::map<std::string, UserRateBucketsRef> users;
+    size_t sweepAt; // Map size that triggers the next sweep
+    std::mutex usersMutex;
+    std::atomic<uint64_t> throttled[RATE_LIMIT_TYPES];
+
+    // Users without a live connection are forgotten once the map grows this large
+    // (and again each time it doubles)
+    static const size_t USER_SWEEP_THRESHOLD = 4096;
+
+    static int typeByName(const std::string &name)
+    {
+        static const struct
+        {
+            const char *name;
+            MessageType type;
+        } names[] = {
+            {"login", MSG_LOGIN},
+            {"subscribe", MSG_SUBSCRIBE},
+            {"unsubscribe", MSG_UNSUBSCRIBE},
+            {"publish_text", MSG_PUBLISH_TEXT},
+            {"publish_file", MSG_PUBLISH_FILE},
+            {"publish_batch", MSG_PUBLISH_BATCH},
+            {"stream_start", MSG_STREAM_START},
+            {"stream_frame", MSG_STREAM_FRAME},
+            {"stream_attach", MSG_STREAM_ATTACH},
+            {"ping", MSG_PING},
+        };
+        for (auto const &entry : names)
+        {
+            if (name == entry.name)
+                return entry.type;
+        }
+        return -1;
+    }
+
+    void setDefault(MessageType type, double messagesPerSecond, double bytesPerSecond)
+    {
+        connectionLimits[type] = RateLimitConfig{messagesPerSecond, bytesPerSecond};
+        // A user has a chat and a stream connection
+        userLimits[type] = RateLimitConfig{2 * messagesPerSecond, 2 * bytesPerSecond};
+    }
+
+public:
+    RateLimiter() : sweepAt(USER_SWEEP_THRESHOLD)
+    {
+        for (int i = 0; i < RATE_LIMIT_TYPES; i++)
+        {
+            connectionLimits[i] = userLimits[i] = RateLimitConfig{0, 0};
+            throttled[i].store(0);
+        }
+        // Defaults leave room for bursty producers; a flood runs at 100x these
+        setDefault(MSG_LOGIN, 5, 0);
+        setDefault(MSG_SUBSCRIBE, 100, 0);
+        setDefault(MSG_UNSUBSCRIBE, 100, 0);
+        setDefault(MSG_PUBLISH_TEXT, 1000, 4 * 1024 * 1024);
+        setDefault(MSG_PUBLISH_FILE, 200, 8 * 1024 * 1024);
+        setDefault(MSG_PUBLISH_BATCH, 200, 8 * 1024 * 1024);
+        setDefault(MSG_STREAM_FRAME, 500, 2 * 1024 * 1024); // Audio is 50 frames/s
+        setDefault(MSG_PING, 10, 0);
+    }
+
+    // Parse "<type>=<messages/s>/<bytes/s>" (0 = unlimited), e.g. publish_text=100/65536
+    bool configure(const std::string &spec, bool perUser)
+    {
+        size_t equals = spec.find('=');
+        size_t slash = spec.find('/', equals);
+        if (equals == std::string::npos || slash == std::string::npos)
+            return false;
+        int type = typeByName(spec.substr(0, equals));
+        if (type < 0)
+            return false;
+        char *end;
+        double messages = std::strtod(spec.c_str() + equals + 1, &end);
+        if (end != spec.c_str() + slash || messages < 0)
+            return false;
+        double bytes = std::strtod(spec.c_str() + slash + 1, &end);
+        if (*end != '\0' || bytes < 0)
+            return false;
+        (perUser ? userLimits : connectionLimits)[type] = RateLimitConfig{messages, bytes};
+        return true;
+    }
+
+    const RateLimitConfig &connectionLimit(uint32_t type) const
+    {
+        return connectionLimits[type];
+    }
+
+    const RateLimitConfig &userLimit(uint32_t type) const
+    {
+        return userLimits[type];
+    }
+
+    UserRateBucketsRef bucketsFor(const std::string &username)
+    {
+        std::lock_guard<std::mutex> lock(usersMutex);
+        if (users.size() >= sweepAt)
+        {
+            for (auto it = users.begin(); it != users.end();)
+            {
+                if (it->second.use_count() == 1)
+                    it = users.erase(it);
+                else
+                    ++it;
+            }
+            sweepAt = users.size() * 2 > USER_SWEEP_THRESHOLD ? users.size() * 2 : USER_SWEEP_THRESHOLD;
+        }
+        UserRateBucketsRef &buckets = users[username];
+        if (!buckets)
+            buckets = std::make_shared<UserRateBuckets>();
+        return buckets;
+    }
+
+    void countThrottled(uint32_t type)
+    {
+        throttled[type].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t throttledCount(uint32_t type) const
+    {
+        return throttled[type].load(std::memory_order_relaxed);
+    }
+
+    uint64_t throttledTotal() const
+    {
+        uint64_t total = 0;
+        for (int i = 0; i < RATE_LIMIT_TYPES; i++)
+        {
+            total += throttledCount(i);
+        }
+        return total;
+    }
+};
+
+// Rate state of one connection (handler only)
+class ConnectionRateLimit
+{
+private:
+    RateLimiter &limiter;
+    RateBuckets buckets;
+    UserRateBucketsRef user;
+    uint64_t throttledPackets;
+
+public:
+    explicit ConnectionRateLimit(RateLimiter &owner) : limiter(owner), throttledPackets(0) {}
+
+    // Charge the user's buckets too from now on (after login / stream attach)
+    void bindUser(const std::string &username)
+    {
+        user = limiter.bucketsFor(username);
+    }
+
+    // Account one received packet; false if it exceeds a limit and must be refused
+    bool allow(uint32_t type, uint32_t length)
+    {
+        if (type >= (uint32_t)RATE_LIMIT_TYPES)
+            return true;
+        int64_t now = steadyMillis();
+        bool ok = buckets.take(limiter.connectionLimit(type), type, length, now);
+        if (ok && user)
+        {
+            std::lock_guard<std::mutex> lock(user->bucketMutex);
+            ok = user->buckets.take(limiter.userLimit(type), type, length, now);
+            if (!ok)
+                buckets.refund(limiter.connectionLimit(type), type, length);
+        }
+        if (!ok)
+        {
+            throttledPackets++;
+            limiter.countThrottled(type);
+        }
+        return ok;
+    }
+
+    uint64_t throttled() const
+    {
+        return throttledPackets;
+    }
+};
+
+// Global cap on concurrent connections (both ports)
+class AdmissionControl
+{
+private:
+    std::atomic<int> active;
+    std::atomic<uint64_t> rejected;
+    int limit;
+
+public:
+    static const int DEFAULT_MAX_CONNECTIONS = 10000;
+
+    AdmissionControl() : active(0), rejected(0), limit(DEFAULT_MAX_CONNECTIONS) {}
+
+    void setLimit(int maxConnections)
+    {
+        limit = maxConnections;
+    }
+
+    bool admit()
+    {
+        if (active.fetch_add(1) < limit)
+            return true;
+        active.fetch_sub(1);
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void release()
+    {
+        active.fetch_sub(1);
+    }
+
+    uint64_t rejectedCount() const
+    {
+        return rejected.load(std::memory_order_relaxed);
+    }
+};
+
+// Admission held for a connection handler's lifetime
+class AdmissionSlot
+{
+private:
+    AdmissionControl &control;
+    bool admitted;
+
+public:
+    explicit AdmissionSlot(AdmissionControl &owner) : control(owner), admitted(owner.admit()) {}
+
+    ~AdmissionSlot()
+    {
+        if (admitted)
+            control.release();
+    }
+
+    AdmissionSlot(const AdmissionSlot &) = delete;
+    AdmissionSlot &operator=(const AdmissionSlot &) = delete;
+
+    explicit operator bool() const
+    {
+        return admitted;
+    }
+};
+
+#endif // RATE_LIMIT_H
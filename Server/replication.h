@@ -0,0 +1,555 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../protocol.h"
+#include "../compression.h"
+#include "broker.h"
+#include "hot_restart.h"
+#include "socket_reader.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+
+// ===== OPTIMIZATION: Replicated topic log (leader / follower failover) =====
+// Purpose: When the server died, every subscription and every message still on its
+// way to a subscriber died with it. A standby process (--follow <host>:<port>)
+// now mirrors a running one (--replicate <port>):
+// - The leader streams what changes its state: a snapshot of every logged-in user's
+//   subscriptions when the follower connects, then subscribe / unsubscribe / session
+//   end records and every publish, in the order they happened
+// - Records are appended to one buffer and shipped by a sender thread, one frame per
+//   write: a publish costs an append, never a round trip, and records that pile up
+//   while a frame is on the wire leave together in the next one
+// - The follower applies them in order: user -> topics, and the last
+//   REPLICA_LOG_DEPTH messages of every topic
+// - When the leader has been gone for REPLICA_FAILOVER_MS the follower promotes
+//   itself: it opens the client ports, and a user logging in gets the subscriptions
+//   it had on the leader back, plus the messages of those topics from the last
+//   REPLICA_REPLAY_MS before the leader went silent (the ones possibly in flight)
+// Replication is asynchronous: a publish acknowledged in the last batch before a
+// crash can be missing on the follower, and a replayed message may be a duplicate.
+
+#define REPLICATION_BATCH 110          // msgType of the frames on the replication link
+#define REPLICA_LOG_DEPTH 64           // Messages kept per topic on the follower
+#define REPLICA_REPLAY_MS 2000         // Replayed on failover: logged this long before the leader went silent
+#define REPLICA_HEARTBEAT_MS 1000      // The leader sends an empty frame when idle this long
+#define REPLICA_TIMEOUT_MS 3000        // Follower: a leader silent this long is gone
+#define REPLICA_FAILOVER_MS 3000       // Follower: promoted when the leader has been gone this long
+#define REPLICA_MAX_PENDING (16 * 1024 * 1024) // Unsent bytes: a follower further behind is dropped (it resyncs)
+
+// Records inside a REPLICATION_BATCH payload (StateWriter encoding)
+enum ReplicationRecordType
+{
+    REPL_SNAPSHOT = 1,    // u32 count, then per user: str username, u32 count, str topic...
+    REPL_SUBSCRIBE = 2,   // str username, str topic
+    REPL_UNSUBSCRIBE = 3, // str username, str topic
+    REPL_SESSION_END = 4, // str username
+    REPL_PUBLISH = 5      // str PacketHeader (v1), str payload (never compressed)
+};
+
+inline bool sendReplicationFrame(SOCKET sock, uint32_t batchNumber, const std::string &records)
+{
+    PacketHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.msgType = REPLICATION_BATCH;
+    header.messageId = batchNumber;
+    header.payloadLength = records.size();
+
+    std::string frame((const char *)&header, sizeof(header));
+    frame += records;
+    size_t sent = 0;
+    while (sent < frame.size())
+    {
+        int n = send(sock, frame.data() + sent, (int)(frame.size() - sent), 0);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Leader side: serves one follower at a time (a new one replaces it)
+class ReplicationLeader
+{
+private:
+    MessageBroker &broker;
+    int port;
+    SOCKET listener;
+    SOCKET follower;     // Connected follower, guarded by replMutex
+    StateWriter pending; // Records not sent yet, guarded by replMutex
+    std::atomic<bool> following; // follower is set: lets publishes skip all work when nobody follows
+    bool senderIdle;             // The sender waits for records, guarded by replMutex
+    bool stopped;
+    std::mutex replMutex;
+    std::condition_variable replCv;
+
+    // Record appended only while a follower is connected
+    template <typename F>
+    void append(F write)
+    {
+        std::lock_guard<std::mutex> lock(replMutex);
+        if (follower == INVALID_SOCKET)
+            return;
+        write(pending);
+        if (pending.size() > REPLICA_MAX_PENDING)
+        {
+            // Too far behind: cut it off, it resyncs from a snapshot on reconnect
+            std::cout << "[REPLICATION] Follower fell " << pending.size() << " bytes behind, dropping it" << std::endl;
+            shutdown(follower, SHUT_RDWR);
+            follower = INVALID_SOCKET;
+            following = false;
+            pending.take();
+        }
+        if (senderIdle)
+        {
+            // A busy sender picks the record up after its current frame: no wakeup
+            senderIdle = false;
+            replCv.notify_one();
+        }
+    }
+
+    void writeSnapshot(StateWriter &out)
+    {
+        auto sessions = broker.sessionSubscriptions();
+        out.u8(REPL_SNAPSHOT);
+        out.u32((uint32_t)sessions.size());
+        for (auto const &session : sessions)
+        {
+            out.str(session.first);
+            out.u32((uint32_t)session.second.size());
+            for (auto const &topic : session.second)
+            {
+                out.str(topic);
+            }
+        }
+    }
+
+    void serveFollower(SOCKET sock)
+    {
+        int flag = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag, sizeof(flag));
+        {
+            std::lock_guard<std::mutex> lock(replMutex);
+            if (stopped)
+            {
+                CLOSE_SOCKET(sock);
+                return;
+            }
+            if (follower != INVALID_SOCKET)
+                shutdown(follower, SHUT_RDWR); // Its sender finds itself replaced
+            follower = sock;
+            following = true;
+            pending.take();
+            // Under the lock: every record appended from here on follows the snapshot.
+            // Records of changes the snapshot already shows are harmless to apply again.
+            writeSnapshot(pending);
+        }
+        std::cout << "[REPLICATION] Follower connected" << std::endl;
+
+        uint32_t batchNumber = 0;
+        while (true)
+        {
+            std::string records;
+            {
+                std::unique_lock<std::mutex> lock(replMutex);
+                senderIdle = pending.size() == 0;
+                replCv.wait_for(lock, std::chrono::milliseconds(REPLICA_HEARTBEAT_MS), [&]
+                                { return pending.size() > 0 || follower != sock; });
+                senderIdle = false;
+                if (follower != sock)
+                    break;
+                records = pending.take(); // Everything appended while the last frame was sent
+            }
+            if (!sendReplicationFrame(sock, ++batchNumber, records))
+                break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(replMutex);
+            if (follower == sock)
+            {
+                follower = INVALID_SOCKET;
+                following = false;
+                pending.take();
+            }
+        }
+        CLOSE_SOCKET(sock);
+        std::cout << "[REPLICATION] Follower disconnected" << std::endl;
+    }
+
+    void acceptLoop()
+    {
+        while (true)
+        {
+            SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            int opt = 1;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons(port);
+            if (bind(sock, (sockaddr *)&address, sizeof(address)) != SOCKET_ERROR &&
+                listen(sock, 4) != SOCKET_ERROR)
+            {
+                std::lock_guard<std::mutex> lock(replMutex);
+                if (!stopped)
+                {
+                    listener = sock;
+                    break;
+                }
+            }
+            // Still held by the process this one takes over from (hot restart)
+            CLOSE_SOCKET(sock);
+            std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_HEARTBEAT_MS));
+        }
+        std::cout << "[REPLICATION] Leader accepting a follower on port " << port << std::endl;
+
+        while (true)
+        {
+            SOCKET sock = accept(listener, nullptr, nullptr);
+            if (sock == INVALID_SOCKET)
+            {
+                std::lock_guard<std::mutex> lock(replMutex);
+                if (stopped)
+                    return;
+                continue;
+            }
+            std::thread(&ReplicationLeader::serveFollower, this, sock).detach();
+        }
+    }
+
+public:
+    explicit ReplicationLeader(MessageBroker &owner)
+        : broker(owner), port(0), listener(INVALID_SOCKET), follower(INVALID_SOCKET), following(false),
+          senderIdle(false), stopped(false)
+    {
+    }
+
+    ReplicationLeader(const ReplicationLeader &) = delete;
+    ReplicationLeader &operator=(const ReplicationLeader &) = delete;
+
+    void start(int replicationPort)
+    {
+        port = replicationPort;
+        std::thread(&ReplicationLeader::acceptLoop, this).detach();
+    }
+
+    // Hot restart: the successor leads from now on (the follower reconnects to it)
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(replMutex);
+        stopped = true;
+        if (listener != INVALID_SOCKET)
+            shutdown(listener, SHUT_RDWR);
+        if (follower != INVALID_SOCKET)
+            shutdown(follower, SHUT_RDWR);
+        follower = INVALID_SOCKET;
+        following = false;
+        replCv.notify_all();
+    }
+
+    void subscribed(const std::string &username, const std::string &topic)
+    {
+        append([&](StateWriter &out)
+               {
+            out.u8(REPL_SUBSCRIBE);
+            out.str(username);
+            out.str(topic); });
+    }
+
+    void unsubscribed(const std::string &username, const std::string &topic)
+    {
+        append([&](StateWriter &out)
+               {
+            out.u8(REPL_UNSUBSCRIBE);
+            out.str(username);
+            out.str(topic); });
+    }
+
+    void sessionEnded(const std::string &username)
+    {
+        append([&](StateWriter &out)
+               {
+            out.u8(REPL_SESSION_END);
+            out.str(username); });
+    }
+
+    // A publish delivered here (to header.topic); stored decompressed since
+    // dictionaries and negotiated codecs do not carry over to the follower
+    void published(const PacketHeader &header, const char *payload, uint32_t length)
+    {
+        if (!following) // The common no-follower case costs nothing
+            return;
+        PacketHeader plainHeader = header;
+        std::vector<char> storage;
+        if (!broker.withoutDictionary(plainHeader, payload, length, storage))
+            return;
+        std::vector<char> plain;
+        if (plainHeader.flags & FLAG_COMPRESSED)
+        {
+            CompressionEnvelope envelope;
+            if (!parseEnvelope(payload, length, envelope) || !decompressPayload(envelope, nullptr, plain))
+                return;
+            plainHeader.flags &= ~FLAG_COMPRESSED;
+            plainHeader.checksum = 0;
+            payload = plain.data();
+            length = plain.size();
+        }
+        plainHeader.payloadLength = length;
+
+        append([&](StateWriter &out)
+               {
+            out.u8(REPL_PUBLISH);
+            out.str((const char *)&plainHeader, sizeof(plainHeader));
+            out.str(payload, length); });
+    }
+
+    void publishedBatch(const PacketHeader &batchHeader, const std::vector<BatchRecord> &records)
+    {
+        if (!following)
+            return;
+        for (auto const &record : records)
+        {
+            // As subscribers receive it (see MessageBroker::publishBatch)
+            PacketHeader header = batchHeader;
+            header.msgType = MSG_PUBLISH_TEXT;
+            header.checksum = 0;
+            header.flags &= ~FLAG_COMPRESSED;
+            std::memset(header.topic, 0, MAX_TOPIC_LEN);
+            std::strncpy(header.topic, record.topic.c_str(), MAX_TOPIC_LEN - 1);
+            published(header, record.payload, record.payloadLength);
+        }
+    }
+};
+
+// A message of the follower's topic log
+struct ReplicatedMessage
+{
+    PacketHeader header;
+    std::string payload;
+    std::chrono::steady_clock::time_point received;
+    uint64_t sequence; // Order of arrival across all topics
+};
+
+// Follower side: the leader's state, applied in order, until promotion
+class ReplicaState
+{
+private:
+    std::map<std::string, std::set<std::string>> sessions; // Username -> topics, guarded by replicaMutex
+    std::map<std::string, std::deque<ReplicatedMessage>> topicLog; // Topic -> last messages, guarded by replicaMutex
+    std::chrono::steady_clock::time_point lostAt; // When the leader went silent
+    uint64_t nextSequence;
+    bool promoted;
+    std::mutex replicaMutex;
+
+    bool applyRecords(const std::string &batch)
+    {
+        StateReader in(batch);
+        uint8_t type;
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(replicaMutex);
+        while (in.u8(type))
+        {
+            std::string username, topic;
+            switch (type)
+            {
+            case REPL_SNAPSHOT:
+            {
+                uint32_t users, topics;
+                if (!in.u32(users))
+                    return false;
+                sessions.clear();
+                for (uint32_t i = 0; i < users; i++)
+                {
+                    if (!in.str(username) || !in.u32(topics))
+                        return false;
+                    std::set<std::string> &subscribed = sessions[username];
+                    for (uint32_t j = 0; j < topics; j++)
+                    {
+                        if (!in.str(topic))
+                            return false;
+                        subscribed.insert(topic);
+                    }
+                }
+                break;
+            }
+
+            case REPL_SUBSCRIBE:
+            case REPL_UNSUBSCRIBE:
+                if (!in.str(username) || !in.str(topic))
+                    return false;
+                if (type == REPL_SUBSCRIBE)
+                    sessions[username].insert(topic);
+                else if (sessions.count(username))
+                    sessions[username].erase(topic);
+                break;
+
+            case REPL_SESSION_END:
+                if (!in.str(username))
+                    return false;
+                sessions.erase(username);
+                break;
+
+            case REPL_PUBLISH:
+            {
+                std::string header;
+                ReplicatedMessage message;
+                if (!in.str(header) || header.size() != sizeof(PacketHeader) || !in.str(message.payload))
+                    return false;
+                std::memcpy(&message.header, header.data(), sizeof(PacketHeader));
+                message.header.topic[MAX_TOPIC_LEN - 1] = '\0';
+                message.header.sender[MAX_USERNAME_LEN - 1] = '\0';
+                message.received = now;
+                message.sequence = nextSequence++;
+                std::deque<ReplicatedMessage> &log = topicLog[message.header.topic];
+                log.push_back(std::move(message));
+                if (log.size() > REPLICA_LOG_DEPTH)
+                    log.pop_front();
+                break;
+            }
+
+            default:
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // One connection to the leader; true if it was ever established
+    bool followOnce(const std::string &host, int port)
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *result = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0 || !result)
+            return false;
+        SOCKET sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+        bool connected = sock != INVALID_SOCKET && connect(sock, result->ai_addr, (int)result->ai_addrlen) == 0;
+        freeaddrinfo(result);
+        if (!connected)
+        {
+            if (sock != INVALID_SOCKET)
+                CLOSE_SOCKET(sock);
+            return false;
+        }
+
+        // The leader sends at least a heartbeat every REPLICA_HEARTBEAT_MS
+        timeval timeout{REPLICA_TIMEOUT_MS / 1000, (REPLICA_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+        std::cout << "[REPLICATION] Following the leader at " << host << ":" << port << std::endl;
+
+        SocketReader reader(sock);
+        CompactDecoder decoder;
+        PacketHeader header;
+        std::string batch;
+        while (reader.readHeader(PROTOCOL_VERSION_1, decoder, header))
+        {
+            if (header.msgType != REPLICATION_BATCH || header.payloadLength > REPLICA_MAX_PENDING)
+                break;
+            batch.resize(header.payloadLength);
+            if (header.payloadLength > 0 && !reader.readExact(&batch[0], header.payloadLength))
+                break;
+            if (!applyRecords(batch))
+            {
+                std::cout << "[REPLICATION] Malformed batch from the leader" << std::endl;
+                break;
+            }
+        }
+        CLOSE_SOCKET(sock);
+
+        std::lock_guard<std::mutex> lock(replicaMutex);
+        lostAt = std::chrono::steady_clock::now();
+        std::cout << "[REPLICATION] Lost the leader (" << sessions.size() << " sessions replicated)" << std::endl;
+        return true;
+    }
+
+public:
+    ReplicaState() : nextSequence(0), promoted(false) {}
+
+    ReplicaState(const ReplicaState &) = delete;
+    ReplicaState &operator=(const ReplicaState &) = delete;
+
+    // Mirror the leader at "<host>:<port>" until it has been gone REPLICA_FAILOVER_MS
+    // (a leader restarting, e.g. a hot restart, reconnects well within that)
+    bool follow(const std::string &address)
+    {
+        size_t colon = address.rfind(':');
+        int port = colon == std::string::npos ? 0 : std::atoi(address.c_str() + colon + 1);
+        if (colon == 0 || port <= 0 || port > 65535)
+            return false;
+        std::string host = address.substr(0, colon);
+
+        bool followed = false;
+        while (true)
+        {
+            followed = followOnce(host, port) || followed;
+            if (followed)
+            {
+                std::lock_guard<std::mutex> lock(replicaMutex);
+                if (std::chrono::steady_clock::now() - lostAt >= std::chrono::milliseconds(REPLICA_FAILOVER_MS))
+                {
+                    promoted = true;
+                    std::cout << "[REPLICATION] Leader gone, promoted with " << sessions.size() << " sessions" << std::endl;
+                    return true;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_HEARTBEAT_MS / 4));
+        }
+    }
+
+    // A user logging in after promotion: the topics it had on the leader and the
+    // messages of those topics that were possibly in flight, in publish order. Once per user.
+    bool takeSession(const std::string &username, std::vector<std::string> &topics,
+                     std::vector<const ReplicatedMessage *> &replay)
+    {
+        std::lock_guard<std::mutex> lock(replicaMutex);
+        if (!promoted)
+            return false;
+        auto it = sessions.find(username);
+        if (it == sessions.end())
+            return false;
+        auto since = lostAt - std::chrono::milliseconds(REPLICA_REPLAY_MS);
+        for (auto const &topic : it->second)
+        {
+            topics.push_back(topic);
+            auto log = topicLog.find(topic);
+            if (log == topicLog.end())
+                continue;
+            for (auto const &message : log->second)
+            {
+                if (message.received >= since)
+                    replay.push_back(&message); // The log is frozen after promotion
+            }
+        }
+        std::sort(replay.begin(), replay.end(), [](const ReplicatedMessage *a, const ReplicatedMessage *b)
+                  { return a->sequence < b->sequence; });
+        sessions.erase(it);
+        return true;
+    }
+};
+
+#endif // REPLICATION_H
@@ -5,8 +5,26 @@
 #include <mutex>
 #include <atomic>
 #include <map>
+#include <set>
 #include "../protocol.h"
+#include "../crc32c.h"
+#include "../tls_session.h"
 #include "broker.h"
+#include "socket_reader.h"
+#include "session_io.h"
+#include "uring_backend.h"
+#include "liveness.h"
+#include "timer_wheel.h"
+#include "rate_limit.h"
+#include "hot_restart.h"
+#include "cluster.h"
+#include "replication.h"
+#include "session_resume.h"
+#include "dedup.h"
+#include "consumer_group.h"
+#include "topic_filter.h"
+#include "presence.h"
+#include "direct_message.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -22,6 +40,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <poll.h>
 #define SOCKET int
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
@@ -31,10 +51,35 @@
 #define STREAM_PORT 8081
 #define CHAT_PORT 8080
 
+// Publisher flow control (see EgressAccounting)
+#define PUBLISH_WINDOW_MAX 64                     // Window granted while the server is idle
+#define EGRESS_LOW_WATER (16 * 1024 * 1024)       // Below: full window
+#define EGRESS_HIGH_WATER (128 * 1024 * 1024)     // Above: stop reading publishes
+
+// Hot restart / shutdown (see hot_restart.h)
+#define HANDOFF_TIMEOUT_MS 5000  // Sessions not at a packet boundary by then are closed instead
+#define SHUTDOWN_TIMEOUT_MS 5000 // Handlers still flushing by then are cut off at exit
+
 // Global message broker
 MessageBroker g_broker;
 std::mutex cout_mutex;
 
+#ifdef USE_TLS
+SSL_CTX *g_tlsContext = nullptr; // Set by --tls: both ports require TLS
+#endif
+
+UringBackend *g_uring = nullptr; // Set by --io uring: the ring thread does socket I/O
+TimerWheel g_timerWheel;         // Idle / write-stall deadlines of every connection
+RateLimiter g_rateLimiter;       // Token bucket limits (--rate, --user-rate)
+AdmissionControl g_admission;    // Connection cap (--max-connections)
+HotRestart g_restart;            // Socket handoff to a successor process (--control, --takeover)
+SessionRegistry g_sessions;      // Live connections, for handoff and graceful shutdown
+std::atomic<bool> g_stopping(false); // SIGTERM: accepted connections are closed right away
+ClusterNode g_cluster(g_broker, g_timerWheel); // Peer brokers (--node, --peer)
+ReplicationLeader g_replication(g_broker);     // State streamed to a standby (--replicate)
+ReplicaState g_replica;                        // This process as the standby (--follow)
+SessionParking g_parking(g_timerWheel);        // Dropped resumable sessions awaiting their client
+
 // Thread-safe logging
 void logMessage(const std::string &msg)
 {
@@ -42,95 +87,434 @@ void logMessage(const std::string &msg)
     std::cout << msg << std::endl;
 }
 
-// Receive all bytes reliably
-bool recvAllBytes(SOCKET sock, char *buffer, int totalBytes)
+// Send error packet to client
+void sendErrorPacket(EgressQueue &egress, uint32_t messageId, const std::string &reason)
 {
-    if (!buffer || totalBytes <= 0)
-        return false;
+    PacketHeader errorHeader;
+    std::memset(&errorHeader, 0, sizeof(errorHeader));
+    errorHeader.msgType = MSG_ERROR;
+    errorHeader.payloadLength = reason.length();
+    errorHeader.messageId = messageId;
+    errorHeader.timestamp = 0;
+    std::strcpy(errorHeader.sender, "SERVER");
 
-    int recvd = 0;
-    while (recvd < totalBytes)
-    {
-        int n = recv(sock, buffer + recvd, totalBytes - recvd, 0);
-        if (n <= 0)
-            return false;
-        recvd += n;
-    }
-    return true;
+    egress.enqueue(errorHeader, reason.c_str(), reason.length());
 }
 
-// Send all bytes reliably
-bool sendAllBytes(SOCKET sock, const char *buffer, int totalBytes)
+// Send ACK packet to client
+// version = PROTOCOL_VERSION_2 accepts a client's v2 request (see protocol_v2.h)
+void sendAckPacket(EgressQueue &egress, uint32_t messageId, const std::string &topic = "",
+                   uint8_t version = 0, uint8_t flags = 0)
 {
-    if (!buffer || totalBytes <= 0)
-        return false;
-
-    int sent = 0;
-    while (sent < totalBytes)
+    PacketHeader ackHeader;
+    std::memset(&ackHeader, 0, sizeof(ackHeader));
+    ackHeader.msgType = MSG_ACK;
+    ackHeader.payloadLength = 0;
+    ackHeader.messageId = messageId;
+    ackHeader.timestamp = 0;
+    ackHeader.version = version;
+    ackHeader.flags = flags;
+    std::strcpy(ackHeader.sender, "SERVER");
+    if (!topic.empty())
     {
-        int n = send(sock, buffer + sent, totalBytes - sent, 0);
-        if (n <= 0)
-            return false;
-        sent += n;
+        std::strncpy(ackHeader.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
     }
-    return true;
+
+    egress.enqueue(ackHeader, SharedPayload());
 }
 
-// Send error packet to client
-void sendErrorPacket(SOCKET sock, uint32_t messageId, const std::string &reason)
+// Refuse a connection over the cap: one v1 MSG_ERROR written directly, then close
+// (a fresh socket has room for it, so this never waits on the peer)
+void rejectConnection(SOCKET sock, const TlsSessionRef &tls, const std::string &tag)
 {
+    const std::string reason = "Server full";
     PacketHeader errorHeader;
     std::memset(&errorHeader, 0, sizeof(errorHeader));
     errorHeader.msgType = MSG_ERROR;
     errorHeader.payloadLength = reason.length();
-    errorHeader.messageId = messageId;
-    errorHeader.timestamp = 0;
     std::strcpy(errorHeader.sender, "SERVER");
 
-    sendAllBytes(sock, (const char *)&errorHeader, sizeof(PacketHeader));
-    if (reason.length() > 0)
+    std::string packet((const char *)&errorHeader, sizeof(errorHeader));
+    packet += reason;
+    if (tls && !tls->kernelSend())
+        tls->sendAll(packet.data(), packet.size());
+    else
+        send(sock, packet.data(), (int)packet.size(), 0);
+
+    logMessage(tag + " Connection rejected: server full (" + std::to_string(g_admission.rejectedCount()) +
+               " rejected so far)");
+    if (tls)
     {
-        sendAllBytes(sock, reason.c_str(), reason.length());
+        tls->shutdown();
     }
+    CLOSE_SOCKET(sock);
 }
 
-// Send ACK packet to client
-void sendAckPacket(SOCKET sock, uint32_t messageId, const std::string &topic = "")
+// Answer a peer's MSG_PING
+void sendPongPacket(EgressQueue &egress, uint32_t messageId)
+{
+    PacketHeader pongHeader;
+    std::memset(&pongHeader, 0, sizeof(pongHeader));
+    pongHeader.msgType = MSG_PONG;
+    pongHeader.messageId = messageId;
+    std::strcpy(pongHeader.sender, "SERVER");
+
+    egress.enqueue(pongHeader, SharedPayload());
+}
+
+// Send the client to the node that owns request's topic (see cluster.h)
+void sendRedirectPacket(EgressQueue &egress, const PacketHeader &request, const std::string &address)
+{
+    PacketHeader redirectHeader;
+    std::memset(&redirectHeader, 0, sizeof(redirectHeader));
+    redirectHeader.msgType = MSG_REDIRECT;
+    redirectHeader.messageId = request.messageId;
+    redirectHeader.payloadLength = address.size();
+    std::strcpy(redirectHeader.sender, "SERVER");
+    std::memcpy(redirectHeader.topic, request.topic, strnlen(request.topic, MAX_TOPIC_LEN - 1));
+
+    egress.enqueue(redirectHeader, address.c_str(), (int)address.size());
+}
+
+// Answer a MSG_QUERY with one page of names (see presence.h)
+void sendQueryResult(EgressQueue &egress, const PacketHeader &request, uint32_t total, bool more,
+                     const std::vector<std::string> &names)
+{
+    std::vector<char> payload = encodeQueryResult(total, more, names);
+    PacketHeader resultHeader;
+    std::memset(&resultHeader, 0, sizeof(resultHeader));
+    resultHeader.msgType = MSG_QUERY_RESULT;
+    resultHeader.messageId = request.messageId;
+    resultHeader.payloadLength = payload.size();
+    resultHeader.flags = request.flags & FLAG_WATCH;
+    std::strcpy(resultHeader.sender, "SERVER");
+    std::memcpy(resultHeader.topic, request.topic, strnlen(request.topic, MAX_TOPIC_LEN - 1));
+
+    egress.enqueue(resultHeader, payload.data(), (int)payload.size());
+}
+
+// Reply to MSG_LOGIN / MSG_STREAM_ATTACH accepting what the client asked for
+// (v2 headers, checksums); the ACK is the last packet in the old format
+// codecs: compression codecs granted to a login that sent FLAG_COMPRESSED, else null
+// resumeToken: token of a resumable login (FLAG_RESUME), else null
+void sendNegotiationAck(EgressQueue &egress, const PacketHeader &request, uint8_t &wireVersion,
+                        bool &checksumEnabled, const uint8_t *codecs = nullptr, const uint64_t *resumeToken = nullptr)
 {
+    uint8_t version = 0;
+    if (request.version >= PROTOCOL_VERSION_2 && wireVersion < PROTOCOL_VERSION_2)
+    {
+        version = PROTOCOL_VERSION_2;
+    }
+    bool enableChecksum = (request.flags & FLAG_CHECKSUM) && !checksumEnabled;
+
     PacketHeader ackHeader;
     std::memset(&ackHeader, 0, sizeof(ackHeader));
     ackHeader.msgType = MSG_ACK;
-    ackHeader.payloadLength = 0;
-    ackHeader.messageId = messageId;
-    ackHeader.timestamp = 0;
+    ackHeader.messageId = request.messageId;
+    ackHeader.version = version;
+    ackHeader.flags = (enableChecksum || checksumEnabled) ? FLAG_CHECKSUM : 0;
+    if (request.msgType == MSG_LOGIN)
+        ackHeader.flags |= request.flags & FLAG_DEDUP; // Retried publishes are dropped (dedup.h)
     std::strcpy(ackHeader.sender, "SERVER");
-    if (!topic.empty())
+    std::string payload;
+    if (codecs)
     {
-        std::strncpy(ackHeader.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+        ackHeader.flags |= FLAG_COMPRESSED;
+        payload.push_back((char)*codecs);
+    }
+    if (resumeToken)
+    {
+        ackHeader.flags |= FLAG_RESUME;
+        payload.append((const char *)resumeToken, sizeof(uint64_t));
+    }
+    ackHeader.payloadLength = payload.size();
+    egress.enqueue(ackHeader, payload.data(), (int)payload.size());
+    if (version)
+    {
+        egress.setWireVersion(version);
+        wireVersion = version;
+    }
+    if (enableChecksum)
+    {
+        egress.setChecksum(true);
+        checksumEnabled = true;
+    }
+}
+
+// ===== OPTIMIZATION: Payload integrity =====
+// Purpose: With FLAG_CHECKSUM negotiated the payload's CRC32C is checked on receipt
+// and forwarded untouched, so subscribers verify the publisher's own checksum.
+// Returns false on mismatch. Unverified checksums are cleared, never relayed.
+bool verifyChecksum(PacketHeader &header, const char *payload, bool checksumEnabled)
+{
+    if (!checksumEnabled)
+    {
+        header.checksum = 0;
+        return true;
+    }
+    if (header.payloadLength == 0)
+    {
+        return true;
     }
+    return crc32c(payload, header.payloadLength) == header.checksum;
+}
+
+// Publish window for the next ACK, shrinking linearly from PUBLISH_WINDOW_MAX at
+// the low watermark to 1 at the high watermark of aggregate egress occupancy
+uint32_t computePublishWindow()
+{
+    size_t queued = EgressAccounting::instance().queued();
+    if (queued <= EGRESS_LOW_WATER)
+        return PUBLISH_WINDOW_MAX;
+    if (queued >= EGRESS_HIGH_WATER)
+        return 1;
+
+    size_t headroom = EGRESS_HIGH_WATER - queued;
+    return 1 + (uint32_t)((PUBLISH_WINDOW_MAX - 1) * headroom / (EGRESS_HIGH_WATER - EGRESS_LOW_WATER));
+}
+
+// ACK a publish and advertise the publisher's new window
+void sendPublishAckPacket(EgressQueue &egress, uint32_t messageId, const std::string &topic)
+{
+    uint32_t window = computePublishWindow();
+
+    PacketHeader ackHeader;
+    std::memset(&ackHeader, 0, sizeof(ackHeader));
+    ackHeader.msgType = MSG_ACK;
+    ackHeader.payloadLength = sizeof(window);
+    ackHeader.messageId = messageId;
+    ackHeader.flags = FLAG_CREDIT;
+    std::strcpy(ackHeader.sender, "SERVER");
+    std::strncpy(ackHeader.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+
+    egress.enqueue(ackHeader, (const char *)&window, sizeof(window));
+}
+
+// Split a MSG_PUBLISH_BATCH payload into records (payloads point into data)
+// Returns false on truncated records or invalid topics
+bool parseBatchRecords(const char *data, uint32_t length, std::vector<BatchRecord> &records)
+{
+    uint32_t offset = 0;
+    while (offset < length)
+    {
+        uint8_t topicLength = (uint8_t)data[offset++];
+        if (topicLength == 0 || topicLength >= MAX_TOPIC_LEN || length - offset < topicLength + sizeof(uint32_t))
+            return false;
+
+        BatchRecord record;
+        record.topic.assign(data + offset, topicLength);
+        offset += topicLength;
+
+        std::memcpy(&record.payloadLength, data + offset, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        if (record.payloadLength > length - offset)
+            return false;
 
-    sendAllBytes(sock, (const char *)&ackHeader, sizeof(PacketHeader));
+        record.payload = data + offset;
+        offset += record.payloadLength;
+        records.push_back(record);
+    }
+    return !records.empty();
 }
 
 // Forward declaration
-void handleClient(int clientId, SOCKET clientSocket);
-void handleStreamClient(int clientId, SOCKET streamSocket);
+SessionTask handleClient(int clientId, SOCKET clientSocket, std::shared_ptr<SessionSnapshot> resumed);
+SessionTask handleStreamClient(int clientId, SOCKET streamSocket);
+
+// Stream sessions of one publishing connection, or of the streams one cluster node
+// relays here (their ids are only unique per connection / per sender)
+struct StreamPublisher
+{
+    int node;                              // Relaying cluster node, -1 for a connection here
+    int connection;                        // Unique per connection here, -1 for a node
+    std::set<StreamSessionKey> owned;      // Sessions started and not stopped yet
+    std::set<uint32_t> redirectedSessions; // Sessions sent to the topic's owner node
+
+    // A connection here publishing streams
+    StreamPublisher() : node(-1), connection(nextConnection()) {}
+    // The streams relayed by a cluster node
+    explicit StreamPublisher(int relayingNode) : node(relayingNode), connection(-1) {}
+
+    StreamSessionKey keyOf(const PacketHeader &header) const
+    {
+        // A relayed stream's publisher is not a connection here: its name tells them apart
+        std::string publisher = node < 0 ? std::string() : std::string(header.sender, strnlen(header.sender, MAX_USERNAME_LEN));
+        return StreamSessionKey{node, connection, publisher, header.messageId};
+    }
+
+    static int nextConnection()
+    {
+        static std::atomic<int> counter(0);
+        return counter++;
+    }
+};
+
+// Relay a stream packet (START/FRAME/STOP) through its stream session
+// messageId carries the session id chosen by the publisher
+void relayStreamPacket(const PacketHeader &header, const char *payload, StreamPublisher &publisher)
+{
+    if (strlen(header.topic) == 0)
+        return;
+
+    uint32_t sessionId = header.messageId;
+    StreamSessionKey sessionKey = publisher.keyOf(header);
+
+    if (header.msgType == MSG_STREAM_START)
+    {
+        int listenerCount = g_broker.registerStreamSession(sessionKey, header.sender, header.topic);
+        publisher.owned.insert(sessionKey);
+        logMessage("[STREAM] Stream start from " + std::string(header.sender) + " on topic " + std::string(header.topic) +
+                   " (session " + std::to_string(sessionId) + ", " + std::to_string(listenerCount) + " listeners)");
+        g_broker.relayStreamFrame(sessionKey, header, payload, header.payloadLength);
+    }
+    else if (header.msgType == MSG_STREAM_FRAME)
+    {
+        // Publisher skipped STREAM_START (or reconnected mid-stream) - open the session lazily
+        if (g_broker.relayStreamFrame(sessionKey, header, payload, header.payloadLength) < 0)
+        {
+            g_broker.registerStreamSession(sessionKey, header.sender, header.topic);
+            publisher.owned.insert(sessionKey);
+            g_broker.relayStreamFrame(sessionKey, header, payload, header.payloadLength);
+        }
+    }
+    else if (header.msgType == MSG_STREAM_STOP)
+    {
+        logMessage("[STREAM] Stream stop from " + std::string(header.sender) + " on topic " + std::string(header.topic));
+        g_broker.relayStreamFrame(sessionKey, header, payload, header.payloadLength);
+        g_broker.unregisterStreamSession(sessionKey);
+        publisher.owned.erase(sessionKey);
+    }
+}
+
+// Drop sessions a disconnected publisher never stopped
+void releaseStreamSessions(StreamPublisher &publisher)
+{
+    for (auto const &sessionKey : publisher.owned)
+    {
+        g_broker.unregisterStreamSession(sessionKey);
+    }
+    publisher.owned.clear();
+}
+
+// A stream packet from a publisher connected here: relayed if this node owns the
+// topic (and forwarded to the nodes with listeners), otherwise the publisher is
+// redirected to the owner once per session and the rest of the session dropped
+void publishStreamPacket(const PacketHeader &header, const char *payload, EgressQueue &egress,
+                         StreamPublisher &publisher)
+{
+    uint32_t sessionId = header.messageId;
+    std::string owner;
+    if (g_cluster.redirectFor(header.topic, owner))
+    {
+        if (header.msgType == MSG_STREAM_STOP)
+        {
+            publisher.redirectedSessions.erase(sessionId);
+        }
+        else if (publisher.redirectedSessions.insert(sessionId).second)
+        {
+            if (publisher.owned.erase(publisher.keyOf(header)))
+            {
+                // The topic moved to another node mid-stream (rebalanced)
+                g_broker.unregisterStreamSession(publisher.keyOf(header));
+            }
+            sendRedirectPacket(egress, header, owner);
+            logMessage("[STREAM] Stream " + std::to_string(sessionId) + " on topic " + std::string(header.topic) +
+                       " redirected to " + owner);
+        }
+        return;
+    }
+
+    publisher.redirectedSessions.erase(sessionId);
+    relayStreamPacket(header, payload, publisher);
+    g_cluster.forward(header, payload, header.payloadLength, {header.topic});
+}
+
+// Stream sessions relayed here by other nodes (the topic's owner), per node
+std::mutex g_clusterStreamsMutex;
+std::map<int, StreamPublisher> g_clusterStreams;
+
+// A client just subscribed (after its ACK): a last-value topic's current values follow,
+// from the topic's owner when another node owns it
+void sendLastValues(int clientId, const char *topic)
+{
+    if (!g_cluster.requestLastValues(clientId, topic))
+        g_broker.sendLastValues(clientId, topic);
+}
+
+// True when connections start with a TLS handshake (--tls)
+bool tlsEnabled()
+{
+#ifdef USE_TLS
+    return g_tlsContext != nullptr;
+#else
+    return false;
+#endif
+}
+
+// TLS handshake for a new connection when the server runs with --tls
+// Returns false if the handshake failed (the caller closes the socket)
+bool startTls(SOCKET sock, TlsSessionRef &session, const std::string &tag)
+{
+#ifdef USE_TLS
+    if (g_tlsContext)
+    {
+        session = TlsSession::accept(g_tlsContext, sock);
+        if (!session)
+        {
+            logMessage(tag + " TLS handshake failed");
+            return false;
+        }
+        logMessage(tag + " TLS established (" + session->describe() + ")");
+    }
+#else
+    (void)sock;
+    (void)session;
+    (void)tag;
+#endif
+    return true;
+}
 
 // Stream handler function - handles audio frames
-void handleStreamClient(int clientId, SOCKET streamSocket)
+SessionTask handleStreamClient(int clientId, SOCKET streamSocket)
 {
     logMessage("[STREAM] Client handler started for ID=" + std::to_string(clientId));
 
+    TlsSessionRef tls;
+    if (!startTls(streamSocket, tls, "[STREAM]"))
+    {
+        CLOSE_SOCKET(streamSocket);
+        co_return;
+    }
+    AdmissionSlot admission(g_admission);
+    if (!admission)
+    {
+        rejectConnection(streamSocket, tls, "[STREAM]");
+        co_return;
+    }
+
     char headerBuffer[sizeof(PacketHeader)];
+    StreamPublisher streamSessions;       // Stream sessions of this connection
+    SessionIo io(streamSocket, tls, g_uring);
+    auto streamEgress = std::make_shared<EgressQueue>(streamSocket, tls, g_uring);
+    ConnectionLiveness liveness(streamSocket, streamEgress);
+    g_timerWheel.schedule(&liveness, SOCKET_TIMEOUT_MS);
+    ConnectionRateLimit rateLimit(g_rateLimiter);
+    RegisteredSession registered(g_sessions, streamSocket, nullptr); // Not handed over: clients reattach
+    CompactDecoder decoder;
+    uint8_t wireVersion = PROTOCOL_VERSION_1; // Switched to v2 by MSG_STREAM_ATTACH
+    bool checksumEnabled = false;             // FLAG_CHECKSUM negotiated by MSG_STREAM_ATTACH
+    int chatClientId = -1;             // Chat session this stream connection is attached to
+    char attachedUsername[MAX_USERNAME_LEN] = {0};
 
     while (true)
     {
         // Receive packet header
-        if (!recvAllBytes(streamSocket, headerBuffer, sizeof(PacketHeader)))
+        if (!co_await io.readHeader(wireVersion, decoder, *(PacketHeader *)headerBuffer))
         {
             logMessage("[STREAM] Connection closed for client " + std::to_string(clientId));
             break;
         }
+        liveness.touch();
 
         PacketHeader *header = (PacketHeader *)headerBuffer;
 
@@ -144,56 +528,232 @@ void handleStreamClient(int clientId, SOCKET streamSocket)
                 break;
             }
 
-            if (!recvAllBytes(streamSocket, payloadBuffer, header->payloadLength))
+            if (!co_await io.readExact(payloadBuffer, header->payloadLength))
             {
                 logMessage("[STREAM] Error reading frame data");
                 break;
             }
         }
 
-        // Relay stream messages to all subscribers of the topic
-        if (strlen(header->topic) > 0)
+        if (!verifyChecksum(*header, payloadBuffer, checksumEnabled))
+        {
+            logMessage("[STREAM] Checksum mismatch, frame dropped");
+            continue;
+        }
+
+        // Over the limit: frames are dropped quietly, anything else is refused
+        if (!rateLimit.allow(header->msgType, header->payloadLength))
+        {
+            if (header->msgType != MSG_STREAM_FRAME)
+                sendErrorPacket(*streamEgress, header->messageId, "Rate limit exceeded");
+            continue;
+        }
+
+        if (header->msgType == MSG_PING)
+        {
+            sendPongPacket(*streamEgress, header->messageId);
+            continue;
+        }
+        if (header->msgType == MSG_PONG)
+            continue;
+
+        // Handshake: bind this connection to the sender's chat session so media
+        // addressed to that user is delivered here instead of on port 8080
+        if (header->msgType == MSG_STREAM_ATTACH)
         {
-            if (header->msgType == MSG_STREAM_START)
+            int attachedId = g_broker.attachStreamSocket(header->sender, streamEgress);
+            if (attachedId < 0)
             {
-                logMessage("[STREAM] Stream start from " + std::string(header->sender) + " on topic " + std::string(header->topic));
-                g_broker.publishToTopic(header->topic, *header, payloadBuffer, header->payloadLength);
+                sendErrorPacket(*streamEgress, header->messageId, "Not logged in");
+                continue;
             }
-            else if (header->msgType == MSG_STREAM_FRAME)
+
+            if (chatClientId >= 0 && chatClientId != attachedId)
             {
-                int sentCount = g_broker.publishToTopic(header->topic, *header, payloadBuffer, header->payloadLength);
-                // Suppress log spam for frame relay (commented out)
-                // logMessage("[STREAM] Relayed frame to " + std::to_string(sentCount) + " subscribers");
+                g_broker.detachStreamSocket(chatClientId, streamEgress);
             }
-            else if (header->msgType == MSG_STREAM_STOP)
+            chatClientId = attachedId;
+            size_t usernameLength = strnlen(header->sender, MAX_USERNAME_LEN - 1);
+            std::memcpy(attachedUsername, header->sender, usernameLength);
+            attachedUsername[usernameLength] = '\0';
+            rateLimit.bindUser(attachedUsername);
+            logMessage("[STREAM] Stream client " + std::to_string(clientId) + " attached to chat client " +
+                       std::to_string(chatClientId) + " (" + std::string(attachedUsername) + ")");
+            sendNegotiationAck(*streamEgress, *header, wireVersion, checksumEnabled);
+            continue;
+        }
+
+        // Relay stream messages to the session's listeners
+        if (header->msgType == MSG_STREAM_START || header->msgType == MSG_STREAM_FRAME ||
+            header->msgType == MSG_STREAM_STOP)
+        {
+            // An attached connection can only publish as its own user
+            if (chatClientId >= 0)
             {
-                logMessage("[STREAM] Stream stop from " + std::string(header->sender) + " on topic " + std::string(header->topic));
-                g_broker.publishToTopic(header->topic, *header, payloadBuffer, header->payloadLength);
+                std::strncpy(header->sender, attachedUsername, MAX_USERNAME_LEN);
             }
+            publishStreamPacket(*header, payloadBuffer, *streamEgress, streamSessions);
         }
     }
 
+    releaseStreamSessions(streamSessions);
+    if (chatClientId >= 0)
+    {
+        g_broker.detachStreamSocket(chatClientId, streamEgress);
+    }
+    co_await io.drain(*streamEgress);
+    co_await io.detach();
+    g_timerWheel.cancel(&liveness);
+    if (liveness.evicted())
+    {
+        logMessage("[STREAM] Client " + std::to_string(clientId) + " evicted (" + liveness.evicted() + ")");
+    }
+    if (rateLimit.throttled() > 0)
+    {
+        logMessage("[STREAM] Client " + std::to_string(clientId) + " throttled " + std::to_string(rateLimit.throttled()) +
+                   " packets (" + std::to_string(g_rateLimiter.throttledTotal()) + " server-wide)");
+    }
+    if (tls)
+    {
+        tls->shutdown();
+    }
     CLOSE_SOCKET(streamSocket);
     logMessage("[STREAM] Client handler terminated for ID=" + std::to_string(clientId));
 }
 
+// ===== OPTIMIZATION: Alias -> interned topic =====
+// Purpose: A v2 publish naming its topic by alias is routed through the Topic the
+// alias was bound to on first use, skipping the topicSubscribers string lookup.
+// Returns null when the header carried no alias.
+static TopicRef resolveAliasTopic(std::vector<TopicRef> &aliasTopics, const V2AliasInfo &alias, const char *topic)
+{
+    if (alias.id == 0)
+        return TopicRef();
+    if (alias.id >= aliasTopics.size())
+        aliasTopics.resize(alias.id + 1);
+    if (!aliasTopics[alias.id])
+        aliasTopics[alias.id] = g_broker.internTopic(topic);
+    return aliasTopics[alias.id];
+}
+
 // Client handler function
-void handleClient(int clientId, SOCKET clientSocket)
+// resumed: session handed over by the previous process (hot restart), else null
+SessionTask handleClient(int clientId, SOCKET clientSocket, std::shared_ptr<SessionSnapshot> resumed)
 {
     logMessage("[CHAT] Client handler started for ID=" + std::to_string(clientId));
 
+    TlsSessionRef tls;
+    if (!resumed && !startTls(clientSocket, tls, "[CHAT]"))
+    {
+        CLOSE_SOCKET(clientSocket);
+        co_return;
+    }
+    AdmissionSlot admission(g_admission);
+    if (!admission)
+    {
+        rejectConnection(clientSocket, tls, "[CHAT]");
+        co_return;
+    }
+
     char headerBuffer[sizeof(PacketHeader)];
     bool clientLoggedIn = false;
     char clientUsername[MAX_USERNAME_LEN] = {0};
+    StreamPublisher streamSessions;       // Stream sessions of this connection
+    SessionIo io(clientSocket, tls, g_uring);
+    auto egress = std::make_shared<EgressQueue>(clientSocket, tls, g_uring); // Outbound packets to this client
+    ConnectionLiveness liveness(clientSocket, egress);                       // Heartbeat and dead-peer eviction
+    g_timerWheel.schedule(&liveness, SOCKET_TIMEOUT_MS);
+    ConnectionRateLimit rateLimit(g_rateLimiter);
+    std::vector<char> batchBuffer;                             // Reused for MSG_PUBLISH_BATCH payloads
+    CompactDecoder decoder;
+    uint8_t wireVersion = PROTOCOL_VERSION_1; // Switched to v2 by a v2 MSG_LOGIN
+    bool checksumEnabled = false;             // FLAG_CHECKSUM negotiated by MSG_LOGIN
+    uint8_t clientCodecs = 0;                 // Compression codecs negotiated by MSG_LOGIN
+    V2AliasInfo alias;                        // Topic alias of the current header (v2)
+    std::vector<TopicRef> aliasTopics;        // Alias id -> interned topic, bound lazily
+    RegisteredSession registered(g_sessions, clientSocket, io.suspends() ? &io : nullptr);
+    bool handingOff = false;                  // Leaving for the successor process
+    bool clusterClaimed = false;              // clientUsername is claimed cluster-wide
+    uint64_t resumeToken = 0;                 // Resumable login: the session parks when the connection drops
+    bool dedupEnabled = false;                // FLAG_DEDUP negotiated by MSG_LOGIN
+    DuplicateWindow publishIds;               // Publish ids delivered, with dedupEnabled
+
+    // Hot restart: carry on exactly where the previous process stopped
+    // (aliases re-bind to topics lazily from the decoder's alias table)
+    if (resumed)
+    {
+        StateReader decoderState(resumed->decoderState);
+        StateReader encoderState(resumed->encoderState);
+        decoder.loadState(decoderState); // Validated by SessionSnapshot::decode
+        egress->loadEncoder(encoderState);
+        wireVersion = resumed->wireVersion;
+        checksumEnabled = resumed->checksumEnabled;
+        clientCodecs = resumed->codecs;
+        resumeToken = resumed->resumeToken;
+        if (!resumed->publishIds.empty())
+        {
+            StateReader idState(resumed->publishIds);
+            dedupEnabled = publishIds.loadState(idState);
+        }
+        egress->setWireVersion(wireVersion);
+        egress->setChecksum(checksumEnabled);
+        io.preload(resumed->pendingBytes);
+        if (resumed->loggedIn)
+        {
+            clientId = g_broker.registerClient(clientSocket, resumed->username.c_str(), egress, clientCodecs);
+            clientLoggedIn = true;
+            std::strncpy(clientUsername, resumed->username.c_str(), MAX_USERNAME_LEN - 1);
+            rateLimit.bindUser(clientUsername);
+            clusterClaimed = g_cluster.enabled(); // Re-asserted when the links come up
+            for (auto const &topic : resumed->topics)
+            {
+                g_broker.subscribeToTopic(clientId, topic.c_str());
+            }
+            for (auto const &filter : resumed->filters)
+            {
+                std::string error;
+                TopicFilterRef compiled = TopicFilter::compile(filter.second, error);
+                if (compiled)
+                    g_broker.subscribeWithFilter(clientId, filter.first.c_str(), compiled);
+            }
+            for (auto const &group : resumed->groups)
+            {
+                g_broker.joinGroup(clientId, group.first.c_str(), group.second);
+            }
+            for (auto const &scope : resumed->watches)
+            {
+                uint32_t total;
+                bool more;
+                g_broker.queryMembers(clientId, scope, std::string(), 0, true, total, more); // Watch again, no page
+            }
+            g_broker.restoreDictionariesSent(clientId, resumed->dictionaries);
+        }
+        logMessage("[CHAT] Client " + std::to_string(clientId) + " resumed from the previous process (" +
+                   (clientLoggedIn ? std::string(clientUsername) : std::string("not logged in")) + ", " +
+                   std::to_string(resumed->topics.size()) + " subscriptions)");
+        resumed.reset();
+    }
 
     while (true)
     {
         // Receive packet header
-        if (!recvAllBytes(clientSocket, headerBuffer, sizeof(PacketHeader)))
+        if (!co_await io.readHeader(wireVersion, decoder, *(PacketHeader *)headerBuffer, &alias))
         {
+            if (io.handoffRequested())
+            {
+                handingOff = true;
+                break;
+            }
             logMessage("[CHAT] Connection closed or error reading header for client " + std::to_string(clientId));
             break;
         }
+        liveness.touch();
+
+        // A (re)defined alias drops whatever topic it was bound to
+        if (alias.defined && alias.id < aliasTopics.size())
+        {
+            aliasTopics[alias.id].reset();
+        }
 
         PacketHeader *header = (PacketHeader *)headerBuffer;
 
@@ -201,27 +761,51 @@ void handleClient(int clientId, SOCKET clientSocket)
         if (header->payloadLength > MAX_MESSAGE_SIZE)
         {
             logMessage("[CHAT] Invalid payload size: " + std::to_string(header->payloadLength));
-            sendErrorPacket(clientSocket, header->messageId, "Payload too large");
+            sendErrorPacket(*egress, header->messageId, "Payload too large");
             break;
         }
 
-        // Receive payload if present
-        char payloadBuffer[MAX_BUFFER_SIZE] = {0};
+        // Receive payload if present (batches may exceed the regular buffer)
+        char smallPayload[MAX_BUFFER_SIZE] = {0};
+        char *payloadBuffer = smallPayload;
         if (header->payloadLength > 0)
         {
-            if (header->payloadLength > MAX_BUFFER_SIZE)
+            uint32_t payloadLimit = header->msgType == MSG_PUBLISH_BATCH ? MAX_BATCH_SIZE : MAX_BUFFER_SIZE;
+            if (header->payloadLength > payloadLimit)
             {
-                sendErrorPacket(clientSocket, header->messageId, "Payload exceeds buffer size");
+                sendErrorPacket(*egress, header->messageId, "Payload exceeds buffer size");
                 break;
             }
 
-            if (!recvAllBytes(clientSocket, payloadBuffer, header->payloadLength))
+            if (header->payloadLength > MAX_BUFFER_SIZE)
+            {
+                batchBuffer.resize(header->payloadLength);
+                payloadBuffer = batchBuffer.data();
+            }
+
+            if (!co_await io.readExact(payloadBuffer, header->payloadLength))
             {
                 logMessage("[CHAT] Error reading payload for client " + std::to_string(clientId));
                 break;
             }
         }
 
+        if (!verifyChecksum(*header, payloadBuffer, checksumEnabled))
+        {
+            logMessage("[CHAT] Checksum mismatch from client " + std::to_string(clientId));
+            sendErrorPacket(*egress, header->messageId, "Checksum mismatch");
+            continue;
+        }
+
+        // Over the limit: refused (the publisher's window treats it like any error),
+        // relayed stream frames are dropped quietly
+        if (!rateLimit.allow(header->msgType, header->payloadLength))
+        {
+            if (header->msgType != MSG_STREAM_FRAME)
+                sendErrorPacket(*egress, header->messageId, "Rate limit exceeded");
+            continue;
+        }
+
         // Handle different message types
         switch (header->msgType)
         {
@@ -230,27 +814,122 @@ void handleClient(int clientId, SOCKET clientSocket)
             // Validate username
             if (strlen(header->sender) == 0 || strlen(header->sender) >= MAX_USERNAME_LEN)
             {
-                sendErrorPacket(clientSocket, header->messageId, "Invalid username");
+                sendErrorPacket(*egress, header->messageId, "Invalid username");
+                break;
+            }
+
+            // Compression: the client lists the codecs it decodes, we keep those we have too
+            bool codecsRequested = (header->flags & FLAG_COMPRESSED) && header->payloadLength >= 1;
+            uint8_t requestedCodecs = codecsRequested ? ((uint8_t)payloadBuffer[0] & localCodecMask()) : 0;
+
+            // Resumable session: the payload ends with the token of the session to resume
+            bool resumable = (header->flags & FLAG_RESUME) &&
+                             header->payloadLength >= (codecsRequested ? 1 : 0) + sizeof(uint64_t);
+            uint64_t presentedToken = 0;
+            if (resumable)
+                std::memcpy(&presentedToken, payloadBuffer + header->payloadLength - sizeof(uint64_t), sizeof(uint64_t));
+
+            ParkedSessionRef parked;
+            if (presentedToken && !clientLoggedIn)
+            {
+                parked = g_parking.take(presentedToken, header->sender);
+                if (parked && parked->codecs != requestedCodecs)
+                {
+                    g_parking.end(parked); // Its buffer was encoded for other codecs
+                    parked.reset();
+                }
+            }
+            if (parked)
+            {
+                // Same broker client, subscriptions untouched: swap the buffer for this connection
+                clientId = parked->clientId;
+                clientCodecs = requestedCodecs;
+                clientLoggedIn = true;
+                size_t usernameLength = strnlen(header->sender, MAX_USERNAME_LEN - 1);
+                std::memcpy(clientUsername, header->sender, usernameLength);
+                clientUsername[usernameLength] = '\0';
+                rateLimit.bindUser(clientUsername);
+                clusterClaimed = parked->clusterClaimed;
+                resumeToken = parked->token;
+                dedupEnabled = (header->flags & FLAG_DEDUP) != 0;
+                publishIds = parked->publishIds; // A retry of a publish delivered before the drop stays a retry
+
+                sendNegotiationAck(*egress, *header, wireVersion, checksumEnabled,
+                                   codecsRequested ? &clientCodecs : nullptr, &resumeToken);
+                g_broker.swapEgress(clientId, egress);
+                size_t replayed = SessionParking::transfer(*parked->buffer, *egress);
+                logMessage("[CHAT] Client " + std::to_string(clientId) + " resumed the session of " +
+                           std::string(clientUsername) + ", " + std::to_string(replayed) + " buffered packets");
                 break;
             }
 
+            // Not resuming: the name's parked session (its token lost) gives way
+            if (!clientLoggedIn || std::strcmp(clientUsername, header->sender) != 0)
+                g_parking.endUser(header->sender);
+
             // Check if username is already taken
             if (g_broker.isUsernameTaken(header->sender))
             {
-                sendErrorPacket(clientSocket, header->messageId, "Username already taken");
+                sendErrorPacket(*egress, header->messageId, "Username already taken");
                 break;
             }
 
-            // Register client
-            g_broker.registerClient(clientSocket, header->sender);
+            // Cluster: the name's owner node decides (another node may have it logged in)
+            if (g_cluster.enabled())
+            {
+                int claim = co_await io.wait(g_cluster.claimUsername(header->sender));
+                if (claim != CLAIM_GRANTED)
+                {
+                    sendErrorPacket(*egress, header->messageId,
+                                    claim == CLAIM_TAKEN ? "Username already taken" : "Cluster unavailable");
+                    break;
+                }
+                if (clusterClaimed)
+                    g_cluster.releaseUsername(clientUsername); // Logged in again under another name
+                clusterClaimed = true;
+            }
+
+            clientCodecs = requestedCodecs;
+            resumeToken = resumable ? g_parking.issueToken() : 0;
+            dedupEnabled = (header->flags & FLAG_DEDUP) != 0;
+            publishIds.reset();
+
+            // Register client - broker id is used for every subscription below
+            clientId = g_broker.registerClient(clientSocket, header->sender, egress, clientCodecs);
             clientLoggedIn = true;
             std::strncpy(clientUsername, header->sender, MAX_USERNAME_LEN - 1);
+            rateLimit.bindUser(clientUsername);
 
             // Auto-subscribe to personal topic
             g_broker.subscribeToTopic(clientId, header->sender);
+            g_replication.subscribed(clientUsername, clientUsername);
+
+            // Failover: the subscriptions this user had on the leader we replaced
+            std::vector<std::string> restoredTopics;
+            std::vector<const ReplicatedMessage *> replay;
+            bool restored = g_replica.takeSession(clientUsername, restoredTopics, replay);
+            for (auto const &topic : restoredTopics)
+            {
+                g_broker.subscribeToTopic(clientId, topic.c_str());
+                g_replication.subscribed(clientUsername, topic);
+            }
 
             logMessage("[CHAT] Client " + std::to_string(clientId) + " logged in as: " + std::string(header->sender));
-            sendAckPacket(clientSocket, header->messageId);
+
+            sendNegotiationAck(*egress, *header, wireVersion, checksumEnabled,
+                               codecsRequested ? &clientCodecs : nullptr, resumable ? &resumeToken : nullptr);
+            if (restored)
+            {
+                // After the ACK: messages possibly still in flight when the leader died
+                for (auto const *message : replay)
+                {
+                    egress->enqueue(message->header, message->payload.data(), (int)message->payload.size());
+                }
+                logMessage("[CHAT] Client " + std::string(clientUsername) + " restored from the replica: " +
+                           std::to_string(restoredTopics.size()) + " subscriptions, " +
+                           std::to_string(replay.size()) + " messages replayed");
+            }
+            g_broker.deliverOffline(clientId); // Direct messages sent while the user was away
             break;
         }
 
@@ -258,19 +937,57 @@ void handleClient(int clientId, SOCKET clientSocket)
         {
             if (!clientLoggedIn)
             {
-                sendErrorPacket(clientSocket, header->messageId, "Not logged in");
+                sendErrorPacket(*egress, header->messageId, "Not logged in");
                 break;
             }
 
             if (strlen(header->topic) == 0)
             {
-                sendErrorPacket(clientSocket, header->messageId, "Empty topic");
+                sendErrorPacket(*egress, header->messageId, "Empty topic");
+                break;
+            }
+
+            // A filter in the payload: only matching messages are delivered
+            if (header->flags & FLAG_FILTER)
+            {
+                std::string error;
+                TopicFilterRef filter =
+                    TopicFilter::compile(std::string(payloadBuffer, header->payloadLength), error);
+                if (!filter)
+                {
+                    sendErrorPacket(*egress, header->messageId, "Invalid filter: " + error);
+                    break;
+                }
+                g_broker.subscribeWithFilter(clientId, header->topic, filter);
+                g_replication.subscribed(clientUsername, header->topic); // The standby restores it unfiltered
+                logMessage("[CHAT] Client " + std::string(clientUsername) + " subscribed to: " +
+                           std::string(header->topic) + " where " + filter->canonical());
+                sendAckPacket(*egress, header->messageId, header->topic);
+                sendLastValues(clientId, header->topic);
+                break;
+            }
+
+            // A group name in the payload: join the topic's consumer group instead
+            if (header->payloadLength > 0)
+            {
+                if (header->payloadLength >= MAX_GROUP_NAME_LEN)
+                {
+                    sendErrorPacket(*egress, header->messageId, "Invalid group name");
+                    break;
+                }
+                std::string group(payloadBuffer, header->payloadLength);
+                g_broker.joinGroup(clientId, header->topic, group);
+                logMessage("[CHAT] Client " + std::string(clientUsername) + " joined group " + group + " on: " +
+                           std::string(header->topic));
+                sendAckPacket(*egress, header->messageId, header->topic);
                 break;
             }
 
             g_broker.subscribeToTopic(clientId, header->topic);
+            g_replication.subscribed(clientUsername, header->topic);
             logMessage("[CHAT] Client " + std::string(clientUsername) + " subscribed to: " + std::string(header->topic));
-            sendAckPacket(clientSocket, header->messageId, header->topic);
+            sendAckPacket(*egress, header->messageId, header->topic);
+            sendLastValues(clientId, header->topic);
             break;
         }
 
@@ -278,19 +995,34 @@ void handleClient(int clientId, SOCKET clientSocket)
         {
             if (!clientLoggedIn)
             {
-                sendErrorPacket(clientSocket, header->messageId, "Not logged in");
+                sendErrorPacket(*egress, header->messageId, "Not logged in");
                 break;
             }
 
             if (strlen(header->topic) == 0)
             {
-                sendErrorPacket(clientSocket, header->messageId, "Empty topic");
+                sendErrorPacket(*egress, header->messageId, "Empty topic");
+                break;
+            }
+
+            if (header->payloadLength > 0)
+            {
+                std::string group(payloadBuffer, header->payloadLength);
+                if (!g_broker.leaveGroup(clientId, header->topic, group))
+                {
+                    sendErrorPacket(*egress, header->messageId, "Not a member of that group");
+                    break;
+                }
+                logMessage("[CHAT] Client " + std::string(clientUsername) + " left group " + group + " on: " +
+                           std::string(header->topic));
+                sendAckPacket(*egress, header->messageId, header->topic);
                 break;
             }
 
             g_broker.unsubscribeFromTopic(clientId, header->topic);
+            g_replication.unsubscribed(clientUsername, header->topic);
             logMessage("[CHAT] Client " + std::string(clientUsername) + " unsubscribed from: " + std::string(header->topic));
-            sendAckPacket(clientSocket, header->messageId, header->topic);
+            sendAckPacket(*egress, header->messageId, header->topic);
             break;
         }
 
@@ -298,19 +1030,64 @@ void handleClient(int clientId, SOCKET clientSocket)
         {
             if (!clientLoggedIn)
             {
-                sendErrorPacket(clientSocket, header->messageId, "Not logged in");
+                sendErrorPacket(*egress, header->messageId, "Not logged in");
                 break;
             }
 
             if (strlen(header->topic) == 0)
             {
-                sendErrorPacket(clientSocket, header->messageId, "Empty topic");
+                sendErrorPacket(*egress, header->messageId, "Empty topic");
+                break;
+            }
+
+            if ((header->flags & FLAG_COMPRESSED) &&
+                !g_broker.validateCompressed(header->topic, payloadBuffer, header->payloadLength))
+            {
+                sendErrorPacket(*egress, header->messageId, "Unsupported compression");
+                break;
+            }
+
+            // Retry of a publish already delivered (FLAG_DEDUP): only acknowledged again
+            if (dedupEnabled && !publishIds.record(header->messageId))
+            {
+                logMessage("[CHAT] Duplicate publish " + std::to_string(header->messageId) + " from " +
+                           std::string(clientUsername) + " not delivered again");
+                sendPublishAckPacket(*egress, header->messageId, header->topic);
+                break;
+            }
+
+            // Publishers that ignore their window are stopped here until subscribers drain
+            co_await io.egressBelow(EGRESS_HIGH_WATER);
+
+            // Direct message: to the recipient's session, bypassing the topic (see direct_message.h)
+            if (header->flags & FLAG_DIRECT)
+            {
+                bool sent = g_broker.publishDirect(*header, payloadBuffer, header->payloadLength) > 0 ||
+                            g_cluster.forward(*header, payloadBuffer, header->payloadLength, {header->topic}) > 0;
+                if (!sent && !g_broker.storeDirect(*header, payloadBuffer, header->payloadLength))
+                {
+                    if (dedupEnabled)
+                        publishIds.forget(header->messageId); // Its retry may still get through
+                    sendErrorPacket(*egress, header->messageId, "Recipient inbox full");
+                    break;
+                }
+                logMessage("[CHAT] Direct message from " + std::string(clientUsername) + " to " +
+                           std::string(header->topic) + (sent ? "" : " kept until they log in"));
+                sendPublishAckPacket(*egress, header->messageId, header->topic);
                 break;
             }
 
-            int sentCount = g_broker.publishToTopic(header->topic, *header, payloadBuffer, header->payloadLength);
+            TopicRef topic = resolveAliasTopic(aliasTopics, alias, header->topic);
+            int sentCount = topic ? g_broker.publishToTopic(topic, *header, payloadBuffer, header->payloadLength)
+                                  : g_broker.publishToTopic(header->topic, *header, payloadBuffer, header->payloadLength);
+            sentCount += g_cluster.forward(*header, payloadBuffer, header->payloadLength, {header->topic});
+            g_replication.published(*header, payloadBuffer, header->payloadLength);
             logMessage("[CHAT] Published to " + std::to_string(sentCount) + " subscribers on topic: " + std::string(header->topic));
-            sendAckPacket(clientSocket, header->messageId, header->topic);
+            sendPublishAckPacket(*egress, header->messageId, header->topic);
+            if (clientCodecs)
+            {
+                g_broker.offerDictionary(clientId, header->topic);
+            }
             break;
         }
 
@@ -318,81 +1095,528 @@ void handleClient(int clientId, SOCKET clientSocket)
         {
             if (!clientLoggedIn)
             {
-                sendErrorPacket(clientSocket, header->messageId, "Not logged in");
+                sendErrorPacket(*egress, header->messageId, "Not logged in");
                 break;
             }
 
             if (strlen(header->topic) == 0)
             {
-                sendErrorPacket(clientSocket, header->messageId, "Empty topic");
+                sendErrorPacket(*egress, header->messageId, "Empty topic");
                 break;
             }
 
-            int sentCount = g_broker.publishToTopic(header->topic, *header, payloadBuffer, header->payloadLength);
+            if ((header->flags & FLAG_COMPRESSED) &&
+                !g_broker.validateCompressed(header->topic, payloadBuffer, header->payloadLength))
+            {
+                sendErrorPacket(*egress, header->messageId, "Unsupported compression");
+                break;
+            }
+
+            // Retry of a publish already delivered (FLAG_DEDUP): only acknowledged again
+            if (dedupEnabled && !publishIds.record(header->messageId))
+            {
+                logMessage("[CHAT] Duplicate publish " + std::to_string(header->messageId) + " from " +
+                           std::string(clientUsername) + " not delivered again");
+                sendPublishAckPacket(*egress, header->messageId, header->topic);
+                break;
+            }
+
+            // Publishers that ignore their window are stopped here until subscribers drain
+            co_await io.egressBelow(EGRESS_HIGH_WATER);
+
+            TopicRef topic = resolveAliasTopic(aliasTopics, alias, header->topic);
+            int sentCount = topic ? g_broker.publishToTopic(topic, *header, payloadBuffer, header->payloadLength)
+                                  : g_broker.publishToTopic(header->topic, *header, payloadBuffer, header->payloadLength);
+            sentCount += g_cluster.forward(*header, payloadBuffer, header->payloadLength, {header->topic});
+            g_replication.published(*header, payloadBuffer, header->payloadLength);
             logMessage("[CHAT] Published file to " + std::to_string(sentCount) + " subscribers");
-            sendAckPacket(clientSocket, header->messageId, header->topic);
+            sendPublishAckPacket(*egress, header->messageId, header->topic);
+            if (clientCodecs)
+            {
+                g_broker.offerDictionary(clientId, header->topic);
+            }
             break;
         }
 
-        case MSG_STREAM_START:
+        case MSG_PUBLISH_BATCH:
         {
-            // Forward audio stream start to subscribers
-            if (strlen(header->topic) > 0)
+            if (!clientLoggedIn)
+            {
+                sendErrorPacket(*egress, header->messageId, "Not logged in");
+                break;
+            }
+
+            std::vector<BatchRecord> records;
+            if (!parseBatchRecords(payloadBuffer, header->payloadLength, records))
             {
-                logMessage("[STREAM] Stream start from " + std::string(header->sender) + " on topic " + std::string(header->topic));
-                g_broker.publishToTopic(header->topic, *header, payloadBuffer, header->payloadLength);
+                sendErrorPacket(*egress, header->messageId, "Malformed batch");
+                break;
             }
+
+            if (dedupEnabled && !publishIds.record(header->messageId))
+            {
+                logMessage("[CHAT] Duplicate batch " + std::to_string(header->messageId) + " from " +
+                           std::string(clientUsername) + " not delivered again");
+                sendPublishAckPacket(*egress, header->messageId, "");
+                break;
+            }
+
+            co_await io.egressBelow(EGRESS_HIGH_WATER);
+
+            int deliveries = g_broker.publishBatch(*header, records);
+            g_replication.publishedBatch(*header, records);
+            if (g_cluster.enabled())
+            {
+                std::vector<std::string> topics;
+                for (auto const &record : records)
+                {
+                    topics.push_back(record.topic);
+                }
+                deliveries += g_cluster.forward(*header, payloadBuffer, header->payloadLength, topics);
+            }
+            logMessage("[CHAT] Batch of " + std::to_string(records.size()) + " records from " +
+                       std::string(clientUsername) + ", " + std::to_string(deliveries) + " deliveries");
+
+            // One cumulative ACK for the whole batch
+            sendPublishAckPacket(*egress, header->messageId, "");
             break;
         }
 
+        case MSG_STREAM_START:
         case MSG_STREAM_FRAME:
+        case MSG_STREAM_STOP:
+        {
+            // Forward audio stream packets to the session's listeners
+            publishStreamPacket(*header, payloadBuffer, *egress, streamSessions);
+            break;
+        }
+
+        case MSG_PING:
         {
-            // Forward audio frame to subscribers
-            if (strlen(header->topic) > 0)
+            sendPongPacket(*egress, header->messageId);
+            break;
+        }
+
+        case MSG_PONG:
+            break; // Any packet counts as activity
+
+        case MSG_ACK:
+        {
+            // A consumer group member has processed a delivery; nothing is sent back
+            if (!clientLoggedIn || !(header->flags & FLAG_GROUP))
             {
-                g_broker.publishToTopic(header->topic, *header, payloadBuffer, header->payloadLength);
+                sendErrorPacket(*egress, header->messageId, "Unexpected ACK");
+                break;
             }
+            g_broker.ackGroupDelivery(clientId, header->messageId);
             break;
         }
 
-        case MSG_STREAM_STOP:
+        case MSG_QUERY:
         {
-            // Forward audio stream stop to subscribers
-            if (strlen(header->topic) > 0)
+            if (!clientLoggedIn)
             {
-                logMessage("[STREAM] Stream stop from " + std::string(header->sender) + " on topic " + std::string(header->topic));
-                g_broker.publishToTopic(header->topic, *header, payloadBuffer, header->payloadLength);
+                sendErrorPacket(*egress, header->messageId, "Not logged in");
+                break;
+            }
+
+            uint16_t limit;
+            std::string cursor;
+            if (!parseQuery(payloadBuffer, header->payloadLength, limit, cursor))
+            {
+                sendErrorPacket(*egress, header->messageId, "Invalid query");
+                break;
             }
+            uint32_t total;
+            bool more;
+            std::vector<std::string> names =
+                g_broker.queryMembers(clientId, header->topic, cursor, limit < QUERY_MAX_PAGE ? limit : QUERY_MAX_PAGE,
+                                      (header->flags & FLAG_WATCH) != 0, total, more);
+            sendQueryResult(*egress, *header, total, more, names);
             break;
         }
 
         case MSG_LOGOUT:
         {
             logMessage("[CHAT] Client " + std::string(clientUsername) + " logged out");
-            sendAckPacket(clientSocket, header->messageId);
+            sendAckPacket(*egress, header->messageId);
             clientLoggedIn = false;
+            resumeToken = 0; // Ended on purpose: nothing to resume
+            g_replication.sessionEnded(clientUsername);
+            if (clusterClaimed)
+                g_cluster.releaseUsername(clientUsername);
+            clusterClaimed = false;
             break;
         }
 
         default:
         {
             logMessage("[CHAT] Unknown message type: " + std::to_string(header->msgType));
-            sendErrorPacket(clientSocket, header->messageId, "Unknown message type");
+            sendErrorPacket(*egress, header->messageId, "Unknown message type");
             break;
         }
         }
     }
 
     // Cleanup
-    if (clientLoggedIn)
+    SessionSnapshot snapshot;
+    if (handingOff)
+    {
+        // Captured before unregistering drops the subscriptions here
+        snapshot.loggedIn = clientLoggedIn;
+        snapshot.username = clientUsername;
+        snapshot.wireVersion = wireVersion;
+        snapshot.checksumEnabled = checksumEnabled;
+        snapshot.codecs = clientCodecs;
+        snapshot.resumeToken = resumeToken;
+        if (dedupEnabled)
+        {
+            StateWriter idState;
+            publishIds.saveState(idState);
+            snapshot.publishIds = idState.data();
+        }
+        if (clientLoggedIn)
+        {
+            snapshot.topics = g_broker.subscriptionsOf(clientId);
+            snapshot.filters = g_broker.filtersOf(clientId);
+            snapshot.groups = g_broker.groupsOf(clientId);
+            snapshot.watches = g_broker.watchesOf(clientId);
+            g_broker.forgetGroupDeliveries(clientId);
+            snapshot.dictionaries = g_broker.dictionariesSentTo(clientId);
+        }
+        StateWriter decoderState;
+        decoder.saveState(decoderState);
+        snapshot.decoderState = decoderState.data();
+    }
+    releaseStreamSessions(streamSessions);
+    bool parked = clientLoggedIn && resumeToken && !handingOff;
+    if (parked)
+    {
+        // Kept for the client to resume: deliveries go to a buffer from now on
+        auto buffer = SessionParking::makeBuffer();
+        g_broker.swapEgress(clientId, buffer);
+        g_parking.park(resumeToken, clientUsername, clientId, clientCodecs, clusterClaimed, buffer, publishIds);
+        logMessage("[CHAT] Session of " + std::string(clientUsername) + " parked for " +
+                   std::to_string(SESSION_RESUME_GRACE_MS / 1000) + "s");
+    }
+    else if (clientLoggedIn)
     {
         g_broker.unregisterClient(clientId);
+        g_replication.sessionEnded(clientUsername); // No-op once handing off (replication stopped)
+    }
+    if (clusterClaimed && !handingOff && !parked)
+    {
+        g_cluster.releaseUsername(clientUsername); // The successor keeps the claim
+    }
+    co_await io.drain(*egress); // Flush pending replies (e.g. the final MSG_ERROR) before closing
+    co_await io.detach();
+    if (handingOff)
+    {
+        // Queue flushed and receiving stopped: nothing is in flight on the socket
+        StateWriter encoderState;
+        egress->saveEncoder(encoderState);
+        snapshot.encoderState = encoderState.data();
+        snapshot.pendingBytes = io.takeBuffered();
+        if (g_restart.sendSession(clientSocket, snapshot))
+            logMessage("[CHAT] Client " + std::to_string(clientId) + " handed over to the new process");
+        else
+            logMessage("[CHAT] Failed to hand client " + std::to_string(clientId) + " over, closing");
+    }
+    g_timerWheel.cancel(&liveness);
+    if (liveness.evicted())
+    {
+        logMessage("[CHAT] Client " + std::to_string(clientId) + " evicted (" + liveness.evicted() + ")");
+    }
+    if (rateLimit.throttled() > 0)
+    {
+        logMessage("[CHAT] Client " + std::to_string(clientId) + " throttled " + std::to_string(rateLimit.throttled()) +
+                   " packets (" + std::to_string(g_rateLimiter.throttledTotal()) + " server-wide)");
+    }
+    if (egress->conflated() > 0)
+    {
+        logMessage("[CHAT] Client " + std::to_string(clientId) + " skipped " + std::to_string(egress->conflated()) +
+                   " superseded last values");
+    }
+    if (tls)
+    {
+        tls->shutdown();
     }
     CLOSE_SOCKET(clientSocket);
     logMessage("[CHAT] Client handler terminated for ID=" + std::to_string(clientId));
 }
 
-int main()
+// Run a connection handler: as a coroutine on the ring thread (--io uring; TLS
+// handshakes block, so those get a thread), otherwise on a thread of its own
+// resumed: chat session handed over by the previous process (never TLS)
+void startHandler(bool stream, SOCKET sock, const std::shared_ptr<SessionSnapshot> &resumed = nullptr)
+{
+    static std::atomic<int> chatIdCounter(0);
+    static std::atomic<int> streamIdCounter(0);
+    int id = stream ? streamIdCounter++ : chatIdCounter++;
+
+    if (g_uring && (!tlsEnabled() || resumed))
+    {
+        auto run = [=]()
+        {
+            if (stream)
+                handleStreamClient(id, sock);
+            else
+                handleClient(id, sock, resumed);
+        };
+        if (g_uring->onLoopThread())
+            run();
+        else
+            g_uring->runOnLoop(run);
+    }
+    else if (stream)
+    {
+        std::thread(handleStreamClient, id, sock).detach();
+    }
+    else
+    {
+        std::thread(handleClient, id, sock, resumed).detach();
+    }
+}
+
+// A connection accepted on either port
+void acceptConnection(SOCKET sock, bool stream)
+{
+    if (g_restart.isHandingOff())
+    {
+        // The successor owns the listening sockets now and takes this one too
+        if (!g_restart.forwardConnection(sock, stream))
+            logMessage("[MAIN] Failed to forward a connection to the new process");
+        CLOSE_SOCKET(sock);
+        return;
+    }
+    if (g_stopping.load())
+    {
+        CLOSE_SOCKET(sock);
+        return;
+    }
+
+    logMessage(stream ? "[MAIN] New stream client connection accepted" : "[MAIN] New chat client connection accepted");
+    startHandler(stream, sock);
+}
+
+// Successor side: adopt what the previous process hands over until it exits
+void adoptHandedOver()
+{
+    HandoffMessage message;
+    int sessions = 0;
+    int connections = 0;
+    while (g_restart.receive(message))
+    {
+        if (message.kind == HANDOFF_BROKER_STATE)
+        {
+            StateReader state(message.body);
+            if (!g_broker.loadDictionaries(state) || !g_broker.loadLastValues(state) ||
+                !g_broker.loadOfflineMessages(state))
+                logMessage("[MAIN] Takeover: malformed broker state");
+            continue;
+        }
+
+        if (message.fds.size() != 1)
+        {
+            for (int fd : message.fds)
+            {
+                CLOSE_SOCKET(fd);
+            }
+            continue;
+        }
+        SOCKET sock = message.fds[0];
+
+        if (message.kind == HANDOFF_CONNECTION)
+        {
+            connections++;
+            startHandler(message.body == "stream", sock);
+        }
+        else if (message.kind == HANDOFF_SESSION)
+        {
+            auto snapshot = std::make_shared<SessionSnapshot>();
+            if (!snapshot->decode(message.body))
+            {
+                logMessage("[MAIN] Takeover: malformed session state, connection closed");
+                CLOSE_SOCKET(sock);
+                continue;
+            }
+            sessions++;
+            startHandler(false, sock, snapshot);
+        }
+        else
+        {
+            CLOSE_SOCKET(sock);
+        }
+    }
+    g_restart.closeChannel();
+    logMessage("[MAIN] Takeover complete: " + std::to_string(sessions) + " sessions resumed, " +
+               std::to_string(connections) + " connections forwarded");
+}
+
+#ifndef _WIN32
+int g_signalPipe[2] = {-1, -1}; // SIGTERM/SIGINT -> lifecycle thread
+
+void onTerminateSignal(int)
+{
+    char byte = 1;
+    ssize_t written = write(g_signalPipe[1], &byte, 1);
+    (void)written;
+}
+
+// Hand the listening sockets, broker state and every session that can move to the
+// successor connecting on --control. Returns false if it went away before taking
+// the listening sockets (this process keeps serving).
+bool handOff(SOCKET chatSocket, SOCKET streamSocket)
+{
+    if (!g_restart.startHandoff(chatSocket, streamSocket))
+    {
+        logMessage("[MAIN] Hot restart: handoff failed, still serving");
+        return false;
+    }
+    logMessage("[MAIN] Hot restart: listening sockets handed over");
+    g_parking.endAll();   // Only connected sessions move
+    g_replication.stop(); // The follower reconnects to the successor and resyncs
+
+    StateWriter state;
+    g_broker.saveDictionaries(state);
+    g_broker.saveLastValues(state);
+    g_broker.saveOfflineMessages(state);
+    g_restart.sendBrokerState(state.data());
+
+    if (g_uring)
+    {
+        g_uring->runOnLoop([]
+                           { g_sessions.forEach([](LiveSession &session)
+                                                {
+                                                    if (session.io)
+                                                        session.io->requestHandoff();
+                                                }); });
+        if (!g_sessions.waitUntilGone(true, HANDOFF_TIMEOUT_MS))
+            logMessage("[MAIN] Hot restart: sessions stuck mid-packet are closed instead");
+    }
+    return true;
+}
+
+// Waits for SIGTERM/SIGINT or a successor on the --control socket. Whatever was not
+// handed over is then closed through the handlers' own cleanup (shutting the read
+// side down ends their pending read), which flushes each queue first.
+void lifecycleLoop(SOCKET chatSocket, SOCKET streamSocket)
+{
+    while (true)
+    {
+        pollfd fds[2] = {{g_signalPipe[0], POLLIN, 0}, {g_restart.controlFd(), POLLIN, 0}};
+        if (poll(fds, g_restart.controlFd() >= 0 ? 2 : 1, -1) < 0)
+            continue;
+        if (fds[0].revents)
+        {
+            logMessage("[MAIN] Shutting down");
+            g_stopping.store(true);
+            break;
+        }
+        if (fds[1].revents && handOff(chatSocket, streamSocket))
+            break;
+    }
+
+    g_sessions.forEach([](LiveSession &session)
+                       { shutdown(session.sock, SHUT_RD); });
+    if (!g_sessions.waitUntilGone(false, SHUTDOWN_TIMEOUT_MS))
+        logMessage("[MAIN] " + std::to_string(g_sessions.size()) + " connections still flushing at exit");
+    logMessage("[MAIN] Server stopped");
+    std::_Exit(0); // Detached handler threads may still hold the globals
+}
+#endif
+
+// Create, bind and listen on a TCP port; INVALID_SOCKET on failure
+SOCKET openListener(int port, const std::string &name)
+{
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET)
+    {
+        logMessage("Failed to create " + name + " socket");
+        return INVALID_SOCKET;
+    }
+
+    // Allow address reuse
+    int opt = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (bind(listener, (sockaddr *)&address, sizeof(address)) == SOCKET_ERROR)
+    {
+        logMessage("Failed to bind " + name + " socket");
+        CLOSE_SOCKET(listener);
+        return INVALID_SOCKET;
+    }
+
+    if (listen(listener, SOMAXCONN) == SOCKET_ERROR)
+    {
+        logMessage("Failed to listen on " + name + " socket");
+        CLOSE_SOCKET(listener);
+        return INVALID_SOCKET;
+    }
+    return listener;
+}
+
+// A parked session was not resumed in time (or its name logged in again): end it
+// as its disconnect would have
+void endParkedSession(const ParkedSession &session)
+{
+    g_broker.unregisterClient(session.clientId);
+    g_replication.sessionEnded(session.username);
+    if (session.clusterClaimed)
+        g_cluster.releaseUsername(session.username);
+    logMessage("[CHAT] Parked session of " + session.username + " ended");
+}
+
+// A publish forwarded by another broker node: fan out to the subscribers here
+void deliverClusterPublish(int node, const PacketHeader &header, const char *payload, uint32_t length)
+{
+    if (header.msgType == MSG_PUBLISH_BATCH)
+    {
+        std::vector<BatchRecord> records;
+        if (length <= MAX_BATCH_SIZE && parseBatchRecords(payload, length, records))
+        {
+            g_broker.publishBatch(header, records);
+            g_replication.publishedBatch(header, records);
+        }
+    }
+    else if (header.msgType == MSG_PUBLISH_TEXT && (header.flags & FLAG_DIRECT) && strlen(header.topic) > 0)
+    {
+        g_broker.publishDirect(header, payload, length); // The recipient's node: not replicated, as where it was sent
+    }
+    else if ((header.msgType == MSG_PUBLISH_TEXT || header.msgType == MSG_PUBLISH_FILE) && strlen(header.topic) > 0)
+    {
+        g_broker.publishToTopic(header.topic, header, payload, length);
+        g_replication.published(header, payload, length);
+    }
+    else if ((header.msgType == MSG_STREAM_START || header.msgType == MSG_STREAM_FRAME ||
+              header.msgType == MSG_STREAM_STOP) && length <= MAX_BUFFER_SIZE)
+    {
+        // Relayed to the listeners here only: the owner already forwarded it to every node
+        std::lock_guard<std::mutex> lock(g_clusterStreamsMutex);
+        relayStreamPacket(header, payload, g_clusterStreams.try_emplace(node, node).first->second);
+    }
+}
+
+// A node went away: its streams will not send MSG_STREAM_STOP
+void dropClusterStreams(int node)
+{
+    std::lock_guard<std::mutex> lock(g_clusterStreamsMutex);
+    auto it = g_clusterStreams.find(node);
+    if (it != g_clusterStreams.end())
+        releaseStreamSessions(it->second);
+}
+
+// Usage: server [--tls <cert.pem> <key.pem>] [--io threads|uring] [--max-connections <n>]
+//               [--rate <type>=<msgs/s>/<bytes/s>]... [--user-rate <type>=<msgs/s>/<bytes/s>]...
+//               [--control <path>] [--takeover <path>]
+//               [--port <chat-port>] [--node <id> <cluster-port> [--peer <id> <host>:<cluster-port>]...]
+//               [--replicate <port>] [--follow <host>:<port>] [--last-value <topic-prefix>]...
+int main(int argc, char **argv)
 {
 #ifdef _WIN32
     WSADATA wsa;
@@ -401,91 +1625,237 @@ int main()
         logMessage("WSAStartup failed");
         return 1;
     }
+#else
+    // A write to an evicted or reset peer must fail with EPIPE, not kill the server
+    signal(SIGPIPE, SIG_IGN);
 #endif
 
     logMessage("=== PUB/SUB SERVER STARTING ===");
 
-    // Create chat socket
-    SOCKET chatSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (chatSocket == INVALID_SOCKET)
+    std::string controlPath;  // --control: accept a successor here
+    std::string takeoverPath; // --takeover: take over from the server controlled there
+    int chatPort = CHAT_PORT;     // --port: chat port, the stream port is the next one
+    int replicationPort = 0;      // --replicate: stream state to a follower connecting here
+    std::string leaderAddress;    // --follow: standby for the leader there until it fails
+    int streamPort = STREAM_PORT;
+    for (int i = 1; i < argc; i++)
     {
-        logMessage("Failed to create chat socket");
-        return 1;
+        std::string arg = argv[i];
+        if (arg == "--tls" && i + 2 < argc)
+        {
+#ifdef USE_TLS
+            g_tlsContext = createServerTlsContext(argv[i + 1], argv[i + 2]);
+            if (!g_tlsContext)
+            {
+                logMessage("Failed to load TLS certificate/key");
+                return 1;
+            }
+            logMessage("[MAIN] TLS enabled on both ports (kTLS offload when the kernel supports it)");
+#else
+            logMessage("--tls requires a build with -DUSE_TLS");
+            return 1;
+#endif
+            i += 2;
+        }
+        else if (arg == "--max-connections" && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+        {
+            g_admission.setLimit(std::atoi(argv[i + 1]));
+            i += 1;
+        }
+        else if ((arg == "--rate" || arg == "--user-rate") && i + 1 < argc &&
+                 g_rateLimiter.configure(argv[i + 1], arg == "--user-rate"))
+        {
+            i += 1;
+        }
+        else if ((arg == "--control" || arg == "--takeover") && i + 1 < argc)
+        {
+            if (!HotRestart::supported())
+            {
+                logMessage(arg + " needs Unix domain sockets");
+                return 1;
+            }
+            (arg == "--control" ? controlPath : takeoverPath) = argv[i + 1];
+            i += 1;
+        }
+        else if (arg == "--port" && i + 1 < argc && std::atoi(argv[i + 1]) > 0 && std::atoi(argv[i + 1]) < 65535)
+        {
+            chatPort = std::atoi(argv[i + 1]);
+            streamPort = chatPort + 1;
+            i += 1;
+        }
+        else if (arg == "--replicate" && i + 1 < argc && std::atoi(argv[i + 1]) > 0 && std::atoi(argv[i + 1]) <= 65535)
+        {
+            replicationPort = std::atoi(argv[i + 1]);
+            i += 1;
+        }
+        else if (arg == "--follow" && i + 1 < argc)
+        {
+            leaderAddress = argv[i + 1];
+            i += 1;
+        }
+        else if (arg == "--last-value" && i + 1 < argc && argv[i + 1][0] != '\0')
+        {
+            g_broker.addLastValuePrefix(argv[i + 1]);
+            logMessage("[MAIN] Last-value topics: " + std::string(argv[i + 1]) + "*");
+            i += 1;
+        }
+        else if (arg == "--node" && i + 2 < argc && g_cluster.configureSelf(std::atoi(argv[i + 1]), std::atoi(argv[i + 2])))
+        {
+            i += 2;
+        }
+        else if (arg == "--peer" && i + 2 < argc && g_cluster.addPeer(std::atoi(argv[i + 1]), argv[i + 2]))
+        {
+            i += 2;
+        }
+        else if (arg == "--io" && i + 1 < argc && (std::string(argv[i + 1]) == "threads" || std::string(argv[i + 1]) == "uring"))
+        {
+            if (std::string(argv[i + 1]) == "uring")
+            {
+                if (!UringBackend::supported())
+                {
+                    logMessage("--io uring is only available on Linux");
+                    return 1;
+                }
+                static UringBackend backend;
+                int error = backend.init();
+                if (error < 0)
+                {
+                    logMessage("Failed to set up io_uring: " + std::string(strerror(-error)));
+                    return 1;
+                }
+                g_uring = &backend;
+                logMessage("[MAIN] I/O backend: io_uring (" + std::string(backend.describe()) + ")");
+            }
+            i += 1;
+        }
+        else
+        {
+            logMessage("Usage: server [--tls <cert.pem> <key.pem>] [--io threads|uring] [--max-connections <n>] "
+                       "[--rate <type>=<msgs/s>/<bytes/s>] [--user-rate <type>=<msgs/s>/<bytes/s>] "
+                       "[--control <path>] [--takeover <path>] [--port <chat-port>] "
+                       "[--node <id> <cluster-port> [--peer <id> <host>:<cluster-port>]...] "
+                       "[--replicate <port>] [--follow <host>:<port>] [--last-value <topic-prefix>]...");
+            return 1;
+        }
     }
 
-    // Allow address reuse
-    int opt = 1;
-    setsockopt(chatSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
-
-    // Bind chat socket
-    sockaddr_in chatAddr{};
-    chatAddr.sin_family = AF_INET;
-    chatAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    chatAddr.sin_port = htons(CHAT_PORT);
+    g_timerWheel.start();
+    g_parking.setEndHandler(endParkedSession);
 
-    if (bind(chatSocket, (sockaddr *)&chatAddr, sizeof(chatAddr)) == SOCKET_ERROR)
+    // Standby: nothing is served until the leader fails
+    if (!leaderAddress.empty())
     {
-        logMessage("Failed to bind chat socket");
-        CLOSE_SOCKET(chatSocket);
-        return 1;
+        if (!takeoverPath.empty())
+        {
+            logMessage("--follow and --takeover cannot be combined");
+            return 1;
+        }
+        logMessage("[MAIN] Standby for the leader at " + leaderAddress);
+        if (!g_replica.follow(leaderAddress))
+        {
+            logMessage("Invalid leader address: " + leaderAddress);
+            return 1;
+        }
+        logMessage("[MAIN] Taking over from the failed leader");
     }
 
-    // Listen on chat socket
-    if (listen(chatSocket, SOMAXCONN) == SOCKET_ERROR)
+    SOCKET chatSocket = INVALID_SOCKET;
+    SOCKET streamSocket = INVALID_SOCKET;
+    if (!takeoverPath.empty())
     {
-        logMessage("Failed to listen on chat socket");
-        CLOSE_SOCKET(chatSocket);
-        return 1;
+        // Hot restart: the running server's listening sockets, already bound
+        if (!g_restart.takeOver(takeoverPath, chatSocket, streamSocket))
+        {
+            logMessage("Failed to take over from the server at " + takeoverPath);
+            return 1;
+        }
+        logMessage("[MAIN] Took over the listening sockets of the running server");
+        std::thread(adoptHandedOver).detach();
+    }
+    else
+    {
+        chatSocket = openListener(chatPort, "chat");
+        if (chatSocket == INVALID_SOCKET)
+            return 1;
+        streamSocket = openListener(streamPort, "stream");
+        if (streamSocket == INVALID_SOCKET)
+        {
+            CLOSE_SOCKET(chatSocket);
+            return 1;
+        }
     }
 
-    logMessage("[MAIN] Chat server listening on port " + std::to_string(CHAT_PORT));
-    logMessage("[MAIN] Waiting for clients...");
+    logMessage("[MAIN] Chat server listening on port " + std::to_string(chatPort));
+    logMessage("[MAIN] Stream server listening on port " + std::to_string(streamPort));
 
-    // Create stream socket
-    SOCKET streamSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (streamSocket == INVALID_SOCKET)
+    if (g_cluster.enabled())
     {
-        logMessage("Failed to create stream socket");
-        CLOSE_SOCKET(chatSocket);
-        return 1;
+        if (!g_cluster.start(chatPort, deliverClusterPublish, dropClusterStreams))
+        {
+            logMessage("Invalid cluster configuration: a peer uses this node's id");
+            return 1;
+        }
+        logMessage("[MAIN] Cluster node started, linking up with its peers");
     }
+    if (replicationPort > 0)
+    {
+        g_replication.start(replicationPort);
+    }
+    logMessage("[MAIN] Waiting for clients...");
 
-    // Allow address reuse
-    opt = 1;
-    setsockopt(streamSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
-
-    // Bind stream socket
-    sockaddr_in streamAddr{};
-    streamAddr.sin_family = AF_INET;
-    streamAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    streamAddr.sin_port = htons(STREAM_PORT);
+#ifndef _WIN32
+    // Replaces a predecessor's control socket at the same path
+    if (!controlPath.empty())
+    {
+        if (!g_restart.listen(controlPath))
+        {
+            logMessage("Failed to listen for a successor on " + controlPath);
+            return 1;
+        }
+        logMessage("[MAIN] Hot restart: a successor can take over at " + controlPath);
+    }
 
-    if (bind(streamSocket, (sockaddr *)&streamAddr, sizeof(streamAddr)) == SOCKET_ERROR)
+    if (pipe(g_signalPipe) == 0)
     {
-        logMessage("Failed to bind stream socket");
-        CLOSE_SOCKET(chatSocket);
-        CLOSE_SOCKET(streamSocket);
-        return 1;
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_handler = onTerminateSignal;
+        sigaction(SIGTERM, &action, nullptr);
+        sigaction(SIGINT, &action, nullptr);
+        std::thread(lifecycleLoop, chatSocket, streamSocket).detach();
     }
+#endif
 
-    // Listen on stream socket
-    if (listen(streamSocket, SOMAXCONN) == SOCKET_ERROR)
+    if (g_uring)
     {
-        logMessage("Failed to listen on stream socket");
+        // The ring thread accepts on both ports and runs the handlers (startHandler)
+        g_uring->listen(streamSocket, [](SOCKET clientStreamSocket)
+                        {
+            if (clientStreamSocket == INVALID_SOCKET)
+            {
+                logMessage("Failed to accept stream client connection");
+                return;
+            }
+            acceptConnection(clientStreamSocket, true); });
+        g_uring->listen(chatSocket, [](SOCKET clientSocket)
+                        {
+            if (clientSocket == INVALID_SOCKET)
+            {
+                logMessage("Failed to accept client connection");
+                return;
+            }
+            acceptConnection(clientSocket, false); });
+
+        int error = g_uring->run();
+        logMessage("io_uring loop failed: " + std::string(strerror(-error)));
         CLOSE_SOCKET(chatSocket);
         CLOSE_SOCKET(streamSocket);
         return 1;
     }
 
-    logMessage("[MAIN] Stream server listening on port " + std::to_string(STREAM_PORT));
-
-    // Accept client connections
-    int clientIdCounter = 0;
-
     // Launch stream accept thread
     std::thread streamAcceptThread([&]()
                                    {
-        int streamIdCounter = 0;
         while (true)
         {
             sockaddr_in clientAddr{};
@@ -498,11 +1868,7 @@ int main()
                 continue;
             }
 
-            logMessage("[MAIN] New stream client connection accepted");
-
-            // Handle stream client in separate thread
-            std::thread streamThread(handleStreamClient, streamIdCounter++, clientStreamSocket);
-            streamThread.detach();
+            acceptConnection(clientStreamSocket, true); // Runs the handler on its own thread
         } });
     streamAcceptThread.detach();
 
@@ -519,11 +1885,7 @@ int main()
             continue;
         }
 
-        logMessage("[MAIN] New chat client connection accepted");
-
-        // Handle client in separate thread
-        std::thread clientThread(handleClient, clientIdCounter++, clientSocket);
-        clientThread.detach(); // Let thread run independently
+        acceptConnection(clientSocket, false); // Runs the handler on its own thread
     }
 
     CLOSE_SOCKET(chatSocket);
@@ -0,0 +1,462 @@
+#ifndef SESSION_IO_H
+#define SESSION_IO_H
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <memory>
+#include <mutex>
+#include <exception>
+#include <thread>
+#include "egress.h"
+#include "socket_reader.h"
+#include "uring_backend.h"
+
+// ===== OPTIMIZATION: Coroutine connection handlers =====
+// Purpose: With --io uring a session still needed a thread (and its stack) just to
+// block in readHeader/readExact between packets. Handlers are now coroutines that
+// co_await the socket instead:
+// - On the ring thread each wait (bytes, egress drain, recv detach, egress occupancy,
+//   timer) parks the coroutine on a LoopWaiter; the completion that satisfies it
+//   schedules the resume, so an idle session costs its coroutine frame and buffers only
+// - Anywhere else (--io threads, TLS sessions) the awaitables finish in
+//   await_ready with the original blocking calls and the coroutine never suspends
+// The handler body is the same code in both modes.
+
+// Fire-and-forget coroutine: starts right away, frees its frame when it returns
+struct SessionTask
+{
+    struct promise_type
+    {
+        SessionTask get_return_object() { return SessionTask(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// A value another thread produces for a handler (e.g. a cluster node's reply)
+class AsyncResult
+{
+private:
+    std::mutex resultMutex;
+    std::condition_variable resultCv;
+    bool done;
+    int value;
+    LoopWaiter *waiter; // Coroutine parked on the ring thread
+    UringBackend *backend;
+
+public:
+    AsyncResult() : done(false), value(0), waiter(nullptr), backend(nullptr) {}
+
+    // Any thread, first call wins; returns false if already completed
+    bool complete(int result)
+    {
+        LoopWaiter *parked;
+        {
+            std::lock_guard<std::mutex> lock(resultMutex);
+            if (done)
+                return false;
+            done = true;
+            value = result;
+            parked = waiter;
+            waiter = nullptr;
+        }
+        resultCv.notify_all();
+        if (parked)
+            backend->runOnLoop([parked]
+                               { parked->wake(); });
+        return true;
+    }
+
+    int wait()
+    {
+        std::unique_lock<std::mutex> lock(resultMutex);
+        resultCv.wait(lock, [this]
+                      { return done; });
+        return value;
+    }
+
+    // Ring thread: wake w on completion; false if the result is already there
+    bool park(LoopWaiter *w, UringBackend *loop)
+    {
+        std::lock_guard<std::mutex> lock(resultMutex);
+        if (done)
+            return false;
+        waiter = w;
+        backend = loop;
+        return true;
+    }
+
+    int result()
+    {
+        std::lock_guard<std::mutex> lock(resultMutex);
+        return value;
+    }
+};
+typedef std::shared_ptr<AsyncResult> AsyncResultRef;
+
+// Socket I/O of one connection as awaitables
+class SessionIo
+{
+private:
+    UringBackend *backend;
+    InboundSourceRef inbound;
+    SocketReader reader;
+    bool async; // Suspend on the ring thread instead of blocking
+    bool handoff; // Hot restart: end the session at its next packet boundary
+    LoopWaiter *parkedHeader; // HeaderRead waiting between packets (ring thread only)
+
+    // Resume the coroutine from the ring thread's ready list
+    struct Suspension : LoopWaiter
+    {
+        SessionIo &io;
+        std::coroutine_handle<> handle;
+
+        explicit Suspension(SessionIo &owner) : io(owner) {}
+
+        void resumeLater()
+        {
+            io.backend->schedule(handle);
+        }
+
+        void wake() override
+        {
+            resumeLater();
+        }
+    };
+
+    // Drives a non-blocking read step until it finishes, waiting for bytes between steps
+    template <typename Read>
+    struct ReadAwaiter : Suspension
+    {
+        bool ok;
+
+        explicit ReadAwaiter(SessionIo &owner) : Suspension(owner), ok(false) {}
+
+        // 1 done, 0 waiting for bytes, -1 failed
+        int advance()
+        {
+            Read &read = *static_cast<Read *>(this);
+            while (true)
+            {
+                int result = read.step();
+                if (result != 0)
+                {
+                    ok = result > 0;
+                    return 1;
+                }
+                int pulled = this->io.reader.pull();
+                if (pulled < 0)
+                {
+                    ok = false;
+                    return 1;
+                }
+                if (pulled == 0)
+                    return 0;
+            }
+        }
+
+        bool await_ready()
+        {
+            if (!this->io.async)
+            {
+                ok = static_cast<Read *>(this)->blocking();
+                return true;
+            }
+            return advance() != 0;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            this->handle = h;
+            this->io.waitForBytes(this);
+        }
+
+        bool await_resume() { return ok; }
+
+        // New bytes (or EOF) arrived: consume them, resume once the read is complete
+        void wake() override
+        {
+            if (advance() != 0)
+            {
+                if (this->io.parkedHeader == this)
+                    this->io.parkedHeader = nullptr;
+                this->resumeLater();
+            }
+            else
+            {
+                this->io.waitForBytes(this);
+            }
+        }
+    };
+
+    void waitForBytes(LoopWaiter *waiter)
+    {
+#ifdef HAVE_IO_URING
+        std::static_pointer_cast<UringInbound>(inbound)->setWaiter(waiter);
+#endif
+    }
+
+public:
+    struct HeaderRead : ReadAwaiter<HeaderRead>
+    {
+        uint8_t wireVersion;
+        CompactDecoder &decoder;
+        PacketHeader &header;
+        V2AliasInfo *alias;
+
+        HeaderRead(SessionIo &owner, uint8_t version, CompactDecoder &d, PacketHeader &h, V2AliasInfo *a)
+            : ReadAwaiter(owner), wireVersion(version), decoder(d), header(h), alias(a) {}
+
+        bool blocking() { return io.reader.readHeader(wireVersion, decoder, header, alias); }
+        int step() { return io.reader.tryReadHeader(wireVersion, decoder, header, alias); }
+
+        // A requested handoff fails the read before it consumes anything
+        bool await_ready()
+        {
+            if (io.handoff)
+            {
+                ok = false;
+                return true;
+            }
+            return ReadAwaiter::await_ready();
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            io.parkedHeader = this;
+            ReadAwaiter::await_suspend(h);
+        }
+    };
+
+    struct ExactRead : ReadAwaiter<ExactRead>
+    {
+        char *dest;
+        size_t length;
+        size_t done;
+
+        ExactRead(SessionIo &owner, char *d, size_t n) : ReadAwaiter(owner), dest(d), length(n), done(0) {}
+
+        bool blocking() { return io.reader.readExact(dest, length); }
+        int step() { return io.reader.tryReadExact(dest, length, done); }
+    };
+
+    struct Sleep : Suspension
+    {
+        unsigned milliseconds;
+
+        Sleep(SessionIo &owner, unsigned ms) : Suspension(owner), milliseconds(ms) {}
+
+        bool await_ready()
+        {
+            if (io.async)
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle = h;
+            io.backend->addTimer(this, milliseconds);
+        }
+
+        void await_resume() {}
+    };
+
+    // Publisher flow control: EgressAccounting::waitBelow, parked until a release
+    // brings occupancy below limit
+    struct EgressBelow : Suspension
+    {
+        size_t limit;
+
+        EgressBelow(SessionIo &owner, size_t bytes) : Suspension(owner), limit(bytes) {}
+
+        bool await_ready()
+        {
+            if (io.async)
+                return false;
+            EgressAccounting::instance().waitBelow(limit);
+            return true;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            handle = h;
+            return EgressAccounting::instance().parkBelow(limit, [this]
+                                                          { io.backend->runOnLoop([this]
+                                                                                  { wake(); }); });
+        }
+
+        void await_resume() {}
+    };
+
+    // EgressQueue::close: flush what is queued before the socket is closed
+    struct Drain : Suspension
+    {
+        EgressQueue &queue;
+
+        Drain(SessionIo &owner, EgressQueue &egress) : Suspension(owner), queue(egress) {}
+
+        bool await_ready()
+        {
+            if (!io.async)
+            {
+                queue.close();
+                return true;
+            }
+            return queue.beginClose();
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle = h;
+            io.backend->waitDrained(&queue, this);
+        }
+
+        void await_resume() {}
+    };
+
+    // Stop the backend receiving for this socket so it can be closed
+    struct Detach : Suspension
+    {
+        explicit Detach(SessionIo &owner) : Suspension(owner) {}
+
+        bool await_ready()
+        {
+            if (!io.inbound)
+                return true;
+            if (!io.async)
+            {
+                io.backend->detach(io.inbound);
+                return true;
+            }
+            return io.backend->detachOnLoop(io.inbound, this);
+        }
+
+        void await_suspend(std::coroutine_handle<> h) { handle = h; }
+        void await_resume() {}
+    };
+
+    // An AsyncResult completed by another thread
+    struct Reply : Suspension
+    {
+        AsyncResultRef result;
+
+        Reply(SessionIo &owner, const AsyncResultRef &r) : Suspension(owner), result(r) {}
+
+        bool await_ready()
+        {
+            if (!io.async)
+            {
+                result->wait();
+                return true;
+            }
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            handle = h;
+            return result->park(this, io.backend);
+        }
+
+        int await_resume() { return result->result(); }
+    };
+
+    // uring: the connection's backend, if any (the socket is attached to it here)
+    SessionIo(SOCKET sock, const TlsSessionRef &tls, UringBackend *uring)
+        : backend(uring), inbound(uring ? uring->attach(sock, tls) : InboundSourceRef()),
+          reader(sock, tls, inbound), async(inbound && uring->onLoopThread()), handoff(false),
+          parkedHeader(nullptr)
+    {
+    }
+
+    // True when the session runs as a coroutine on the ring thread (it can be
+    // handed to another process between packets, see hot_restart.h)
+    bool suspends() const
+    {
+        return async;
+    }
+
+    // Ring thread: make the current or next readHeader fail so the handler can hand
+    // the connection over; a header read waiting for bytes is ended right away
+    void requestHandoff()
+    {
+        handoff = true;
+        if (LoopWaiter *parked = parkedHeader)
+        {
+            parkedHeader = nullptr;
+            waitForBytes(nullptr);
+            static_cast<HeaderRead *>(parked)->ok = false;
+            static_cast<HeaderRead *>(parked)->resumeLater();
+        }
+    }
+
+    bool handoffRequested() const
+    {
+        return handoff;
+    }
+
+    // After detach: bytes received but not parsed yet
+    std::string takeBuffered()
+    {
+        std::string bytes = reader.takeBuffered();
+        if (inbound)
+        {
+            char chunk[16 * 1024];
+            int n;
+            while ((n = inbound->tryReceive(chunk, sizeof(chunk))) > 0)
+            {
+                bytes.append(chunk, n);
+            }
+        }
+        return bytes;
+    }
+
+    // A session taken over from another process: its unparsed bytes come first
+    void preload(const std::string &bytes)
+    {
+        reader.preload(bytes);
+    }
+
+    HeaderRead readHeader(uint8_t wireVersion, CompactDecoder &decoder, PacketHeader &header,
+                          V2AliasInfo *alias = nullptr)
+    {
+        return HeaderRead(*this, wireVersion, decoder, header, alias);
+    }
+
+    ExactRead readExact(char *dest, size_t length)
+    {
+        return ExactRead(*this, dest, length);
+    }
+
+    Sleep sleep(unsigned milliseconds)
+    {
+        return Sleep(*this, milliseconds);
+    }
+
+    EgressBelow egressBelow(size_t limit)
+    {
+        return EgressBelow(*this, limit);
+    }
+
+    Reply wait(const AsyncResultRef &result)
+    {
+        return Reply(*this, result);
+    }
+
+    Drain drain(EgressQueue &queue)
+    {
+        return Drain(*this, queue);
+    }
+
+    Detach detach()
+    {
+        return Detach(*this);
+    }
+};
+
+#endif // SESSION_IO_H
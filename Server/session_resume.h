@@ -0,0 +1,229 @@
+#ifndef SESSION_RESUME_H
+#define SESSION_RESUME_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include "dedup.h"
+#include "egress.h"
+#include "timer_wheel.h"
+
+// ===== OPTIMIZATION: Resumable sessions =====
+// Purpose: A dropped connection used to end its session at once: subscriptions were
+// erased and the client had to log in and subscribe again topic by topic - after a
+// network blip, every client at the same moment. A login with FLAG_RESUME gets a
+// token in its ACK; when such a connection drops:
+// - The session stays registered with the broker for SESSION_RESUME_GRACE_MS with
+//   its subscriptions, delivering into a buffer queue that nothing writes (the usual
+//   per-connection cap applies, oldest audio frames are dropped first)
+// - A login presenting the token within the grace period takes the session over in
+//   one round trip: the ACK echoes the token, the buffered packets follow it
+// - Otherwise the session ends when the grace period runs out, as a disconnect did
+//   before; a login without the token under the same name ends it at once
+
+#define SESSION_RESUME_GRACE_MS 30000 // A dropped resumable session is kept this long
+#define SESSION_RESUME_BATCH 64       // Buffered packets moved to the new connection per lock
+
+// Write driver of a parked session's buffer: packets wait until the session is resumed
+class ParkedWriteDriver : public EgressDriver
+{
+public:
+    static ParkedWriteDriver &instance()
+    {
+        static ParkedWriteDriver driver;
+        return driver;
+    }
+
+    void requestWrite(const std::shared_ptr<EgressQueue> &) override {}
+};
+
+class SessionParking;
+
+// A logged-in session whose connection dropped, still registered with the broker
+struct ParkedSession : WheelTimer
+{
+    SessionParking &parking;
+    uint64_t token;
+    std::string username;
+    int clientId;                        // Broker id, subscriptions intact
+    uint8_t codecs;                      // Negotiated at login, the buffer was filled for these
+    bool clusterClaimed;                 // The username is claimed cluster-wide
+    std::shared_ptr<EgressQueue> buffer; // The broker's queue for the client while parked
+    DuplicateWindow publishIds;          // Publishes delivered so far (FLAG_DEDUP), retries stay retries
+
+    ParkedSession(SessionParking &p, uint64_t t, const std::string &name, int id, uint8_t c, bool claimed,
+                  const std::shared_ptr<EgressQueue> &queue, const DuplicateWindow &ids)
+        : parking(p), token(t), username(name), clientId(id), codecs(c), clusterClaimed(claimed), buffer(queue),
+          publishIds(ids) {}
+
+    ~ParkedSession()
+    {
+        buffer->writeFailed(); // Whatever was not taken over is dropped
+    }
+
+    unsigned expired(int64_t) override;
+};
+typedef std::shared_ptr<ParkedSession> ParkedSessionRef;
+
+class SessionParking
+{
+private:
+    TimerWheel &wheel;
+    std::function<void(const ParkedSession &)> endSession;
+    std::map<uint64_t, ParkedSessionRef> sessions; // token -> session
+    std::mutex parkingMutex;
+    std::random_device random; // Tokens, guarded by parkingMutex
+
+    ParkedSessionRef takeLocked(std::map<uint64_t, ParkedSessionRef>::iterator it)
+    {
+        ParkedSessionRef session = it->second;
+        sessions.erase(it);
+        return session;
+    }
+
+public:
+    explicit SessionParking(TimerWheel &timerWheel) : wheel(timerWheel) {}
+
+    // Ends a session that was not resumed: unregister it like a disconnect. Runs on
+    // the wheel thread when the grace period runs out, after the wheel is unlocked.
+    void setEndHandler(const std::function<void(const ParkedSession &)> &handler)
+    {
+        endSession = handler;
+    }
+
+    // Token for a resumable login: random, never 0 (0 asks for a new session)
+    uint64_t issueToken()
+    {
+        std::lock_guard<std::mutex> lock(parkingMutex);
+        uint64_t token = 0;
+        while (token == 0 || sessions.count(token))
+        {
+            token = ((uint64_t)random() << 32) | random();
+        }
+        return token;
+    }
+
+    // Queue that holds a parked client's packets: swapped in for its connection's queue
+    static std::shared_ptr<EgressQueue> makeBuffer()
+    {
+        return std::make_shared<EgressQueue>(INVALID_SOCKET, TlsSessionRef(), &ParkedWriteDriver::instance());
+    }
+
+    // The connection of a resumable session dropped; buffer already receives its packets
+    void park(uint64_t token, const std::string &username, int clientId, uint8_t codecs, bool clusterClaimed,
+              const std::shared_ptr<EgressQueue> &buffer, const DuplicateWindow &publishIds)
+    {
+        auto session = std::make_shared<ParkedSession>(*this, token, username, clientId, codecs, clusterClaimed, buffer,
+                                                       publishIds);
+        wheel.schedule(session.get(), SESSION_RESUME_GRACE_MS); // Armed before a resume can find it
+        std::lock_guard<std::mutex> lock(parkingMutex);
+        sessions[token] = session;
+    }
+
+    // A login presented token: the parked session, now the caller's, or null
+    // (unknown, expired, or parked under another name)
+    ParkedSessionRef take(uint64_t token, const std::string &username)
+    {
+        ParkedSessionRef session;
+        {
+            std::lock_guard<std::mutex> lock(parkingMutex);
+            auto it = sessions.find(token);
+            if (it == sessions.end() || it->second->username != username)
+                return nullptr;
+            session = takeLocked(it);
+        }
+        wheel.cancel(session.get());
+        return session;
+    }
+
+    // A session resumed under a codec set its buffer was not filled for: end it instead
+    void end(const ParkedSessionRef &session)
+    {
+        if (endSession)
+            endSession(*session);
+    }
+
+    // A login without the token: the name's parked session gives way
+    void endUser(const std::string &username)
+    {
+        ParkedSessionRef session;
+        {
+            std::lock_guard<std::mutex> lock(parkingMutex);
+            for (auto it = sessions.begin(); it != sessions.end(); ++it)
+            {
+                if (it->second->username == username)
+                {
+                    session = takeLocked(it);
+                    break;
+                }
+            }
+        }
+        if (!session)
+            return;
+        wheel.cancel(session.get());
+        end(session);
+    }
+
+    // Hot restart: only connected sessions move to the successor, parked ones end here
+    void endAll()
+    {
+        std::map<uint64_t, ParkedSessionRef> ending;
+        {
+            std::lock_guard<std::mutex> lock(parkingMutex);
+            ending.swap(sessions);
+        }
+        for (auto const &pair : ending)
+        {
+            wheel.cancel(pair.second.get());
+            end(pair.second);
+        }
+    }
+
+    // Grace period over (wheel thread, wheel locked): the session is taken out here, so
+    // no resume can claim it any more, and ended once the wheel is unlocked - ending
+    // it unregisters the client and may release its name in the cluster
+    void expire(ParkedSession *expiring)
+    {
+        ParkedSessionRef session;
+        {
+            std::lock_guard<std::mutex> lock(parkingMutex);
+            auto it = sessions.find(expiring->token);
+            if (it == sessions.end() || it->second.get() != expiring)
+                return; // Resumed meanwhile
+            session = takeLocked(it);
+        }
+        wheel.afterTick([this, session]
+                        { end(session); });
+    }
+
+    // Move a resumed session's buffered packets to its new connection, in scheduling
+    // order (dictionaries first). Returns the number of packets moved
+    static size_t transfer(EgressQueue &buffer, EgressQueue &target)
+    {
+        std::vector<EgressPacket> packets;
+        std::vector<std::vector<char>> headers;
+        size_t moved = 0;
+        while (buffer.takeBatch(packets, headers, SESSION_RESUME_BATCH))
+        {
+            for (auto const &packet : packets)
+            {
+                if (target.enqueue(packet.header, packet.payload))
+                    moved++;
+            }
+        }
+        return moved;
+    }
+};
+
+inline unsigned ParkedSession::expired(int64_t)
+{
+    parking.expire(this);
+    return 0;
+}
+
+#endif // SESSION_RESUME_H
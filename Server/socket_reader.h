@@ -0,0 +1,210 @@
+#ifndef SOCKET_READER_H
+#define SOCKET_READER_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstring>
+#include "../protocol.h"
+#include "../protocol_v2.h"
+#include "../tls_session.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#endif
+
+// Bytes delivered by an I/O backend (io_uring) instead of recv() on the socket
+class InboundSource
+{
+public:
+    virtual ~InboundSource() {}
+
+    // Block until bytes arrive; <= 0 on close or error
+    virtual int receive(char *dest, size_t length) = 0;
+
+    // Non-blocking: bytes already delivered, 0 on close, -1 if none yet
+    virtual int tryReceive(char *dest, size_t length) = 0;
+};
+typedef std::shared_ptr<InboundSource> InboundSourceRef;
+
+// ===== OPTIMIZATION: Buffered connection reader =====
+// Purpose: One recv() usually returns several small packets; serving header and
+// payload reads from a local buffer saves a syscall per read and lets the v2
+// header (variable length) be decoded without knowing its size up front.
+class SocketReader
+{
+private:
+    SOCKET sock;
+    TlsSessionRef tls; // Set when records are decrypted in user space
+    InboundSourceRef source; // Set when an I/O backend receives for this socket
+    std::vector<char> buffer;
+    size_t start; // First unread byte
+    size_t end;   // One past the last buffered byte
+
+    void compact()
+    {
+        if (start > 0)
+        {
+            std::memmove(buffer.data(), buffer.data() + start, end - start);
+            end -= start;
+            start = 0;
+        }
+    }
+
+    // Pull more bytes from the socket, compacting the buffer first
+    bool fill()
+    {
+        compact();
+        if (end == buffer.size())
+            return false; // Header larger than the buffer - malformed
+
+        int n = receive(buffer.data() + end, buffer.size() - end);
+        if (n <= 0)
+            return false;
+        end += n;
+        return true;
+    }
+
+    int receive(char *dest, size_t length)
+    {
+        if (tls)
+            return tls->receive(dest, length);
+        if (source)
+            return source->receive(dest, length);
+        return recv(sock, dest, (int)length, 0);
+    }
+
+public:
+    // session: the connection's TLS session, if any (kTLS receive needs no help)
+    // inbound: backend-delivered bytes, if the socket is not read directly
+    explicit SocketReader(SOCKET s, const TlsSessionRef &session = TlsSessionRef(),
+                          const InboundSourceRef &inbound = InboundSourceRef(), size_t capacity = 16 * 1024)
+        : sock(s), tls(session && !session->kernelRecv() ? session : TlsSessionRef()), source(inbound),
+          buffer(capacity), start(0), end(0)
+    {
+    }
+
+    // Read exactly length bytes (buffered bytes first, then straight from the socket)
+    bool readExact(char *dest, size_t length)
+    {
+        size_t available = end - start;
+        size_t fromBuffer = available < length ? available : length;
+        std::memcpy(dest, buffer.data() + start, fromBuffer);
+        start += fromBuffer;
+
+        size_t received = fromBuffer;
+        while (received < length)
+        {
+            // Small remainders go through the buffer so following packets are read ahead
+            if (length - received < buffer.size() / 2)
+            {
+                if (!fill())
+                    return false;
+                size_t chunk = end - start < length - received ? end - start : length - received;
+                std::memcpy(dest + received, buffer.data() + start, chunk);
+                start += chunk;
+                received += chunk;
+                continue;
+            }
+
+            int n = receive(dest + received, length - received);
+            if (n <= 0)
+                return false;
+            received += n;
+        }
+        return true;
+    }
+
+    // Read one packet header in the connection's negotiated wire format
+    // alias (optional) receives the v2 topic alias the header used, if any
+    bool readHeader(uint8_t wireVersion, CompactDecoder &decoder, PacketHeader &header,
+                    V2AliasInfo *alias = nullptr)
+    {
+        if (alias)
+            *alias = V2AliasInfo{0, false};
+        if (wireVersion < PROTOCOL_VERSION_2)
+            return readExact((char *)&header, sizeof(PacketHeader));
+
+        while (true)
+        {
+            int consumed = decoder.decodeHeader(buffer.data() + start, end - start, header, alias);
+            if (consumed > 0)
+            {
+                start += consumed;
+                return true;
+            }
+            if (consumed < 0 || !fill())
+                return false;
+        }
+    }
+
+    // Hot restart: bytes received but not parsed yet leave with the connection
+    std::string takeBuffered()
+    {
+        std::string bytes(buffer.data() + start, end - start);
+        start = end = 0;
+        return bytes;
+    }
+
+    // ... and are read first by the process that takes the connection over
+    void preload(const std::string &bytes)
+    {
+        compact();
+        if (buffer.size() - end < bytes.size())
+            buffer.resize(end + bytes.size());
+        std::memcpy(buffer.data() + end, bytes.data(), bytes.size());
+        end += bytes.size();
+    }
+
+    // ----- Non-blocking variants (coroutine handlers, see session_io.h) -----
+    // Each returns 1 when done, 0 when more bytes are needed, -1 on a protocol error
+
+    // Move whatever the inbound source already holds into the buffer
+    // Returns 1 if bytes were added, 0 if none are available yet, -1 on close/error
+    int pull()
+    {
+        compact();
+        if (end == buffer.size() || !source)
+            return -1;
+        int n = source->tryReceive(buffer.data() + end, buffer.size() - end);
+        if (n < 0)
+            return 0;
+        if (n == 0)
+            return -1;
+        end += n;
+        return 1;
+    }
+
+    int tryReadHeader(uint8_t wireVersion, CompactDecoder &decoder, PacketHeader &header, V2AliasInfo *alias)
+    {
+        if (alias)
+            *alias = V2AliasInfo{0, false};
+        if (wireVersion < PROTOCOL_VERSION_2)
+        {
+            if (end - start < sizeof(PacketHeader))
+                return 0;
+            std::memcpy(&header, buffer.data() + start, sizeof(PacketHeader));
+            start += sizeof(PacketHeader);
+            return 1;
+        }
+
+        int consumed = decoder.decodeHeader(buffer.data() + start, end - start, header, alias);
+        if (consumed > 0)
+            start += consumed;
+        return consumed > 0 ? 1 : consumed;
+    }
+
+    // done: bytes of dest already filled by earlier calls
+    int tryReadExact(char *dest, size_t length, size_t &done)
+    {
+        size_t chunk = end - start < length - done ? end - start : length - done;
+        std::memcpy(dest + done, buffer.data() + start, chunk);
+        start += chunk;
+        done += chunk;
+        return done == length ? 1 : 0;
+    }
+};
+
+#endif // SOCKET_READER_H
@@ -0,0 +1,229 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Monotonic milliseconds, for deadlines and activity stamps
+inline int64_t steadyMillis()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+class TimerWheel;
+
+// Intrusive timer entry: filing and cancelling never allocate
+class WheelTimer
+{
+public:
+    // Called on the wheel thread with the wheel locked (so it must not schedule or
+    // cancel timers itself, nor block; hand such work to TimerWheel::afterTick).
+    // Returns ms until the timer should fire again, 0 to stop.
+    virtual unsigned expired(int64_t now) = 0;
+
+protected:
+    WheelTimer() : prev(nullptr), next(nullptr), slot(nullptr), expiryTick(0) {}
+    ~WheelTimer() {}
+
+private:
+    friend class TimerWheel;
+    WheelTimer *prev;
+    WheelTimer *next;
+    WheelTimer **slot; // List head the timer is filed in, null when not armed
+    uint64_t expiryTick;
+};
+
+// ===== OPTIMIZATION: Hierarchical timer wheel =====
+// Purpose: Every connection carries idle and write-stall deadlines (liveness.h).
+// A sorted container would cost O(log n) per update; the wheel files a timer in
+// the slot of its expiry tick in O(1) and cancels by unlinking it.
+// - Level 0 has one slot per 100 ms tick, each higher level 64x coarser
+//   (6.4 s, 7 min, 7.5 h); timers cascade down a level as their time comes closer
+// - Deadlines that move on every packet are not re-filed per packet: the owner
+//   stamps its activity and, when the timer fires, files it again from that stamp
+class TimerWheel
+{
+private:
+    static constexpr unsigned TICK_MS = 100;
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+    static constexpr uint64_t MAX_DELTA = (1ull << (SLOT_BITS * LEVELS)) - 1; // Longer waits fire early
+
+    WheelTimer *slots[LEVELS][SLOTS];
+    uint64_t currentTick; // Last tick processed
+    int64_t startMs;
+    bool stopping;
+    std::vector<std::function<void()>> deferred; // See afterTick, guarded by wheelMutex
+    std::mutex wheelMutex;
+    std::condition_variable stopCv;
+    std::thread ticker;
+
+    void link(WheelTimer *timer)
+    {
+        uint64_t delta = timer->expiryTick - currentTick;
+        if (delta > MAX_DELTA)
+        {
+            delta = MAX_DELTA;
+            timer->expiryTick = currentTick + delta;
+        }
+
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ull << (SLOT_BITS * (level + 1))))
+        {
+            level++;
+        }
+        WheelTimer *&head = slots[level][(timer->expiryTick >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        timer->prev = nullptr;
+        timer->next = head;
+        if (head)
+            head->prev = timer;
+        head = timer;
+        timer->slot = &head;
+    }
+
+    void unlink(WheelTimer *timer)
+    {
+        if (timer->prev)
+            timer->prev->next = timer->next;
+        else
+            *timer->slot = timer->next;
+        if (timer->next)
+            timer->next->prev = timer->prev;
+        timer->prev = timer->next = nullptr;
+        timer->slot = nullptr;
+    }
+
+    // Move to the next tick: cascade coarser slots that came due, fire level 0
+    void step()
+    {
+        currentTick++;
+        for (int level = 1; level < LEVELS; level++)
+        {
+            if (currentTick & ((1ull << (SLOT_BITS * level)) - 1))
+                break;
+            WheelTimer *&head = slots[level][(currentTick >> (SLOT_BITS * level)) & (SLOTS - 1)];
+            WheelTimer *timer = head;
+            head = nullptr;
+            while (timer)
+            {
+                WheelTimer *next = timer->next;
+                link(timer);
+                timer = next;
+            }
+        }
+
+        WheelTimer *&head = slots[0][currentTick & (SLOTS - 1)];
+        int64_t now = steadyMillis();
+        while (head)
+        {
+            WheelTimer *timer = head;
+            unlink(timer);
+            unsigned again = timer->expired(now);
+            if (again > 0)
+            {
+                timer->expiryTick = currentTick + ticksFor(again);
+                link(timer); // Never lands in the slot being drained (delta >= 1)
+            }
+        }
+    }
+
+    static uint64_t ticksFor(unsigned milliseconds)
+    {
+        uint64_t ticks = (milliseconds + TICK_MS - 1) / TICK_MS;
+        return ticks > 0 ? ticks : 1;
+    }
+
+    void tickerLoop()
+    {
+        std::unique_lock<std::mutex> lock(wheelMutex);
+        while (!stopping)
+        {
+            stopCv.wait_for(lock, std::chrono::milliseconds(TICK_MS));
+            uint64_t target = (uint64_t)(steadyMillis() - startMs) / TICK_MS;
+            while (currentTick < target)
+            {
+                step();
+            }
+            if (deferred.empty())
+                continue;
+
+            // Work handed over by expired(): the wheel is free again while it runs
+            std::vector<std::function<void()>> work;
+            work.swap(deferred);
+            lock.unlock();
+            for (auto &call : work)
+            {
+                call();
+            }
+            work.clear(); // Whatever the calls held is released unlocked too
+            lock.lock();
+        }
+    }
+
+public:
+    TimerWheel() : currentTick(0), startMs(steadyMillis()), stopping(false)
+    {
+        for (auto &level : slots)
+        {
+            for (auto &slot : level)
+            {
+                slot = nullptr;
+            }
+        }
+    }
+
+    ~TimerWheel()
+    {
+        {
+            std::lock_guard<std::mutex> lock(wheelMutex);
+            stopping = true;
+        }
+        stopCv.notify_all();
+        if (ticker.joinable())
+            ticker.join();
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // Start the thread that advances the wheel
+    void start()
+    {
+        ticker = std::thread(&TimerWheel::tickerLoop, this);
+    }
+
+    // (Re)arm timer to fire in about milliseconds (rounded up to a tick)
+    void schedule(WheelTimer *timer, unsigned milliseconds)
+    {
+        std::lock_guard<std::mutex> lock(wheelMutex);
+        if (timer->slot)
+            unlink(timer);
+        timer->expiryTick = currentTick + ticksFor(milliseconds);
+        link(timer);
+    }
+
+    // From expired() only: run call on the wheel thread once the wheel is unlocked,
+    // for work that takes other locks or touches timers
+    void afterTick(std::function<void()> call)
+    {
+        deferred.push_back(std::move(call)); // wheelMutex is held by the caller's step()
+    }
+
+    // Disarm timer; once this returns its expired() is not running and will not run
+    void cancel(WheelTimer *timer)
+    {
+        std::lock_guard<std::mutex> lock(wheelMutex);
+        if (timer->slot)
+            unlink(timer);
+    }
+};
+
+#endif // TIMER_WHEEL_H
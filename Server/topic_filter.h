@@ -0,0 +1,494 @@
+#ifndef TOPIC_FILTER_H
+#define TOPIC_FILTER_H
+
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../protocol.h"
+
+// ===== OPTIMIZATION: Server-side subscription filters =====
+// Purpose: Subscribers that want a fraction of a topic used to receive all of it and
+// discard the rest, paying egress for every dropped message. A MSG_SUBSCRIBE with
+// FLAG_FILTER carries an expression; only matching publishes are queued to it.
+// - Compiled once at subscribe time into a flat node array (operators resolved, numbers
+//   parsed), evaluated with short-circuiting during fan-out
+// - Subscribers whose expressions compile to the same canonical text share one filter,
+//   so each distinct filter runs once per message however many clients use it
+// - Payload attributes are parsed only for filters that read them, once per message
+//
+// Expression grammar:
+//   expr  := term (("||" | "or") term)*
+//   term  := unary (("&&" | "and") unary)*
+//   unary := ("!" | "not") unary | "(" expr ")" | field [op value]
+//   op    := "==" | "=" | "!=" | "<" | "<=" | ">" | ">=" | "^=" (prefix) | "~=" (contains)
+// Fields: sender, topic, size (payload bytes); any other name is a payload attribute.
+// A field alone tests that it is present. <, <=, >, >= compare numbers (false if either
+// side is not one); the other operators compare text. Values are quoted ('..' or "..")
+// or bare words.
+// Payload attributes are key=value pairs separated by spaces, ',', ';', '&' or newlines,
+// e.g. "type=order price=12.5 region=eu"; a value may be double-quoted.
+
+#define MAX_FILTER_LEN 256   // Expression bytes in a MSG_SUBSCRIBE payload
+#define MAX_FILTER_NODES 64  // Comparisons and operators per expression
+
+// The message a filter looks at; attributes are parsed on first use
+class FilterMessage
+{
+private:
+    struct Attribute
+    {
+        std::string_view key;
+        std::string_view value;
+    };
+
+    std::string_view payload;
+    bool parsed;
+    std::vector<Attribute> attributes;
+
+    static bool isSeparator(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ',' || c == ';' || c == '&';
+    }
+
+    void parse()
+    {
+        parsed = true;
+        size_t i = 0;
+        while (i < payload.size())
+        {
+            while (i < payload.size() && isSeparator(payload[i]))
+                i++;
+            size_t keyStart = i;
+            while (i < payload.size() && !isSeparator(payload[i]) && payload[i] != '=')
+                i++;
+            if (i >= payload.size() || payload[i] != '=' || i == keyStart)
+            {
+                while (i < payload.size() && !isSeparator(payload[i]))
+                    i++; // Not a key=value token
+                continue;
+            }
+            std::string_view key = payload.substr(keyStart, i - keyStart);
+            i++;
+            size_t valueStart = i;
+            if (i < payload.size() && payload[i] == '"')
+            {
+                valueStart = ++i;
+                while (i < payload.size() && payload[i] != '"')
+                    i++;
+                attributes.push_back({key, payload.substr(valueStart, i - valueStart)});
+                if (i < payload.size())
+                    i++;
+                continue;
+            }
+            while (i < payload.size() && !isSeparator(payload[i]))
+                i++;
+            attributes.push_back({key, payload.substr(valueStart, i - valueStart)});
+        }
+    }
+
+public:
+    std::string_view sender;
+    std::string_view topic;
+
+    FilterMessage(const char *senderName, const char *topicName, const char *data, size_t length)
+        : payload(data ? std::string_view(data, length) : std::string_view()), parsed(false),
+          sender(senderName, strnlen(senderName, MAX_USERNAME_LEN)), topic(topicName, strnlen(topicName, MAX_TOPIC_LEN)) {}
+
+    size_t size() const
+    {
+        return payload.size();
+    }
+
+    // First value of a payload attribute; false if absent
+    bool attribute(const std::string &key, std::string_view &value)
+    {
+        if (!parsed)
+            parse();
+        for (auto const &attr : attributes)
+        {
+            if (attr.key == key)
+            {
+                value = attr.value;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+class TopicFilter
+{
+private:
+    enum Op : uint8_t
+    {
+        OP_AND,
+        OP_OR,
+        OP_NOT,
+        OP_EXISTS,
+        OP_EQ,
+        OP_NE,
+        OP_LT,
+        OP_LE,
+        OP_GT,
+        OP_GE,
+        OP_PREFIX,
+        OP_CONTAINS
+    };
+
+    enum Field : uint8_t
+    {
+        FIELD_SENDER,
+        FIELD_TOPIC,
+        FIELD_SIZE,
+        FIELD_ATTRIBUTE
+    };
+
+    struct Node
+    {
+        Op op;
+        uint8_t left, right; // Operand nodes of AND/OR (NOT: left)
+        Field field;
+        std::string name;  // Attribute name
+        std::string value; // Compared text
+        double number;     // value as a number, when numeric
+        bool numeric;
+    };
+
+    std::vector<Node> nodes; // Root is the last node
+    std::string canonicalText;
+    bool readsPayload;
+
+    // ----- Compilation -----
+
+    struct Parser
+    {
+        const std::string &text;
+        size_t pos;
+        std::string error;
+
+        explicit Parser(const std::string &expression) : text(expression), pos(0) {}
+
+        void skipSpace()
+        {
+            while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t'))
+                pos++;
+        }
+
+        bool accept(const char *token)
+        {
+            skipSpace();
+            size_t length = std::strlen(token);
+            if (text.compare(pos, length, token) != 0)
+                return false;
+            // Word operators must end at a word boundary
+            if (std::isalpha((unsigned char)token[0]) && pos + length < text.size() && isWordChar(text[pos + length]))
+                return false;
+            pos += length;
+            return true;
+        }
+
+        static bool isWordChar(char c)
+        {
+            return std::isalnum((unsigned char)c) || c == '_' || c == '.' || c == '-' || c == '+' || c == ':';
+        }
+
+        bool word(std::string &out)
+        {
+            skipSpace();
+            size_t start = pos;
+            while (pos < text.size() && isWordChar(text[pos]))
+                pos++;
+            out = text.substr(start, pos - start);
+            return !out.empty();
+        }
+
+        bool value(std::string &out)
+        {
+            skipSpace();
+            if (pos < text.size() && (text[pos] == '"' || text[pos] == '\''))
+            {
+                char quote = text[pos++];
+                size_t end = text.find(quote, pos);
+                if (end == std::string::npos)
+                {
+                    error = "unterminated string";
+                    return false;
+                }
+                out = text.substr(pos, end - pos);
+                pos = end + 1;
+                return true;
+            }
+            if (!word(out))
+            {
+                error = "value expected at " + std::to_string(pos);
+                return false;
+            }
+            return true;
+        }
+    };
+
+    static bool parseNumber(std::string_view text, double &number)
+    {
+        if (text.empty())
+            return false;
+        const char *end = text.data() + text.size();
+        auto result = std::from_chars(text.data(), end, number);
+        return result.ec == std::errc() && result.ptr == end;
+    }
+
+    // Appends a node, returns its index (-1 when the expression is too large)
+    int add(Parser &parser, Node node)
+    {
+        if (nodes.size() >= MAX_FILTER_NODES)
+        {
+            parser.error = "expression too large";
+            return -1;
+        }
+        nodes.push_back(std::move(node));
+        return (int)nodes.size() - 1;
+    }
+
+    int parseOr(Parser &parser)
+    {
+        int left = parseAnd(parser);
+        while (left >= 0 && (parser.accept("||") || parser.accept("or")))
+        {
+            int right = parseAnd(parser);
+            if (right < 0)
+                return -1;
+            left = add(parser, Node{OP_OR, (uint8_t)left, (uint8_t)right, FIELD_SENDER, "", "", 0, false});
+        }
+        return left;
+    }
+
+    int parseAnd(Parser &parser)
+    {
+        int left = parseUnary(parser);
+        while (left >= 0 && (parser.accept("&&") || parser.accept("and")))
+        {
+            int right = parseUnary(parser);
+            if (right < 0)
+                return -1;
+            left = add(parser, Node{OP_AND, (uint8_t)left, (uint8_t)right, FIELD_SENDER, "", "", 0, false});
+        }
+        return left;
+    }
+
+    int parseUnary(Parser &parser)
+    {
+        if (parser.accept("!") || parser.accept("not"))
+        {
+            int operand = parseUnary(parser);
+            if (operand < 0)
+                return -1;
+            return add(parser, Node{OP_NOT, (uint8_t)operand, 0, FIELD_SENDER, "", "", 0, false});
+        }
+        if (parser.accept("("))
+        {
+            int inner = parseOr(parser);
+            if (inner < 0)
+                return -1;
+            if (!parser.accept(")"))
+            {
+                parser.error = "')' expected at " + std::to_string(parser.pos);
+                return -1;
+            }
+            return inner;
+        }
+
+        Node node{OP_EXISTS, 0, 0, FIELD_ATTRIBUTE, "", "", 0, false};
+        if (!parser.word(node.name))
+        {
+            parser.error = "field expected at " + std::to_string(parser.pos);
+            return -1;
+        }
+        if (node.name == "sender")
+            node.field = FIELD_SENDER;
+        else if (node.name == "topic")
+            node.field = FIELD_TOPIC;
+        else if (node.name == "size")
+            node.field = FIELD_SIZE;
+
+        // Two-character operators first so "<=" is not read as "<"
+        static const struct
+        {
+            const char *token;
+            Op op;
+        } operators[] = {{"==", OP_EQ}, {"!=", OP_NE}, {"<=", OP_LE}, {">=", OP_GE}, {"^=", OP_PREFIX},
+                         {"~=", OP_CONTAINS}, {"=", OP_EQ}, {"<", OP_LT}, {">", OP_GT}};
+        bool compared = false;
+        for (auto const &candidate : operators)
+        {
+            if (parser.accept(candidate.token))
+            {
+                node.op = candidate.op;
+                compared = true;
+                break;
+            }
+        }
+        if (compared)
+        {
+            if (!parser.value(node.value))
+                return -1;
+            node.numeric = parseNumber(node.value, node.number);
+            if ((node.op == OP_LT || node.op == OP_LE || node.op == OP_GT || node.op == OP_GE) && !node.numeric)
+            {
+                parser.error = "number expected after " + node.name;
+                return -1;
+            }
+        }
+        if (node.field == FIELD_ATTRIBUTE || node.field == FIELD_SIZE)
+            readsPayload = true;
+        return add(parser, std::move(node));
+    }
+
+    static std::string quoted(const std::string &value)
+    {
+        return value.find('"') == std::string::npos ? "\"" + value + "\"" : "'" + value + "'";
+    }
+
+    std::string print(size_t index) const
+    {
+        static const char *const symbols[] = {"&&", "||", "!", "", "==", "!=", "<", "<=", ">", ">=", "^=", "~="};
+        const Node &node = nodes[index];
+        switch (node.op)
+        {
+        case OP_AND:
+        case OP_OR:
+            return "(" + print(node.left) + " " + symbols[node.op] + " " + print(node.right) + ")";
+        case OP_NOT:
+            return "!" + print(node.left);
+        case OP_EXISTS:
+            return node.name;
+        default:
+            return node.name + " " + symbols[node.op] + " " + (node.numeric ? node.value : quoted(node.value));
+        }
+    }
+
+    // ----- Evaluation -----
+
+    bool compare(const Node &node, std::string_view actual) const
+    {
+        switch (node.op)
+        {
+        case OP_EQ:
+            return actual == node.value;
+        case OP_NE:
+            return actual != node.value;
+        case OP_PREFIX:
+            return actual.substr(0, node.value.size()) == node.value;
+        case OP_CONTAINS:
+            return actual.find(node.value) != std::string_view::npos;
+        default:
+            break;
+        }
+        double number;
+        return parseNumber(actual, number) && compare(node, number);
+    }
+
+    bool compare(const Node &node, double number) const
+    {
+        switch (node.op)
+        {
+        case OP_EQ:
+            return node.numeric && number == node.number;
+        case OP_NE:
+            return !node.numeric || number != node.number;
+        case OP_LT:
+            return number < node.number;
+        case OP_LE:
+            return number <= node.number;
+        case OP_GT:
+            return number > node.number;
+        case OP_GE:
+            return number >= node.number;
+        default:
+            return false;
+        }
+    }
+
+    bool evaluate(size_t index, FilterMessage &message) const
+    {
+        const Node &node = nodes[index];
+        switch (node.op)
+        {
+        case OP_AND:
+            return evaluate(node.left, message) && evaluate(node.right, message);
+        case OP_OR:
+            return evaluate(node.left, message) || evaluate(node.right, message);
+        case OP_NOT:
+            return !evaluate(node.left, message);
+        default:
+            break;
+        }
+
+        std::string_view actual;
+        switch (node.field)
+        {
+        case FIELD_SENDER:
+            actual = message.sender;
+            break;
+        case FIELD_TOPIC:
+            actual = message.topic;
+            break;
+        case FIELD_SIZE:
+            return node.op == OP_EXISTS || compare(node, (double)message.size());
+        case FIELD_ATTRIBUTE:
+            if (!message.attribute(node.name, actual))
+                return node.op == OP_NE; // Absent: only "differs" holds
+            break;
+        }
+        return node.op == OP_EXISTS || compare(node, actual);
+    }
+
+    TopicFilter() : readsPayload(false) {}
+
+public:
+    // Compile an expression; null with error set if it is not valid
+    static std::shared_ptr<const TopicFilter> compile(const std::string &expression, std::string &error)
+    {
+        if (expression.empty() || expression.size() > MAX_FILTER_LEN)
+        {
+            error = "filter must be 1-" + std::to_string(MAX_FILTER_LEN) + " bytes";
+            return nullptr;
+        }
+        std::shared_ptr<TopicFilter> filter(new TopicFilter());
+        Parser parser(expression);
+        int root = filter->parseOr(parser);
+        parser.skipSpace();
+        if (root >= 0 && parser.pos != expression.size())
+            parser.error = "unexpected text at " + std::to_string(parser.pos);
+        if (!parser.error.empty() || root < 0)
+        {
+            error = parser.error.empty() ? "invalid filter" : parser.error;
+            return nullptr;
+        }
+        filter->canonicalText = filter->print(root);
+        return filter;
+    }
+
+    // Normalized expression: filters that print the same are the same filter
+    const std::string &canonical() const
+    {
+        return canonicalText;
+    }
+
+    // Whether evaluating looks at the payload (attributes or size): a compressed one must be inflated
+    bool needsPayload() const
+    {
+        return readsPayload;
+    }
+
+    bool matches(FilterMessage &message) const
+    {
+        return evaluate(nodes.size() - 1, message);
+    }
+};
+typedef std::shared_ptr<const TopicFilter> TopicFilterRef;
+
+#endif // TOPIC_FILTER_H
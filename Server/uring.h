@@ -0,0 +1,362 @@
+#ifndef URING_H
+#define URING_H
+
+// Minimal io_uring ring over the raw syscalls (Linux 6.0+), so the io_uring
+// backend builds without liburing. Only the pieces the server uses: SQE/CQE
+// rings, submit-and-wait, and provided receive buffers.
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+class Uring
+{
+private:
+    int ringFd;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned *sqArray;
+    unsigned sqeTail; // Next SQE to hand out; published to *sqTail on submit
+
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    io_uring_cqe *cqes;
+
+    template <typename T>
+    static T *at(void *base, uint32_t offset)
+    {
+        return (T *)((char *)base + offset);
+    }
+
+    static unsigned loadAcquire(const unsigned *p)
+    {
+        return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    }
+
+    static void storeRelease(unsigned *p, unsigned value)
+    {
+        __atomic_store_n(p, value, __ATOMIC_RELEASE);
+    }
+
+    int setup(unsigned entries, io_uring_params &params)
+    {
+        return (int)syscall(__NR_io_uring_setup, entries, &params);
+    }
+
+public:
+    Uring() : ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqRingSize(0), cqRingSize(0),
+              sqes((io_uring_sqe *)MAP_FAILED), sqesSize(0), sqHead(nullptr), sqTail(nullptr), sqMask(0),
+              sqEntries(0), sqArray(nullptr), sqeTail(0), cqHead(nullptr), cqTail(nullptr), cqMask(0),
+              cqes(nullptr)
+    {
+    }
+
+    ~Uring()
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (ringFd >= 0)
+            close(ringFd);
+    }
+
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    // entries SQEs, completionEntries CQEs; returns -errno on failure
+    int init(unsigned entries, unsigned completionEntries)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = completionEntries;
+        ringFd = setup(entries, params);
+        if (ringFd < 0 && errno == EINVAL)
+        {
+            // Older kernel: drop the task-run hints
+            std::memset(&params, 0, sizeof(params));
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = completionEntries;
+            ringFd = setup(entries, params);
+        }
+        if (ringFd < 0)
+            return -errno;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap)
+            sqRingSize = cqRingSize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return -errno;
+        cqRing = singleMap ? sqRing
+                           : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+            return -errno;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return -errno;
+
+        sqHead = at<unsigned>(sqRing, params.sq_off.head);
+        sqTail = at<unsigned>(sqRing, params.sq_off.tail);
+        sqMask = *at<unsigned>(sqRing, params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        sqArray = at<unsigned>(sqRing, params.sq_off.array);
+        sqeTail = *sqTail;
+
+        cqHead = at<unsigned>(cqRing, params.cq_off.head);
+        cqTail = at<unsigned>(cqRing, params.cq_off.tail);
+        cqMask = *at<unsigned>(cqRing, params.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(cqRing, params.cq_off.cqes);
+        return 0;
+    }
+
+    // Zeroed SQE, or nullptr when the submission queue is full (submit first)
+    io_uring_sqe *getSqe()
+    {
+        if (sqeTail - loadAcquire(sqHead) >= sqEntries)
+            return nullptr;
+        io_uring_sqe *sqe = &sqes[sqeTail & sqMask];
+        sqeTail++;
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // One io_uring_enter: submit every prepared SQE and wait for waitFor completions
+    // Returns the number submitted or -errno
+    int submitAndWait(unsigned waitFor)
+    {
+        unsigned tail = *sqTail;
+        unsigned toSubmit = sqeTail - tail;
+        for (unsigned i = tail; i != sqeTail; i++)
+        {
+            sqArray[i & sqMask] = i & sqMask;
+        }
+        storeRelease(sqTail, sqeTail);
+
+        if (toSubmit == 0 && waitFor == 0)
+            return 0;
+        int ret;
+        do
+        {
+            ret = (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor,
+                               waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        } while (ret < 0 && errno == EINTR && waitFor == 0);
+        return ret < 0 ? -errno : ret;
+    }
+
+    // Hand every ready completion to fn(const io_uring_cqe &), then release them
+    template <typename Fn>
+    unsigned drainCompletions(Fn fn)
+    {
+        unsigned head = *cqHead;
+        unsigned tail = loadAcquire(cqTail);
+        unsigned count = 0;
+        while (head != tail)
+        {
+            fn(cqes[head & cqMask]);
+            head++;
+            count++;
+            if (head == tail)
+                tail = loadAcquire(cqTail);
+        }
+        storeRelease(cqHead, head);
+        return count;
+    }
+
+    // Register a provided buffer ring (entries must be a power of two); -errno on failure
+    int registerBufferRing(io_uring_buf_ring *ring, unsigned entries, unsigned short group)
+    {
+        io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)ring;
+        reg.ring_entries = entries;
+        reg.bgid = group;
+        int ret = (int)syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1);
+        return ret < 0 ? -errno : ret;
+    }
+
+    int unregisterBufferRing(unsigned short group)
+    {
+        io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.bgid = group;
+        int ret = (int)syscall(__NR_io_uring_register, ringFd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        return ret < 0 ? -errno : ret;
+    }
+};
+
+// Provided receive buffers: the kernel picks one for each multishot recv
+// completion, the owner hands it back with recycle() once the bytes are consumed.
+// A registered buffer ring is used when it works; some kernels accept the
+// registration but never hand out its buffers, so init() probes one recv and
+// otherwise falls back to IORING_OP_PROVIDE_BUFFERS (same recv SQEs, one extra
+// SQE per recycled buffer, submitted with the next batch).
+class UringBufferRing
+{
+private:
+    io_uring_buf_ring *ring; // MAP_FAILED in fallback mode
+    size_t ringBytes;
+    char *buffers;
+    unsigned count;
+    unsigned bufferSize;
+    unsigned short group;
+    unsigned short tail;
+
+    // Recv one byte through the buffer group; true if a buffer was selected
+    bool probe(Uring &uring)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+            return false;
+        bool works = false;
+        io_uring_sqe *sqe = uring.getSqe();
+        if (sqe && write(pair[1], "", 1) == 1)
+        {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = pair[0];
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = group;
+            if (uring.submitAndWait(1) >= 0)
+            {
+                uring.drainCompletions([&](const io_uring_cqe &cqe)
+                                       {
+                    if (cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER))
+                    {
+                        works = true;
+                        recycle(uring, (unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+                    } });
+            }
+        }
+        close(pair[0]);
+        close(pair[1]);
+        return works;
+    }
+
+    int provideAll(Uring &uring)
+    {
+        io_uring_sqe *sqe = uring.getSqe();
+        if (!sqe)
+            return -EBUSY;
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = (int)count;
+        sqe->addr = (uint64_t)(uintptr_t)buffers;
+        sqe->len = bufferSize;
+        sqe->buf_group = group;
+        int ret = uring.submitAndWait(1);
+        uring.drainCompletions([&](const io_uring_cqe &cqe)
+                               { ret = cqe.res < 0 ? cqe.res : ret; });
+        return ret < 0 ? ret : 0;
+    }
+
+public:
+    UringBufferRing() : ring((io_uring_buf_ring *)MAP_FAILED), ringBytes(0), buffers((char *)MAP_FAILED),
+                        count(0), bufferSize(0), group(0), tail(0)
+    {
+    }
+
+    ~UringBufferRing()
+    {
+        if (ring != MAP_FAILED)
+            munmap(ring, ringBytes);
+        if (buffers != MAP_FAILED)
+            munmap(buffers, (size_t)count * bufferSize);
+    }
+
+    UringBufferRing(const UringBufferRing &) = delete;
+    UringBufferRing &operator=(const UringBufferRing &) = delete;
+
+    // bufferCount must be a power of two; call before anything else is queued
+    // on the ring. -errno on failure.
+    int init(Uring &uring, unsigned bufferCount, unsigned size, unsigned short bufferGroup)
+    {
+        count = bufferCount;
+        bufferSize = size;
+        group = bufferGroup;
+        buffers = (char *)mmap(nullptr, (size_t)count * bufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffers == MAP_FAILED)
+            return -ENOMEM;
+
+        ringBytes = (size_t)count * sizeof(io_uring_buf);
+        ring = (io_uring_buf_ring *)mmap(nullptr, ringBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring != MAP_FAILED && uring.registerBufferRing(ring, count, group) == 0)
+        {
+            for (unsigned id = 0; id < count; id++)
+            {
+                recycle(uring, (unsigned short)id);
+            }
+            if (probe(uring))
+                return 0;
+            uring.unregisterBufferRing(group);
+        }
+        if (ring != MAP_FAILED)
+            munmap(ring, ringBytes);
+        ring = (io_uring_buf_ring *)MAP_FAILED;
+        return provideAll(uring);
+    }
+
+    bool registeredRing() const
+    {
+        return ring != MAP_FAILED;
+    }
+
+    const char *data(unsigned short id) const
+    {
+        return buffers + (size_t)id * bufferSize;
+    }
+
+    void recycle(Uring &uring, unsigned short id)
+    {
+        if (ring == MAP_FAILED)
+        {
+            io_uring_sqe *sqe = uring.getSqe();
+            if (!sqe)
+            {
+                uring.submitAndWait(0);
+                sqe = uring.getSqe();
+            }
+            sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe->fd = 1;
+            sqe->addr = (uint64_t)(uintptr_t)data(id);
+            sqe->len = bufferSize;
+            sqe->buf_group = group;
+            sqe->off = id;
+            return;
+        }
+
+        io_uring_buf &buf = ring->bufs[tail & (count - 1)];
+        buf.addr = (uint64_t)(uintptr_t)data(id);
+        buf.len = bufferSize;
+        buf.bid = id;
+        tail++;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+};
+
+#endif // __linux__
+
+#endif // URING_H
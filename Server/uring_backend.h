@@ -0,0 +1,771 @@
+#ifndef URING_BACKEND_H
+#define URING_BACKEND_H
+
+#include <coroutine>
+#include <functional>
+#include <memory>
+#include "egress.h"
+#include "socket_reader.h"
+#include "uring.h"
+
+// ===== OPTIMIZATION: io_uring I/O backend (server --io uring, Linux) =====
+// Purpose: With one blocking send() per packet per subscriber, a publish to N
+// subscribers costs N syscalls and N writer wake-ups. Here a single ring thread
+// owns the socket I/O:
+// - Both listening sockets use multishot accept (one SQE for every connection)
+// - Each connection has one multishot recv drawing from a provided buffer ring;
+//   bytes are handed to the connection's handler through UringInbound
+// - EgressQueues get no writer thread: a queue with work asks the ring thread,
+//   which takes a batch of packets (scheduling order unchanged) and writes them
+//   with one SENDMSG (header + payload iovecs). Every queue touched by a fan-out
+//   goes out in the same io_uring_enter.
+// Connection handlers run as coroutines on the ring thread (session_io.h), woken
+// through LoopWaiter; a TLS session decrypting in user space keeps its own thread.
+
+typedef std::function<void(SOCKET)> AcceptHandler; // INVALID_SOCKET when accept failed
+
+// Something suspended on the ring thread until a completion arrives
+// (the coroutine awaitables in session_io.h). wake() runs on the ring thread.
+class LoopWaiter
+{
+public:
+    virtual void wake() = 0;
+
+protected:
+    ~LoopWaiter() {}
+};
+
+#ifdef HAVE_IO_URING
+
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class UringBackend;
+
+// Receive side of one connection: the ring thread appends, the handler reads
+class UringInbound : public InboundSource, public std::enable_shared_from_this<UringInbound>
+{
+private:
+    friend class UringBackend;
+
+    // Buffered bytes at which the recv is cancelled until the handler catches up
+    static const size_t HIGH_WATER = 1024 * 1024;
+    static const size_t LOW_WATER = 256 * 1024;
+
+    UringBackend &backend;
+    SOCKET sock;
+    std::vector<char> bytes;
+    size_t start; // First unread byte
+    bool eof;
+    bool paused;   // Over HIGH_WATER: recv not re-armed
+    bool detached; // Ring thread no longer references the socket
+    LoopWaiter *waiter; // Coroutine waiting for bytes (ring thread only)
+    std::mutex inboundMutex;
+    std::condition_variable inboundCv;
+
+    // Ring thread: hand new bytes (or EOF) to a waiting coroutine
+    void wakeWaiter()
+    {
+        LoopWaiter *w = waiter;
+        waiter = nullptr;
+        if (w)
+            w->wake();
+    }
+
+    // Copy out buffered bytes (lock held, released before a resume request)
+    int take(std::unique_lock<std::mutex> &lock, char *dest, size_t length);
+
+    // Ring thread: returns false when the handler has fallen too far behind
+    bool push(const char *data, size_t length)
+    {
+        bool keepReceiving;
+        {
+            std::lock_guard<std::mutex> lock(inboundMutex);
+            bytes.insert(bytes.end(), data, data + length);
+            keepReceiving = bytes.size() - start < HIGH_WATER;
+            paused = paused || !keepReceiving;
+        }
+        inboundCv.notify_one();
+        return keepReceiving;
+    }
+
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(inboundMutex);
+            eof = true;
+        }
+        inboundCv.notify_all();
+    }
+
+    void markDetached()
+    {
+        {
+            std::lock_guard<std::mutex> lock(inboundMutex);
+            detached = true;
+        }
+        inboundCv.notify_all();
+    }
+
+    bool isPaused()
+    {
+        std::lock_guard<std::mutex> lock(inboundMutex);
+        return paused;
+    }
+
+public:
+    UringInbound(UringBackend &owner, SOCKET s)
+        : backend(owner), sock(s), start(0), eof(false), paused(false), detached(false), waiter(nullptr)
+    {
+    }
+
+    int receive(char *dest, size_t length) override
+    {
+        std::unique_lock<std::mutex> lock(inboundMutex);
+        inboundCv.wait(lock, [this]
+                       { return start < bytes.size() || eof; });
+        return take(lock, dest, length);
+    }
+
+    int tryReceive(char *dest, size_t length) override
+    {
+        std::unique_lock<std::mutex> lock(inboundMutex);
+        if (start == bytes.size() && !eof)
+            return -1;
+        return take(lock, dest, length);
+    }
+
+    // Ring thread: wake w once bytes or EOF arrive
+    void setWaiter(LoopWaiter *w)
+    {
+        waiter = w;
+    }
+};
+typedef std::shared_ptr<UringInbound> UringInboundRef;
+
+class UringBackend : public EgressDriver
+{
+private:
+    static const unsigned RING_ENTRIES = 4096;
+    static const unsigned COMPLETION_ENTRIES = 16384;
+    static const unsigned RECV_BUFFER_COUNT = 512; // Power of two
+    static const unsigned RECV_BUFFER_SIZE = 16 * 1024;
+    static const unsigned short RECV_BUFFER_GROUP = 0;
+    static const size_t SEND_BATCH_PACKETS = 32; // Two iovecs each
+
+    enum OperationKind
+    {
+        OP_ACCEPT,
+        OP_RECV,
+        OP_SEND,
+        OP_WAKE,
+        OP_TIMER
+    };
+
+    // user_data of every SQE points at one of these (0 = ignore the completion)
+    struct Operation
+    {
+        OperationKind kind;
+        explicit Operation(OperationKind k) : kind(k) {}
+    };
+
+    struct AcceptOp : Operation
+    {
+        SOCKET listener;
+        AcceptHandler handler;
+        AcceptOp(SOCKET s, const AcceptHandler &h) : Operation(OP_ACCEPT), listener(s), handler(h) {}
+    };
+
+    struct RecvOp : Operation
+    {
+        UringInboundRef inbound;
+        bool armed;       // Multishot recv outstanding
+        bool cancelling;  // Cancel submitted, final completion pending
+        bool detaching;   // Handler is waiting to close the socket
+        LoopWaiter *detachWaiter; // Coroutine handler waiting for the detach
+        explicit RecvOp(const UringInboundRef &in)
+            : Operation(OP_RECV), inbound(in), armed(false), cancelling(false), detaching(false),
+              detachWaiter(nullptr) {}
+    };
+
+    struct SendOp : Operation
+    {
+        std::shared_ptr<EgressQueue> queue;
+        std::vector<EgressPacket> packets;
+        std::vector<std::vector<char>> headers;
+        std::vector<iovec> iov;
+        msghdr message;
+        SendOp() : Operation(OP_SEND) {}
+    };
+
+    struct TimerOp : Operation
+    {
+        __kernel_timespec timeout;
+        LoopWaiter *waiter;
+        TimerOp() : Operation(OP_TIMER), waiter(nullptr) {}
+    };
+
+    enum RequestKind
+    {
+        REQUEST_ATTACH,
+        REQUEST_DETACH,
+        REQUEST_RESUME,
+        REQUEST_WRITE,
+        REQUEST_CALL
+    };
+
+    struct Request
+    {
+        RequestKind kind;
+        UringInboundRef inbound;
+        std::shared_ptr<EgressQueue> queue;
+        std::function<void()> call; // REQUEST_CALL
+    };
+
+    Uring ring;
+    UringBufferRing recvBuffers;
+    int wakeFd;
+    uint64_t wakeValue;
+    Operation wakeOp;
+
+    // Other threads -> ring thread
+    std::vector<Request> requests;
+    std::mutex requestMutex;
+    std::atomic<bool> wakePending;
+
+    // Ring thread only
+    std::vector<std::unique_ptr<AcceptOp>> acceptOps;
+    std::map<UringInbound *, std::unique_ptr<RecvOp>> receivers;
+    std::map<EgressQueue *, std::unique_ptr<SendOp>> senders;
+    std::vector<std::unique_ptr<SendOp>> idleSenders;
+    std::map<EgressQueue *, LoopWaiter *> drainWaiters;
+    std::deque<std::coroutine_handle<>> ready; // Coroutines to resume this iteration
+    std::thread::id loopThread;
+
+    void post(const Request &request)
+    {
+        {
+            std::lock_guard<std::mutex> lock(requestMutex);
+            requests.push_back(request);
+        }
+        // One eventfd write per ring-thread wake-up, however many requests pile up;
+        // none from the ring thread itself, which checks the list before waiting
+        if (!onLoopThread() && !wakePending.exchange(true))
+        {
+            uint64_t one = 1;
+            ssize_t written = write(wakeFd, &one, sizeof(one));
+            (void)written;
+        }
+    }
+
+    io_uring_sqe *nextSqe()
+    {
+        io_uring_sqe *sqe = ring.getSqe();
+        if (!sqe)
+        {
+            ring.submitAndWait(0); // Queue full: flush what is prepared
+            sqe = ring.getSqe();
+        }
+        return sqe;
+    }
+
+    void armWake()
+    {
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakeFd;
+        sqe->addr = (uint64_t)(uintptr_t)&wakeValue;
+        sqe->len = sizeof(wakeValue);
+        sqe->user_data = (uint64_t)(uintptr_t)&wakeOp;
+    }
+
+    void armAccept(AcceptOp *op)
+    {
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = op->listener;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = (uint64_t)(uintptr_t)op;
+    }
+
+    void armRecv(RecvOp *op)
+    {
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = op->inbound->sock;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RECV_BUFFER_GROUP;
+        sqe->user_data = (uint64_t)(uintptr_t)op;
+        op->armed = true;
+    }
+
+    void cancelRecv(RecvOp *op)
+    {
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uint64_t)(uintptr_t)op;
+        sqe->user_data = 0;
+        op->cancelling = true;
+    }
+
+    void submitSend(SendOp *op)
+    {
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = op->queue->socket();
+        sqe->addr = (uint64_t)(uintptr_t)&op->message;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = (uint64_t)(uintptr_t)op;
+    }
+
+    // Write the queue's next batch, or let the queue go when it has none
+    void startSend(SendOp *op)
+    {
+        if (!op->queue->takeBatch(op->packets, op->headers, SEND_BATCH_PACKETS))
+        {
+            releaseSender(op);
+            return;
+        }
+
+        op->iov.clear();
+        for (size_t i = 0; i < op->packets.size(); i++)
+        {
+            op->iov.push_back(iovec{op->headers[i].data(), op->headers[i].size()});
+            const SharedPayload &payload = op->packets[i].payload;
+            if (payload && !payload->empty())
+                op->iov.push_back(iovec{(void *)payload->data(), payload->size()});
+        }
+        std::memset(&op->message, 0, sizeof(op->message));
+        op->message.msg_iov = op->iov.data();
+        op->message.msg_iovlen = op->iov.size();
+        submitSend(op);
+    }
+
+    void releaseSender(SendOp *op)
+    {
+        auto it = senders.find(op->queue.get());
+        if (it == senders.end())
+            return;
+        auto drained = drainWaiters.find(op->queue.get());
+        if (drained != drainWaiters.end())
+        {
+            drained->second->wake();
+            drainWaiters.erase(drained);
+        }
+        op->queue.reset();
+        op->packets.clear(); // Drop the payload references now
+        idleSenders.push_back(std::move(it->second));
+        senders.erase(it);
+    }
+
+    void completeSend(SendOp *op, int result)
+    {
+        if (result < 0)
+        {
+            op->queue->writeFailed();
+            releaseSender(op);
+            return;
+        }
+        op->queue->recordProgress();
+
+        // Short write: skip what went out and send the rest
+        size_t sent = (size_t)result;
+        while (op->message.msg_iovlen > 0 && sent >= op->message.msg_iov->iov_len)
+        {
+            sent -= op->message.msg_iov->iov_len;
+            op->message.msg_iov++;
+            op->message.msg_iovlen--;
+        }
+        if (op->message.msg_iovlen == 0)
+        {
+            startSend(op);
+            return;
+        }
+        op->message.msg_iov->iov_base = (char *)op->message.msg_iov->iov_base + sent;
+        op->message.msg_iov->iov_len -= sent;
+        submitSend(op);
+    }
+
+    void completeRecv(RecvOp *op, const io_uring_cqe &cqe)
+    {
+        if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+        {
+            unsigned short id = (unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            bool keepReceiving = op->inbound->push(recvBuffers.data(id), (size_t)cqe.res);
+            recvBuffers.recycle(ring, id);
+            if (!keepReceiving && (cqe.flags & IORING_CQE_F_MORE) && !op->cancelling)
+                cancelRecv(op);
+            op->inbound->wakeWaiter();
+        }
+        if (cqe.flags & IORING_CQE_F_MORE)
+            return;
+
+        // The multishot recv ended: peer closed, error, cancel, or out of buffers
+        op->armed = false;
+        op->cancelling = false;
+        bool closed = cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED);
+        if (closed)
+        {
+            op->inbound->finish();
+            op->inbound->wakeWaiter();
+        }
+        if (op->detaching)
+        {
+            finishDetach(op);
+            return;
+        }
+        if (!closed && !op->inbound->isPaused())
+            armRecv(op);
+    }
+
+    void finishDetach(RecvOp *op)
+    {
+        UringInboundRef inbound = op->inbound;
+        LoopWaiter *waiter = op->detachWaiter;
+        receivers.erase(inbound.get());
+        inbound->markDetached();
+        if (waiter)
+            waiter->wake();
+    }
+
+    void attachOnLoop(const UringInboundRef &inbound)
+    {
+        std::unique_ptr<RecvOp> op(new RecvOp(inbound));
+        armRecv(op.get());
+        receivers[inbound.get()] = std::move(op);
+    }
+
+    void complete(const io_uring_cqe &cqe)
+    {
+        Operation *op = (Operation *)(uintptr_t)cqe.user_data;
+        if (!op)
+            return;
+
+        switch (op->kind)
+        {
+        case OP_WAKE:
+            wakePending.store(false);
+            armWake();
+            break;
+
+        case OP_ACCEPT:
+        {
+            AcceptOp *accept = (AcceptOp *)op;
+            accept->handler(cqe.res >= 0 ? (SOCKET)cqe.res : INVALID_SOCKET);
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+                armAccept(accept);
+            break;
+        }
+
+        case OP_RECV:
+            completeRecv((RecvOp *)op, cqe);
+            break;
+
+        case OP_SEND:
+            completeSend((SendOp *)op, cqe.res);
+            break;
+
+        case OP_TIMER:
+        {
+            TimerOp *timer = (TimerOp *)op;
+            timer->waiter->wake();
+            delete timer;
+            break;
+        }
+        }
+    }
+
+    void processRequests()
+    {
+        std::vector<Request> pending;
+        {
+            std::lock_guard<std::mutex> lock(requestMutex);
+            pending.swap(requests);
+        }
+
+        for (auto &request : pending)
+        {
+            switch (request.kind)
+            {
+            case REQUEST_ATTACH:
+                attachOnLoop(request.inbound);
+                break;
+
+            case REQUEST_DETACH:
+            {
+                auto it = receivers.find(request.inbound.get());
+                if (it == receivers.end())
+                    break;
+                RecvOp *op = it->second.get();
+                op->detaching = true;
+                if (!op->armed)
+                    finishDetach(op);
+                else if (!op->cancelling)
+                    cancelRecv(op);
+                break;
+            }
+
+            case REQUEST_RESUME:
+            {
+                auto it = receivers.find(request.inbound.get());
+                if (it != receivers.end() && !it->second->armed && !it->second->detaching)
+                    armRecv(it->second.get());
+                break;
+            }
+
+            case REQUEST_WRITE:
+            {
+                if (senders.count(request.queue.get()))
+                    break; // Batch in flight - its completion takes the rest
+                std::unique_ptr<SendOp> op;
+                if (idleSenders.empty())
+                {
+                    op.reset(new SendOp());
+                }
+                else
+                {
+                    op = std::move(idleSenders.back());
+                    idleSenders.pop_back();
+                }
+                SendOp *sender = op.get();
+                sender->queue = request.queue;
+                senders[request.queue.get()] = std::move(op);
+                startSend(sender);
+                break;
+            }
+
+            case REQUEST_CALL:
+                request.call();
+                break;
+            }
+        }
+    }
+
+public:
+    UringBackend() : wakeFd(-1), wakeValue(0), wakeOp(OP_WAKE), wakePending(false) {}
+
+    ~UringBackend()
+    {
+        if (wakeFd >= 0)
+            close(wakeFd);
+    }
+
+    UringBackend(const UringBackend &) = delete;
+    UringBackend &operator=(const UringBackend &) = delete;
+
+    static bool supported() { return true; }
+
+    // Create the ring and register the receive buffers; -errno on failure
+    int init()
+    {
+        int ret = ring.init(RING_ENTRIES, COMPLETION_ENTRIES);
+        if (ret < 0)
+            return ret;
+        ret = recvBuffers.init(ring, RECV_BUFFER_COUNT, RECV_BUFFER_SIZE, RECV_BUFFER_GROUP);
+        if (ret < 0)
+            return ret;
+        wakeFd = eventfd(0, EFD_CLOEXEC);
+        return wakeFd < 0 ? -errno : 0;
+    }
+
+    // Accept connections on a listening socket (call before run)
+    void listen(SOCKET listener, const AcceptHandler &handler)
+    {
+        acceptOps.emplace_back(new AcceptOp(listener, handler));
+    }
+
+    // Ring thread main loop: one io_uring_enter submits everything prepared since
+    // the last one and waits for the next completion. Returns -errno on failure.
+    int run()
+    {
+        loopThread = std::this_thread::get_id();
+        armWake();
+        for (auto &op : acceptOps)
+        {
+            armAccept(op.get());
+        }
+
+        while (true)
+        {
+            int ret = ring.submitAndWait(1);
+            if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+                return ret;
+            ring.drainCompletions([this](const io_uring_cqe &cqe)
+                                  { complete(cqe); });
+            processRequests();
+
+            // Resumed handlers queue sends and waits of their own: pick those up
+            // before going back into the kernel
+            while (!ready.empty())
+            {
+                std::coroutine_handle<> handle = ready.front();
+                ready.pop_front();
+                handle.resume();
+                if (ready.empty())
+                    processRequests();
+            }
+        }
+    }
+
+    bool onLoopThread() const
+    {
+        return std::this_thread::get_id() == loopThread;
+    }
+
+    // ----- Ring thread only: used by the coroutine awaitables -----
+
+    // Resume a coroutine once the current completions are handled
+    void schedule(std::coroutine_handle<> handle)
+    {
+        ready.push_back(handle);
+    }
+
+    void addTimer(LoopWaiter *waiter, unsigned milliseconds)
+    {
+        TimerOp *op = new TimerOp();
+        op->waiter = waiter;
+        op->timeout.tv_sec = milliseconds / 1000;
+        op->timeout.tv_nsec = (long long)(milliseconds % 1000) * 1000000;
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uint64_t)(uintptr_t)&op->timeout;
+        sqe->len = 1;
+        sqe->user_data = (uint64_t)(uintptr_t)op;
+    }
+
+    // Wake waiter when the queue (already closing) has written or dropped everything
+    void waitDrained(EgressQueue *queue, LoopWaiter *waiter)
+    {
+        drainWaiters[queue] = waiter;
+    }
+
+    // Stop receiving for a coroutine handler. Returns true if the socket can be
+    // closed right away, otherwise waiter is woken once the recv is cancelled.
+    bool detachOnLoop(const InboundSourceRef &source, LoopWaiter *waiter)
+    {
+        auto it = receivers.find((UringInbound *)source.get());
+        if (it == receivers.end())
+            return true;
+        RecvOp *op = it->second.get();
+        op->detaching = true;
+        if (!op->armed)
+        {
+            finishDetach(op);
+            return true;
+        }
+        op->detachWaiter = waiter;
+        if (!op->cancelling)
+            cancelRecv(op);
+        return false;
+    }
+
+    // Handler thread: receive through the ring from now on. Returns null when the
+    // socket must still be read directly (TLS decrypted in user space).
+    InboundSourceRef attach(SOCKET sock, const TlsSessionRef &tls)
+    {
+        if (tls && !tls->kernelRecv())
+            return InboundSourceRef();
+        UringInboundRef inbound = std::make_shared<UringInbound>(*this, sock);
+        if (onLoopThread())
+            attachOnLoop(inbound); // Coroutine handler: armed before it first waits
+        else
+            post(Request{REQUEST_ATTACH, inbound, nullptr, nullptr});
+        return inbound;
+    }
+
+    // Handler thread: stop receiving and wait until the socket can be closed
+    void detach(const InboundSourceRef &source)
+    {
+        UringInboundRef inbound = std::static_pointer_cast<UringInbound>(source);
+        if (!inbound)
+            return;
+        post(Request{REQUEST_DETACH, inbound, nullptr, nullptr});
+        std::unique_lock<std::mutex> lock(inbound->inboundMutex);
+        inbound->inboundCv.wait(lock, [&]
+                                { return inbound->detached; });
+    }
+
+    void resume(const UringInboundRef &inbound)
+    {
+        post(Request{REQUEST_RESUME, inbound, nullptr, nullptr});
+    }
+
+    void requestWrite(const std::shared_ptr<EgressQueue> &queue) override
+    {
+        post(Request{REQUEST_WRITE, nullptr, queue, nullptr});
+    }
+
+    // Any thread: run call on the ring thread (e.g. start a coroutine handler there)
+    void runOnLoop(const std::function<void()> &call)
+    {
+        post(Request{REQUEST_CALL, nullptr, nullptr, call});
+    }
+
+    // How receive buffers are provided to the kernel, for the startup log
+    const char *describe() const
+    {
+        return recvBuffers.registeredRing() ? "multishot accept/recv, buffer ring, batched sends"
+                                            : "multishot accept/recv, provided buffers, batched sends";
+    }
+};
+
+inline int UringInbound::take(std::unique_lock<std::mutex> &lock, char *dest, size_t length)
+{
+    size_t available = bytes.size() - start;
+    if (available == 0)
+        return 0;
+    size_t n = available < length ? available : length;
+    std::memcpy(dest, bytes.data() + start, n);
+    start += n;
+    if (start == bytes.size())
+    {
+        bytes.clear();
+        start = 0;
+    }
+    else if (start >= LOW_WATER)
+    {
+        bytes.erase(bytes.begin(), bytes.begin() + start);
+        start = 0;
+    }
+    bool resume = paused && bytes.size() - start <= LOW_WATER;
+    paused = paused && !resume;
+    lock.unlock();
+
+    if (resume)
+        backend.resume(shared_from_this());
+    return (int)n;
+}
+
+#else
+
+// Not Linux (or no io_uring headers): --io uring is refused at startup
+class UringBackend : public EgressDriver
+{
+public:
+    static bool supported() { return false; }
+    int init() { return -1; }
+    const char *describe() const { return ""; }
+    void listen(SOCKET, const AcceptHandler &) {}
+    int run() { return -1; }
+    bool onLoopThread() const { return false; }
+    void schedule(std::coroutine_handle<>) {}
+    void addTimer(LoopWaiter *, unsigned) {}
+    void waitDrained(EgressQueue *, LoopWaiter *) {}
+    bool detachOnLoop(const InboundSourceRef &, LoopWaiter *) { return true; }
+    InboundSourceRef attach(SOCKET, const TlsSessionRef &) { return InboundSourceRef(); }
+    void detach(const InboundSourceRef &) {}
+    void requestWrite(const std::shared_ptr<EgressQueue> &) override {}
+    void runOnLoop(const std::function<void()> &) {}
+};
+
+#endif // HAVE_IO_URING
+
+#endif // URING_BACKEND_H
@@ -0,0 +1,337 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include "protocol.h"
+
+// ===== Payload compression =====
+// A payload with FLAG_COMPRESSED set is an envelope:
+//   uint8_t codec | uint32_t dictionaryId | uint32_t originalLength | compressed bytes
+// dictionaryId 0 = no dictionary, otherwise a topic dictionary announced by the
+// server with MSG_DICTIONARY before the first packet that uses it.
+//
+// Codecs are compiled in with -DUSE_ZSTD (link zstd) and/or -DUSE_ZLIB (link z);
+// without either the build neither advertises nor accepts compression.
+
+enum CompressionCodec
+{
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1, // Raw deflate, dictionary = preset window content
+    CODEC_ZSTD = 2  // Zstandard, dictionary trained with ZDICT
+};
+
+#define CODEC_BIT(codec) (1u << (codec)) // Codec masks: MSG_LOGIN payload, login ACK payload
+
+#define COMPRESSION_ENVELOPE_SIZE 9   // codec + dictionaryId + originalLength
+#define COMPRESSION_MIN_PLAIN 256     // Smaller payloads only pay off with a dictionary
+#define DICTIONARY_MAX_SAMPLE 1024    // Publishes up to this size feed the topic dictionary
+#define DICTIONARY_SAMPLE_COUNT 128   // Samples collected before a dictionary is built
+#define DICTIONARY_MAX_SIZE (MAX_BUFFER_SIZE - 5) // Fits in one MSG_DICTIONARY packet
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+struct CompressionDictionary
+{
+    uint32_t id;
+    uint8_t codec;
+    std::string topic;
+    std::vector<char> bytes;
+};
+typedef std::shared_ptr<const CompressionDictionary> DictionaryRef;
+
+struct CompressionEnvelope
+{
+    uint8_t codec = 0;
+    uint32_t dictionaryId = 0;
+    uint32_t originalLength = 0;
+    const char *data = nullptr;
+    size_t length = 0;
+};
+
+// Codecs this build can encode and decode
+inline uint8_t localCodecMask()
+{
+    uint8_t mask = 0;
+#ifdef USE_ZLIB
+    mask |= CODEC_BIT(CODEC_ZLIB);
+#endif
+#ifdef USE_ZSTD
+    mask |= CODEC_BIT(CODEC_ZSTD);
+#endif
+    return mask;
+}
+
+// Best codec in a mask (CODEC_NONE if empty)
+inline uint8_t preferredCodec(uint8_t mask)
+{
+    if (mask & CODEC_BIT(CODEC_ZSTD))
+        return CODEC_ZSTD;
+    if (mask & CODEC_BIT(CODEC_ZLIB))
+        return CODEC_ZLIB;
+    return CODEC_NONE;
+}
+
+namespace compression_detail
+{
+#ifdef USE_ZLIB
+    // deflate/inflate state is expensive to set up - one per thread, reset per message
+    struct ZlibContext
+    {
+        z_stream deflater;
+        z_stream inflater;
+        bool ready;
+
+        ZlibContext() : ready(false)
+        {
+            std::memset(&deflater, 0, sizeof(deflater));
+            std::memset(&inflater, 0, sizeof(inflater));
+            ready = deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            ready = ready && inflateInit2(&inflater, -15) == Z_OK;
+        }
+
+        ~ZlibContext()
+        {
+            deflateEnd(&deflater);
+            inflateEnd(&inflater);
+        }
+    };
+
+    inline ZlibContext &zlibContext()
+    {
+        thread_local ZlibContext context;
+        return context;
+    }
+#endif
+
+#ifdef USE_ZSTD
+    struct ZstdContext
+    {
+        ZSTD_CCtx *compressor;
+        ZSTD_DCtx *decompressor;
+
+        ZstdContext() : compressor(ZSTD_createCCtx()), decompressor(ZSTD_createDCtx()) {}
+
+        ~ZstdContext()
+        {
+            ZSTD_freeCCtx(compressor);
+            ZSTD_freeDCtx(decompressor);
+        }
+    };
+
+    inline ZstdContext &zstdContext()
+    {
+        thread_local ZstdContext context;
+        return context;
+    }
+#endif
+
+    inline void putU32(char *out, uint32_t value)
+    {
+        std::memcpy(out, &value, sizeof(value));
+    }
+
+    inline uint32_t getU32(const char *in)
+    {
+        uint32_t value;
+        std::memcpy(&value, in, sizeof(value));
+        return value;
+    }
+}
+
+// Build a topic dictionary from sample payloads (most recent last)
+// Returns an empty vector if the codec is not compiled in
+inline std::vector<char> buildDictionary(uint8_t codec, const std::vector<std::string> &samples)
+{
+    // Raw content: the most recent samples, newest at the end where deflate and
+    // zstd find the shortest match distances
+    std::vector<char> content;
+    for (auto it = samples.rbegin(); it != samples.rend() && content.size() < DICTIONARY_MAX_SIZE; ++it)
+    {
+        content.insert(content.begin(), it->begin(), it->end());
+    }
+    if (content.size() > DICTIONARY_MAX_SIZE)
+    {
+        content.erase(content.begin(), content.end() - DICTIONARY_MAX_SIZE);
+    }
+
+    if (codec == CODEC_ZLIB)
+    {
+#ifdef USE_ZLIB
+        return content;
+#endif
+    }
+    else if (codec == CODEC_ZSTD)
+    {
+#ifdef USE_ZSTD
+        std::string joined;
+        std::vector<size_t> sizes;
+        for (auto const &sample : samples)
+        {
+            joined += sample;
+            sizes.push_back(sample.size());
+        }
+        std::vector<char> trained(DICTIONARY_MAX_SIZE);
+        size_t size = ZDICT_trainFromBuffer(trained.data(), trained.size(), joined.data(),
+                                            sizes.data(), (unsigned)sizes.size());
+        if (ZDICT_isError(size))
+            return content; // Too few/too uniform samples: zstd also accepts raw content
+        trained.resize(size);
+        return trained;
+#endif
+    }
+    return std::vector<char>();
+}
+
+// Compress data into a FLAG_COMPRESSED envelope
+// Returns false if the codec is unavailable or the result would not be smaller
+inline bool compressPayload(uint8_t codec, const char *data, size_t length, const CompressionDictionary *dictionary,
+                            std::vector<char> &out)
+{
+    (void)data; // Not read when built without any codec
+    if (length == 0 || (dictionary && dictionary->codec != codec))
+        return false;
+
+    size_t produced = 0;
+    if (codec == CODEC_ZLIB)
+    {
+#ifdef USE_ZLIB
+        compression_detail::ZlibContext &ctx = compression_detail::zlibContext();
+        if (!ctx.ready || deflateReset(&ctx.deflater) != Z_OK)
+            return false;
+        if (dictionary && deflateSetDictionary(&ctx.deflater, (const Bytef *)dictionary->bytes.data(),
+                                               (uInt)dictionary->bytes.size()) != Z_OK)
+            return false;
+
+        size_t bound = deflateBound(&ctx.deflater, (uLong)length);
+        out.resize(COMPRESSION_ENVELOPE_SIZE + bound);
+        ctx.deflater.next_in = (Bytef *)data;
+        ctx.deflater.avail_in = (uInt)length;
+        ctx.deflater.next_out = (Bytef *)out.data() + COMPRESSION_ENVELOPE_SIZE;
+        ctx.deflater.avail_out = (uInt)bound;
+        if (deflate(&ctx.deflater, Z_FINISH) != Z_STREAM_END)
+            return false;
+        produced = bound - ctx.deflater.avail_out;
+#else
+        return false;
+#endif
+    }
+    else if (codec == CODEC_ZSTD)
+    {
+#ifdef USE_ZSTD
+        compression_detail::ZstdContext &ctx = compression_detail::zstdContext();
+        size_t bound = ZSTD_compressBound(length);
+        out.resize(COMPRESSION_ENVELOPE_SIZE + bound);
+        char *target = out.data() + COMPRESSION_ENVELOPE_SIZE;
+        produced = dictionary ? ZSTD_compress_usingDict(ctx.compressor, target, bound, data, length,
+                                                        dictionary->bytes.data(), dictionary->bytes.size(), 3)
+                              : ZSTD_compressCCtx(ctx.compressor, target, bound, data, length, 3);
+        if (ZSTD_isError(produced))
+            return false;
+#else
+        return false;
+#endif
+    }
+    else
+    {
+        return false;
+    }
+
+    if (COMPRESSION_ENVELOPE_SIZE + produced >= length)
+        return false;
+
+    out.resize(COMPRESSION_ENVELOPE_SIZE + produced);
+    out[0] = (char)codec;
+    compression_detail::putU32(out.data() + 1, dictionary ? dictionary->id : 0);
+    compression_detail::putU32(out.data() + 5, (uint32_t)length);
+    return true;
+}
+
+// Split a FLAG_COMPRESSED payload into its envelope fields
+inline bool parseEnvelope(const char *payload, size_t length, CompressionEnvelope &envelope)
+{
+    envelope = CompressionEnvelope(); // Fully set even when malformed
+    if (!payload || length <= COMPRESSION_ENVELOPE_SIZE)
+        return false;
+
+    envelope.codec = (uint8_t)payload[0];
+    envelope.dictionaryId = compression_detail::getU32(payload + 1);
+    envelope.originalLength = compression_detail::getU32(payload + 5);
+    envelope.data = payload + COMPRESSION_ENVELOPE_SIZE;
+    envelope.length = length - COMPRESSION_ENVELOPE_SIZE;
+    return envelope.originalLength > 0 && envelope.originalLength <= MAX_BUFFER_SIZE;
+}
+
+// Decompress an envelope; dictionary must match envelope.dictionaryId
+inline bool decompressPayload(const CompressionEnvelope &envelope, const CompressionDictionary *dictionary,
+                              std::vector<char> &out)
+{
+    if ((envelope.dictionaryId != 0) != (dictionary != nullptr) ||
+        (dictionary && (dictionary->id != envelope.dictionaryId || dictionary->codec != envelope.codec)))
+        return false;
+
+    out.resize(envelope.originalLength);
+    if (envelope.codec == CODEC_ZLIB)
+    {
+#ifdef USE_ZLIB
+        compression_detail::ZlibContext &ctx = compression_detail::zlibContext();
+        if (!ctx.ready || inflateReset(&ctx.inflater) != Z_OK)
+            return false;
+        if (dictionary && inflateSetDictionary(&ctx.inflater, (const Bytef *)dictionary->bytes.data(),
+                                               (uInt)dictionary->bytes.size()) != Z_OK)
+            return false;
+
+        ctx.inflater.next_in = (Bytef *)envelope.data;
+        ctx.inflater.avail_in = (uInt)envelope.length;
+        ctx.inflater.next_out = (Bytef *)out.data();
+        ctx.inflater.avail_out = (uInt)out.size();
+        return inflate(&ctx.inflater, Z_FINISH) == Z_STREAM_END && ctx.inflater.avail_out == 0;
+#endif
+    }
+    else if (envelope.codec == CODEC_ZSTD)
+    {
+#ifdef USE_ZSTD
+        compression_detail::ZstdContext &ctx = compression_detail::zstdContext();
+        size_t produced = dictionary ? ZSTD_decompress_usingDict(ctx.decompressor, out.data(), out.size(),
+                                                                 envelope.data, envelope.length,
+                                                                 dictionary->bytes.data(), dictionary->bytes.size())
+                                     : ZSTD_decompressDCtx(ctx.decompressor, out.data(), out.size(),
+                                                           envelope.data, envelope.length);
+        return !ZSTD_isError(produced) && produced == out.size();
+#endif
+    }
+    return false;
+}
+
+// MSG_DICTIONARY payload: uint32_t dictionaryId | uint8_t codec | dictionary bytes
+inline std::vector<char> encodeDictionaryPayload(const CompressionDictionary &dictionary)
+{
+    std::vector<char> payload(5 + dictionary.bytes.size());
+    compression_detail::putU32(payload.data(), dictionary.id);
+    payload[4] = (char)dictionary.codec;
+    std::memcpy(payload.data() + 5, dictionary.bytes.data(), dictionary.bytes.size());
+    return payload;
+}
+
+inline bool parseDictionaryPayload(const char *payload, size_t length, const char *topic,
+                                   CompressionDictionary &dictionary)
+{
+    if (!payload || length <= 5)
+        return false;
+    dictionary.id = compression_detail::getU32(payload);
+    dictionary.codec = (uint8_t)payload[4];
+    dictionary.topic.assign(topic, strnlen(topic, MAX_TOPIC_LEN));
+    dictionary.bytes.assign(payload + 5, payload + length);
+    return dictionary.id != 0;
+}
+
+#endif // COMPRESSION_H
@@ -0,0 +1,216 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// ===== CRC32C (Castagnoli) for PacketHeader::checksum =====
+// checksum = crc32c(payload) when the connection negotiated FLAG_CHECKSUM.
+// - x86 with SSE4.2 + PCLMUL: crc32 instruction on three interleaved lanes, so its
+//   3-cycle latency is hidden, lanes merged with one carry-less multiply each
+// - elsewhere: slicing-by-8 tables
+// The implementation is picked once at runtime, so no -msse4.2 build flag is needed.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRC32C_HAVE_SSE42 1
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32C_TARGET_SSE42
+#else
+#include <cpuid.h>
+#define CRC32C_TARGET_SSE42 __attribute__((target("sse4.2,pclmul")))
+#endif
+#endif
+
+namespace crc32c_detail
+{
+    const uint32_t POLY = 0x82F63B78; // Reflected Castagnoli polynomial
+
+    struct Tables
+    {
+        uint32_t slice[8][256];
+
+        Tables()
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; bit++)
+                    crc = (crc >> 1) ^ (POLY & (0 - (crc & 1)));
+                slice[0][i] = crc;
+            }
+            for (int k = 1; k < 8; k++)
+            {
+                for (uint32_t i = 0; i < 256; i++)
+                    slice[k][i] = (slice[k - 1][i] >> 8) ^ slice[0][slice[k - 1][i] & 0xFF];
+            }
+        }
+    };
+
+    inline const Tables &tables()
+    {
+        static const Tables t;
+        return t;
+    }
+
+    // Slicing-by-8 (little-endian wire data, like the rest of the protocol)
+    inline uint32_t software(uint32_t crc, const uint8_t *p, size_t n)
+    {
+        const Tables &t = tables();
+        while (n >= 8)
+        {
+            uint32_t lo, hi;
+            std::memcpy(&lo, p, 4);
+            std::memcpy(&hi, p + 4, 4);
+            lo ^= crc;
+            crc = t.slice[7][lo & 0xFF] ^ t.slice[6][(lo >> 8) & 0xFF] ^
+                  t.slice[5][(lo >> 16) & 0xFF] ^ t.slice[4][lo >> 24] ^
+                  t.slice[3][hi & 0xFF] ^ t.slice[2][(hi >> 8) & 0xFF] ^
+                  t.slice[1][(hi >> 16) & 0xFF] ^ t.slice[0][hi >> 24];
+            p += 8;
+            n -= 8;
+        }
+        while (n--)
+            crc = t.slice[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        return crc;
+    }
+
+    // GF(2) multiply of two reflected CRC values, modulo POLY
+    inline uint32_t multiply(uint32_t a, uint32_t b)
+    {
+        uint32_t product = 0;
+        for (int i = 0; i < 32; i++)
+        {
+            product ^= (0 - ((b >> 31) & 1)) & a;
+            a = (a >> 1) ^ (POLY & (0 - (a & 1)));
+            b <<= 1;
+        }
+        return product;
+    }
+
+    // x^exponent mod POLY
+    inline uint32_t xPower(uint64_t exponent)
+    {
+        uint32_t result = 0x80000000; // x^0
+        uint32_t power = 0x40000000;  // x^1
+        while (exponent)
+        {
+            if (exponent & 1)
+                result = multiply(result, power);
+            power = multiply(power, power);
+            exponent >>= 1;
+        }
+        return result;
+    }
+
+#ifdef CRC32C_HAVE_SSE42
+    // Buffers are cut into rounds of three equal lanes computed in parallel: long
+    // lanes for file chunks, short lanes so a MAX_BUFFER_SIZE relay packet still
+    // gets the parallel path
+    const size_t LONG_LANE = 4096;
+    const size_t SHORT_LANE = 256;
+
+    // crc * x^(8 * lane) mod POLY: carry-less multiply by x^(8 * lane - 33),
+    // then the crc32 instruction reduces the 64-bit product
+    CRC32C_TARGET_SSE42
+    inline uint32_t shiftLane(uint32_t crc, uint32_t factor)
+    {
+        __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc), _mm_cvtsi32_si128((int)factor), 0);
+        return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(product));
+    }
+
+    CRC32C_TARGET_SSE42
+    inline uint64_t threeLanes(uint64_t crc0, const uint8_t *&p, size_t &n, size_t lane, uint32_t factor)
+    {
+        while (n >= 3 * lane)
+        {
+            uint64_t crc1 = 0, crc2 = 0;
+            const uint8_t *lane1 = p + lane;
+            const uint8_t *lane2 = p + 2 * lane;
+            for (size_t i = 0; i < lane; i += 8)
+            {
+                uint64_t w0, w1, w2;
+                std::memcpy(&w0, p + i, 8);
+                std::memcpy(&w1, lane1 + i, 8);
+                std::memcpy(&w2, lane2 + i, 8);
+                crc0 = _mm_crc32_u64(crc0, w0);
+                crc1 = _mm_crc32_u64(crc1, w1);
+                crc2 = _mm_crc32_u64(crc2, w2);
+            }
+            crc0 = shiftLane((uint32_t)crc0, factor) ^ crc1;
+            crc0 = shiftLane((uint32_t)crc0, factor) ^ crc2;
+            p += 3 * lane;
+            n -= 3 * lane;
+        }
+        return crc0;
+    }
+
+    CRC32C_TARGET_SSE42
+    inline uint32_t hardware(uint32_t crc, const uint8_t *p, size_t n)
+    {
+        static const uint32_t longFactor = xPower(8 * LONG_LANE - 33);
+        static const uint32_t shortFactor = xPower(8 * SHORT_LANE - 33);
+
+        uint64_t crc0 = threeLanes(crc, p, n, LONG_LANE, longFactor);
+        crc0 = threeLanes(crc0, p, n, SHORT_LANE, shortFactor);
+        while (n >= 8)
+        {
+            uint64_t w;
+            std::memcpy(&w, p, 8);
+            crc0 = _mm_crc32_u64(crc0, w);
+            p += 8;
+            n -= 8;
+        }
+        while (n--)
+            crc0 = _mm_crc32_u8((uint32_t)crc0, *p++);
+        return (uint32_t)crc0;
+    }
+
+    inline bool cpuSupportsHardware()
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) && (info[2] & (1 << 1)); // SSE4.2, PCLMULQDQ
+#else
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return false;
+        return (ecx & bit_SSE4_2) && (ecx & bit_PCLMUL);
+#endif
+    }
+#endif
+
+    inline bool useHardware()
+    {
+#ifdef CRC32C_HAVE_SSE42
+        static const bool available = cpuSupportsHardware();
+        return available;
+#else
+        return false;
+#endif
+    }
+}
+
+// Continue a CRC32C: crc32c(b, crc32c(a)) == crc32c(a + b)
+inline uint32_t crc32c(const void *data, size_t length, uint32_t crc = 0)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_detail::useHardware())
+        return ~crc32c_detail::hardware(crc, p, length);
+#endif
+    return ~crc32c_detail::software(crc, p, length);
+}
+
+// Software path only - lets the benchmark compare both implementations
+inline uint32_t crc32cPortable(const void *data, size_t length, uint32_t crc = 0)
+{
+    return ~crc32c_detail::software(~crc, (const uint8_t *)data, length);
+}
+
+#endif // CRC32C_H
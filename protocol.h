@@ -9,9 +9,50 @@
 #define MAX_BUFFER_SIZE 4096
 #define MAX_TOPIC_LEN 32
 #define MAX_USERNAME_LEN 32
-#define SOCKET_TIMEOUT_MS 5000              // 5 second socket timeout
+#define MAX_GROUP_NAME_LEN 32               // Consumer group name in a MSG_SUBSCRIBE payload
+#define SOCKET_TIMEOUT_MS 5000              // Write stall: queued bytes making no progress this long evict the connection
 #define MAX_MESSAGE_SIZE (10 * 1024 * 1024) // 10MB max message size
 
+// PacketHeader::version values (legacy clients send 0, treated as v1)
+#define PROTOCOL_VERSION_1 1 // Fixed-size PacketHeader below
+#define PROTOCOL_VERSION_2 2 // Compact header, see protocol_v2.h
+
+// PacketHeader::flags bits (bits 0-1 carry audio quality on MSG_STREAM_START)
+#define FLAG_FILTER 0x01   // MSG_SUBSCRIBE: payload is a filter expression (Server/topic_filter.h)
+#define FLAG_DIRECT 0x01   // Publish: direct message to the user named in topic (Server/direct_message.h)
+#define FLAG_WATCH 0x02    // MSG_QUERY: keep receiving MSG_PRESENCE deltas of the scope (without it: stop)
+#define FLAG_GROUP 0x04    // Publish to a consumer group member: messageId is its delivery id (Server/consumer_group.h)
+                           // MSG_ACK from that member: messageId names the delivery it has processed
+#define FLAG_DEDUP 0x08    // MSG_LOGIN/its ACK: publishes carry increasing messageIds, retries are dropped
+#define FLAG_RESUME 0x10   // MSG_LOGIN: resumable session, payload ends with a uint64_t token to resume (0 = new)
+                           // Its ACK: payload ends with the session's token (the same one if resumed)
+#define FLAG_CREDIT 0x20   // MSG_ACK of a publish: payload is a uint32_t publish window
+#define FLAG_COMPRESSED 0x40 // Publish: payload is a compression envelope (compression.h)
+                             // MSG_LOGIN/its ACK: payload is a uint8_t codec mask
+#define FLAG_CHECKSUM 0x80 // MSG_LOGIN/MSG_STREAM_ATTACH and their ACK: enable checksums (crc32c.h)
+
+// Flow control: a publisher keeps at most `window` publishes unacknowledged.
+// The server re-advertises the window in every publish ACK.
+#define PUBLISH_WINDOW_INITIAL 8 // Window assumed before the first grant
+
+// MSG_PUBLISH_BATCH payload: repeated records, each
+//   uint8_t topicLength | char topic[topicLength] | uint32_t payloadLength | payload
+// Subscribers receive every record as an ordinary MSG_PUBLISH_TEXT
+#define MAX_BATCH_SIZE (64 * 1024) // Max MSG_PUBLISH_BATCH payload
+
+// MSG_QUERY payload: uint16_t limit | cursor (list names after it, empty = from the first)
+// MSG_QUERY_RESULT payload: uint32_t total | uint8_t more | names separated by '\n'
+#define QUERY_MAX_PAGE 100 // Names per MSG_QUERY_RESULT: 100 * MAX_USERNAME_LEN fits MAX_BUFFER_SIZE
+
+// MSG_PRESENCE payload: one byte
+#define PRESENCE_LEFT 0
+#define PRESENCE_JOINED 1
+
+// Liveness: after HEARTBEAT_INTERVAL_MS without a packet from the peer the server
+// sends MSG_PING (answered with MSG_PONG); a peer silent for IDLE_TIMEOUT_MS is evicted
+#define HEARTBEAT_INTERVAL_MS 15000
+#define IDLE_TIMEOUT_MS 45000
+
 // Message types
 enum MessageType
 {
@@ -31,7 +72,22 @@ enum MessageType
     MSG_STREAM_START,
     MSG_STREAM_READY,
     MSG_STREAM_FRAME,
-    MSG_STREAM_STOP
+    MSG_STREAM_STOP,
+
+    MSG_STREAM_ATTACH, // Gắn kết nối stream (8081) vào phiên chat đã đăng nhập
+
+    MSG_PUBLISH_BATCH, // Nhiều bản ghi (topic, payload) trong một gói, một ACK chung
+
+    MSG_DICTIONARY, // Server gửi từ điển nén của topic (trước gói đầu tiên dùng nó)
+
+    MSG_PING, // Kiểm tra kết nối còn sống (cả hai chiều), trả lời bằng MSG_PONG
+    MSG_PONG,
+
+    MSG_REDIRECT, // Topic thuộc node khác trong cụm: payload "host:port" cổng chat của node đó
+
+    MSG_QUERY,        // Hỏi danh sách người online (topic rỗng) hoặc subscriber của topic, theo trang
+    MSG_QUERY_RESULT, // Một trang kết quả của MSG_QUERY (cùng messageId)
+    MSG_PRESENCE      // Thay đổi trong phạm vi đang theo dõi: sender vào/ra topic (rỗng = online)
 
 };
 #pragma pack(push, 1) // ensure no padding
@@ -45,7 +101,7 @@ struct PacketHeader
     uint8_t flags;                 // Bit flags for properities
     char sender[MAX_USERNAME_LEN]; // Sender's username
     char topic[MAX_TOPIC_LEN];     // Topic name
-    uint32_t checksum;             // CRC32 for integrity check
+    uint32_t checksum;             // CRC32C of the payload when negotiated (FLAG_CHECKSUM), else 0
 };
 #pragma pack(pop)
 #endif
\ No newline at end of file
@@ -0,0 +1,448 @@
+#ifndef PROTOCOL_V2_H
+#define PROTOCOL_V2_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include "protocol.h"
+
+// ===== Protocol v2: compact header =====
+// Negotiated per connection through PacketHeader::version:
+// - client sends MSG_LOGIN (or MSG_STREAM_ATTACH on 8081) in v1 with version = 2
+//   and waits for the reply before sending anything else
+// - an ACK with version = 2 means both directions switch to v2 right after it;
+//   any other reply keeps the connection on v1
+//
+// Wire format (all integers little-endian, varint = LEB128):
+//   uint8   msgType
+//   uint8   presence bits (V2_HAS_*)
+//   varint  payloadLength
+//   [varint messageId] [varint timestamp] [uint8 flags]
+//   [string sender] [string topic] [uint32 checksum]
+// Absent fields decode as zero/empty.
+//
+// Strings are interned per connection and direction:
+//   varint ref; ref & 1 -> definition: varint length + bytes follow, id = ref >> 1
+//               (id 0 = literal, not stored); otherwise a reference to id ref >> 1
+//
+// Topic aliases: a (sender, topic) pair used again and again (publishes, stream
+// frames) is sent once and then named by a small number, per connection and direction:
+//   V2_HAS_ALIAS replaces V2_HAS_SENDER/V2_HAS_TOPIC with
+//   varint ref; ref & 1 -> definition: [string sender] [string topic] follow,
+//               alias = ref >> 1; otherwise a reference to alias ref >> 1
+
+#define V2_HAS_MESSAGE_ID 0x01
+#define V2_HAS_TIMESTAMP 0x02
+#define V2_HAS_FLAGS 0x04
+#define V2_HAS_SENDER 0x08
+#define V2_HAS_TOPIC 0x10
+#define V2_HAS_CHECKSUM 0x20
+#define V2_HAS_ALIAS 0x40
+
+#define V2_MAX_INTERNED_STRINGS 1024 // Per connection and direction
+#define V2_MAX_ALIASES 256           // Per connection and direction
+#define V2_MAX_HEADER_SIZE 128       // Upper bound of an encoded header
+
+// Alias carried by a decoded header (id 0 = none)
+struct V2AliasInfo
+{
+    uint32_t id;
+    bool defined; // This header introduced the alias
+};
+
+class CompactEncoder
+{
+private:
+    std::map<std::string, uint32_t> ids;
+    uint32_t nextId;
+    std::map<std::pair<std::string, std::string>, uint32_t> aliases;
+    uint32_t nextAlias;
+
+    static void putVarint(std::vector<char> &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back((char)((value & 0x7F) | 0x80));
+            value >>= 7;
+        }
+        out.push_back((char)value);
+    }
+
+    void putString(std::vector<char> &out, const char *field, size_t maxLen)
+    {
+        size_t length = strnlen(field, maxLen);
+        std::string value(field, length);
+
+        auto it = ids.find(value);
+        if (it != ids.end())
+        {
+            putVarint(out, (uint64_t)it->second << 1);
+            return;
+        }
+
+        uint32_t id = 0; // Table full: send as literal
+        if (nextId <= V2_MAX_INTERNED_STRINGS)
+        {
+            id = nextId++;
+            ids[value] = id;
+        }
+        putVarint(out, ((uint64_t)id << 1) | 1);
+        putVarint(out, length);
+        out.insert(out.end(), field, field + length);
+    }
+
+public:
+    CompactEncoder() : nextId(1), nextAlias(1) {}
+
+    // Interning tables, so another process can continue the connection (hot restart)
+    // Writer/Reader: see StateWriter / StateReader in Server/hot_restart.h
+    template <typename Writer>
+    void saveState(Writer &out) const
+    {
+        out.u32(nextId);
+        out.u32((uint32_t)ids.size());
+        for (auto const &entry : ids)
+        {
+            out.str(entry.first);
+            out.u32(entry.second);
+        }
+        out.u32(nextAlias);
+        out.u32((uint32_t)aliases.size());
+        for (auto const &entry : aliases)
+        {
+            out.str(entry.first.first);
+            out.str(entry.first.second);
+            out.u32(entry.second);
+        }
+    }
+
+    template <typename Reader>
+    bool loadState(Reader &in)
+    {
+        uint32_t count;
+        ids.clear();
+        aliases.clear();
+        if (!in.u32(nextId) || !in.u32(count) || count > V2_MAX_INTERNED_STRINGS)
+            return false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            std::string value;
+            uint32_t id;
+            if (!in.str(value) || !in.u32(id))
+                return false;
+            ids[value] = id;
+        }
+        if (!in.u32(nextAlias) || !in.u32(count) || count > V2_MAX_ALIASES)
+            return false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            std::pair<std::string, std::string> key;
+            uint32_t alias;
+            if (!in.str(key.first) || !in.str(key.second) || !in.u32(alias))
+                return false;
+            aliases[key] = alias;
+        }
+        return true;
+    }
+
+    // Append the v2 encoding of header (without payload) to out
+    void encodeHeader(const PacketHeader &header, std::vector<char> &out)
+    {
+        uint8_t presence = 0;
+        if (header.messageId)
+            presence |= V2_HAS_MESSAGE_ID;
+        if (header.timestamp)
+            presence |= V2_HAS_TIMESTAMP;
+        if (header.flags)
+            presence |= V2_HAS_FLAGS;
+        if (header.sender[0])
+            presence |= V2_HAS_SENDER;
+        if (header.topic[0])
+            presence |= V2_HAS_TOPIC;
+        if (header.checksum)
+            presence |= V2_HAS_CHECKSUM;
+
+        // Both names present: send an alias instead (defining it on first use)
+        uint64_t aliasRef = 0;
+        if ((presence & V2_HAS_SENDER) && (presence & V2_HAS_TOPIC))
+        {
+            std::pair<std::string, std::string> key(std::string(header.sender, strnlen(header.sender, MAX_USERNAME_LEN)),
+                                                    std::string(header.topic, strnlen(header.topic, MAX_TOPIC_LEN)));
+            auto it = aliases.find(key);
+            if (it != aliases.end())
+            {
+                aliasRef = (uint64_t)it->second << 1;
+            }
+            else if (nextAlias <= V2_MAX_ALIASES)
+            {
+                aliases[key] = nextAlias;
+                aliasRef = ((uint64_t)nextAlias++ << 1) | 1;
+            }
+            if (aliasRef)
+                presence = (presence & ~(V2_HAS_SENDER | V2_HAS_TOPIC)) | V2_HAS_ALIAS;
+        }
+
+        out.push_back((char)header.msgType);
+        out.push_back((char)presence);
+        putVarint(out, header.payloadLength);
+
+        if (presence & V2_HAS_MESSAGE_ID)
+            putVarint(out, header.messageId);
+        if (presence & V2_HAS_TIMESTAMP)
+            putVarint(out, header.timestamp);
+        if (presence & V2_HAS_FLAGS)
+            out.push_back((char)header.flags);
+        if (presence & V2_HAS_SENDER)
+            putString(out, header.sender, MAX_USERNAME_LEN);
+        if (presence & V2_HAS_TOPIC)
+            putString(out, header.topic, MAX_TOPIC_LEN);
+        if (presence & V2_HAS_ALIAS)
+        {
+            putVarint(out, aliasRef);
+            if (aliasRef & 1)
+            {
+                putString(out, header.sender, MAX_USERNAME_LEN);
+                putString(out, header.topic, MAX_TOPIC_LEN);
+            }
+        }
+        if (presence & V2_HAS_CHECKSUM)
+        {
+            for (int shift = 0; shift < 32; shift += 8)
+                out.push_back((char)((header.checksum >> shift) & 0xFF));
+        }
+    }
+};
+
+class CompactDecoder
+{
+private:
+    std::vector<std::string> strings; // Index = interned id (0 unused)
+    std::vector<std::pair<std::string, std::string>> aliases; // Index = alias (0 unused): sender, topic
+
+    struct Cursor
+    {
+        const uint8_t *pos;
+        const uint8_t *end;
+    };
+
+    // Returns 1 on success, 0 if more bytes are needed, -1 on malformed input
+    static int getVarint(Cursor &c, uint64_t &value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (c.pos >= c.end)
+                return 0;
+            uint8_t byte = *c.pos++;
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return 1;
+        }
+        return -1;
+    }
+
+    // Definitions are collected in pending and only stored once the whole header decoded
+    int getString(Cursor &c, char *field, size_t maxLen,
+                  std::vector<std::pair<uint32_t, std::string>> &pending)
+    {
+        uint64_t ref;
+        int rc = getVarint(c, ref);
+        if (rc <= 0)
+            return rc;
+
+        uint64_t id = ref >> 1;
+        std::string value;
+        if (ref & 1)
+        {
+            uint64_t length;
+            rc = getVarint(c, length);
+            if (rc <= 0)
+                return rc;
+            if (length >= maxLen || id > V2_MAX_INTERNED_STRINGS)
+                return -1;
+            if ((uint64_t)(c.end - c.pos) < length)
+                return 0;
+            value.assign((const char *)c.pos, length);
+            c.pos += length;
+            if (id != 0)
+                pending.push_back({(uint32_t)id, value});
+        }
+        else
+        {
+            bool pendingDefinition = false;
+            for (auto const &def : pending)
+            {
+                if (def.first == id)
+                {
+                    value = def.second;
+                    pendingDefinition = true;
+                }
+            }
+            if (!pendingDefinition)
+            {
+                if (id == 0 || id >= strings.size())
+                    return -1;
+                value = strings[id];
+            }
+        }
+
+        std::memset(field, 0, maxLen);
+        std::memcpy(field, value.data(), value.length());
+        return 1;
+    }
+
+public:
+    // Interning tables, so another process can continue the connection (hot restart)
+    template <typename Writer>
+    void saveState(Writer &out) const
+    {
+        out.u32((uint32_t)strings.size());
+        for (auto const &value : strings)
+        {
+            out.str(value);
+        }
+        out.u32((uint32_t)aliases.size());
+        for (auto const &alias : aliases)
+        {
+            out.str(alias.first);
+            out.str(alias.second);
+        }
+    }
+
+    template <typename Reader>
+    bool loadState(Reader &in)
+    {
+        uint32_t count;
+        if (!in.u32(count) || count > V2_MAX_INTERNED_STRINGS + 1)
+            return false;
+        strings.assign(count, std::string());
+        for (auto &value : strings)
+        {
+            if (!in.str(value))
+                return false;
+        }
+        if (!in.u32(count) || count > V2_MAX_ALIASES + 1)
+            return false;
+        aliases.assign(count, std::pair<std::string, std::string>());
+        for (auto &alias : aliases)
+        {
+            if (!in.str(alias.first) || !in.str(alias.second))
+                return false;
+        }
+        return true;
+    }
+
+    // Decode one header from data[0..length)
+    // Returns bytes consumed, 0 if more bytes are needed, -1 on malformed input
+    // alias (optional) reports the alias the header used, so the caller can cache
+    // whatever it resolved the names to
+    int decodeHeader(const char *data, size_t length, PacketHeader &header, V2AliasInfo *alias = nullptr)
+    {
+        Cursor c = {(const uint8_t *)data, (const uint8_t *)data + length};
+        if (length < 2)
+            return 0;
+
+        std::memset(&header, 0, sizeof(header));
+        header.msgType = *c.pos++;
+        uint8_t presence = *c.pos++;
+        header.version = PROTOCOL_VERSION_2;
+
+        std::vector<std::pair<uint32_t, std::string>> pending;
+        uint64_t value;
+        int rc;
+        uint64_t aliasRef = 0;
+
+        if ((rc = getVarint(c, value)) <= 0)
+            return rc;
+        if (value > MAX_MESSAGE_SIZE)
+            return -1;
+        header.payloadLength = (uint32_t)value;
+
+        if (presence & V2_HAS_MESSAGE_ID)
+        {
+            if ((rc = getVarint(c, value)) <= 0)
+                return rc;
+            header.messageId = (uint32_t)value;
+        }
+        if (presence & V2_HAS_TIMESTAMP)
+        {
+            if ((rc = getVarint(c, value)) <= 0)
+                return rc;
+            header.timestamp = value;
+        }
+        if (presence & V2_HAS_FLAGS)
+        {
+            if (c.pos >= c.end)
+                return 0;
+            header.flags = *c.pos++;
+        }
+        if (presence & V2_HAS_SENDER)
+        {
+            if ((rc = getString(c, header.sender, MAX_USERNAME_LEN, pending)) <= 0)
+                return rc;
+        }
+        if (presence & V2_HAS_TOPIC)
+        {
+            if ((rc = getString(c, header.topic, MAX_TOPIC_LEN, pending)) <= 0)
+                return rc;
+        }
+        if (presence & V2_HAS_ALIAS)
+        {
+            if (presence & (V2_HAS_SENDER | V2_HAS_TOPIC))
+                return -1;
+            if ((rc = getVarint(c, aliasRef)) <= 0)
+                return rc;
+            uint64_t id = aliasRef >> 1;
+            if (id == 0 || id > V2_MAX_ALIASES)
+                return -1;
+            if (aliasRef & 1)
+            {
+                if ((rc = getString(c, header.sender, MAX_USERNAME_LEN, pending)) <= 0)
+                    return rc;
+                if ((rc = getString(c, header.topic, MAX_TOPIC_LEN, pending)) <= 0)
+                    return rc;
+            }
+            else
+            {
+                if (id >= aliases.size() || aliases[id].second.empty())
+                    return -1;
+                std::memcpy(header.sender, aliases[id].first.data(), aliases[id].first.length());
+                std::memcpy(header.topic, aliases[id].second.data(), aliases[id].second.length());
+            }
+        }
+        if (presence & V2_HAS_CHECKSUM)
+        {
+            if (c.end - c.pos < 4)
+                return 0;
+            header.checksum = 0;
+            for (int shift = 0; shift < 32; shift += 8)
+                header.checksum |= (uint32_t)*c.pos++ << shift;
+        }
+
+        for (auto &def : pending)
+        {
+            if (def.first >= strings.size())
+                strings.resize(def.first + 1);
+            strings[def.first] = std::move(def.second);
+        }
+
+        uint32_t aliasId = (uint32_t)(aliasRef >> 1);
+        if (aliasRef & 1)
+        {
+            if (aliasId >= aliases.size())
+                aliases.resize(aliasId + 1);
+            aliases[aliasId].first.assign(header.sender, strnlen(header.sender, MAX_USERNAME_LEN));
+            aliases[aliasId].second.assign(header.topic, strnlen(header.topic, MAX_TOPIC_LEN));
+        }
+        if (alias)
+        {
+            alias->id = aliasId;
+            alias->defined = (aliasRef & 1) != 0;
+        }
+        return (int)(c.pos - (const uint8_t *)data);
+    }
+};
+
+#endif // PROTOCOL_V2_H
@@ -0,0 +1,254 @@
+#ifndef TLS_SESSION_H
+#define TLS_SESSION_H
+
+#include <memory>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+typedef SOCKET TlsSocket;
+#else
+typedef int TlsSocket;
+#endif
+
+// ===== TLS transport (build with -DUSE_TLS, link ssl and crypto) =====
+// The handshake runs in user space with OpenSSL. With kTLS (Linux, AES-GCM) OpenSSL
+// then hands the session keys to the kernel, and plain send()/recv() on the socket
+// carry encrypted records: EgressQueue, SocketReader and any sendfile() path stay
+// exactly as they are for plaintext.
+// Directions the kernel did not take over go through SSL_write/SSL_read; if both
+// are in user space the socket is made non-blocking and SSL calls are serialized,
+// because the reader and writer threads share one SSL object.
+
+#ifdef USE_TLS
+#include <mutex>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#ifdef _WIN32
+#define TLS_POLL WSAPoll
+#else
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#define TLS_POLL poll
+#endif
+
+class TlsSession
+{
+private:
+    SSL *ssl;
+    TlsSocket sock;
+    bool ktlsSend;
+    bool ktlsRecv;
+    bool shared;          // Both directions in user space: non-blocking socket + sslMutex
+    std::mutex sslMutex;
+
+    TlsSession(SSL *s, TlsSocket fd) : ssl(s), sock(fd), ktlsSend(false), ktlsRecv(false), shared(false) {}
+
+    // Wait until the socket is ready for what OpenSSL asked for; false on other errors
+    bool waitFor(int sslError)
+    {
+        pollfd pfd;
+        pfd.fd = sock;
+        pfd.revents = 0;
+        if (sslError == SSL_ERROR_WANT_READ)
+            pfd.events = POLLIN;
+        else if (sslError == SSL_ERROR_WANT_WRITE)
+            pfd.events = POLLOUT;
+        else
+            return false;
+        return TLS_POLL(&pfd, 1, -1) > 0;
+    }
+
+    static std::shared_ptr<TlsSession> handshake(SSL_CTX *ctx, TlsSocket fd, bool server, const std::string &host)
+    {
+        SSL *ssl = SSL_new(ctx);
+        if (!ssl)
+            return nullptr;
+        SSL_set_fd(ssl, (int)fd);
+
+        if (!server && !host.empty())
+        {
+            // Certificate must match the host we dialed (IP SAN for addresses)
+            X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+            if (X509_VERIFY_PARAM_set1_ip_asc(param, host.c_str()) != 1)
+            {
+                SSL_set_tlsext_host_name(ssl, host.c_str());
+                SSL_set1_host(ssl, host.c_str());
+            }
+        }
+
+        if ((server ? SSL_accept(ssl) : SSL_connect(ssl)) != 1)
+        {
+            ERR_clear_error();
+            SSL_free(ssl);
+            return nullptr;
+        }
+
+        std::shared_ptr<TlsSession> session(new TlsSession(ssl, fd));
+        session->ktlsSend = BIO_get_ktls_send(SSL_get_wbio(ssl));
+        session->ktlsRecv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+        session->shared = !session->ktlsSend && !session->ktlsRecv;
+        if (session->shared)
+        {
+#ifdef _WIN32
+            u_long nonBlocking = 1;
+            ioctlsocket(fd, FIONBIO, &nonBlocking);
+#else
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+        }
+        return session;
+    }
+
+public:
+    ~TlsSession()
+    {
+        SSL_free(ssl);
+    }
+
+    TlsSession(const TlsSession &) = delete;
+    TlsSession &operator=(const TlsSession &) = delete;
+
+    // Blocking handshakes; nullptr on failure
+    static std::shared_ptr<TlsSession> accept(SSL_CTX *ctx, TlsSocket fd)
+    {
+        return handshake(ctx, fd, true, std::string());
+    }
+
+    static std::shared_ptr<TlsSession> connect(SSL_CTX *ctx, TlsSocket fd, const std::string &host)
+    {
+        return handshake(ctx, fd, false, host);
+    }
+
+    // Kernel encrypts/decrypts this direction: use send()/recv() directly
+    bool kernelSend() const { return ktlsSend; }
+    bool kernelRecv() const { return ktlsRecv; }
+
+    // User-space write of the whole buffer
+    bool sendAll(const char *data, size_t total)
+    {
+        size_t sent = 0;
+        while (sent < total)
+        {
+            int n, error;
+            {
+                std::unique_lock<std::mutex> lock(sslMutex, std::defer_lock);
+                if (shared)
+                    lock.lock();
+                n = SSL_write(ssl, data + sent, (int)(total - sent));
+                error = n > 0 ? SSL_ERROR_NONE : SSL_get_error(ssl, n);
+            }
+            if (n > 0)
+                sent += n;
+            else if (!waitFor(error))
+                return false;
+        }
+        return true;
+    }
+
+    // User-space read of up to length bytes; <= 0 on close or error
+    int receive(char *data, size_t length)
+    {
+        while (true)
+        {
+            int n, error;
+            {
+                std::unique_lock<std::mutex> lock(sslMutex, std::defer_lock);
+                if (shared)
+                    lock.lock();
+                n = SSL_read(ssl, data, (int)length);
+                error = n > 0 ? SSL_ERROR_NONE : SSL_get_error(ssl, n);
+            }
+            if (n > 0)
+                return n;
+            if (!waitFor(error))
+                return -1;
+        }
+    }
+
+    // Send close_notify (best effort, before the socket is closed)
+    void shutdown()
+    {
+        std::lock_guard<std::mutex> lock(sslMutex);
+        SSL_shutdown(ssl);
+    }
+
+    const char *describe() const
+    {
+        if (ktlsSend && ktlsRecv)
+            return "kTLS";
+        if (ktlsSend)
+            return "kTLS send, user-space receive";
+        if (ktlsRecv)
+            return "user-space send, kTLS receive";
+        return "user-space TLS";
+    }
+};
+
+// TLS 1.3 with AES-GCM first - the suites Linux kTLS can offload
+inline void configureTlsContext(SSL_CTX *ctx, bool enableKtls)
+{
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+    SSL_CTX_set_cipher_list(ctx, "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+                                 "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384");
+    if (enableKtls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+}
+
+// Server context from PEM files; nullptr (error logged by caller) on failure
+inline SSL_CTX *createServerTlsContext(const std::string &certFile, const std::string &keyFile, bool enableKtls = true)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+        return nullptr;
+    configureTlsContext(ctx, enableKtls);
+    if (SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    return ctx;
+}
+
+// Client context verifying the server against caFile (or the system store if empty)
+inline SSL_CTX *createClientTlsContext(const std::string &caFile, bool enableKtls = true)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx)
+        return nullptr;
+    configureTlsContext(ctx, enableKtls);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    int loaded = caFile.empty() ? SSL_CTX_set_default_verify_paths(ctx)
+                                : SSL_CTX_load_verify_locations(ctx, caFile.c_str(), nullptr);
+    if (loaded != 1)
+    {
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    return ctx;
+}
+
+#else
+
+// Plaintext build: sessions are never created, this only keeps call sites unconditional
+class TlsSession
+{
+public:
+    bool kernelSend() const { return true; }
+    bool kernelRecv() const { return true; }
+    bool sendAll(const char *, size_t) { return false; }
+    int receive(char *, size_t) { return -1; }
+    void shutdown() {}
+};
+
+#endif // USE_TLS
+
+typedef std::shared_ptr<TlsSession> TlsSessionRef;
+
+#endif // TLS_SESSION_H